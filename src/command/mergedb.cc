@@ -18,7 +18,10 @@
 #include "log/mlogger.h"
 #include "log/mlogger_ostream.h"
 #include "storage/storage.h"
+#include "logic/hash.h"
 #include <iostream>
+#include <vector>
+#include <string.h>
 
 template <typename T>
 struct auto_array {
@@ -35,8 +38,10 @@ private:
 using namespace kumo;
 
 struct for_each_update {
-	for_each_update(Storage* dstdb, uint64_t* total, uint64_t* merged) :
-		m_total(total), m_merged(merged), m_dstdb(dstdb) { }
+	for_each_update(Storage* dstdb, uint64_t* total, uint64_t* merged,
+			bool rehash, HashSpace::hash_function func) :
+		m_total(total), m_merged(merged), m_dstdb(dstdb),
+		m_rehash(rehash), m_function(func) { }
 
 	void operator() (Storage::iterator& kv)
 	{
@@ -45,7 +50,20 @@ struct for_each_update {
 		if(kv.keylen() < Storage::KEY_META_SIZE) { return; }
 		if(kv.vallen() < Storage::VALUE_META_SIZE) { return; }
 
-		if( m_dstdb->update(kv.key(), kv.keylen(), kv.val(), kv.vallen()) ) {
+		const char* key = kv.key();
+		if(m_rehash) {
+			// replace the hash prefix of the key
+			m_keybuf.resize(kv.keylen());
+			memcpy(&m_keybuf[0], kv.key(), kv.keylen());
+			uint64_t h = HashSpace::hash(
+					kv.key() + Storage::KEY_META_SIZE,
+					kv.keylen() - Storage::KEY_META_SIZE,
+					m_function);
+			Storage::hash_to(h, &m_keybuf[0]);
+			key = &m_keybuf[0];
+		}
+
+		if( m_dstdb->update(key, kv.keylen(), kv.val(), kv.vallen()) ) {
 			++*m_merged;
 		}
 	}
@@ -54,13 +72,38 @@ private:
 	uint64_t *m_total;
 	uint64_t *m_merged;
 	Storage* m_dstdb;
+	bool m_rehash;
+	HashSpace::hash_function m_function;
+	std::vector<char> m_keybuf;
 };
 
 
+static void usage(const char* prog)
+{
+	std::cerr << "usage: "<<prog<<" [-f <sha1|xxh64>] <dst.tch> <src.tch>..." << std::endl;
+	std::cerr << "  -f  rehash keys with the hash function" << std::endl;
+}
+
+
 int main(int argc, char* argv[])
 {
-	if(argc <= 3) {
-		std::cerr << "usage: "<<argv[0]<<" <dst.tch> <src.tch>..." << std::endl;
+	const char* prog = argv[0];
+	bool rehash = false;
+	HashSpace::hash_function func = HashSpace::HASH_SHA1;
+
+	if(argc > 2 && strcmp(argv[1], "-f") == 0) {
+		if(!HashSpace::parse_function(argv[2], &func)) {
+			std::cerr << "unknown hash function: "<<argv[2] << std::endl;
+			usage(prog);
+			return 1;
+		}
+		rehash = true;
+		argc -= 2;
+		argv += 2;
+	}
+
+	if(argc <= 2) {
+		usage(prog);
 		return 1;
 	}
 
@@ -86,7 +129,7 @@ int main(int argc, char* argv[])
 			std::cout << "merging "<<psrcs[i]<< "..." << std::flush;
 
 			srcdbs[i]->for_each(
-					for_each_update(dstdb.get(), &total, &merged),
+					for_each_update(dstdb.get(), &total, &merged, rehash, func),
 					ClockTime(0) );
 
 			//std::cout << srcdbs[i]->error() << std::endl;  // FIXME
@@ -75,6 +75,19 @@ struct req_get {
 	void submit();
 };
 
+struct req_get_multi {
+	req_get_multi() : reqs(NULL), num(0) { }
+
+	// life of each req_get is ignored; all keys must be kept alive by
+	// this life.
+	req_get* reqs;
+	uint32_t num;
+
+	shared_zone life;
+
+	void submit();
+};
+
 
 enum set_op_t {
 	OP_SET       = 0,
@@ -82,11 +95,14 @@ enum set_op_t {
 	OP_CAS       = 2,
 	OP_APPEND    = 3,
 	OP_PREPEND   = 4,
+	OP_INCR      = 5,
+	OP_DECR      = 6,
+	OP_ADD       = 7,
 };
 
 
 struct res_set {
-	int error;
+	int error;  // 2: not a number (OP_INCR, OP_DECR)
 
 	const char* key;
 	uint32_t keylen;
@@ -97,13 +113,19 @@ struct res_set {
 	uint32_t vallen;
 	uint64_t clocktime;
 
+	// OP_APPEND, OP_PREPEND, OP_INCR, OP_DECR:
+	//   false if the key is not found.
+	//   val is the stored data without the head.
+	// OP_ADD:
+	//   false if the key is found.
 	bool cas_success;
 };
 
 typedef void (*callback_set)(void* user, res_set& res, auto_zone z);
 
 struct req_set {
-	req_set() : has_user_hash(false), operation(OP_SET) { }
+	req_set() : has_user_hash(false), has_exptime(false), operation(OP_SET),
+		headlen(0), amount(0) { }
 
 	const char* key;
 	uint32_t keylen;
@@ -113,10 +135,19 @@ struct req_set {
 
 	const char* val;
 	uint32_t vallen;
+	bool has_exptime;  // val begins with 4 bytes expiration time
 
 	set_op_t operation;
 	uint64_t clocktime;
 
+	// OP_APPEND, OP_PREPEND, OP_INCR, OP_DECR:
+	//   the first headlen bytes of val (expiration time and flags) are
+	//   not modified. rest of val is added to the data (OP_APPEND,
+	//   OP_PREPEND) or is stored if the key is not found and it's not
+	//   empty (OP_INCR, OP_DECR).
+	uint32_t headlen;
+	uint64_t amount;  // OP_INCR, OP_DECR
+
 	shared_zone life;
 	callback_set callback;
 	void* user;
@@ -124,6 +155,20 @@ struct req_set {
 	void submit();
 };
 
+struct req_set_multi {
+	req_set_multi() : reqs(NULL), num(0) { }
+
+	// life of each req_set is ignored; all keys and values must be kept
+	// alive by this life.
+	// OP_SET requests to the same server are sent in one request.
+	req_set* reqs;
+	uint32_t num;
+
+	shared_zone life;
+
+	void submit();
+};
+
 
 struct res_delete {
 	int error;
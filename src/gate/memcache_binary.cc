@@ -23,6 +23,7 @@
 #include <mp/stream_buffer.h>
 #include <stdexcept>
 #include <string.h>
+#include <stdio.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -34,6 +35,7 @@
 #include <algorithm>
 #include <memory>
 #include <deque>
+#include <vector>
 
 namespace kumo {
 namespace {
@@ -68,6 +70,8 @@ using gate::auto_zone;
 
 static const size_t MEMPROTO_INITIAL_ALLOCATION_SIZE = 32*1024;
 static const size_t MEMPROTO_RESERVE_SIZE = 4*1024;
+static const size_t MEMPROTO_SETQ_BATCH_MAX = 64;
+static const unsigned int MEMPROTO_TOUCH_RETRY_MAX = 3;
 
 class handler : public wavy::handler {
 public:
@@ -82,27 +86,57 @@ private:
 	void request_getx(memproto_header* h,
 			const char* key, uint16_t keylen);
 
-	// set
+	// set, setq, replace, replaceq
 	void request_set(memproto_header* h,
 			const char* key, uint16_t keylen,
 			const char* val, uint32_t vallen,
 			uint32_t flags, uint32_t expiration);
 
-	// delete
+	// add, addq
+	void request_add(memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen,
+			uint32_t flags, uint32_t expiration);
+
+	// delete, deleteq
 	void request_delete(memproto_header* h,
 			const char* key, uint16_t keylen,
 			uint32_t expiration);
 
+	// increment, decrement, incrementq, decrementq
+	void request_incr(memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint64_t amount, uint64_t initial, uint32_t expiration);
+
+	// append, prepend, appendq, prependq
+	void request_append(memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen);
+
+	// touch, gat, gatq
+	void request_touch(memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint32_t expiration);
+
 	// noop
 	void request_noop(memproto_header* h);
 
+	// flush, flushq
 	void request_flush(memproto_header* h,
 			uint32_t expiration);
 
+	void request_status(memproto_header* h, uint16_t status);
+
 private:
 	memproto_parser m_memproto;
 	mp::stream_buffer m_buffer;
 
+	// SETQ requests are sent in one request until other request
+	// is received or the read buffer is drained.
+	void flush_setq();
+	void submit_setq();
+	std::vector<gate::req_set> m_setq;
+
 	struct entry;
 
 	class response_queue {
@@ -122,17 +156,21 @@ private:
 		int m_fd;
 
 		struct element_t {
-			element_t(entry* a) : e(a), vec(NULL), veclen(0) { }
+			element_t(entry* a, bool q) :
+				e(a), quiet(q), vec(NULL), veclen(0) { }
 
 			void filled() { e = NULL; }
 			bool is_filled() const { return e == NULL; }
 
 			entry* e;
+			bool quiet;
 			shared_zone life;
 			struct iovec* vec;
 			size_t veclen;
 		};
 
+		void send_element(const element_t& elem);
+
 		mp::pthread_mutex m_queue_mutex;
 
 		typedef std::deque<element_t> queue_t;
@@ -164,26 +202,48 @@ private:
 			gate::res_get& res, auto_zone z);
 
 
-	// set
+	// set, setq, replace, replaceq
 	struct set_entry : entry {
+		bool flag_quiet;
 	};
 	static void response_set(void* user,
 			gate::res_set& res, auto_zone z);
 	static void response_cas(void* user,
 			gate::res_set& res, auto_zone z);
+	static void response_append(void* user,
+			gate::res_set& res, auto_zone z);
+	static void response_incr(void* user,
+			gate::res_set& res, auto_zone z);
 
 
-	// delete
+	// delete, deleteq
 	struct delete_entry : entry {
+		bool flag_quiet;
 	};
 	static void response_delete(void* user,
 			gate::res_delete& res, auto_zone z);
 
 
+	// touch, gat, gatq
+	struct touch_entry : entry {
+		bool flag_value;
+		bool flag_quiet;
+		uint32_t exptime;
+		const char* key;
+		uint16_t keylen;
+		unsigned int retried;
+	};
+	static void submit_touch(touch_entry* e, shared_zone& life);
+	static void response_touch_get(void* user,
+			gate::res_get& res, auto_zone z);
+	static void response_touch(void* user,
+			gate::res_set& res, auto_zone z);
+
+
 	static void send_response_nosend(entry* e, auto_zone z);
 
 	static void send_response_nodata(entry* e, auto_zone z,
-			uint8_t status);
+			uint16_t status);
 
 	static void send_response(entry* e, auto_zone z,
 			uint8_t status,
@@ -228,7 +288,11 @@ inline void handler::response_queue::invalidate()
 
 void handler::response_queue::push_entry(entry* e)
 {
-	element_t m(e);
+	// responses of GETQ and GETKQ are matched by opaque.
+	// clients don't expect them in order.
+	bool quiet = (e->header.opcode == MEMPROTO_CMD_GETQ ||
+			e->header.opcode == MEMPROTO_CMD_GETKQ);
+	element_t m(e, quiet);
 
 	mp::pthread_scoped_lock mqlk(m_queue_mutex);
 	m_queue.push_back(m);
@@ -246,6 +310,16 @@ struct handler::response_queue::find_entry_compare {
 	entry* m_key;
 };
 
+inline void handler::response_queue::send_element(const element_t& elem)
+{
+	if(elem.veclen > 0) {
+		std::auto_ptr<shared_zone> sz(new shared_zone(elem.life));
+		wavy::request req(&mp::object_delete<shared_zone>, sz.get());
+		wavy::writev(m_fd, elem.vec, elem.veclen, req);
+		sz.release();
+	}
+}
+
 void handler::response_queue::reached_try_send(
 		entry* e, auto_zone z,
 		struct iovec* vec, size_t veclen)
@@ -267,22 +341,32 @@ void handler::response_queue::reached_try_send(
 	found->veclen = veclen;
 	found->filled();
 
-	do {
+	if(found->quiet) {
+		// stream quiet responses of a multi-get as soon as they arrive
+		// unless an ordered response is waiting before them.
+		// a quiet response filled earlier has been sent by this rule,
+		// so the elements before it are not filled.
+		queue_t::iterator it(m_queue.begin());
+		for(; it != found; ++it) {
+			if(!it->quiet) { break; }
+		}
+		if(it == found) {
+			send_element(*found);
+			m_queue.erase(found);
+		}
+	}
+
+	while(!m_queue.empty()) {
 		element_t& elem(m_queue.front());
 
 		if(!elem.is_filled()) {
 			break;
 		}
 
-		if(elem.veclen > 0) {
-			std::auto_ptr<shared_zone> sz(new shared_zone(elem.life));
-			wavy::request req(&mp::object_delete<shared_zone>, sz.get());
-			wavy::writev(m_fd, elem.vec, elem.veclen, req);
-			sz.release();
-		}
+		send_element(elem);
 
 		m_queue.pop_front();
-	} while(!m_queue.empty());
+	}
 
 #if 0
 	size_t reqlen = 0;
@@ -357,7 +441,7 @@ inline void handler::send_response_nosend(entry* e, auto_zone z)
 
 void handler::send_response_nodata(
 		entry* e, auto_zone z,
-		uint8_t status)
+		uint16_t status)
 {
 	char* header = (char*)z->malloc(MEMPROTO_HEADER_SIZE);
 
@@ -434,6 +518,15 @@ handler::handler(int fd) :
 				uint32_t, uint32_t)>
 				::mem_fun<handler, &handler::request_set>;
 
+	void (*cmd_add)(void*, memproto_header*,
+			const char*, uint16_t,
+			const char*, uint32_t,
+			uint32_t, uint32_t) = &mp::object_callback<void (memproto_header*,
+				const char*, uint16_t,
+				const char*, uint32_t,
+				uint32_t, uint32_t)>
+				::mem_fun<handler, &handler::request_add>;
+
 	void (*cmd_delete)(void*, memproto_header*,
 			const char*, uint16_t,
 			uint32_t) = &mp::object_callback<void (memproto_header*,
@@ -441,6 +534,27 @@ handler::handler(int fd) :
 				uint32_t)>
 				::mem_fun<handler, &handler::request_delete>;
 
+	void (*cmd_incr)(void*, memproto_header*,
+			const char*, uint16_t,
+			uint64_t, uint64_t, uint32_t) = &mp::object_callback<void (memproto_header*,
+				const char*, uint16_t,
+				uint64_t, uint64_t, uint32_t)>
+				::mem_fun<handler, &handler::request_incr>;
+
+	void (*cmd_append)(void*, memproto_header*,
+			const char*, uint16_t,
+			const char*, uint32_t) = &mp::object_callback<void (memproto_header*,
+				const char*, uint16_t,
+				const char*, uint32_t)>
+				::mem_fun<handler, &handler::request_append>;
+
+	void (*cmd_touch)(void*, memproto_header*,
+			const char*, uint16_t,
+			uint32_t) = &mp::object_callback<void (memproto_header*,
+				const char*, uint16_t,
+				uint32_t)>
+				::mem_fun<handler, &handler::request_touch>;
+
 	void (*cmd_noop)(void*, memproto_header*) =
 			&mp::object_callback<void (memproto_header*)>
 				::mem_fun<handler, &handler::request_noop>;
@@ -453,11 +567,11 @@ handler::handler(int fd) :
 	memproto_callback cb = {
 		cmd_getx,    // get
 		cmd_set,     // set
-		NULL,        // add
+		cmd_add,     // add
 		cmd_set,     // replace
 		cmd_delete,  // delete
-		NULL,        // increment
-		NULL,        // decrement
+		cmd_incr,    // increment
+		cmd_incr,    // decrement
 		NULL,        // quit
 		cmd_flush,   // flush
 		cmd_getx,    // getq
@@ -465,8 +579,21 @@ handler::handler(int fd) :
 		NULL,        // version
 		cmd_getx,    // getk
 		cmd_getx,    // getkq
-		NULL,        // append
-		NULL,        // prepend
+		cmd_append,  // append
+		cmd_append,  // prepend
+		cmd_set,     // setq
+		cmd_add,     // addq
+		cmd_set,     // replaceq
+		cmd_delete,  // deleteq
+		cmd_incr,    // incrementq
+		cmd_incr,    // decrementq
+		NULL,        // quitq
+		cmd_flush,   // flushq
+		cmd_append,  // appendq
+		cmd_append,  // prependq
+		cmd_touch,   // touch
+		cmd_touch,   // gat
+		cmd_touch,   // gatq
 	};
 
 	memproto_parser_init(&m_memproto, &cb, this);
@@ -515,6 +642,8 @@ try {
 
 	} while(m_buffer.data_size() > 0);
 
+	flush_setq();
+
 } catch(rpc::connection_error& e) {
 	LOG_DEBUG(e.what());
 	throw;
@@ -544,10 +673,55 @@ try {
 	}
 
 
+inline void handler::flush_setq()
+{
+	if(!m_setq.empty()) {
+		submit_setq();
+	}
+}
+
+void handler::submit_setq()
+{
+	if(m_setq.size() == 1) {
+		gate::req_set req(m_setq.front());
+		m_setq.clear();
+		req.submit();
+		return;
+	}
+
+	// the life holds lives of the requests
+	shared_zone life(new msgpack::zone());
+	std::vector<gate::req_set>* reqs =
+		life->allocate< std::vector<gate::req_set> >();
+	reqs->swap(m_setq);
+
+	gate::req_set_multi req;
+	req.reqs = &reqs->front();
+	req.num  = reqs->size();
+	req.life = life;
+
+	req.submit();
+}
+
+void handler::request_status(memproto_header* h, uint16_t status)
+{
+	auto_zone z(new msgpack::zone());
+
+	entry* e = z->allocate<entry>();
+	e->queue      = m_queue;
+	e->header     = *h;
+
+	m_queue->push_entry(e);
+
+	send_response_nodata(e, z, status);
+}
+
+
 void handler::request_getx(memproto_header* h,
 		const char* key, uint16_t keylen)
 {
 	LOG_TRACE("getx");
+	flush_setq();
 	RELEASE_REFERENCE(life);
 
 	get_entry* e = life->allocate<get_entry>();
@@ -573,16 +747,29 @@ void handler::request_set(memproto_header* h,
 		uint32_t flags, uint32_t expiration)
 {
 	LOG_TRACE("set");
+
+	bool quiet = (h->opcode == MEMPROTO_CMD_SETQ ||
+			h->opcode == MEMPROTO_CMD_REPLACEQ ||
+			h->opcode == MEMPROTO_CMD_ADDQ);
+	bool add = (h->opcode == MEMPROTO_CMD_ADD ||
+			h->opcode == MEMPROTO_CMD_ADDQ);
+	bool batch = (h->opcode == MEMPROTO_CMD_SETQ && !h->cas);
+	if(!batch) {
+		flush_setq();
+	}
+
 	RELEASE_REFERENCE(life);
 
-	if(h->opcode == MEMPROTO_CMD_REPLACE && !h->cas) {
+	if((h->opcode == MEMPROTO_CMD_REPLACE ||
+			h->opcode == MEMPROTO_CMD_REPLACEQ) && !h->cas) {
 		// replace without cas value is not supported
-		throw std::runtime_error("memcached binary protocol: unsupported requrest");
+		request_status(h, MEMPROTO_RES_NOT_SUPPORTED);
+		return;
 	}
 
 	if((!g_save_flag && flags) || (!g_save_exptime && expiration)) {
-		// FIXME error response
-		throw std::runtime_error("memcached binary protocol: invalid argument");
+		request_status(h, MEMPROTO_RES_INVALID_ARGUMENTS);
+		return;
 	}
 
 	if(g_save_flag || g_save_exptime) {
@@ -618,12 +805,14 @@ void handler::request_set(memproto_header* h,
 	set_entry* e = life->allocate<set_entry>();
 	e->queue      = m_queue;
 	e->header     = *h;
+	e->flag_quiet = quiet;
 
 	gate::req_set req;
 	req.keylen   = keylen;
 	req.key      = key;
 	req.vallen   = vallen;
 	req.val      = val;
+	req.has_exptime = g_save_exptime;
 	req.user     = reinterpret_cast<void*>(e);
 	req.callback = &handler::response_set;
 	req.life     = life;
@@ -631,27 +820,59 @@ void handler::request_set(memproto_header* h,
 		req.operation = gate::OP_CAS;
 		req.clocktime = h->cas;
 		req.callback = &handler::response_cas;
+	} else if(add) {
+		// stored only if the key is not found
+		req.operation = gate::OP_ADD;
+		req.callback = &handler::response_cas;
 	}
 
 	m_queue->push_entry(e);
+
+	if(batch) {
+		m_setq.push_back(req);
+		if(m_setq.size() >= MEMPROTO_SETQ_BATCH_MAX) {
+			submit_setq();
+		}
+		return;
+	}
+
 	req.submit();
 }
 
+void handler::request_add(memproto_header* h,
+		const char* key, uint16_t keylen,
+		const char* val, uint32_t vallen,
+		uint32_t flags, uint32_t expiration)
+{
+	LOG_TRACE("add");
+
+	if(h->cas) {
+		flush_setq();
+		RELEASE_REFERENCE(life);
+		request_status(h, MEMPROTO_RES_INVALID_ARGUMENTS);
+		return;
+	}
+
+	request_set(h, key, keylen, val, vallen, flags, expiration);
+}
+
 void handler::request_delete(memproto_header* h,
 		const char* key, uint16_t keylen,
 		uint32_t expiration)
 {
 	LOG_TRACE("delete");
+	flush_setq();
 	RELEASE_REFERENCE(life);
 
 	if(expiration) {
-		// FIXME error response
-		throw std::runtime_error("memcached binary protocol: invalid argument");
+		request_status(h, MEMPROTO_RES_INVALID_ARGUMENTS);
+		return;
 	}
 
 	delete_entry* e = life->allocate<delete_entry>();
 	e->queue      = m_queue;
 	e->header     = *h;
+	e->flag_quiet = (h->opcode == MEMPROTO_CMD_DELETEQ);
 
 	gate::req_delete req;
 	req.key      = key;
@@ -664,9 +885,151 @@ void handler::request_delete(memproto_header* h,
 	req.submit();
 }
 
+void handler::request_incr(memproto_header* h,
+		const char* key, uint16_t keylen,
+		uint64_t amount, uint64_t initial, uint32_t expiration)
+{
+	LOG_TRACE("incr");
+	flush_setq();
+	RELEASE_REFERENCE(life);
+
+	// 0xffffffff: don't create the key if it doesn't exist
+	bool create = (expiration != 0xffffffff);
+	if(!create) {
+		expiration = 0;
+	}
+
+	if(!g_save_exptime && expiration) {
+		request_status(h, MEMPROTO_RES_INVALID_ARGUMENTS);
+		return;
+	}
+
+	// [exptime][flags][initial number]
+	uint32_t headlen = (g_save_flag ? 2 : 0) + (g_save_exptime ? 4 : 0);
+	char* val = (char*)life->malloc(headlen + 20 + 1);
+	memset(val, 0, headlen);
+	if(g_save_exptime) {
+		*(uint32_t*)val = htonl( exptime_to_system(expiration) );
+	}
+	uint32_t vallen = headlen;
+	if(create) {
+		vallen += sprintf(val+headlen, "%llu", (unsigned long long)initial);
+	}
+
+	set_entry* e = life->allocate<set_entry>();
+	e->queue      = m_queue;
+	e->header     = *h;
+	e->flag_quiet = (h->opcode == MEMPROTO_CMD_INCREMENTQ ||
+			h->opcode == MEMPROTO_CMD_DECREMENTQ);
+
+	gate::req_set req;
+	req.keylen   = keylen;
+	req.key      = key;
+	req.vallen   = vallen;
+	req.val      = val;
+	req.has_exptime = g_save_exptime;
+	req.operation = (h->opcode == MEMPROTO_CMD_INCREMENT ||
+			h->opcode == MEMPROTO_CMD_INCREMENTQ) ?
+		gate::OP_INCR : gate::OP_DECR;
+	req.headlen  = headlen;
+	req.amount   = amount;
+	req.user     = reinterpret_cast<void*>(e);
+	req.callback = &handler::response_incr;
+	req.life     = life;
+
+	m_queue->push_entry(e);
+	req.submit();
+}
+
+void handler::request_append(memproto_header* h,
+		const char* key, uint16_t keylen,
+		const char* val, uint32_t vallen)
+{
+	LOG_TRACE("append");
+	flush_setq();
+	RELEASE_REFERENCE(life);
+
+	// flags and exptime of the stored value are kept.
+	// the head is still needed to tell its length to the server.
+	uint32_t headlen = (g_save_flag ? 2 : 0) + (g_save_exptime ? 4 : 0);
+	if(headlen > 0) {
+		// key is just before val; move it
+		char* xkey = (char*)life->malloc(keylen);
+		memcpy(xkey, key, keylen);
+		key = xkey;
+
+		val    -= headlen;
+		vallen += headlen;
+		memset(const_cast<char*>(val), 0, headlen);
+	}
+
+	set_entry* e = life->allocate<set_entry>();
+	e->queue      = m_queue;
+	e->header     = *h;
+	e->flag_quiet = (h->opcode == MEMPROTO_CMD_APPENDQ ||
+			h->opcode == MEMPROTO_CMD_PREPENDQ);
+
+	gate::req_set req;
+	req.keylen   = keylen;
+	req.key      = key;
+	req.vallen   = vallen;
+	req.val      = val;
+	req.has_exptime = g_save_exptime;
+	req.operation = (h->opcode == MEMPROTO_CMD_APPEND ||
+			h->opcode == MEMPROTO_CMD_APPENDQ) ?
+		gate::OP_APPEND : gate::OP_PREPEND;
+	req.headlen  = headlen;
+	req.user     = reinterpret_cast<void*>(e);
+	req.callback = &handler::response_append;
+	req.life     = life;
+
+	m_queue->push_entry(e);
+	req.submit();
+}
+
+void handler::request_touch(memproto_header* h,
+		const char* key, uint16_t keylen,
+		uint32_t expiration)
+{
+	LOG_TRACE("touch");
+	flush_setq();
+	RELEASE_REFERENCE(life);
+
+	if(!g_save_exptime) {
+		request_status(h, MEMPROTO_RES_NOT_SUPPORTED);
+		return;
+	}
+
+	touch_entry* e = life->allocate<touch_entry>();
+	e->queue      = m_queue;
+	e->header     = *h;
+	e->flag_value = (h->opcode == MEMPROTO_CMD_GAT || h->opcode == MEMPROTO_CMD_GATQ);
+	e->flag_quiet = (h->opcode == MEMPROTO_CMD_GATQ);
+	e->exptime    = exptime_to_system(expiration);
+	e->key        = key;
+	e->keylen     = keylen;
+	e->retried    = 0;
+
+	m_queue->push_entry(e);
+	submit_touch(e, life);
+}
+
+void handler::submit_touch(touch_entry* e, shared_zone& life)
+{
+	gate::req_get req;
+	req.keylen   = e->keylen;
+	req.key      = e->key;
+	req.user     = reinterpret_cast<void*>(e);
+	req.callback = &handler::response_touch_get;
+	req.life     = life;
+
+	req.submit();
+}
+
 void handler::request_noop(memproto_header* h)
 {
 	LOG_TRACE("noop");
+	flush_setq();
 	RELEASE_REFERENCE_AUTO(z);
 
 	entry* e = z->allocate<entry>();
@@ -682,6 +1045,7 @@ void handler::request_flush(memproto_header* h,
 		uint32_t expiration)
 {
 	LOG_TRACE("flush");
+	flush_setq();
 	RELEASE_REFERENCE_AUTO(z);
 
 	if(expiration) {
@@ -695,6 +1059,10 @@ void handler::request_flush(memproto_header* h,
 
 	m_queue->push_entry(e);
 
+	if(h->opcode == MEMPROTO_CMD_FLUSHQ) {
+		send_response_nosend(e, z);
+		return;
+	}
 	send_response_nodata(e, z, MEMPROTO_RES_NO_ERROR);
 }
 
@@ -801,6 +1169,10 @@ void handler::response_set(void* user,
 	}
 
 	// stored
+	if(e->flag_quiet) {
+		send_response_nosend(e, z);
+		return;
+	}
 	send_response_nodata(e, z, MEMPROTO_RES_NO_ERROR);
 }
 
@@ -825,9 +1197,90 @@ void handler::response_cas(void* user,
 	}
 
 	// stored
+	if(e->flag_quiet) {
+		send_response_nosend(e, z);
+		return;
+	}
 	send_response_nodata(e, z, MEMPROTO_RES_NO_ERROR);
 }
 
+void handler::response_append(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	set_entry* e = reinterpret_cast<set_entry*>(user);
+	if(!e->queue->is_valid()) { return; }
+
+	LOG_TRACE("append response");
+
+	if(res.error) {
+		// error
+		send_response_nodata(e, z, MEMPROTO_RES_OUT_OF_MEMORY);
+		return;
+	}
+
+	if(!res.cas_success) {
+		send_response_nodata(e, z, MEMPROTO_RES_ITEM_NOT_STORED);
+		return;
+	}
+
+	// stored
+	if(e->flag_quiet) {
+		send_response_nosend(e, z);
+		return;
+	}
+	send_response(e, z, MEMPROTO_RES_NO_ERROR,
+			NULL, 0,
+			NULL, 0,
+			NULL, 0,
+			res.clocktime);
+}
+
+void handler::response_incr(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	set_entry* e = reinterpret_cast<set_entry*>(user);
+	if(!e->queue->is_valid()) { return; }
+
+	LOG_TRACE("incr response");
+
+	if(res.error == 2) {
+		send_response_nodata(e, z, MEMPROTO_RES_INCR_DECR_ON_NON_NUMERIC_VALUE);
+		return;
+	}
+
+	if(res.error) {
+		// error
+		send_response_nodata(e, z, MEMPROTO_RES_OUT_OF_MEMORY);
+		return;
+	}
+
+	if(!res.cas_success) {
+		send_response_nodata(e, z, MEMPROTO_RES_KEY_NOT_FOUND);
+		return;
+	}
+
+	if(e->flag_quiet) {
+		send_response_nosend(e, z);
+		return;
+	}
+
+	// the server stores decimal number
+	uint64_t num = 0;
+	for(uint32_t i=0; i < res.vallen; ++i) {
+		num = num * 10 + (res.val[i] - '0');
+	}
+
+	uint32_t* val = (uint32_t*)z->malloc(8);
+	val[0] = htonl((uint32_t)(num >> 32));
+	val[1] = htonl((uint32_t)(num & 0xffffffffULL));
+
+	send_response(e, z, MEMPROTO_RES_NO_ERROR,
+			NULL, 0,
+			val, 8,
+			NULL, 0,
+			res.clocktime);
+}
+
 void handler::response_delete(void* user,
 		gate::res_delete& res, auto_zone z)
 {
@@ -843,12 +1296,126 @@ void handler::response_delete(void* user,
 	}
 
 	if(res.deleted) {
+		if(e->flag_quiet) {
+			send_response_nosend(e, z);
+			return;
+		}
 		send_response_nodata(e, z, MEMPROTO_RES_NO_ERROR);
 	} else {
 		send_response_nodata(e, z, MEMPROTO_RES_OUT_OF_MEMORY);
 	}
 }
 
+void handler::response_touch_get(void* user,
+		gate::res_get& res, auto_zone z)
+{
+	touch_entry* e = reinterpret_cast<touch_entry*>(user);
+	if(!e->queue->is_valid()) { return; }
+
+	LOG_TRACE("touch get response");
+
+	if(res.error) {
+		// error
+		send_response_nodata(e, z, MEMPROTO_RES_OUT_OF_MEMORY);
+		return;
+	}
+
+	bool found = (res.val && res.vallen >= 4 + (g_save_flag ? 2 : 0));
+	if(found) {
+		union {
+			uint32_t num;
+			char mem[4];
+		} cast;
+		memcpy(cast.mem, res.val, 4);
+		uint32_t exptime = ntohl(cast.num);
+		if(exptime != 0 && exptime < g_system_time) {
+			found = false;
+		}
+	}
+
+	if(!found) {
+		if(e->flag_quiet) {
+			send_response_nosend(e, z);
+			return;
+		}
+		send_response_nodata(e, z, MEMPROTO_RES_KEY_NOT_FOUND);
+		return;
+	}
+
+	// the response zone holds the life of the request
+	shared_zone life(z.release());
+
+	char* val = (char*)life->malloc(res.vallen);
+	memcpy(val, res.val, res.vallen);
+	*(uint32_t*)val = htonl(e->exptime);
+
+	gate::req_set req;
+	req.keylen   = e->keylen;
+	req.key      = e->key;
+	req.vallen   = res.vallen;
+	req.val      = val;
+	req.has_exptime = true;
+	req.operation = gate::OP_CAS;
+	req.clocktime = res.clocktime;
+	req.user     = reinterpret_cast<void*>(e);
+	req.callback = &handler::response_touch;
+	req.life     = life;
+
+	req.submit();
+}
+
+void handler::response_touch(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	touch_entry* e = reinterpret_cast<touch_entry*>(user);
+	if(!e->queue->is_valid()) { return; }
+
+	LOG_TRACE("touch response");
+
+	if(res.error) {
+		// error
+		send_response_nodata(e, z, MEMPROTO_RES_OUT_OF_MEMORY);
+		return;
+	}
+
+	if(!res.cas_success) {
+		// updated by other client between get and cas
+		if(++e->retried < MEMPROTO_TOUCH_RETRY_MAX) {
+			shared_zone life(z.release());
+			submit_touch(e, life);
+			return;
+		}
+		send_response_nodata(e, z, MEMPROTO_RES_ITEM_NOT_STORED);
+		return;
+	}
+
+	if(!e->flag_value) {
+		send_response(e, z, MEMPROTO_RES_NO_ERROR,
+				NULL, 0,
+				NULL, 0,
+				NULL, 0,
+				res.clocktime);
+		return;
+	}
+
+	const char* val = res.val + 4;
+	uint32_t vallen = res.vallen - 4;
+
+	char* flags = (char*)z->malloc(4);
+	memset(flags, 0, 4);
+	if(g_save_flag) {
+		memcpy(flags+2, val, 2);
+		val    += 2;
+		vallen -= 2;
+	}
+
+	send_response(e, z, MEMPROTO_RES_NO_ERROR,
+			NULL, 0,
+			val, vallen,
+			flags, 4,
+			res.clocktime);
+}
+
 
 void accepted(int fd, int err)
 {
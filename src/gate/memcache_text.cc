@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <algorithm>
 #include <memory>
+#include <vector>
 #include <inttypes.h>
 #include <sys/time.h>
 #include "config.h"  // PACKAGE VERSION
@@ -129,11 +130,7 @@ struct get_entry : entry {
 
 struct get_multi_entry : entry {
 	bool require_cas;
-	size_t offset;
 	unsigned *count;
-	struct iovec*  vhead;
-	wavy::request* rhead;
-	size_t veclen;
 };
 
 struct set_entry : entry {
@@ -158,13 +155,6 @@ inline void send_datav(entry* e,
 	wavy::writev(e->fd, vb, count, req);
 }
 
-inline void send_datav(entry* e,
-		struct iovec* vb, wavy::request* vr, size_t count)
-{
-	if(!*e->valid) { return; }
-	wavy::writev(e->fd, vb, vr, count);
-}
-
 
 static const char* const NOT_SUPPORTED_REPLY = "CLIENT_ERROR supported\r\n";
 static const char* const GET_FAILED_REPLY    = "SERVER_ERROR get failed\r\n";
@@ -173,6 +163,9 @@ static const char* const DELETE_FAILED_REPLY = "SERVER_ERROR delete failed\r\n";
 static const char* const VERSION_REPLY       = "VERSION " PACKAGE "-" VERSION "\r\n";
 static const char* const EXISTS_REPLY        = "EXISTS\r\n";
 static const char* const NOT_FOUND_REPLY     = "NOT_FOUND\r\n";
+static const char* const NOT_STORED_REPLY    = "NOT_STORED\r\n";
+static const char* const NOT_NUMBER_REPLY    =
+	"CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
 
 // "VALUE "+keylen+" "+uint16+" "+uint32+" "+uint64+"\r\n\0"
 #define HEADER_SIZE(keylen) \
@@ -262,6 +255,10 @@ void response_get_multi(void* user,
 	get_multi_entry* e = reinterpret_cast<get_multi_entry*>(user);
 	LOG_TRACE("get multi response");
 
+	// each VALUE block is sent as soon as it arrives. the block is
+	// queued before decrementing the count, so END sent by the last
+	// response always follows all blocks.
+
 	if(res.error || !res.val) {
 		goto filled;
 	}
@@ -289,10 +286,10 @@ void response_get_multi(void* user,
 
 	{
 		// res.life is different from req.life and res.life includes req.life
-		char* const header = (char*)z->malloc(HEADER_SIZE(res.keylen)+2);  // +2: \r\n
+		char* const header = (char*)z->malloc(HEADER_SIZE(res.keylen));
 		char* p = header;
 	
-		memcpy(p, "\r\nVALUE ", 8);       p += 8;
+		memcpy(p, "VALUE ", 6);           p += 6;
 		memcpy(p, res.key,  res.keylen);  p += res.keylen;
 
 		if(g_save_flag) {
@@ -314,29 +311,22 @@ void response_get_multi(void* user,
 		} else {
 			p[0] = '\r'; p[1] = '\n'; p += 2;
 		}
-	
-		struct iovec*  vb = &e->vhead[e->offset];
-		wavy::request* vr = &e->rhead[e->offset];
-	
+
+		struct iovec vb[3];
 		vb[0].iov_base = header;
 		vb[0].iov_len  = p - header;
 		vb[1].iov_base = res.val;
 		vb[1].iov_len  = res.vallen;
-	
-		vr[1] = wavy::request(&mp::object_delete<msgpack::zone>, z.release());
+
+		vb[2].iov_base = const_cast<char*>("\r\n");
+		vb[2].iov_len  = 2;
+
+		send_datav(e, vb, 3, z);
 	}
 
 filled:
 	if(__sync_sub_and_fetch(e->count, 1) == 0) {
-		for(struct iovec* v=e->vhead, * const ve = e->vhead+e->veclen;
-				v < ve; v+=2) {
-			if(v->iov_base) {
-				v->iov_base = (char*)v->iov_base + 2;  // strip \r\n
-				v->iov_len -= 2;
-				break;
-			}
-		}
-		send_datav(e, e->vhead, e->rhead, e->veclen);
+		send_data(e, "END\r\n", 5);
 	}
 }
 
@@ -374,6 +364,55 @@ void response_cas(void* user,
 	send_data(e, "STORED\r\n", 8);
 }
 
+void response_append(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	set_entry* e = reinterpret_cast<set_entry*>(user);
+	LOG_TRACE("append response");
+
+	if(res.error) {
+		send_data(e, STORE_FAILED_REPLY, strlen(STORE_FAILED_REPLY));
+		return;
+	}
+
+	if(!res.cas_success) {
+		send_data(e, NOT_STORED_REPLY, strlen(NOT_STORED_REPLY));
+		return;
+	}
+
+	send_data(e, "STORED\r\n", 8);
+}
+
+void response_incr(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	set_entry* e = reinterpret_cast<set_entry*>(user);
+	LOG_TRACE("incr response");
+
+	if(res.error == 2) {
+		send_data(e, NOT_NUMBER_REPLY, strlen(NOT_NUMBER_REPLY));
+		return;
+	}
+
+	if(res.error) {
+		send_data(e, STORE_FAILED_REPLY, strlen(STORE_FAILED_REPLY));
+		return;
+	}
+
+	if(!res.cas_success) {
+		send_data(e, NOT_FOUND_REPLY, strlen(NOT_FOUND_REPLY));
+		return;
+	}
+
+	struct iovec vb[2];
+	vb[0].iov_base = const_cast<char*>(res.val);
+	vb[0].iov_len  = res.vallen;
+	vb[1].iov_base = const_cast<char*>("\r\n");
+	vb[1].iov_len  = 2;
+
+	send_datav(e, vb, 2, z);
+}
+
 void response_delete(void* user,
 		gate::res_delete& res, auto_zone z)
 {
@@ -445,49 +484,34 @@ int request_get_multi(void* user,
 	LOG_TRACE("get multi");
 	RELEASE_REFERENCE(user, ctx, life);
 
-	size_t const veclen = r->key_num * 2 + 1;  // +1: \r\nEND\r\n
-
-	struct iovec*  vhead = (struct iovec* )life->malloc(
-			sizeof(struct iovec )*veclen);
-
-	wavy::request* rhead = (wavy::request*)life->malloc(
-			sizeof(wavy::request)*veclen);
-
 	unsigned* share_count = (unsigned*)life->malloc(sizeof(unsigned));
 
 	*share_count = r->key_num;
 
-	memset(vhead, 0, sizeof(struct iovec )*(veclen-1));
-	vhead[veclen-1].iov_base = const_cast<char*>("\r\nEND\r\n");
-	vhead[veclen-1].iov_len  = 7;
-
-	memset(rhead, 0, sizeof(wavy::request)*veclen);
-
-
 	get_multi_entry* me[r->key_num];
 	for(unsigned i=0; i < r->key_num; ++i) {
 		me[i] = life->allocate<get_multi_entry>();
 		me[i]->fd          = ctx->fd();
 		me[i]->valid       = ctx->valid();
 		me[i]->require_cas = require_cas;
-		me[i]->offset      = i*2;
 		me[i]->count       = share_count;
-		me[i]->vhead       = vhead;
-		me[i]->rhead       = rhead;
-		me[i]->veclen      = veclen;
 	}
 
+	std::vector<gate::req_get> reqs(r->key_num);
 	for(unsigned i=0; i < r->key_num; ++i) {
-		gate::req_get req;
-		req.keylen   = r->key_len[i];
-		req.key      = r->key[i];
-		req.user     = reinterpret_cast<void*>(me[i]);
-		req.callback = &response_get_multi;
-		req.life     = life;
-
-		req.submit();
+		reqs[i].keylen   = r->key_len[i];
+		reqs[i].key      = r->key[i];
+		reqs[i].user     = reinterpret_cast<void*>(me[i]);
+		reqs[i].callback = &response_get_multi;
 	}
 
+	gate::req_get_multi req;
+	req.reqs = &reqs[0];
+	req.num  = r->key_num;
+	req.life = life;
+
+	req.submit();
+
 	return 0;
 }
 
@@ -526,30 +550,30 @@ int request_set_impl(void* user,
 		return 0;
 	}
 
-	if(cmd == MEMTEXT_CMD_SET || cmd == MEMTEXT_CMD_CAS) {
-		if(g_save_flag) {
-			union {
-				uint16_t num;
-				char mem[2];
-			} cast;
-			cast.num = htons(r->flags);
-			r->data     -= 2;
-			r->data_len += 2;
-			// テキストプロトコルでdataの前2バイトには\nとbytesが入っているが、
-			// r->data_lenにコピーされている
-			memcpy(const_cast<char*>(r->data), cast.mem, 2);
-		}
+	// append and prepend keep flags and exptime of the stored value.
+	// the head is still needed to tell its length to the server.
+	if(g_save_flag) {
+		union {
+			uint16_t num;
+			char mem[2];
+		} cast;
+		cast.num = htons(r->flags);
+		r->data     -= 2;
+		r->data_len += 2;
+		// テキストプロトコルでdataの前2バイトには\nとbytesが入っているが、
+		// r->data_lenにコピーされている
+		memcpy(const_cast<char*>(r->data), cast.mem, 2);
+	}
 
-		if(g_save_exptime) {
-			union {
-				uint32_t num;
-				char mem[4];
-			} cast;
-			cast.num = htonl( exptime_to_system(r->exptime) );
-			r->data     -= 4;
-			r->data_len += 4;
-			memcpy(const_cast<char*>(r->data), cast.mem, 4);
-		}
+	if(g_save_exptime) {
+		union {
+			uint32_t num;
+			char mem[4];
+		} cast;
+		cast.num = htonl( exptime_to_system(r->exptime) );
+		r->data     -= 4;
+		r->data_len += 4;
+		memcpy(const_cast<char*>(r->data), cast.mem, 4);
 	}
 
 	set_entry* e = life->allocate<set_entry>();
@@ -561,6 +585,7 @@ int request_set_impl(void* user,
 	req.key      = r->key;
 	req.vallen   = r->data_len;
 	req.val      = r->data;
+	req.has_exptime = g_save_exptime;
 	req.user     = reinterpret_cast<void*>(e);
 	req.life     = life;
 	if(r->noreply) {
@@ -583,10 +608,13 @@ int request_set_impl(void* user,
 		req.clocktime = cas_unique;
 		break;
 	case MEMTEXT_CMD_APPEND:
-		req.operation = gate::OP_APPEND;
-		break;
 	case MEMTEXT_CMD_PREPEND:
-		req.operation = gate::OP_PREPEND;
+		if(!r->noreply) {
+			req.callback = &response_append;
+		}
+		req.operation = (cmd == MEMTEXT_CMD_APPEND) ?
+			gate::OP_APPEND : gate::OP_PREPEND;
+		req.headlen = (g_save_flag ? 2 : 0) + (g_save_exptime ? 4 : 0);
 		break;
 	default:
 		throw std::logic_error("unknown command");
@@ -613,6 +641,44 @@ int request_cas(void* user,
 			(memtext_request_storage*)r, r->cas_unique);
 }
 
+int request_incr(void* user,
+		memtext_command cmd,
+		memtext_request_numeric* r)
+{
+	LOG_TRACE("incr/decr");
+	RELEASE_REFERENCE(user, ctx, life);
+
+	set_entry* e = life->allocate<set_entry>();
+	e->fd    = ctx->fd();
+	e->valid = ctx->valid();
+
+	// the key doesn't exist: not created.
+	// val is the head only; its content is not used.
+	uint32_t headlen = (g_save_flag ? 2 : 0) + (g_save_exptime ? 4 : 0);
+	char* head = (char*)life->malloc(headlen > 0 ? headlen : 1);
+	memset(head, 0, headlen);
+
+	gate::req_set req;
+	req.keylen   = r->key_len;
+	req.key      = r->key;
+	req.vallen   = headlen;
+	req.val      = head;
+	req.has_exptime = g_save_exptime;
+	req.operation = (cmd == MEMTEXT_CMD_INCR) ? gate::OP_INCR : gate::OP_DECR;
+	req.headlen  = headlen;
+	req.amount   = r->value;
+	req.user     = reinterpret_cast<void*>(e);
+	req.life     = life;
+	if(r->noreply) {
+		req.callback = &response_noreply_set;
+	} else {
+		req.callback = &response_incr;
+	}
+
+	req.submit();
+	return 0;
+}
+
 int request_delete(void* user,
 		memtext_command cmd,
 		memtext_request_delete* r)
@@ -687,12 +753,12 @@ handler::handler(int fd) :
 		request_set,    // set
 		NULL,           // add
 		NULL,           // replace
-		NULL, //request_set,    // append
-		NULL, //request_set,    // prepend
+		request_set,    // append
+		request_set,    // prepend
 		request_cas,    // cas
 		request_delete, // delete
-		NULL,           // incr
-		NULL,           // decr
+		request_incr,   // incr
+		request_incr,   // decr
 		request_version,// version
 	};
 
@@ -69,7 +69,7 @@ static inline uint64_t memproto_be64h(uint64_t x) {
 #define MEMPROTO_EXTRA_8_EXPIRATION(extra)   htonl(*((uint32_t*)&extra[4]))
 #define MEMPROTO_EXTRA_20_AMOUNT(extra)      memproto_be64h(*((uint64_t*)&extra[0]))
 #define MEMPROTO_EXTRA_20_INITIAL(extra)     memproto_be64h(*((uint64_t*)&extra[8]))
-#define MEMPROTO_EXTRA_20_EXPIRATION(extra)  memproto_be64h(*((uint32_t*)&extra[16]))
+#define MEMPROTO_EXTRA_20_EXPIRATION(extra)  htonl(*((uint32_t*)&extra[16]))
 
 
 void memproto_parser_init(memproto_parser* ctx, memproto_callback* cb, void* user)
@@ -91,6 +91,19 @@ void memproto_parser_init(memproto_parser* ctx, memproto_callback* cb, void* use
 	ctx->callback[0x0d] = (void*)cb->cb_getkq;
 	ctx->callback[0x0e] = (void*)cb->cb_append;
 	ctx->callback[0x0f] = (void*)cb->cb_prepend;
+	ctx->callback[0x11] = (void*)cb->cb_setq;
+	ctx->callback[0x12] = (void*)cb->cb_addq;
+	ctx->callback[0x13] = (void*)cb->cb_replaceq;
+	ctx->callback[0x14] = (void*)cb->cb_deleteq;
+	ctx->callback[0x15] = (void*)cb->cb_incrementq;
+	ctx->callback[0x16] = (void*)cb->cb_decrementq;
+	ctx->callback[0x17] = (void*)cb->cb_quitq;
+	ctx->callback[0x18] = (void*)cb->cb_flushq;
+	ctx->callback[0x19] = (void*)cb->cb_appendq;
+	ctx->callback[0x1a] = (void*)cb->cb_prependq;
+	ctx->callback[0x1c] = (void*)cb->cb_touch;
+	ctx->callback[0x1d] = (void*)cb->cb_gat;
+	ctx->callback[0x1e] = (void*)cb->cb_gatq;
 	ctx->user = user;
 }
 
@@ -134,6 +147,7 @@ int memproto_dispatch(memproto_parser* ctx)
 	const uint32_t vallen   = bodylen - extralen - keylen;
 
 	memproto_command cmd = (memproto_command)h.opcode;
+	if(cmd >= MEMPROTO_CALLBACK_SIZE) { return -cmd; }
 	void* cb = ctx->callback[cmd];
 	if(!cb) { return -cmd; }
 
@@ -151,6 +165,7 @@ int memproto_dispatch(memproto_parser* ctx)
 		return 1;
 
 	case MEMPROTO_CMD_DELETE:
+	case MEMPROTO_CMD_DELETEQ:
 		if(keylen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(vallen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(extralen == 0) {
@@ -170,6 +185,7 @@ int memproto_dispatch(memproto_parser* ctx)
 		} else { return MEMPROTO_INVALID_ARGUMENT; }
 
 	case MEMPROTO_CMD_FLUSH:
+	case MEMPROTO_CMD_FLUSHQ:
 		if(keylen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(vallen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(extralen == 0) {
@@ -188,6 +204,9 @@ int memproto_dispatch(memproto_parser* ctx)
 	case MEMPROTO_CMD_SET:
 	case MEMPROTO_CMD_ADD:
 	case MEMPROTO_CMD_REPLACE:
+	case MEMPROTO_CMD_SETQ:
+	case MEMPROTO_CMD_ADDQ:
+	case MEMPROTO_CMD_REPLACEQ:
 		if(keylen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(extralen != 8) { return MEMPROTO_INVALID_ARGUMENT; }
 		/*if(vallen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }*/
@@ -203,6 +222,8 @@ int memproto_dispatch(memproto_parser* ctx)
 
 	case MEMPROTO_CMD_INCREMENT:
 	case MEMPROTO_CMD_DECREMENT:
+	case MEMPROTO_CMD_INCREMENTQ:
+	case MEMPROTO_CMD_DECREMENTQ:
 		if(extralen != 20) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(keylen   ==  0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(vallen   !=  0) { return MEMPROTO_INVALID_ARGUMENT; }
@@ -218,6 +239,7 @@ int memproto_dispatch(memproto_parser* ctx)
 	case MEMPROTO_CMD_QUIT:
 	case MEMPROTO_CMD_NOOP:
 	case MEMPROTO_CMD_VERSION:
+	case MEMPROTO_CMD_QUITQ:
 		if(keylen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(extralen != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(vallen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
@@ -226,6 +248,8 @@ int memproto_dispatch(memproto_parser* ctx)
 
 	case MEMPROTO_CMD_APPEND:
 	case MEMPROTO_CMD_PREPEND:
+	case MEMPROTO_CMD_APPENDQ:
+	case MEMPROTO_CMD_PREPENDQ:
 		if(keylen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		if(extralen != 0) { return MEMPROTO_INVALID_ARGUMENT; }
 		/*if(vallen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }*/
@@ -235,6 +259,19 @@ int memproto_dispatch(memproto_parser* ctx)
 					key, keylen,
 					val, vallen);
 		return 1;
+
+	case MEMPROTO_CMD_TOUCH:
+	case MEMPROTO_CMD_GAT:
+	case MEMPROTO_CMD_GATQ:
+		if(keylen   == 0) { return MEMPROTO_INVALID_ARGUMENT; }
+		if(extralen != 4) { return MEMPROTO_INVALID_ARGUMENT; }
+		if(vallen   != 0) { return MEMPROTO_INVALID_ARGUMENT; }
+		MEMPROTO_CALLBACK(cb, void*, memproto_header*,
+				const char*, uint16_t,
+				uint32_t)(ctx->user, &h,
+					key, keylen,
+					MEMPROTO_EXTRA_4_EXPIRATION(extra));
+		return 1;
 	}
 
 	return -cmd;
@@ -39,8 +39,10 @@ typedef enum {
 	MEMPROTO_RES_VALUE_TOO_BIG      = 0x0003,
 	MEMPROTO_RES_INVALID_ARGUMENTS  = 0x0004,
 	MEMPROTO_RES_ITEM_NOT_STORED    = 0x0005,
+	MEMPROTO_RES_INCR_DECR_ON_NON_NUMERIC_VALUE = 0x0006,
 	MEMPROTO_RES_UNKNOWN_COMMAND    = 0x0081,
 	MEMPROTO_RES_OUT_OF_MEMORY      = 0x0082,
+	MEMPROTO_RES_NOT_SUPPORTED      = 0x0083,
 	MEMPROTO_RES_PAUSE              = 0xfe00,
 	MEMPROTO_RES_IO_ERROR           = 0xff00,
 } memproto_response_status;
@@ -63,6 +65,19 @@ typedef enum {
 	MEMPROTO_CMD_GETKQ               = 0x0d,
 	MEMPROTO_CMD_APPEND              = 0x0e,
 	MEMPROTO_CMD_PREPEND             = 0x0f,
+	MEMPROTO_CMD_SETQ                = 0x11,
+	MEMPROTO_CMD_ADDQ                = 0x12,
+	MEMPROTO_CMD_REPLACEQ            = 0x13,
+	MEMPROTO_CMD_DELETEQ             = 0x14,
+	MEMPROTO_CMD_INCREMENTQ          = 0x15,
+	MEMPROTO_CMD_DECREMENTQ          = 0x16,
+	MEMPROTO_CMD_QUITQ               = 0x17,
+	MEMPROTO_CMD_FLUSHQ              = 0x18,
+	MEMPROTO_CMD_APPENDQ             = 0x19,
+	MEMPROTO_CMD_PREPENDQ            = 0x1a,
+	MEMPROTO_CMD_TOUCH               = 0x1c,
+	MEMPROTO_CMD_GAT                 = 0x1d,
+	MEMPROTO_CMD_GATQ                = 0x1e,
 } memproto_command;
 
 
@@ -142,12 +157,68 @@ typedef struct memproto_callback_ {
 			const char* key, uint16_t keylen,
 			const char* val, uint32_t vallen);
 
+	/* quiet commands take the same arguments as the
+	 * corresponding commands. */
+	void (*cb_setq     )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen,
+			uint32_t flags, uint32_t expiration);
+
+	void (*cb_addq     )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen,
+			uint32_t flags, uint32_t expiration);
+
+	void (*cb_replaceq )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen,
+			uint32_t flags, uint32_t expiration);
+
+	void (*cb_deleteq  )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint32_t expiration);
+
+	void (*cb_incrementq)(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint64_t amount, uint64_t initial, uint32_t expiration);
+
+	void (*cb_decrementq)(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint64_t amount, uint64_t initial, uint32_t expiration);
+
+	void (*cb_quitq    )(void* user, memproto_header* h);
+
+	void (*cb_flushq   )(void* user, memproto_header* h,
+			uint32_t expiration);
+
+	void (*cb_appendq  )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen);
+
+	void (*cb_prependq )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			const char* val, uint32_t vallen);
+
+	void (*cb_touch    )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint32_t expiration);
+
+	void (*cb_gat      )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint32_t expiration);
+
+	void (*cb_gatq     )(void* user, memproto_header* h,
+			const char* key, uint16_t keylen,
+			uint32_t expiration);
+
 } memproto_callback;
 
 
+#define MEMPROTO_CALLBACK_SIZE 32
+
 typedef struct memproto_parser_ {
 	const char* header;
-	void* callback[16];
+	void* callback[MEMPROTO_CALLBACK_SIZE];
 	void* user;
 } memproto_parser;
 
@@ -74,6 +74,7 @@ private:
 #define REQUIRE_HSLK const pthread_scoped_lock& hslk
 #define REQUIRE_RELK const pthread_scoped_lock& relk
 #define REQUIRE_STLK const pthread_scoped_lock& stlk
+#define REQUIRE_RBLK const pthread_scoped_lock& rblk
 
 #define REQUIRE_HSLK_RDLOCK const pthread_scoped_rdlock& hslk
 #define REQUIRE_HSLK_WRLOCK const pthread_scoped_wrlock& hslk
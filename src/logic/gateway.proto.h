@@ -27,6 +27,7 @@ namespace gateway {
 
 
 @message mod_network_t::HashSpacePush       = 3
+@message mod_network_t::CacheInvalidate     = 4
 
 
 @rpc mod_network_t
@@ -36,6 +37,11 @@ namespace gateway {
 		// acknowledge: true
 	};
 
+	message CacheInvalidate {
+		msgtype::DBKey dbkey;
+		// acknowledge: true
+	};
+
 public:
 	void keep_alive();
 
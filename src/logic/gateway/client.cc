@@ -0,0 +1,418 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "logic/boot.h"
+#include "gateway/framework.h"
+#include "gateway/init.h"
+#include "gateway/kumoclient.h"
+#include "gate/interface.h"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace kumo;
+
+
+struct kumo_client_ {
+	// same fields as arg_t of kumo-gateway
+	rpc::address manager1;
+	rpc::address manager2;
+
+	unsigned long keepalive_interval_usec;
+	unsigned long clock_interval_usec;
+	unsigned int connect_timeout_msec;
+	unsigned short connect_retry_limit;
+	unsigned short wthreads;
+	unsigned short rthreads;
+	bool sharded_threads;
+	bool catch_signals;
+
+	unsigned short get_retry_num;
+	unsigned short set_retry_num;
+	unsigned short delete_retry_num;
+	unsigned short renew_threshold;
+	bool async_replicate_set;
+	bool async_replicate_delete;
+	unsigned short write_quorum;
+	bool no_get_coalescing;
+	bool read_latency_aware;
+	unsigned short read_hedge_percentile;
+	unsigned int read_hedge_min_msec;
+	size_t local_cache_memory_bytes;
+	unsigned int local_cache_stats_interval;
+	uint32_t cache_lease_msec;
+	std::string key_prefix;
+};
+
+
+namespace {
+
+// wavy can't be restarted after it ends; one client is created in a
+// process and the framework lives until the process exits.
+static volatile int s_created = 0;
+
+static void resolve_managers(kumo_client* c,
+		const char* manager1, const char* manager2)
+{
+	sockaddr_in manager1_in;
+	sockaddr_in manager2_in;
+	bool manager2_set = false;
+
+	const char* argv[] = {
+		"-m", manager1,
+		"-p", manager2,
+		NULL };
+	int argc = (manager2 ? 4 : 2);
+
+	using namespace kazuhiki;
+	init();
+	on("-m", "--manager1",
+			type::connectable(&manager1_in, MANAGER_DEFAULT_PORT));
+	on("-p", "--manager2", &manager2_set,
+			type::connectable(&manager2_in, MANAGER_DEFAULT_PORT));
+	parse(argc, const_cast<char**>(argv));
+
+	c->manager1 = rpc::address(manager1_in);
+	if(manager2_set) {
+		c->manager2 = rpc::address(manager2_in);
+	}
+}
+
+
+struct sync_wait {
+	sync_wait() : done(false), status(KUMO_ERROR), val(NULL), vallen(0) { }
+
+	void wait()
+	{
+		mp::pthread_scoped_lock lk(mutex);
+		while(!done) {
+			cond.wait(mutex);
+		}
+	}
+
+	void notify(kumo_status st)
+	{
+		mp::pthread_scoped_lock lk(mutex);
+		status = st;
+		done = true;
+		cond.signal();
+	}
+
+	mp::pthread_mutex mutex;
+	mp::pthread_cond cond;
+	bool done;
+
+	kumo_status status;
+	char* val;
+	size_t vallen;
+};
+
+static void sync_get_callback(void* user, kumo_status status,
+		const char* val, size_t vallen)
+{
+	sync_wait* w = static_cast<sync_wait*>(user);
+	if(status == KUMO_OK) {
+		w->val = (char*)::malloc(vallen > 0 ? vallen : 1);
+		if(!w->val) {
+			w->notify(KUMO_ERROR);
+			return;
+		}
+		memcpy(w->val, val, vallen);
+		w->vallen = vallen;
+	}
+	w->notify(status);
+}
+
+static void sync_status_callback(void* user, kumo_status status)
+{
+	static_cast<sync_wait*>(user)->notify(status);
+}
+
+
+struct get_entry {
+	kumo_get_callback callback;
+	void* user;
+};
+
+struct set_entry {
+	kumo_set_callback callback;
+	void* user;
+};
+
+struct delete_entry {
+	kumo_delete_callback callback;
+	void* user;
+};
+
+static void response_get(void* user,
+		gate::res_get& res, auto_zone z)
+{
+	get_entry* e = static_cast<get_entry*>(user);
+	LOG_TRACE("get response");
+
+	if(res.error) {
+		(*e->callback)(e->user, KUMO_ERROR, NULL, 0);
+	} else if(!res.val) {
+		(*e->callback)(e->user, KUMO_NOT_FOUND, NULL, 0);
+	} else {
+		(*e->callback)(e->user, KUMO_OK, res.val, res.vallen);
+	}
+}
+
+static void response_set(void* user,
+		gate::res_set& res, auto_zone z)
+{
+	set_entry* e = static_cast<set_entry*>(user);
+	LOG_TRACE("set response");
+
+	(*e->callback)(e->user, res.error ? KUMO_ERROR : KUMO_OK);
+}
+
+static void response_delete(void* user,
+		gate::res_delete& res, auto_zone z)
+{
+	delete_entry* e = static_cast<delete_entry*>(user);
+	LOG_TRACE("delete response");
+
+	if(res.error) {
+		(*e->callback)(e->user, KUMO_ERROR);
+	} else if(!res.deleted) {
+		(*e->callback)(e->user, KUMO_NOT_FOUND);
+	} else {
+		(*e->callback)(e->user, KUMO_OK);
+	}
+}
+
+// the gateway keeps the key and the value until the callback is called
+// if they are allocated in the life.
+static char* copy_to_life(shared_zone& life, const char* buf, size_t len)
+{
+	char* p = (char*)life->malloc(len > 0 ? len : 1);
+	memcpy(p, buf, len);
+	return p;
+}
+
+}  // noname namespace
+
+
+extern "C" {
+
+void kumo_client_config_init(kumo_client_config* cfg)
+{
+	memset(cfg, 0, sizeof(kumo_client_config));
+	cfg->rthreads = 2;
+	cfg->wthreads = 1;
+	cfg->connect_timeout_msec = 10 * 1000;
+	cfg->connect_retry_limit = 4;
+	cfg->get_retry_num = 5;
+	cfg->set_retry_num = 20;
+	cfg->delete_retry_num = 20;
+}
+
+kumo_client* kumo_client_new(const kumo_client_config* cfg)
+try {
+	if(!cfg->manager1) { return NULL; }
+	if(cfg->read_hedge_percentile > 100) { return NULL; }
+	if(cfg->write_quorum > MAX_REPLICATION+1) { return NULL; }
+
+	if(!__sync_bool_compare_and_swap(&s_created, 0, 1)) {
+		LOG_ERROR("kumo_client_new failed: a client is already created in this process");
+		return NULL;
+	}
+
+	if(cfg->logfile) {
+		init_mlogger(cfg->logfile, false,
+				(cfg->verbose ? mlogger::TRACE : mlogger::WARN));
+	}
+
+	std::auto_ptr<kumo_client> c(new kumo_client());
+	resolve_managers(c.get(), cfg->manager1, cfg->manager2);
+
+	c->keepalive_interval_usec = 2 * 1000 * 1000;
+	c->clock_interval_usec = 2 * 1000 * 1000;
+	c->connect_timeout_msec = cfg->connect_timeout_msec;
+	c->connect_retry_limit = cfg->connect_retry_limit;
+	c->wthreads = cfg->wthreads;
+	c->rthreads = cfg->rthreads;
+	c->sharded_threads = false;
+	c->catch_signals = false;  // the signals belong to the application
+
+	c->get_retry_num = cfg->get_retry_num;
+	c->set_retry_num = cfg->set_retry_num;
+	c->delete_retry_num = cfg->delete_retry_num;
+	c->renew_threshold = 4;
+	c->async_replicate_set = false;
+	c->async_replicate_delete = false;
+	c->write_quorum = cfg->write_quorum;
+	c->no_get_coalescing = false;
+	c->read_latency_aware = cfg->read_latency_aware;
+	c->read_hedge_percentile = cfg->read_hedge_percentile;
+	c->read_hedge_min_msec = 2;
+	c->local_cache_memory_bytes = cfg->local_cache_memory;
+	c->local_cache_stats_interval = 0;
+	c->cache_lease_msec = (cfg->local_cache_memory > 0 ?
+			cfg->local_cache_lease_msec : 0);
+
+	gateway::init(*c);
+	gateway::net->run(*c);
+
+	return c.release();
+
+} catch (std::exception& e) {
+	LOG_ERROR("kumo_client_new failed: ",e.what());
+	return NULL;
+} catch (...) {
+	LOG_ERROR("kumo_client_new failed: unknown error");
+	return NULL;
+}
+
+void kumo_client_free(kumo_client* client)
+{
+	// gateway::net, the sessions and the cache are released at exit;
+	// the output threads may still use them after join().
+	gateway::net->signal_end();
+	gateway::net->join();
+	delete client;
+}
+
+
+kumo_status kumo_get_async(kumo_client* client,
+		const char* key, size_t keylen,
+		kumo_get_callback callback, void* user)
+try {
+	shared_zone life(new msgpack::zone());
+
+	get_entry* e = life->allocate<get_entry>();
+	e->callback = callback;
+	e->user     = user;
+
+	gate::req_get req;
+	req.keylen   = keylen;
+	req.key      = copy_to_life(life, key, keylen);
+	req.user     = static_cast<void*>(e);
+	req.callback = &response_get;
+	req.life     = life;
+
+	req.submit();
+	return KUMO_OK;
+
+} catch (std::exception& e) {
+	LOG_WARN("get failed: ",e.what());
+	return KUMO_ERROR;
+} catch (...) {
+	return KUMO_ERROR;
+}
+
+kumo_status kumo_set_async(kumo_client* client,
+		const char* key, size_t keylen,
+		const char* val, size_t vallen,
+		kumo_set_callback callback, void* user)
+try {
+	shared_zone life(new msgpack::zone());
+
+	set_entry* e = life->allocate<set_entry>();
+	e->callback = callback;
+	e->user     = user;
+
+	gate::req_set req;
+	req.keylen   = keylen;
+	req.key      = copy_to_life(life, key, keylen);
+	req.vallen   = vallen;
+	req.val      = copy_to_life(life, val, vallen);
+	req.user     = static_cast<void*>(e);
+	req.callback = &response_set;
+	req.life     = life;
+
+	req.submit();
+	return KUMO_OK;
+
+} catch (std::exception& e) {
+	LOG_WARN("set failed: ",e.what());
+	return KUMO_ERROR;
+} catch (...) {
+	return KUMO_ERROR;
+}
+
+kumo_status kumo_delete_async(kumo_client* client,
+		const char* key, size_t keylen,
+		kumo_delete_callback callback, void* user)
+try {
+	shared_zone life(new msgpack::zone());
+
+	delete_entry* e = life->allocate<delete_entry>();
+	e->callback = callback;
+	e->user     = user;
+
+	gate::req_delete req;
+	req.key      = copy_to_life(life, key, keylen);
+	req.keylen   = keylen;
+	req.user     = static_cast<void*>(e);
+	req.callback = &response_delete;
+	req.life     = life;
+
+	req.submit();
+	return KUMO_OK;
+
+} catch (std::exception& e) {
+	LOG_WARN("delete failed: ",e.what());
+	return KUMO_ERROR;
+} catch (...) {
+	return KUMO_ERROR;
+}
+
+
+kumo_status kumo_get(kumo_client* client,
+		const char* key, size_t keylen,
+		char** val, size_t* vallen)
+{
+	sync_wait w;
+	if(kumo_get_async(client, key, keylen,
+				&sync_get_callback, &w) != KUMO_OK) {
+		return KUMO_ERROR;
+	}
+	w.wait();
+	*val = w.val;
+	*vallen = w.vallen;
+	return w.status;
+}
+
+kumo_status kumo_set(kumo_client* client,
+		const char* key, size_t keylen,
+		const char* val, size_t vallen)
+{
+	sync_wait w;
+	if(kumo_set_async(client, key, keylen, val, vallen,
+				&sync_status_callback, &w) != KUMO_OK) {
+		return KUMO_ERROR;
+	}
+	w.wait();
+	return w.status;
+}
+
+kumo_status kumo_delete(kumo_client* client,
+		const char* key, size_t keylen)
+{
+	sync_wait w;
+	if(kumo_delete_async(client, key, keylen,
+				&sync_status_callback, &w) != KUMO_OK) {
+		return KUMO_ERROR;
+	}
+	w.wait();
+	return w.status;
+}
+
+}  // extern "C"
+
@@ -31,6 +31,7 @@ void framework::dispatch(
 try {
 	switch(method.get()) {
 	RPC_DISPATCH(mod_network, HashSpacePush);
+	RPC_DISPATCH(mod_network, CacheInvalidate);
 	default:
 		throw unknown_method_error();
 	}
@@ -41,6 +42,8 @@ DISPATCH_CATCH(method, response)
 void framework::session_lost(const address& addr, shared_session& s)
 {
 	LOG_WARN("lost session ",addr);
+	// invalidations from the server may be lost
+	mod_cache.drop_leases();
 	if(addr == share->manager1() || addr == share->manager2()) {
 		mod_network.renew_hash_space_for(addr);
 	}
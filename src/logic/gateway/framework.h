@@ -19,9 +19,11 @@
 #define GATEWAY_FRAMEWORK_H__
 
 #include "logic/client_logic.h"
+#include "logic/hs_snapshot.h"
 #include "gateway/mod_network.h"
 #include "gateway/mod_cache.h"
 #include "gateway/mod_store.h"
+#include "gateway/latency_table.h"
 
 namespace kumo {
 namespace gateway {
@@ -64,15 +66,15 @@ public:
 	resource(const Config& cfg);
 
 private:
-	mp::pthread_rwlock m_hs_rwlock;
-	HashSpace m_rhs;
-	HashSpace m_whs;
+	hs_snapshot m_rhs;
+	hs_snapshot m_whs;
 
 	const address m_manager1;
 	const address m_manager2;
 
 	const bool m_cfg_async_replicate_set;
 	const bool m_cfg_async_replicate_delete;
+	const unsigned short m_cfg_write_quorum;
 
 	const unsigned short m_cfg_get_retry_num;
 	const unsigned short m_cfg_set_retry_num;
@@ -82,16 +84,38 @@ private:
 
 	unsigned short m_error_count;
 
+	// function of the current hash space.
+	// read without hslk by gate::stdhash.
+	volatile HashSpace::hash_function m_hash_function;
+
 	std::string m_cfg_key_prefix;
 
+	const uint32_t m_cfg_cache_lease_msec;
+
+	const bool m_cfg_get_coalescing;
+
+	const bool m_cfg_read_latency_aware;
+	const unsigned short m_cfg_read_hedge_percentile;
+	const unsigned int m_cfg_read_hedge_min_usec;
+
+	latency_table m_read_latency;
+	volatile unsigned int m_read_count;
+
 public:
 	// mod_store.cc
 	void incr_error_renew_count();
 
 public:
-	RESOURCE_ACCESSOR(mp::pthread_rwlock, hs_rwlock);
-	bool update_rhs(const HashSpace::Seed& seed, REQUIRE_HSLK_WRLOCK);
-	bool update_whs(const HashSpace::Seed& seed, REQUIRE_HSLK_WRLOCK);
+	// lock mutex() of the snapshot to update
+	hs_snapshot& rhs_snapshot() { return m_rhs; }
+	hs_snapshot& whs_snapshot() { return m_whs; }
+	bool update_rhs(const HashSpace::Seed& seed, REQUIRE_HSLK);
+	bool update_whs(const HashSpace::Seed& seed, REQUIRE_HSLK);
+
+	HashSpace::hash_function hash_function() const { return m_hash_function; }
+
+	// replication factor of the current hash space for reading
+	unsigned int read_replicas() const { return m_rhs.get()->replicas(); }
 
 	enum hash_space_type {
 		HS_WRITE,
@@ -103,12 +127,25 @@ public:
 	template <hash_space_type Hs>
 	shared_session server_for(uint64_t h, unsigned int offset = 0);
 
+	// mod_store.cc
+	// active replica for reading. the fastest one if
+	// cfg_read_latency_aware, otherwise the first one.
+	// returns NULL if no replica except *exclude is active.
+	// Note: hslk is not required
+	shared_session read_server_for(uint64_t h, address* result_addr,
+			const address* exclude = NULL);
+
+	// 1/READ_PROBE_INTERVAL of reads are sent to the other replicas
+	// to measure their latency
+	static const unsigned int READ_PROBE_INTERVAL = 64;
+
 public:
 	RESOURCE_CONST_ACCESSOR(address, manager1);
 	RESOURCE_CONST_ACCESSOR(address, manager2);
 
 	RESOURCE_CONST_ACCESSOR(bool, cfg_async_replicate_set);
 	RESOURCE_CONST_ACCESSOR(bool, cfg_async_replicate_delete);
+	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_write_quorum);
 
 	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_get_retry_num);
 	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_set_retry_num);
@@ -118,6 +155,16 @@ public:
 
 	RESOURCE_CONST_ACCESSOR(std::string, cfg_key_prefix);
 
+	RESOURCE_CONST_ACCESSOR(uint32_t, cfg_cache_lease_msec);
+
+	RESOURCE_CONST_ACCESSOR(bool, cfg_get_coalescing);
+
+	RESOURCE_CONST_ACCESSOR(bool, cfg_read_latency_aware);
+	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_read_hedge_percentile);
+	RESOURCE_CONST_ACCESSOR(unsigned int, cfg_read_hedge_min_usec);
+
+	RESOURCE_ACCESSOR(latency_table, read_latency);
+
 private:
 	resource();
 	resource(const resource&);
@@ -128,22 +175,34 @@ extern std::auto_ptr<framework> net;
 extern std::auto_ptr<resource> share;
 
 
-inline bool resource::update_rhs(const HashSpace::Seed& seed, REQUIRE_HSLK_WRLOCK)
+inline bool resource::update_rhs(const HashSpace::Seed& seed, REQUIRE_HSLK)
 {
-	if(m_rhs.empty() ||
-			(m_rhs.clocktime() <= seed.clocktime() && !seed.empty())) {
-		m_rhs = HashSpace(seed);
+	hs_snapshot::ref cur(m_rhs.get());
+	if(cur->empty() ||
+			(cur->clocktime() <= seed.clocktime() && !seed.empty())) {
+		if(cur->clocktime() != seed.clocktime()) {
+			// servers may not notify updates of keys they lost
+			net->mod_cache.drop_leases();
+		}
+		m_rhs.publish(HashSpace(seed), hslk);
+		m_hash_function = seed.function();
 		return true;
 	} else {
 		return false;
 	}
 }
 
-inline bool resource::update_whs(const HashSpace::Seed& seed, REQUIRE_HSLK_WRLOCK)
+inline bool resource::update_whs(const HashSpace::Seed& seed, REQUIRE_HSLK)
 {
-	if(m_whs.empty() ||
-			(m_whs.clocktime() <= seed.clocktime() && !seed.empty())) {
-		m_whs = HashSpace(seed);
+	hs_snapshot::ref cur(m_whs.get());
+	if(cur->empty() ||
+			(cur->clocktime() <= seed.clocktime() && !seed.empty())) {
+		if(cur->clocktime() != seed.clocktime()) {
+			// servers may not notify updates of keys they lost
+			net->mod_cache.drop_leases();
+		}
+		m_whs.publish(HashSpace(seed), hslk);
+		m_hash_function = seed.function();
 		return true;
 	} else {
 		return false;
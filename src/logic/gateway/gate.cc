@@ -23,7 +23,7 @@ namespace gate {
 
 uint64_t stdhash(const char* key, size_t keylen)
 {
-	return HashSpace::hash(key, keylen);
+	return HashSpace::hash(key, keylen, gateway::share->hash_function());
 }
 
 void fatal_stop()
@@ -37,11 +37,21 @@ void req_get::submit()
 	gateway::net->mod_store.Get(*this);
 }
 
+void req_get_multi::submit()
+{
+	gateway::net->mod_store.GetMulti(*this);
+}
+
 void req_set::submit()
 {
 	gateway::net->mod_store.Set(*this);
 }
 
+void req_set_multi::submit()
+{
+	gateway::net->mod_store.SetMulti(*this);
+}
+
 void req_delete::submit()
 {
 	gateway::net->mod_store.Delete(*this);
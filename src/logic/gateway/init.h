@@ -30,18 +30,26 @@ framework::framework(const Config& cfg) :
 			cfg.connect_timeout_msec,
 			cfg.connect_retry_limit)
 {
-	if(!cfg.local_cache.empty()) {
-		mod_cache.init(cfg.local_cache.c_str());
+	if(cfg.local_cache_memory_bytes > 0) {
+		mod_cache.init(cfg.local_cache_memory_bytes);
 	}
 }
 
 template <typename Config>
 void framework::run(const Config& cfg)
 {
-	init_wavy(cfg.rthreads, cfg.wthreads);  // wavy_server
+	init_wavy(cfg.rthreads, cfg.wthreads, cfg.sharded_threads,
+			cfg.catch_signals);  // wavy_server
 	start_timeout_step(cfg.clock_interval_usec);  // rpc_server
 	start_keepalive(cfg.keepalive_interval_usec);  // rpc_server
 	mod_network.renew_hash_space();
+	if(cfg.read_hedge_percentile > 0) {
+		mod_store.start_hedge();
+	}
+	if(cfg.local_cache_memory_bytes > 0 && cfg.local_cache_stats_interval > 0) {
+		struct timespec ts = {cfg.local_cache_stats_interval, 0};
+		wavy::timer(&ts, mp::bind(&mod_cache_t::log_stats, &mod_cache));
+	}
 	TLOGPACK("SW",2,
 			"mgr1", share->manager1(),
 			"mgr2", share->manager2());
@@ -53,12 +61,20 @@ resource::resource(const Config& cfg) :
 	m_manager2(cfg.manager2),
 	m_cfg_async_replicate_set(cfg.async_replicate_set),
 	m_cfg_async_replicate_delete(cfg.async_replicate_delete),
+	m_cfg_write_quorum(cfg.write_quorum),
 	m_cfg_get_retry_num(cfg.get_retry_num),
 	m_cfg_set_retry_num(cfg.set_retry_num),
 	m_cfg_delete_retry_num(cfg.delete_retry_num),
 	m_cfg_renew_threshold(cfg.renew_threshold),
 	m_cfg_key_prefix(cfg.key_prefix),
-	m_error_count(0)
+	m_error_count(0),
+	m_hash_function(HashSpace::HASH_SHA1),
+	m_cfg_cache_lease_msec(cfg.cache_lease_msec),
+	m_cfg_get_coalescing(!cfg.no_get_coalescing),
+	m_cfg_read_latency_aware(cfg.read_latency_aware),
+	m_cfg_read_hedge_percentile(cfg.read_hedge_percentile),
+	m_cfg_read_hedge_min_usec(cfg.read_hedge_min_msec * 1000),
+	m_read_count(0)
 { }
 
 template <typename Config>
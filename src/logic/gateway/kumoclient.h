@@ -0,0 +1,132 @@
+/*
+ * libkumoclient  embeddable kumofs client
+ *
+ * Copyright (C) 2009 FURUHASHI Sadayuki
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#ifndef KUMOCLIENT_H__
+#define KUMOCLIENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The client subscribes to hash space pushes from kumo-managers and
+ * sends requests to kumo-servers directly, without a kumo-gateway hop.
+ * It runs its own event loop threads.
+ *
+ * Only one client can be created in a process.
+ */
+typedef struct kumo_client_ kumo_client;
+
+
+typedef enum {
+	KUMO_OK         =  0,
+	KUMO_NOT_FOUND  =  1,
+	KUMO_ERROR      = -1,
+} kumo_status;
+
+
+typedef struct kumo_client_config_ {
+	const char* manager1;  /* host[:port], required */
+	const char* manager2;  /* host[:port] or NULL */
+
+	unsigned short rthreads;
+	unsigned short wthreads;
+
+	unsigned int connect_timeout_msec;
+	unsigned short connect_retry_limit;
+
+	unsigned short get_retry_num;
+	unsigned short set_retry_num;
+	unsigned short delete_retry_num;
+
+	unsigned short write_quorum;  /* 0: kumo-server's default */
+
+	int read_latency_aware;
+	unsigned short read_hedge_percentile;  /* 0: disabled */
+
+	size_t local_cache_memory;  /* bytes; 0: disabled */
+	uint32_t local_cache_lease_msec;
+
+	const char* logfile;  /* NULL: no logging, "-": stdout */
+	int verbose;
+} kumo_client_config;
+
+/* fills cfg with the defaults of kumo-gateway */
+void kumo_client_config_init(kumo_client_config* cfg);
+
+/* returns NULL on error.
+ * only one client can be created in a process; calling it again fails
+ * even after kumo_client_free. */
+kumo_client* kumo_client_new(const kumo_client_config* cfg);
+
+/* stops the event loop threads. outstanding callbacks are not called.
+ * call it only when the process exits; the connections and the cache
+ * are released at exit, and no client can be created again. */
+void kumo_client_free(kumo_client* client);
+
+
+/*
+ * Asynchronous interface.
+ * Callbacks are called on the event loop threads; val is valid until
+ * the callback returns. Don't call synchronous functions in callbacks.
+ * These functions return KUMO_OK if the request is submitted.
+ */
+typedef void (*kumo_get_callback)(void* user, kumo_status status,
+		const char* val, size_t vallen);
+typedef void (*kumo_set_callback)(void* user, kumo_status status);
+typedef void (*kumo_delete_callback)(void* user, kumo_status status);
+
+kumo_status kumo_get_async(kumo_client* client,
+		const char* key, size_t keylen,
+		kumo_get_callback callback, void* user);
+
+kumo_status kumo_set_async(kumo_client* client,
+		const char* key, size_t keylen,
+		const char* val, size_t vallen,
+		kumo_set_callback callback, void* user);
+
+kumo_status kumo_delete_async(kumo_client* client,
+		const char* key, size_t keylen,
+		kumo_delete_callback callback, void* user);
+
+
+/*
+ * Synchronous interface.
+ * kumo_get stores malloc(3)ed value to *val; release it with free(3).
+ */
+kumo_status kumo_get(kumo_client* client,
+		const char* key, size_t keylen,
+		char** val, size_t* vallen);
+
+kumo_status kumo_set(kumo_client* client,
+		const char* key, size_t keylen,
+		const char* val, size_t vallen);
+
+kumo_status kumo_delete(kumo_client* client,
+		const char* key, size_t keylen);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* kumoclient.h */
+
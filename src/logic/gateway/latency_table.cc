@@ -0,0 +1,154 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "gateway/latency_table.h"
+#include <string.h>
+#include <time.h>
+
+namespace kumo {
+namespace gateway {
+
+
+latency_table::server::server() :
+	ewma(0), total(0)
+{
+	memset(counts, 0, sizeof(counts));
+}
+
+latency_table::latency_table() { }
+
+latency_table::~latency_table()
+{
+	for(map_t::iterator it(m_map.begin()), it_end(m_map.end());
+			it != it_end; ++it) {
+		delete it->second;
+	}
+}
+
+uint64_t latency_table::now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+unsigned int latency_table::bucket_of(uint64_t usec)
+{
+	if(usec < 4) { return usec; }
+	unsigned int lg = 63 - __builtin_clzll(usec);
+	unsigned int b = lg*4 + ((usec >> (lg-2)) & 0x03) - 4;
+	return b < BUCKETS ? b : BUCKETS-1;
+}
+
+uint64_t latency_table::upper_bound_of(unsigned int bucket)
+{
+	if(bucket < 4) { return bucket + 1; }
+	unsigned int lg = (bucket + 4) / 4;
+	uint64_t sub = (bucket + 4) % 4;
+	return ((4 + sub + 1) << (lg-2));
+}
+
+latency_table::server* latency_table::find(const rpc::address& addr)
+{
+	mp::pthread_scoped_rdlock lk(m_rwlock);
+	map_t::iterator it = m_map.find(addr);
+	if(it == m_map.end()) {
+		return NULL;
+	}
+	return it->second;
+}
+
+latency_table::server* latency_table::find_or_add(const rpc::address& addr)
+{
+	server* s = find(addr);
+	if(!s) {
+		mp::pthread_scoped_wrlock lk(m_rwlock);
+		std::pair<map_t::iterator, bool> ins =
+			m_map.insert(map_t::value_type(addr, NULL));
+		if(ins.second) {
+			ins.first->second = new server();
+		}
+		s = ins.first->second;
+	}
+	return s;
+}
+
+void latency_table::record(const rpc::address& addr, uint64_t usec)
+{
+	server* s = find_or_add(addr);
+
+	mp::pthread_scoped_lock lk(s->mutex);
+
+	if(s->total == 0) {
+		s->ewma = usec;
+	} else {
+		// alpha = 1/8
+		s->ewma = s->ewma - s->ewma/8 + usec/8;
+	}
+
+	if(++s->total >= DECAY_SAMPLES) {
+		s->total = 0;
+		for(unsigned int i=0; i < BUCKETS; ++i) {
+			s->counts[i] /= 2;
+			s->total += s->counts[i];
+		}
+	}
+	++s->counts[bucket_of(usec)];
+}
+
+void latency_table::record_error(const rpc::address& addr)
+{
+	server* s = find_or_add(addr);
+
+	mp::pthread_scoped_lock lk(s->mutex);
+	s->ewma *= 2;
+	if(s->ewma < ERROR_PENALTY_USEC) {
+		s->ewma = ERROR_PENALTY_USEC;
+	}
+}
+
+uint64_t latency_table::ewma(const rpc::address& addr)
+{
+	server* s = find(addr);
+	if(!s) { return 0; }
+	mp::pthread_scoped_lock lk(s->mutex);
+	return s->ewma;
+}
+
+uint64_t latency_table::percentile(const rpc::address& addr, unsigned int pct)
+{
+	server* s = find(addr);
+	if(!s) { return 0; }
+	mp::pthread_scoped_lock lk(s->mutex);
+
+	if(s->total == 0) { return 0; }
+	uint64_t require = (uint64_t)s->total * pct / 100;
+	if(require >= s->total) { require = s->total - 1; }
+	uint64_t sum = 0;
+	for(unsigned int i=0; i < BUCKETS; ++i) {
+		sum += s->counts[i];
+		if(sum > require) {
+			return upper_bound_of(i);
+		}
+	}
+	return 0;
+}
+
+
+}  // namespace gateway
+}  // namespace kumo
+
@@ -0,0 +1,87 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef GATEWAY_LATENCY_TABLE_H__
+#define GATEWAY_LATENCY_TABLE_H__
+
+#include "rpc/address.h"
+#include <mp/pthread.h>
+#include <map>
+#include <stdint.h>
+
+namespace kumo {
+namespace gateway {
+
+
+// response time of each server.
+// keeps an EWMA and a histogram of recent samples.
+class latency_table {
+public:
+	latency_table();
+	~latency_table();
+
+public:
+	void record(const rpc::address& addr, uint64_t usec);
+
+	// the server returned an error. it raises the EWMA so that
+	// reads avoid the server, but isn't counted in the histogram.
+	void record_error(const rpc::address& addr);
+
+	// 0 if no samples are recorded
+	uint64_t ewma(const rpc::address& addr);
+	uint64_t percentile(const rpc::address& addr, unsigned int pct);
+
+	static uint64_t now_usec();
+
+	// counts are halved when the total reaches this number
+	static const uint32_t DECAY_SAMPLES = 1024;
+
+	// the EWMA after an error is at least this
+	static const uint64_t ERROR_PENALTY_USEC = 100*1000;
+
+	// 4 buckets for each power of 2
+	static const unsigned int BUCKETS = 27*4;
+
+private:
+	struct server {
+		server();
+		mp::pthread_mutex mutex;
+		uint64_t ewma;
+		uint32_t total;
+		uint32_t counts[BUCKETS];
+	};
+
+	server* find(const rpc::address& addr);
+	server* find_or_add(const rpc::address& addr);
+
+	static unsigned int bucket_of(uint64_t usec);
+	static uint64_t upper_bound_of(unsigned int bucket);
+
+	mp::pthread_rwlock m_rwlock;
+	typedef std::map<rpc::address, server*> map_t;
+	map_t m_map;
+
+private:
+	latency_table(const latency_table&);
+};
+
+
+}  // namespace gateway
+}  // namespace kumo
+
+#endif /* gateway/latency_table.h */
+
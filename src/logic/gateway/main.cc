@@ -45,7 +45,19 @@ struct arg_t : rpc_args {
 	bool async_replicate_set;
 	bool async_replicate_delete;
 
+	unsigned short write_quorum;
+
+	bool no_get_coalescing;
+
+	bool read_latency_aware;
+	unsigned short read_hedge_percentile;
+	unsigned int read_hedge_min_msec;
+
 	std::string local_cache;
+	unsigned int local_cache_memory;  // MB
+	size_t local_cache_memory_bytes;  // convert
+	unsigned int local_cache_stats_interval;  // sec
+	uint32_t cache_lease_msec;
 
 	bool mctext_set;
 	sockaddr_in mctext_addr_in;
@@ -64,6 +76,10 @@ struct arg_t : rpc_args {
 
 	std::string key_prefix;
 
+	bool sharded_threads;
+
+	bool catch_signals;
+
 	virtual void convert()
 	{
 		rpc_args::convert();
@@ -71,6 +87,23 @@ struct arg_t : rpc_args {
 		manager1 = rpc::address(manager1_in);
 		manager2 = rpc::address(manager2_in);
 
+		// -lc is deprecated: the local cache is kept in memory
+		if(!local_cache.empty() && local_cache_memory == 0) {
+			local_cache_memory = 64;
+		}
+		local_cache_memory_bytes = (size_t)local_cache_memory * 1024 * 1024;
+		if(local_cache_memory_bytes == 0) {
+			cache_lease_msec = 0;
+		}
+
+		if(write_quorum > MAX_REPLICATION+1) {
+			throw std::runtime_error("-wQ is larger than the maximum replication factor");
+		}
+
+		if(read_hedge_percentile > 100) {
+			throw std::runtime_error("-Rh must be 0 to 100");
+		}
+
 		if(!mctext_set && !mcbin_set && !cloudy_set) {
 			throw std::runtime_error("-t, -b or -c is required");
 		}
@@ -89,7 +122,14 @@ struct arg_t : rpc_args {
 		get_retry_num(5),
 		set_retry_num(20),
 		delete_retry_num(20),
-		renew_threshold(4)
+		renew_threshold(4),
+		write_quorum(0),
+		local_cache_memory(0),
+		local_cache_stats_interval(60),
+		cache_lease_msec(0),
+		read_hedge_percentile(0),
+		read_hedge_min_msec(2),
+		catch_signals(true)
 	{
 		using namespace kazuhiki;
 		set_basic_args();
@@ -99,6 +139,12 @@ struct arg_t : rpc_args {
 				type::connectable(&manager2_in, MANAGER_DEFAULT_PORT));
 		on("-lc","--local-cache",
 				type::string(&local_cache, ""));
+		on("-lm","--local-cache-memory",
+				type::numeric(&local_cache_memory, local_cache_memory));
+		on("-ls","--local-cache-stats",
+				type::numeric(&local_cache_stats_interval, local_cache_stats_interval));
+		on("-lL","--local-cache-lease",
+				type::numeric(&cache_lease_msec, cache_lease_msec));
 		on("-t", "--memproto-text", &mctext_set,
 				type::listenable(&mctext_addr_in, MEMTEXT_DEFAULT_PORT));
 		on("-b", "--memproto-binary", &mcbin_set,
@@ -115,14 +161,26 @@ struct arg_t : rpc_args {
 				type::numeric(&set_retry_num, set_retry_num));
 		on("-D", "--delete-retry",
 				type::numeric(&delete_retry_num, delete_retry_num));
+		on("-Gn", "--no-get-coalescing",
+				type::boolean(&no_get_coalescing));
+		on("-Rl", "--read-latency-aware",
+				type::boolean(&read_latency_aware));
+		on("-Rh", "--read-hedge",
+				type::numeric(&read_hedge_percentile, read_hedge_percentile));
+		on("-Rm", "--read-hedge-min",
+				type::numeric(&read_hedge_min_msec, read_hedge_min_msec));
 		on("-rn", "--renew-threshold",
 				type::numeric(&renew_threshold, renew_threshold));
 		on("-As", "--async-replicate-set",
 				type::boolean(&async_replicate_set));
 		on("-Ad", "--async-replicate-delete",
 				type::boolean(&async_replicate_delete));
+		on("-wQ", "--write-quorum",
+				type::numeric(&write_quorum, write_quorum));
 		on("-k", "--key-prefix",
 				type::string(&key_prefix, ""));
+		on("-TS", "--sharded-threads",
+				type::boolean(&sharded_threads));
 		parse(argc, argv);
 	}
 
@@ -138,8 +196,14 @@ struct arg_t : rpc_args {
 			"--manager1        address of manager 1\n"
 		"  -p  <addr[:port="<<MANAGER_DEFAULT_PORT<<"]>   "
 			"--manager2        address of manager 2\n"
+		"  -lm <MB="<<local_cache_memory<<">            "
+			"--local-cache-memory     memory size of the local cache (0: disabled)\n"
+		"  -ls <sec="<<local_cache_stats_interval<<">          "
+			"--local-cache-stats      interval of the local cache statistics log\n"
+		"  -lL <msec="<<cache_lease_msec<<">           "
+			"--local-cache-lease      serve cached values without asking servers within the lease (0: disabled)\n"
 		"  -lc                       "
-			"--local-cache     local cache (Tokyo Cabinet abstract database)\n"
+			"--local-cache     (deprecated) same as -lm 64\n"
 		"  -t  <[addr:]port="<<MEMTEXT_DEFAULT_PORT<<">   "
 			"--memproto-text   memcached text protocol listen port\n"
 		"  -b  <[addr:]port="<<MEMPROTO_DEFAULT_PORT<<">   "
@@ -154,16 +218,28 @@ struct arg_t : rpc_args {
 			"--async-replicate-set    send response without waiting replication on set\n"
 		"  -Ad               "
 			"--async-replicate-delete send response without waiting replication on delete\n"
+		"  -wQ <number="<<write_quorum<<">    "
+			"--write-quorum           number of copies stored before response on set and delete (0: server's default)\n"
 		"  -G  <number="<<get_retry_num<<">    "
 			"--get-retry              get retry limit\n"
 		"  -S  <number="<<set_retry_num<<">   "
 			"--set-retry              set retry limit\n"
 		"  -D  <number="<<delete_retry_num<<">   "
 			"--delete-retry           delete retry limit\n"
+		"  -Gn               "
+			"--no-get-coalescing      send a request for each get of the same key\n"
+		"  -Rl               "
+			"--read-latency-aware     send gets to the fastest replica\n"
+		"  -Rh <percentile="<<read_hedge_percentile<<"> "
+			"--read-hedge             send a get to another replica if the response is slower than this percentile (0: disabled)\n"
+		"  -Rm <msec="<<read_hedge_min_msec<<">       "
+			"--read-hedge-min         minimum delay of the hedged get\n"
 		"  -rn <number="<<renew_threshold<<">    "
 			"--renew-threshold        hash space renew threshold\n"
 		"  -k <string>       "
 			"--key-prefix             add prefix to keys automatically\n"
+		"  -TS               "
+			"--sharded-threads        read threads own an event loop each\n"
 		;
 		rpc_args::show_usage();
 	}
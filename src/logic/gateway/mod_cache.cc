@@ -17,85 +17,565 @@
 //
 #include "gateway/framework.h"
 #include "storage/storage.h"
+#include <vector>
+#include <time.h>
 
 namespace kumo {
 namespace gateway {
 
 
-mod_cache_t::mod_cache_t() : m_db(NULL) { }
+static const size_t CACHE_MIN_CHUNK = 64;
+static const size_t CACHE_MAX_PAGE_SIZE = 1024*1024;
+static const size_t CACHE_CLASSES = 15;  // CACHE_MIN_CHUNK << 14 == CACHE_MAX_PAGE_SIZE
 
-mod_cache_t::~mod_cache_t()
+
+struct mod_cache_t::entry {
+	entry* next;  // hash chain or free list
+	uint64_t hash;
+	uint64_t lease;  // expire time of the lease in msec
+	uint64_t lease_epoch;
+	uint32_t keylen;
+	uint32_t vallen;
+	uint8_t cls;
+	bool used;
+	bool ref;
+
+	char* key() { return reinterpret_cast<char*>(this+1); }
+	char* val() { return key() + keylen; }
+
+	bool equals(uint64_t h, const char* k, size_t klen)
+	{
+		return hash == h && keylen == klen && memcmp(key(), k, klen) == 0;
+	}
+};
+
+struct mod_cache_t::slab_class {
+	slab_class() : chunk_size(0), hand(0), free(NULL), page_hand(0) { }
+	size_t chunk_size;
+	std::vector<entry*> chunks;  // CLOCK ring
+	size_t hand;
+	entry* free;
+	std::vector<char*> pages;
+	size_t page_hand;  // next page to be moved to another class
+};
+
+class mod_cache_t::shard {
+public:
+	shard();
+	~shard();
+
+	void init(size_t page_size, size_t pages_limit);
+
+	bool get(const msgtype::DBKey& key, msgtype::DBValue* result_val,
+			msgpack::zone* z, bool* leased);
+
+	void update(const msgtype::DBKey& key, const msgtype::DBValue& val);
+
+	uint64_t lease_sequence();
+	void lease(const msgtype::DBKey& key, ClockTime clocktime,
+			uint64_t expire_msec, uint64_t sequence);
+	void invalidate(const msgtype::DBKey& key);
+	void drop_leases();
+
+	void add_stats(stats_t* result);
+
+private:
+	entry** find(uint64_t h, const char* key, size_t keylen);
+	void insert(entry* e);
+	void unlink(entry* e);
+	void release(entry* e);
+	entry* alloc(unsigned int cls);
+	entry* evict(unsigned int cls);
+	void carve(unsigned int cls, char* page);
+	bool move_page(unsigned int cls);
+	void rehash(size_t size);
+	size_t bucket_of(uint64_t h) const;
+
+private:
+	mp::pthread_mutex m_mutex;
+
+	std::vector<entry*> m_table;
+	size_t m_items;
+
+	std::vector<char*> m_pages;
+	size_t m_page_size;
+	size_t m_pages_limit;
+
+	slab_class m_classes[CACHE_CLASSES];
+
+	// m_sequence is incremented by invalidate() and drop_leases().
+	// m_epoch is incremented by drop_leases().
+	uint64_t m_sequence;
+	uint64_t m_epoch;
+
+	uint64_t m_hits;
+	uint64_t m_leased_hits;
+	uint64_t m_misses;
+	uint64_t m_updates;
+	uint64_t m_evictions;
+	uint64_t m_invalidations;
+
+private:
+	shard(const shard&);
+};
+
+
+static int cache_class_of(size_t size, size_t page_size)
 {
-	if(m_db) {
-		tcadbclose(m_db);
-		tcadbdel(m_db);
+	size_t chunk = CACHE_MIN_CHUNK;
+	for(unsigned int i=0; i < CACHE_CLASSES && chunk <= page_size; ++i) {
+		if(size <= chunk) { return i; }
+		chunk <<= 1;
 	}
+	return -1;
 }
 
-void mod_cache_t::init(const char* name)
+
+mod_cache_t::shard::shard() :
+	m_table(64, NULL),
+	m_items(0),
+	m_page_size(0),
+	m_pages_limit(0),
+	m_sequence(0), m_epoch(0),
+	m_hits(0), m_leased_hits(0), m_misses(0),
+	m_updates(0), m_evictions(0), m_invalidations(0)
 {
-	m_db = tcadbnew();
-	if(!m_db) {
-		throw std::bad_alloc();
+	for(unsigned int i=0; i < CACHE_CLASSES; ++i) {
+		m_classes[i].chunk_size = CACHE_MIN_CHUNK << i;
 	}
+}
 
-	if(!tcadbopen(m_db, name)) {
-		tcadbdel(m_db);
-		m_db = NULL;
-		throw std::runtime_error("failed to open local cache db");
+mod_cache_t::shard::~shard()
+{
+	for(std::vector<char*>::iterator it(m_pages.begin()), it_end(m_pages.end());
+			it != it_end; ++it) {
+		::free(*it);
 	}
 }
 
-bool mod_cache_t::get_real(const msgtype::DBKey& key, msgtype::DBValue* result_val,
-		msgpack::zone* z)
+void mod_cache_t::shard::init(size_t page_size, size_t pages_limit)
+{
+	m_page_size = page_size;
+	m_pages_limit = pages_limit;
+}
+
+size_t mod_cache_t::shard::bucket_of(uint64_t h) const
+{
+	// the hash may be given by users
+	return (size_t)((h * 0x9E3779B97F4A7C15ULL) >> 32) & (m_table.size()-1);
+}
+
+mod_cache_t::entry** mod_cache_t::shard::find(uint64_t h, const char* key, size_t keylen)
+{
+	entry** p = &m_table[bucket_of(h)];
+	for(; *p; p = &(*p)->next) {
+		if((*p)->equals(h, key, keylen)) {
+			return p;
+		}
+	}
+	return p;
+}
+
+void mod_cache_t::shard::insert(entry* e)
+{
+	if(m_items >= m_table.size()) {
+		rehash(m_table.size() * 2);
+	}
+	entry*& head = m_table[bucket_of(e->hash)];
+	e->next = head;
+	head = e;
+	++m_items;
+}
+
+void mod_cache_t::shard::unlink(entry* e)
 {
-	int len;
-	char* val = (char*)tcadbget(m_db, key.data(), key.size(), &len);  // FIXME key.raw_data() is invalid
-	if(!val) {
+	entry** p = find(e->hash, e->key(), e->keylen);
+	if(*p == e) {
+		*p = e->next;
+		--m_items;
+	}
+}
+
+void mod_cache_t::shard::release(entry* e)
+{
+	slab_class& c = m_classes[e->cls];
+	e->used = false;
+	e->next = c.free;
+	c.free = e;
+}
+
+void mod_cache_t::shard::rehash(size_t size)
+{
+	std::vector<entry*> old(size, NULL);
+	old.swap(m_table);
+	for(std::vector<entry*>::iterator it(old.begin()), it_end(old.end());
+			it != it_end; ++it) {
+		entry* e = *it;
+		while(e) {
+			entry* next = e->next;
+			entry*& head = m_table[bucket_of(e->hash)];
+			e->next = head;
+			head = e;
+			e = next;
+		}
+	}
+}
+
+mod_cache_t::entry* mod_cache_t::shard::alloc(unsigned int cls)
+{
+	slab_class& c = m_classes[cls];
+
+	if(!c.free && m_pages.size() < m_pages_limit) {
+		char* page = (char*)::malloc(m_page_size);
+		if(page) {
+			m_pages.push_back(page);
+			carve(cls, page);
+		}
+	}
+
+	if(!c.free) {
+		entry* e = evict(cls);
+		if(e) {
+			return e;
+		}
+		// the class has no pages; take one from another class
+		if(!move_page(cls)) {
+			return NULL;
+		}
+	}
+
+	entry* e = c.free;
+	c.free = e->next;
+	return e;
+}
+
+void mod_cache_t::shard::carve(unsigned int cls, char* page)
+{
+	slab_class& c = m_classes[cls];
+	c.pages.push_back(page);
+	for(size_t off = 0; off + c.chunk_size <= m_page_size; off += c.chunk_size) {
+		entry* e = reinterpret_cast<entry*>(page + off);
+		e->cls = cls;
+		e->used = false;
+		e->ref = false;
+		e->next = c.free;
+		c.free = e;
+		c.chunks.push_back(e);
+	}
+}
+
+bool mod_cache_t::shard::move_page(unsigned int cls)
+{
+	// the class which has the most pages gives one page
+	unsigned int from = CACHE_CLASSES;
+	size_t most = 0;
+	for(unsigned int i=0; i < CACHE_CLASSES; ++i) {
+		if(i != cls && m_classes[i].pages.size() > most) {
+			from = i;
+			most = m_classes[i].pages.size();
+		}
+	}
+	if(from == CACHE_CLASSES) {
 		return false;
 	}
-	if(len < static_cast<int>(Storage::VALUE_META_SIZE)) {
-		::free(val);
+
+	slab_class& v = m_classes[from];
+	v.page_hand %= v.pages.size();
+	char* page = v.pages[v.page_hand];
+	v.pages.erase(v.pages.begin() + v.page_hand);
+	char* page_end = page + m_page_size;
+
+	// evict the entries in the page
+	std::vector<entry*> chunks;
+	chunks.reserve(v.chunks.size());
+	for(std::vector<entry*>::iterator it(v.chunks.begin()), it_end(v.chunks.end());
+			it != it_end; ++it) {
+		entry* e = *it;
+		if((char*)e < page || page_end <= (char*)e) {
+			chunks.push_back(e);
+		} else if(e->used) {
+			unlink(e);
+			++m_evictions;
+		}
+	}
+	v.chunks.swap(chunks);
+	if(v.hand >= v.chunks.size()) {
+		v.hand = 0;
+	}
+
+	for(entry** p = &v.free; *p; ) {
+		if((char*)*p < page || page_end <= (char*)*p) {
+			p = &(*p)->next;
+		} else {
+			*p = (*p)->next;
+		}
+	}
+
+	carve(cls, page);
+	return true;
+}
+
+mod_cache_t::entry* mod_cache_t::shard::evict(unsigned int cls)
+{
+	slab_class& c = m_classes[cls];
+	size_t n = c.chunks.size();
+	for(size_t i=0; i < n*2; ++i) {
+		entry* e = c.chunks[c.hand];
+		c.hand = (c.hand + 1) % n;
+		if(!e->used) {
+			continue;  // on the free list
+		}
+		if(e->ref) {
+			e->ref = false;
+			continue;
+		}
+		unlink(e);
+		++m_evictions;
+		return e;
+	}
+	return NULL;
+}
+
+bool mod_cache_t::shard::get(const msgtype::DBKey& key, msgtype::DBValue* result_val,
+		msgpack::zone* z, bool* leased)
+{
+	uint64_t now = leased ? now_msec() : 0;
+
+	mp::pthread_scoped_lock lk(m_mutex);
+
+	entry* e = *find(key.hash(), key.data(), key.size());
+	if(!e) {
+		++m_misses;
 		return false;
 	}
 
-	z->push_finalizer(&::free, (void*)val);
-	*result_val = msgtype::DBValue(val, len);
+	e->ref = true;
+	++m_hits;
+
+	if(leased) {
+		*leased = e->lease_epoch == m_epoch && now < e->lease;
+		if(*leased) { ++m_leased_hits; }
+	}
 
+	// copy to the zone of the request
+	size_t vallen = e->vallen;
+	char* val = (char*)z->malloc(vallen);
+	memcpy(val, e->val(), vallen);
+	lk.unlock();
+
+	*result_val = msgtype::DBValue(val, vallen);
 	return true;
 }
 
-namespace {
-static void* cache_update_proc(const void* vbuf, int vsiz, int *sp, void* op)
+void mod_cache_t::shard::update(const msgtype::DBKey& key, const msgtype::DBValue& val)
 {
-	const msgtype::DBValue* val =
-		reinterpret_cast<const msgtype::DBValue*>(op);
+	size_t size = sizeof(entry) + key.size() + val.raw_size();
+	int cls = cache_class_of(size, m_page_size);
 
-	if(static_cast<size_t>(vsiz) < Storage::VALUE_CLOCKTIME_SIZE ||
-			Storage::clocktime_of((const char*)vbuf) < val->clocktime()) {
+	mp::pthread_scoped_lock lk(m_mutex);
 
-		void* mem = ::malloc(val->raw_size());
-		if(!mem) {
-			return NULL;  // FIXME
+	entry** p = find(key.hash(), key.data(), key.size());
+	entry* e = *p;
+	if(e) {
+		if(!(Storage::clocktime_of(e->val()) < val.clocktime())) {
+			return;
+		}
+		if(e->cls == cls) {
+			// overwrite in place
+			e->lease = 0;
+			e->vallen = val.raw_size();
+			memcpy(e->val(), val.raw_data(), val.raw_size());
+			e->ref = true;
+			++m_updates;
+			return;
 		}
+		*p = e->next;
+		--m_items;
+		release(e);
+	}
+
+	if(cls < 0) {
+		return;  // too large to cache
+	}
+
+	e = alloc(cls);
+	if(!e) {
+		return;
+	}
+
+	e->hash = key.hash();
+	e->lease = 0;
+	e->lease_epoch = m_epoch;
+	e->keylen = key.size();
+	e->vallen = val.raw_size();
+	e->used = true;
+	e->ref = false;
+	memcpy(e->key(), key.data(), key.size());
+	memcpy(e->val(), val.raw_data(), val.raw_size());
+	insert(e);
+	++m_updates;
+}
+
+uint64_t mod_cache_t::shard::lease_sequence()
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	return m_sequence;
+}
+
+void mod_cache_t::shard::lease(const msgtype::DBKey& key, ClockTime clocktime,
+		uint64_t expire_msec, uint64_t sequence)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+
+	if(m_sequence != sequence) {
+		// invalidated while the lease was requested
+		return;
+	}
+
+	entry* e = *find(key.hash(), key.data(), key.size());
+	if(!e || Storage::clocktime_of(e->val()) != clocktime) {
+		return;
+	}
+
+	e->lease = expire_msec;
+	e->lease_epoch = m_epoch;
+}
+
+void mod_cache_t::shard::invalidate(const msgtype::DBKey& key)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+
+	++m_sequence;
+	++m_invalidations;
+
+	entry** p = find(key.hash(), key.data(), key.size());
+	entry* e = *p;
+	if(e) {
+		*p = e->next;
+		--m_items;
+		release(e);
+	}
+}
+
+void mod_cache_t::shard::drop_leases()
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	++m_sequence;
+	++m_epoch;
+}
+
+void mod_cache_t::shard::add_stats(stats_t* result)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	result->hits          += m_hits;
+	result->leased_hits   += m_leased_hits;
+	result->misses        += m_misses;
+	result->updates       += m_updates;
+	result->evictions     += m_evictions;
+	result->invalidations += m_invalidations;
+	result->items         += m_items;
+	result->bytes         += m_pages.size() * m_page_size;
+}
+
 
-		*sp = val->raw_size();
-		memcpy(mem, val->raw_data(), val->raw_size());
-		return mem;
+mod_cache_t::mod_cache_t() : m_shards(NULL) { }
+
+mod_cache_t::~mod_cache_t()
+{
+	delete[] m_shards;
+}
+
+void mod_cache_t::init(size_t memory_limit)
+{
+	// pages are smaller than CACHE_MAX_PAGE_SIZE if memory_limit is small
+	// so that the shards don't exceed it.
+	size_t shard_limit = memory_limit / SHARDS;
+	size_t page_size = CACHE_MAX_PAGE_SIZE;
+	while(page_size > shard_limit && page_size > CACHE_MIN_CHUNK) {
+		page_size >>= 1;
+	}
+	if(page_size > shard_limit) {
+		LOG_WARN("local cache is disabled: memory limit is too small");
+		return;
+	}
 
-	} else {
-		return NULL;
+	m_shards = new shard[SHARDS];
+	for(size_t i=0; i < SHARDS; ++i) {
+		m_shards[i].init(page_size, shard_limit / page_size);
 	}
 }
-}  // noname namespace
+
+mod_cache_t::shard& mod_cache_t::shard_for(uint64_t hash)
+{
+	return m_shards[hash % SHARDS];
+}
+
+bool mod_cache_t::get_real(const msgtype::DBKey& key, msgtype::DBValue* result_val,
+		msgpack::zone* z, bool* leased)
+{
+	return shard_for(key.hash()).get(key, result_val, z, leased);
+}
 
 void mod_cache_t::update_real(const msgtype::DBKey& key, const msgtype::DBValue& val)
 {
-	tcadbputproc(m_db,
-			key.data(), key.size(),    // FIXME key.raw_data()?
-			val.raw_data(), val.raw_size(),
-			&cache_update_proc,
-			const_cast<void*>(reinterpret_cast<const void*>(&val)));
+	shard_for(key.hash()).update(key, val);
+}
+
+uint64_t mod_cache_t::lease_sequence(const msgtype::DBKey& key)
+{
+	if(!m_shards) { return 0; }
+	return shard_for(key.hash()).lease_sequence();
+}
+
+void mod_cache_t::lease(const msgtype::DBKey& key, ClockTime clocktime,
+		uint64_t expire_msec, uint64_t sequence)
+{
+	if(!m_shards) { return; }
+	shard_for(key.hash()).lease(key, clocktime, expire_msec, sequence);
+}
+
+void mod_cache_t::invalidate(const msgtype::DBKey& key)
+{
+	if(!m_shards) { return; }
+	shard_for(key.hash()).invalidate(key);
+}
+
+void mod_cache_t::drop_leases()
+{
+	if(!m_shards) { return; }
+	for(size_t i=0; i < SHARDS; ++i) {
+		m_shards[i].drop_leases();
+	}
+}
+
+uint64_t mod_cache_t::now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void mod_cache_t::get_stats(stats_t* result)
+{
+	memset(result, 0, sizeof(stats_t));
+	if(!m_shards) { return; }
+	for(size_t i=0; i < SHARDS; ++i) {
+		m_shards[i].add_stats(result);
+	}
+}
+
+void mod_cache_t::log_stats()
+{
+	stats_t st;
+	get_stats(&st);
+	LOG_INFO("local cache: hits ",st.hits,
+			" leased hits ",st.leased_hits,
+			" misses ",st.misses,
+			" updates ",st.updates,
+			" evictions ",st.evictions,
+			" invalidations ",st.invalidations,
+			" items ",st.items,
+			" bytes ",st.bytes);
 }
 
 
@@ -18,44 +18,81 @@
 #ifndef GATEWAY_MOD_CACHE_H__
 #define GATEWAY_MOD_CACHE_H__
 
-#include <tcutil.h>
-#include <tcadb.h>
 #include "logic/msgtype.h"
 
 namespace kumo {
 namespace gateway {
 
 
+// byte-bounded in-memory cache.
+// values are stored in slab pages and evicted by CLOCK in each size class.
 class mod_cache_t {
 public:
 	mod_cache_t();
 	~mod_cache_t();
 
 public:
-	void init(const char* name);
+	void init(size_t memory_limit);
 
 public:
+	// *leased is set to true if the value is leased by the server
 	bool get(const msgtype::DBKey& key, msgtype::DBValue* result_val,
-			msgpack::zone* z)
+			msgpack::zone* z, bool* leased = NULL)
 	{
-		if(!m_db) { return false; }
-		return get_real(key, result_val, z);
+		if(!m_shards) { return false; }
+		return get_real(key, result_val, z, leased);
 	}
 
 	void update(const msgtype::DBKey& key, const msgtype::DBValue& val)
 	{
-		if(!m_db) { return; }
+		if(!m_shards) { return; }
 		return update_real(key, val);
 	}
 
+	// leases; see server::mod_store_t::GetLease.
+	// a lease is set only if no invalidation is received
+	// after lease_sequence() is called.
+	uint64_t lease_sequence(const msgtype::DBKey& key);
+	void lease(const msgtype::DBKey& key, ClockTime clocktime,
+			uint64_t expire_msec, uint64_t sequence);
+	void invalidate(const msgtype::DBKey& key);
+	void drop_leases();
+
+	static uint64_t now_msec();
+
+	struct stats_t {
+		uint64_t hits;
+		uint64_t leased_hits;
+		uint64_t misses;
+		uint64_t updates;
+		uint64_t evictions;
+		uint64_t invalidations;
+		uint64_t items;
+		uint64_t bytes;
+	};
+
+	void get_stats(stats_t* result);
+	void log_stats();
+
+	static const size_t SHARDS = 16;
+
 private:
 	bool get_real(const msgtype::DBKey& key, msgtype::DBValue* result_val,
-			msgpack::zone* z);
+			msgpack::zone* z, bool* leased);
 
 	void update_real(const msgtype::DBKey& key, const msgtype::DBValue& val);
 
-public:
-	TCADB* m_db;
+private:
+	struct entry;
+	struct slab_class;
+	class shard;
+
+	shard* m_shards;
+
+	shard& shard_for(uint64_t hash);
+
+private:
+	mod_cache_t(const mod_cache_t&);
 };
 
 
@@ -28,15 +28,24 @@ RPC_IMPL(mod_network_t, HashSpacePush, req, z, response)
 	LOG_DEBUG("HashSpacePush");
 
 	{
-		pthread_scoped_wrlock hslk(share->hs_rwlock());
-		share->update_whs(req.param().wseed, hslk);
-		share->update_rhs(req.param().rseed, hslk);
+		pthread_scoped_lock whlk(share->whs_snapshot().mutex());
+		pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
+		share->update_whs(req.param().wseed, whlk);
+		share->update_rhs(req.param().rseed, rhlk);
 	}
 
 	response.result(true);
 }
 
 
+RPC_IMPL(mod_network_t, CacheInvalidate, req, z, response)
+{
+	LOG_TRACE("CacheInvalidate");
+	net->mod_cache.invalidate(req.param().dbkey);
+	response.result(true);
+}
+
+
 void mod_network_t::renew_hash_space()
 {
 	shared_zone nullz;
@@ -98,9 +107,10 @@ RPC_REPLY_IMPL(mod_network_t, HashSpaceRequest, from, res, err, z)
 	} else {
 		gateway::mod_network_t::HashSpacePush st(res.convert());
 		{
-			pthread_scoped_wrlock hslk(share->hs_rwlock());
-			share->update_whs(st.wseed, hslk);
-			share->update_rhs(st.rseed, hslk);
+			pthread_scoped_lock whlk(share->whs_snapshot().mutex());
+			pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
+			share->update_whs(st.wseed, whlk);
+			share->update_rhs(st.rseed, rhlk);
 		}
 	}
 }
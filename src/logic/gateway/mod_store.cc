@@ -17,66 +17,134 @@
 //
 #include "gateway/framework.h"
 #include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <time.h>
 
 namespace kumo {
 namespace gateway {
 
 
-mod_store_t::mod_store_t() { }
+class mod_store_t::hedge_thread : public mp::pthread_thread {
+public:
+	hedge_thread(mod_store_t* store) :
+		mp::pthread_thread(this), m_store(store) { }
 
-mod_store_t::~mod_store_t() { }
+	void operator() ()
+	{
+		m_store->run_hedge();
+	}
+
+private:
+	mod_store_t* m_store;
+	hedge_thread();
+	hedge_thread(const hedge_thread&);
+};
+
+mod_store_t::mod_store_t() :
+	m_hedge_thread(NULL),
+	m_hedge_end(false) { }
+
+mod_store_t::~mod_store_t()
+{
+	if(m_hedge_thread) {
+		{
+			mp::pthread_scoped_lock lk(m_hedge_mutex);
+			m_hedge_end = true;
+			m_hedge_cond.signal();
+		}
+		m_hedge_thread->join();
+		delete m_hedge_thread;
+	}
+}
+
+void mod_store_t::start_hedge()
+{
+	std::auto_ptr<hedge_thread> th(new hedge_thread(this));
+	th->run();
+	m_hedge_thread = th.release();
+}
 
 
 template <resource::hash_space_type Hs>
 framework::shared_session resource::server_for(uint64_t h, unsigned int offset)
 {
-#if NUM_REPLICATION != 2
-#error fix following code
-#endif
-	assert(offset == 0 || offset == 1 || offset == 2);
+	assert(offset < HashSpace::MAX_REPLICAS);
 
-	pthread_scoped_rdlock hslk(m_hs_rwlock);
+	hs_snapshot::ref hs_ref(Hs == HS_WRITE ? m_whs.get() : m_rhs.get());
+	const HashSpace& hs(*hs_ref);
 
-	if((Hs == HS_WRITE ? m_whs : m_rhs).empty()) {
+	if(hs.empty()) {
 		share->incr_error_renew_count();
 		throw std::runtime_error("No server");
 	}
-	HashSpace::iterator it = (Hs == HS_WRITE ? m_whs : m_rhs).find(h);
+	const HashSpace::node* reps[HashSpace::MAX_REPLICAS];
+	size_t num = hs.find_replicas(h, reps);
 
-	{
+	// offset-th node or following active node
+	const HashSpace::node* n = reps[0];
+	for(size_t i=0; i < num; ++i) {
 		if(offset == 0) {
-			if(it->is_active()) { goto node_found; }
-		} else { --offset; }
-	
-		HashSpace::iterator origin(it);
-		++it;
-		for(; it != origin; ++it) {
-			if(*it == *origin) { continue; }
-	
-			if(offset == 0) {
-				if(it->is_active()) { goto node_found; }
-			} else { --offset; }
-	
-			HashSpace::node rep1 = *it;
-			++it;
-			for(; it != origin; ++it) {
-				if(*it == *origin || *it == rep1) { continue; }
-				HashSpace::node _rep2_ = *it;
-	
-				if(offset == 0) {
-					if(it->is_active()) { goto node_found; }
-				} else { --offset; }
-	
+			if(reps[i]->is_active()) {
+				n = reps[i];
 				break;
 			}
-			break;
+		} else { --offset; }
+	}
+
+	return net->get_session(n->addr());
+}
+
+framework::shared_session resource::read_server_for(uint64_t h,
+		address* result_addr, const address* exclude)
+{
+	hs_snapshot::ref rhs_ref(m_rhs.get());
+	const HashSpace& rhs(*rhs_ref);
+
+	if(rhs.empty()) {
+		share->incr_error_renew_count();
+		throw std::runtime_error("No server");
+	}
+	const HashSpace::node* reps[HashSpace::MAX_REPLICAS];
+	size_t num = rhs.find_replicas(h, reps);
+
+	const HashSpace::node* cands[HashSpace::MAX_REPLICAS];
+	size_t ncands = 0;
+	for(size_t i=0; i < num; ++i) {
+		if(reps[i]->is_active() &&
+				(!exclude || reps[i]->addr() != *exclude)) {
+			cands[ncands++] = reps[i];
 		}
 	}
 
-node_found:
-	address addr = it->addr();
-	hslk.unlock();
-	return net->get_session(addr);
+	const HashSpace::node* n;
+	if(ncands == 0) {
+		if(exclude) { return shared_session(); }
+		n = reps[0];
+
+	} else if(!m_cfg_read_latency_aware || ncands == 1) {
+		n = cands[0];
+
+	} else {
+		unsigned int count = __sync_fetch_and_add(&m_read_count, 1);
+		if(count % READ_PROBE_INTERVAL == 0) {
+			n = cands[(count / READ_PROBE_INTERVAL) % ncands];
+		} else {
+			// replicas which have no samples are tried first
+			n = cands[0];
+			uint64_t best = m_read_latency.ewma(n->addr());
+			for(size_t i=1; i < ncands; ++i) {
+				uint64_t lat = m_read_latency.ewma(cands[i]->addr());
+				if(lat < best) {
+					n = cands[i];
+					best = lat;
+				}
+			}
+		}
+	}
+
+	*result_addr = n->addr();
+	return net->get_session(n->addr());
 }
 
 template <typename ReqType>
@@ -155,42 +223,472 @@ catch (std::exception& e) { \
 }
 
 
+bool mod_store_t::get_cached(const msgtype::DBKey& key,
+		gate::callback_get callback, void* user,
+		shared_zone& life)
+{
+	msgtype::DBValue cached_val_buf;
+	bool leased = false;
+
+	if(!net->mod_cache.get(key, &cached_val_buf, life.get(),
+				share->cfg_cache_lease_msec() > 0 ? &leased : NULL)) {
+		return false;
+	}
+
+	if(leased && !Storage::is_expired(cached_val_buf.raw_data(),
+				cached_val_buf.raw_size(), time(NULL))) {
+		// updates are notified by the server within the lease
+		gate::res_get ret;
+		ret.error     = 0;
+		dbkey_remove_prefix(&ret, key);
+		ret.hash      = key.hash();
+		ret.val       = (char*)cached_val_buf.data();
+		ret.vallen    = cached_val_buf.size();
+		ret.clocktime = cached_val_buf.clocktime().get();
+		wavy::submit(submit_callback_trampoline<gate::callback_get, gate::res_get>,
+				callback, user, ret, life);
+		return true;
+	}
+
+	msgtype::DBValue* cached_val = life->allocate<msgtype::DBValue>(cached_val_buf);
+
+	if(share->cfg_cache_lease_msec() > 0) {
+		get_lease(key, callback, user, life, cached_val);
+		return true;
+	}
+
+	rpc::retry<server::mod_store_t::GetIfModified>* retry =
+		life->allocate< rpc::retry<server::mod_store_t::GetIfModified> >(
+				server::mod_store_t::GetIfModified(key, cached_val_buf.clocktime())
+				);
+
+	retry->set_callback(
+			BIND_RESPONSE(mod_store_t, GetIfModified, retry,
+				callback, user, cached_val) );
+
+	retry->call(share->server_for<resource::HS_READ>(key.hash()), life, 10);
+	return true;
+}
+
+void mod_store_t::get_lease(const msgtype::DBKey& key,
+		gate::callback_get callback, void* user,
+		shared_zone& life, msgtype::DBValue* cached_val)
+{
+	get_lease_entry* e = life->allocate<get_lease_entry>();
+	e->cached_val = cached_val;
+	e->sequence   = net->mod_cache.lease_sequence(key);
+	e->sent_msec  = mod_cache_t::now_msec();
+
+	rpc::retry<server::mod_store_t::GetLease>* retry =
+		life->allocate< rpc::retry<server::mod_store_t::GetLease> >(
+				server::mod_store_t::GetLease(key,
+					cached_val ? cached_val->clocktime() : ClockTime(),
+					share->cfg_cache_lease_msec())
+				);
+
+	retry->set_callback(
+			BIND_RESPONSE(mod_store_t, GetLease, retry,
+				callback, user, e) );
+
+	retry->call(share->server_for<resource::HS_READ>(key.hash()), life, 10);
+}
+
+void mod_store_t::get_single(const msgtype::DBKey& key,
+		gate::callback_get callback, void* user,
+		shared_zone& life, bool primary_failed)
+{
+	rpc::retry<server::mod_store_t::Get>* retry =
+		life->allocate< rpc::retry<server::mod_store_t::Get> >(
+				server::mod_store_t::Get(key)
+				);
+
+	read_state* rs = NULL;
+	if(!primary_failed && (share->cfg_read_latency_aware() ||
+				share->cfg_read_hedge_percentile() > 0)) {
+		rs = life->allocate<read_state>();
+	}
+
+	retry->set_callback(
+			BIND_RESPONSE(mod_store_t, Get, retry,
+				callback, user, rs) );
+
+	if(rs) {
+		send_read(rs, key.hash(), retry, life);
+		return;
+	}
+
+	unsigned int offset = 0;
+	if(primary_failed) {
+		// continue as if Get to the primary node returned an error
+		retry->retry_incr(share->read_replicas() * share->cfg_get_retry_num() - 1);
+		offset = 1;
+	}
+
+	retry->call(share->server_for<resource::HS_READ>(key.hash(), offset), life, 10);
+}
+
+
+struct mod_store_t::get_flight {
+	struct waiter {
+		gate::callback_get callback;
+		void* user;
+		shared_zone life;
+	};
+
+	uint64_t hash;
+	std::string key;
+	std::vector<waiter> waiters;  // waiters[0] sends the request
+};
+
+bool mod_store_t::join_get_flight(const msgtype::DBKey& key,
+		gate::callback_get* callback, void** user,
+		shared_zone& life)
+{
+	get_flight::waiter w;
+	w.callback = *callback;
+	w.user     = *user;
+	w.life     = life;
+
+	get_flight_stripe& st(m_get_flights[key.hash() % GET_FLIGHT_STRIPES]);
+	mp::pthread_scoped_lock lk(st.mutex);
+
+	std::pair<get_flight_map_t::iterator, get_flight_map_t::iterator>
+		range(st.map.equal_range(key.hash()));
+	for(get_flight_map_t::iterator it(range.first); it != range.second; ++it) {
+		get_flight* f = it->second;
+		if(f->key.size() == key.size() &&
+				memcmp(f->key.data(), key.data(), key.size()) == 0) {
+			f->waiters.push_back(w);
+			return true;
+		}
+	}
+
+	std::auto_ptr<get_flight> f(new get_flight());
+	f->hash = key.hash();
+	f->key.assign(key.data(), key.size());
+	f->waiters.push_back(w);
+	st.map.insert(range.second, get_flight_map_t::value_type(key.hash(), f.get()));
+
+	*callback = get_flight_callback;
+	*user     = f.release();
+	return false;
+}
+
+void mod_store_t::close_get_flights(const msgtype::DBKey& key)
+{
+	if(!share->cfg_get_coalescing()) {
+		return;
+	}
+
+	get_flight_stripe& st(m_get_flights[key.hash() % GET_FLIGHT_STRIPES]);
+	mp::pthread_scoped_lock lk(st.mutex);
+
+	// the flights are completed by their responses;
+	// complete_get_flight doesn't find them in the map.
+	std::pair<get_flight_map_t::iterator, get_flight_map_t::iterator>
+		range(st.map.equal_range(key.hash()));
+	for(get_flight_map_t::iterator it(range.first); it != range.second; ) {
+		get_flight* f = it->second;
+		if(f->key.size() == key.size() &&
+				memcmp(f->key.data(), key.data(), key.size()) == 0) {
+			st.map.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+void mod_store_t::get_flight_callback(void* user, gate::res_get& res, auto_zone z)
+{
+	net->mod_store.complete_get_flight(static_cast<get_flight*>(user), res, z);
+}
+
+void mod_store_t::complete_get_flight(get_flight* f, gate::res_get& res, auto_zone z)
+{
+	{
+		get_flight_stripe& st(m_get_flights[f->hash % GET_FLIGHT_STRIPES]);
+		mp::pthread_scoped_lock lk(st.mutex);
+		std::pair<get_flight_map_t::iterator, get_flight_map_t::iterator>
+			range(st.map.equal_range(f->hash));
+		for(get_flight_map_t::iterator it(range.first); it != range.second; ++it) {
+			if(it->second == f) {
+				st.map.erase(it);
+				break;
+			}
+		}
+	}
+	std::auto_ptr<get_flight> fl(f);
+
+	// waiters are not added any more
+	// res.key may point to the zone of the first waiter
+	shared_zone life(z.release());
+	shared_zone first_life(f->waiters.front().life);
+	for(std::vector<get_flight::waiter>::iterator it(f->waiters.begin()),
+			it_end(f->waiters.end()); it != it_end; ++it) {
+		try {
+			auto_zone wz(new msgpack::zone());
+			wz->allocate<shared_zone>(life);
+			wz->allocate<shared_zone>(first_life);
+			if(it->life != first_life) { wz->allocate<shared_zone>(it->life); }
+			gate::res_get ret(res);
+			(*it->callback)(it->user, ret, wz);
+		} catch (...) { }
+	}
+}
+
+
+mod_store_t::read_state::read_state() :
+	done(0), outstanding(0), hedged(0)
+{
+	attempts[0].session = NULL;
+	attempts[1].session = NULL;
+}
+
+void mod_store_t::send_read(read_state* rs, uint64_t hash,
+		rpc::retry<server::mod_store_t::Get>* retry, shared_zone& life)
+{
+	read_state::attempt& a(rs->attempts[0]);
+	shared_session s(share->read_server_for(hash, &a.addr));
+	a.session = static_cast<rpc::basic_session*>(s.get());
+	a.sent_usec = latency_table::now_usec();
+	rs->outstanding = 1;
+
+	retry->call(s, life, 10);
+
+	unsigned short pct = share->cfg_read_hedge_percentile();
+	if(pct > 0) {
+		uint64_t delay = std::max(
+				share->read_latency().percentile(a.addr, pct),
+				(uint64_t)share->cfg_read_hedge_min_usec());
+		hedge_entry e;
+		e.rs    = rs;
+		e.hash  = hash;
+		e.retry = retry;
+		e.life  = life;
+		mp::pthread_scoped_lock lk(m_hedge_mutex);
+		hedge_queue_t::iterator it = m_hedge_queue.insert(
+				hedge_queue_t::value_type(a.sent_usec + delay, e));
+		if(it == m_hedge_queue.begin()) {
+			m_hedge_cond.signal();
+		}
+	}
+}
+
+void mod_store_t::run_hedge()
+{
+	mp::pthread_scoped_lock lk(m_hedge_mutex);
+	while(!m_hedge_end) {
+		if(m_hedge_queue.empty()) {
+			m_hedge_cond.wait(m_hedge_mutex);
+			continue;
+		}
+
+		uint64_t now = latency_table::now_usec();
+		uint64_t due = m_hedge_queue.begin()->first;
+		if(now < due) {
+			// pthread_cond_timedwait uses CLOCK_REALTIME
+			struct timespec abstime;
+			clock_gettime(CLOCK_REALTIME, &abstime);
+			uint64_t nsec = abstime.tv_nsec + (due - now) * 1000;
+			abstime.tv_sec += nsec / 1000000000;
+			abstime.tv_nsec = nsec % 1000000000;
+			m_hedge_cond.timedwait(m_hedge_mutex, &abstime);
+			continue;
+		}
+
+		lk.unlock();
+		step_hedge();
+		lk.relock(m_hedge_mutex);
+	}
+}
+
+void mod_store_t::step_hedge()
+{
+	uint64_t now = latency_table::now_usec();
+
+	std::vector<hedge_entry> fire;
+	{
+		mp::pthread_scoped_lock lk(m_hedge_mutex);
+		hedge_queue_t::iterator it(m_hedge_queue.begin());
+		for(; it != m_hedge_queue.end() && it->first <= now; ++it) {
+			fire.push_back(it->second);
+		}
+		m_hedge_queue.erase(m_hedge_queue.begin(), it);
+	}
+
+	for(std::vector<hedge_entry>::iterator it(fire.begin()), it_end(fire.end());
+			it != it_end; ++it) {
+		read_state* rs = it->rs;
+		if(rs->done || __sync_lock_test_and_set(&rs->hedged, 1)) {
+			continue;
+		}
+		try {
+			read_state::attempt& a(rs->attempts[1]);
+			shared_session s(share->read_server_for(it->hash, &a.addr,
+						&rs->attempts[0].addr));
+			if(!s) { continue; }
+			a.sent_usec = latency_table::now_usec();
+			__sync_synchronize();
+			a.session = static_cast<rpc::basic_session*>(s.get());
+			__sync_add_and_fetch(&rs->outstanding, 1);
+			LOG_TRACE("hedged get to ",a.addr);
+			it->retry->call(s, it->life, 10);
+		} catch (std::exception& e) {
+			LOG_WARN("hedged get failed: ",e.what());
+		} catch (...) {
+			LOG_WARN("hedged get failed: unknown error");
+		}
+	}
+}
+
+void mod_store_t::record_read(read_state* rs, basic_shared_session& from, bool failed)
+{
+	uint64_t now = latency_table::now_usec();
+	for(unsigned int i=0; i < 2; ++i) {
+		read_state::attempt& a(rs->attempts[i]);
+		if(a.session != NULL && a.session == from.get()) {
+			if(failed) {
+				share->read_latency().record_error(a.addr);
+			} else {
+				share->read_latency().record(a.addr, now - a.sent_usec);
+			}
+			return;
+		}
+	}
+}
+
+
 void mod_store_t::Get(gate::req_get& req)
 try {
 	shared_zone life(req.life);
 	if(!life) { life.reset(new msgpack::zone()); }
 
 	msgtype::DBKey key = dbkey_with_prefix(req, life);
-	msgtype::DBValue cached_val_buf;
 
-	if(net->mod_cache.get(key, &cached_val_buf, life.get())) {
-		msgtype::DBValue* cached_val = life->allocate<msgtype::DBValue>(cached_val_buf);
+	if(share->cfg_get_coalescing() &&
+			join_get_flight(key, &req.callback, &req.user, life)) {
+		// completed by the request in flight
+		return;
+	}
 
-		rpc::retry<server::mod_store_t::GetIfModified>* retry =
-			life->allocate< rpc::retry<server::mod_store_t::GetIfModified> >(
-					server::mod_store_t::GetIfModified(key, cached_val_buf.clocktime())
-					);
+	if(get_cached(key, req.callback, req.user, life)) {
+		return;
+	}
 
-		retry->set_callback(
-				BIND_RESPONSE(mod_store_t, GetIfModified, retry,
-					req.callback, req.user, cached_val) );
+	if(share->cfg_cache_lease_msec() > 0) {
+		get_lease(key, req.callback, req.user, life, NULL);
+	} else {
+		get_single(key, req.callback, req.user, life);
+	}
+}
+SUBMIT_CATCH(_get);
 
-		retry->call(share->server_for<resource::HS_READ>(key.hash()), life, 10);
 
-	} else {
-		rpc::retry<server::mod_store_t::Get>* retry =
-			life->allocate< rpc::retry<server::mod_store_t::Get> >(
-					server::mod_store_t::Get(key)
-					);
+namespace {
+struct get_multi_group {
+	framework::shared_session session;
+	std::vector<msgtype::DBKey> keys;
+	std::vector<uint32_t> index;
+};
 
-		retry->set_callback(
-				BIND_RESPONSE(mod_store_t, Get, retry,
-					req.callback, req.user) );
+static void submit_get_error(gate::callback_get callback, void* user,
+		shared_zone& life)
+{
+	gate::res_get res;
+	res.error = 1;
+	wavy::submit(submit_callback_trampoline<gate::callback_get, gate::res_get>,
+			callback, user, res, life);
+}
+}  // noname namespace
+
+void mod_store_t::GetMulti(gate::req_get_multi& req)
+{
+	shared_zone life(req.life);
+	if(!life) { life.reset(new msgpack::zone()); }
+
+	// group keys by the node which has them
+	std::vector<get_multi_group> groups;
+
+	for(uint32_t i=0; i < req.num; ++i) {
+		gate::req_get& r(req.reqs[i]);
+		try {
+			msgtype::DBKey key = dbkey_with_prefix(r, life);
+
+			if(get_cached(key, r.callback, r.user, life)) {
+				continue;
+			}
+
+			framework::shared_session s(
+					share->server_for<resource::HS_READ>(key.hash()));
 
-		retry->call(share->server_for<resource::HS_READ>(key.hash()), life, 10);
+			std::vector<get_multi_group>::iterator g(groups.begin());
+			for(; g != groups.end(); ++g) {
+				if(g->session == s) { break; }
+			}
+			if(g == groups.end()) {
+				groups.push_back(get_multi_group());
+				g = groups.end() - 1;
+				g->session = s;
+			}
+
+			g->keys.push_back(key);
+			g->index.push_back(i);
+
+		} catch (std::exception& e) {
+			LOG_WARN("req_get_multi FAILED: ",e.what());
+			submit_get_error(r.callback, r.user, life);
+		} catch (...) {
+			LOG_WARN("req_get_multi FAILED: unknown error");
+			submit_get_error(r.callback, r.user, life);
+		}
+	}
+
+	for(std::vector<get_multi_group>::iterator g(groups.begin());
+			g != groups.end(); ++g) {
+		const size_t num = g->keys.size();
+		try {
+			if(num == 1 || !get_multi_supported(
+						static_cast<rpc::basic_session*>(g->session.get()))) {
+				for(size_t x=0; x < num; ++x) {
+					gate::req_get& r(req.reqs[g->index[x]]);
+					get_single(g->keys[x], r.callback, r.user, life);
+				}
+				continue;
+			}
+
+			get_multi_entry* entries = (get_multi_entry*)life->malloc(
+					sizeof(get_multi_entry)*num);
+			for(size_t x=0; x < num; ++x) {
+				gate::req_get& r(req.reqs[g->index[x]]);
+				entries[x].callback = r.callback;
+				entries[x].user     = r.user;
+			}
+
+			rpc::retry<server::mod_store_t::GetMulti>* retry =
+				life->allocate< rpc::retry<server::mod_store_t::GetMulti> >(
+						server::mod_store_t::GetMulti(g->keys)
+						);
+
+			retry->set_callback(
+					BIND_RESPONSE(mod_store_t, GetMulti, retry, entries) );
+
+			retry->call(g->session, life, 10);
+
+		} catch (std::exception& e) {
+			LOG_WARN("req_get_multi FAILED: ",e.what());
+			for(size_t x=0; x < num; ++x) {
+				gate::req_get& r(req.reqs[g->index[x]]);
+				submit_get_error(r.callback, r.user, life);
+			}
+		} catch (...) {
+			LOG_WARN("req_get_multi FAILED: unknown error");
+			for(size_t x=0; x < num; ++x) {
+				gate::req_get& r(req.reqs[g->index[x]]);
+				submit_get_error(r.callback, r.user, life);
+			}
+		}
 	}
 }
-SUBMIT_CATCH(_get);
 
 
 void mod_store_t::Set(gate::req_set& req)
@@ -217,23 +715,179 @@ try {
 	case gate::OP_PREPEND:
 		op = server::OP_PREPEND;
 		break;
+	case gate::OP_INCR:
+		op = server::OP_INCR;
+		break;
+	case gate::OP_DECR:
+		op = server::OP_DECR;
+		break;
+	case gate::OP_ADD:
+		op = server::OP_ADD;
+		break;
+	default:
+		throw std::logic_error("unknown operation");
 	}
 
 	msgtype::DBKey key = dbkey_with_prefix(req, life);
 
 	uint16_t meta = 0;
+	if(req.has_exptime) {
+		meta |= Storage::VALUE_META_EXPIRE;
+	}
+
+	if(op != server::OP_SET && op != server::OP_SET_ASYNC &&
+			op != server::OP_CAS && op != server::OP_ADD) {
+		// the server modifies the stored value
+		rpc::retry<server::mod_store_t::Modify>* retry =
+			life->allocate< rpc::retry<server::mod_store_t::Modify> >(
+					server::mod_store_t::Modify(op,
+						key,
+						msgtype::DBValue(req.val, req.vallen, meta, 0),
+						req.headlen, req.amount,
+						share->cfg_write_quorum())
+					);
+
+		retry->set_callback(
+				BIND_RESPONSE(mod_store_t, Modify, retry, req.callback, req.user) );
+		retry->call(share->server_for<resource::HS_WRITE>(key.hash()), life, 10);
+		return;
+	}
+
+	set_single(op, key,
+			msgtype::DBValue(req.val, req.vallen, meta, clocktime),
+			req.callback, req.user, life);
+}
+SUBMIT_CATCH(_set);
+
+void mod_store_t::set_single(server::set_op_t op,
+		const msgtype::DBKey& key, const msgtype::DBValue& val,
+		gate::callback_set callback, void* user,
+		shared_zone& life)
+{
 	rpc::retry<server::mod_store_t::Set>* retry =
 		life->allocate< rpc::retry<server::mod_store_t::Set> >(
-				server::mod_store_t::Set(op,
-					key,
-					msgtype::DBValue(req.val, req.vallen, meta, clocktime))
+				server::mod_store_t::Set(op, key, val,
+					share->cfg_write_quorum())
 				);
 
 	retry->set_callback(
-			BIND_RESPONSE(mod_store_t, Set, retry, req.callback, req.user) );
+			BIND_RESPONSE(mod_store_t, Set, retry, callback, user) );
 	retry->call(share->server_for<resource::HS_WRITE>(key.hash()), life, 10);
 }
-SUBMIT_CATCH(_set);
+
+
+namespace {
+struct set_multi_group {
+	framework::shared_session session;
+	std::vector<msgtype::DBKey> keys;
+	std::vector<msgtype::DBValue> vals;
+	std::vector<uint32_t> index;
+};
+
+static void submit_set_error(gate::callback_set callback, void* user,
+		shared_zone& life)
+{
+	gate::res_set res;
+	res.error = 1;
+	wavy::submit(submit_callback_trampoline<gate::callback_set, gate::res_set>,
+			callback, user, res, life);
+}
+}  // noname namespace
+
+void mod_store_t::SetMulti(gate::req_set_multi& req)
+{
+	shared_zone life(req.life);
+	if(!life) { life.reset(new msgpack::zone()); }
+
+	// group plain sets by the node which coordinates them
+	std::vector<set_multi_group> groups;
+
+	for(uint32_t i=0; i < req.num; ++i) {
+		gate::req_set& r(req.reqs[i]);
+		if(r.operation != gate::OP_SET) {
+			r.life = life;
+			Set(r);
+			continue;
+		}
+		try {
+			msgtype::DBKey key = dbkey_with_prefix(r, life);
+
+			uint16_t meta = 0;
+			if(r.has_exptime) {
+				meta |= Storage::VALUE_META_EXPIRE;
+			}
+
+			framework::shared_session s(
+					share->server_for<resource::HS_WRITE>(key.hash()));
+
+			std::vector<set_multi_group>::iterator g(groups.begin());
+			for(; g != groups.end(); ++g) {
+				if(g->session == s) { break; }
+			}
+			if(g == groups.end()) {
+				groups.push_back(set_multi_group());
+				g = groups.end() - 1;
+				g->session = s;
+			}
+
+			g->keys.push_back(key);
+			g->vals.push_back(msgtype::DBValue(r.val, r.vallen, meta, 0));
+			g->index.push_back(i);
+
+		} catch (std::exception& e) {
+			LOG_WARN("req_set_multi FAILED: ",e.what());
+			submit_set_error(r.callback, r.user, life);
+		} catch (...) {
+			LOG_WARN("req_set_multi FAILED: unknown error");
+			submit_set_error(r.callback, r.user, life);
+		}
+	}
+
+	for(std::vector<set_multi_group>::iterator g(groups.begin());
+			g != groups.end(); ++g) {
+		const size_t num = g->keys.size();
+		try {
+			if(num == 1) {
+				gate::req_set& r(req.reqs[g->index[0]]);
+				set_single(server::OP_SET, g->keys[0], g->vals[0],
+						r.callback, r.user, life);
+				continue;
+			}
+
+			set_multi_entry* entries = (set_multi_entry*)life->malloc(
+					sizeof(set_multi_entry)*num);
+			for(size_t x=0; x < num; ++x) {
+				gate::req_set& r(req.reqs[g->index[x]]);
+				entries[x].callback = r.callback;
+				entries[x].user     = r.user;
+			}
+
+			rpc::retry<server::mod_store_t::SetMulti>* retry =
+				life->allocate< rpc::retry<server::mod_store_t::SetMulti> >(
+						server::mod_store_t::SetMulti(g->keys, g->vals,
+							share->cfg_write_quorum())
+						);
+
+			retry->set_callback(
+					BIND_RESPONSE(mod_store_t, SetMulti, retry, entries) );
+
+			retry->call(g->session, life, 10);
+
+		} catch (std::exception& e) {
+			LOG_WARN("req_set_multi FAILED: ",e.what());
+			for(size_t x=0; x < num; ++x) {
+				gate::req_set& r(req.reqs[g->index[x]]);
+				submit_set_error(r.callback, r.user, life);
+			}
+		} catch (...) {
+			LOG_WARN("req_set_multi FAILED: unknown error");
+			for(size_t x=0; x < num; ++x) {
+				gate::req_set& r(req.reqs[g->index[x]]);
+				submit_set_error(r.callback, r.user, life);
+			}
+		}
+	}
+}
 
 
 void mod_store_t::Delete(gate::req_delete& req)
@@ -249,7 +903,7 @@ try {
 					(share->cfg_async_replicate_delete() || req.async) ?
 					 static_cast<server::store_flags>(server::store_flags_async()) :
 					 static_cast<server::store_flags>(server::store_flags_none()),
-					key)
+					key, share->cfg_write_quorum())
 				);
 
 	retry->set_callback(
@@ -310,16 +964,78 @@ void retry_after(unsigned int steps,
 	net->do_after(steps,
 			retry_after_callback<Hs, Parameter>(retry, life, for_hash, offset));
 }
+
+// error of Get, GetIfModified and GetLease.
+// retries the get with the next replica; returns false if it's
+// retried too many times.
+template <typename Parameter>
+bool retry_get(rpc::retry<Parameter>* retry, const msgtype::DBKey& key,
+		rpc::msgobj err, auto_zone& z)
+{
+	if( retry->retry_incr(share->read_replicas() * share->cfg_get_retry_num() - 1) ) {
+		share->incr_error_renew_count();
+		unsigned short offset = retry->num_retried() % share->read_replicas();
+		SHARED_ZONE(life, z);
+		if(offset == 0) {
+			// FIXME configurable steps
+			retry_after<resource::HS_READ>(1*framework::DO_AFTER_BY_SECONDS,
+					retry, life, key.hash(), offset);
+		} else {
+			retry->call(share->server_for<resource::HS_READ>(key.hash(), offset), life, 10);
+		}
+		LOG_DEBUG("Get error: ",err,", fallback to offset +",offset," node");  // too slow to display it
+		return true;
+	}
+
+	if(err.via.u64 == (uint64_t)rpc::protocol::TRANSPORT_LOST_ERROR ||
+			err.via.u64 == (uint64_t)rpc::protocol::SERVER_ERROR) {
+		net->mod_network.renew_hash_space();   // FIXME
+	}
+	return false;
+}
+
+void reply_get_error(const msgtype::DBKey& key, rpc::msgobj err,
+		gate::callback_get callback, void* user, auto_zone& z)
+{
+	gate::res_get ret;
+	ret.error     = 1;  // ERROR
+	dbkey_remove_prefix(&ret, key);
+	ret.hash      = key.hash();
+	ret.val       = NULL;
+	ret.vallen    = 0;
+	ret.clocktime = 0;
+	try { (*callback)(user, ret, z); } catch (...) { }
+	TLOGPACK("eg",3,
+			"key",msgtype::raw_ref(key.data(),key.size()),
+			"err",err.via.u64);
+	LOG_ERROR("Get error: ", err);
+}
 }  // noname namespace
 
 
 RPC_REPLY_IMPL(mod_store_t, Get, from, res, err, z,
 		rpc::retry<server::mod_store_t::Get>* retry,
-		gate::callback_get callback, void* user)
+		gate::callback_get callback, void* user,
+		read_state* rs)
 try {
 	msgtype::DBKey key(retry->param().dbkey);
 	LOG_TRACE("ResGet ",err);
 
+	if(rs) {
+		record_read(rs, from, !err.is_nil());
+		if(err.is_nil()) {
+			if(__sync_lock_test_and_set(&rs->done, 1)) {
+				return;  // the other request is answered first
+			}
+		} else {
+			if(rs->done) { return; }
+			if(__sync_sub_and_fetch(&rs->outstanding, 1) > 0) {
+				return;  // wait for the other request
+			}
+			__sync_add_and_fetch(&rs->outstanding, 1);  // retried below
+		}
+	}
+
 	if(err.is_nil()) {
 		gate::res_get ret;
 		ret.error     = 0;
@@ -338,39 +1054,113 @@ try {
 		}
 		try { (*callback)(user, ret, z); } catch (...) { }
 
-	} else if( retry->retry_incr((NUM_REPLICATION+1) * share->cfg_get_retry_num() - 1) ) {
-		share->incr_error_renew_count();
-		unsigned short offset = retry->num_retried() % (NUM_REPLICATION+1);
-		SHARED_ZONE(life, z);
-		if(offset == 0) {
-			// FIXME configurable steps
-			retry_after<resource::HS_READ>(1*framework::DO_AFTER_BY_SECONDS,
-					retry, life, key.hash(), offset);
-		} else {
-			retry->call(share->server_for<resource::HS_READ>(key.hash(), offset), life, 10);
+	} else if(!retry_get(retry, key, err, z)) {
+		if(rs && __sync_lock_test_and_set(&rs->done, 1)) {
+			return;
 		}
-		LOG_DEBUG("Get error: ",err,", fallback to offset +",offset," node");  // too slow to display it
+		reply_get_error(key, err, callback, user, z);
+	}
+}
+GATEWAY_CATCH(ResGet, gate::res_get)
 
-	} else {
-		if(err.via.u64 == (uint64_t)rpc::protocol::TRANSPORT_LOST_ERROR ||
-				err.via.u64 == (uint64_t)rpc::protocol::SERVER_ERROR) {
-			net->mod_network.renew_hash_space();   // FIXME
+
+bool mod_store_t::get_multi_supported(void* session)
+{
+	mp::pthread_scoped_lock lk(m_get_multi_unsupported_mutex);
+	get_multi_unsupported_t::iterator it(m_get_multi_unsupported.find(session));
+	if(it == m_get_multi_unsupported.end()) {
+		return true;
+	}
+	if(time(NULL) < it->second) {
+		return false;
+	}
+	// the server may be upgraded
+	m_get_multi_unsupported.erase(it);
+	return true;
+}
+
+RPC_REPLY_IMPL(mod_store_t, GetMulti, from, res, err, z,
+		rpc::retry<server::mod_store_t::GetMulti>* retry,
+		get_multi_entry* entries)
+{
+	const std::vector<msgtype::DBKey>& keys(retry->param().dbkeys);
+	const size_t num = keys.size();
+	LOG_TRACE("ResGetMulti ",err);
+
+	SHARED_ZONE(life, z);
+
+	bool unsupported = false;
+	if(err.type == msgpack::type::POSITIVE_INTEGER &&
+			err.via.u64 == (uint64_t)rpc::protocol::PROTOCOL_ERROR) {
+		// unknown method; the server is older than GetMulti
+		LOG_WARN("GetMulti is not supported by the server; fallback to Get");
+		if(from) {
+			mp::pthread_scoped_lock lk(m_get_multi_unsupported_mutex);
+			m_get_multi_unsupported[from.get()] =
+				time(NULL) + GET_MULTI_RETRY_SEC;
 		}
-		gate::res_get ret;
-		ret.error     = 1;  // ERROR
-		dbkey_remove_prefix(&ret, key);
-		ret.hash      = key.hash();
-		ret.val       = NULL;
-		ret.vallen    = 0;
-		ret.clocktime = 0;
-		try { (*callback)(user, ret, z); } catch (...) { }
-		TLOGPACK("eg",3,
-				"key",msgtype::raw_ref(key.data(),key.size()),
-				"err",err.via.u64);
-		LOG_ERROR("Get error: ", err);
+		unsupported = true;
+	}
+
+	bool batch_failed = !err.is_nil() ||
+		res.type != msgpack::type::ARRAY || res.via.array.size != num;
+	if(batch_failed && !unsupported) {
+		share->incr_error_renew_count();
+		LOG_DEBUG("GetMulti error: ",err,", fallback to Get");
+	}
+
+	bool renew_required = false;
+
+	for(size_t i=0; i < num; ++i) {
+		const msgtype::DBKey& key(keys[i]);
+		gate::callback_get callback = entries[i].callback;
+		void* user = entries[i].user;
+
+		try {
+			if(batch_failed ||
+					res.via.array.ptr[i].type == msgpack::type::BOOLEAN) {
+				// per-key retry and fallback to replicas
+				if(!batch_failed) { renew_required = true; }
+				get_single(key, callback, user, life, !unsupported);
+				continue;
+			}
+
+			msgpack::object r = res.via.array.ptr[i];
+
+			// each callback holds the response zone
+			auto_zone kz(new msgpack::zone());
+			kz->allocate<shared_zone>(life);
+
+			gate::res_get ret;
+			ret.error     = 0;
+			dbkey_remove_prefix(&ret, key);
+			ret.hash      = key.hash();
+			if(r.is_nil()) {
+				ret.val       = NULL;
+				ret.vallen    = 0;
+				ret.clocktime = 0;
+			} else {
+				msgtype::DBValue st = r.as<msgtype::DBValue>();
+				ret.val       = (char*)st.data();
+				ret.vallen    = st.size();
+				ret.clocktime = st.clocktime().get();
+				net->mod_cache.update(key, st);
+			}
+			try { (*callback)(user, ret, kz); } catch (...) { }
+
+		} catch (std::exception& e) {
+			LOG_WARN("ResGetMulti FAILED: ",e.what());
+			submit_get_error(callback, user, life);
+		} catch (...) {
+			LOG_WARN("ResGetMulti FAILED: unknown error");
+			submit_get_error(callback, user, life);
+		}
+	}
+
+	if(renew_required) {
+		share->incr_error_renew_count();
 	}
 }
-GATEWAY_CATCH(ResGet, gate::res_get)
 
 
 RPC_REPLY_IMPL(mod_store_t, GetIfModified, from, res, err, z,
@@ -378,7 +1168,6 @@ RPC_REPLY_IMPL(mod_store_t, GetIfModified, from, res, err, z,
 		gate::callback_get callback, void* user,
 		msgtype::DBValue* cached_val)
 try {
-	// FIXME copied code
 	msgtype::DBKey key(retry->param().dbkey);
 	LOG_TRACE("ResGetIfModified ",err);
 
@@ -406,36 +1195,62 @@ try {
 		}
 		try { (*callback)(user, ret, z); } catch (...) { }
 
-	} else if( retry->retry_incr((NUM_REPLICATION+1) * share->cfg_get_retry_num() - 1) ) {
-		share->incr_error_renew_count();
-		unsigned short offset = retry->num_retried() % (NUM_REPLICATION+1);
-		SHARED_ZONE(life, z);
-		if(offset == 0) {
-			// FIXME configurable steps
-			retry_after<resource::HS_READ>(1*framework::DO_AFTER_BY_SECONDS,
-					retry, life, key.hash(), offset);
-		} else {
-			retry->call(share->server_for<resource::HS_READ>(key.hash(), offset), life, 10);
-		}
-		LOG_WARN("Get error: ",err,", fallback to offset +",offset," node");
+	} else if(!retry_get(retry, key, err, z)) {
+		reply_get_error(key, err, callback, user, z);
+	}
+}
+GATEWAY_CATCH(ResGet, gate::res_get)
 
-	} else {
-		if(err.via.u64 == (uint64_t)rpc::protocol::TRANSPORT_LOST_ERROR ||
-				err.via.u64 == (uint64_t)rpc::protocol::SERVER_ERROR) {
-			net->mod_network.renew_hash_space();   // FIXME
-		}
+
+RPC_REPLY_IMPL(mod_store_t, GetLease, from, res, err, z,
+		rpc::retry<server::mod_store_t::GetLease>* retry,
+		gate::callback_get callback, void* user,
+		get_lease_entry* e)
+try {
+	msgtype::DBKey key(retry->param().dbkey);
+	LOG_TRACE("ResGetLease ",err);
+
+	if(err.is_nil()) {
 		gate::res_get ret;
-		ret.error     = 1;  // ERROR
+		ret.error     = 0;
 		dbkey_remove_prefix(&ret, key);
 		ret.hash      = key.hash();
-		ret.val       = NULL;
-		ret.vallen    = 0;
-		ret.clocktime = 0;
+		if(res.is_nil()) {
+			ret.val       = NULL;
+			ret.vallen    = 0;
+			ret.clocktime = 0;
+		} else {
+			if(res.type != msgpack::type::ARRAY || res.via.array.size != 2) {
+				throw msgpack::type_error();
+			}
+			msgpack::object r = res.via.array.ptr[0];
+			uint32_t lease_msec = res.via.array.ptr[1].as<uint32_t>();
+
+			ClockTime clocktime;
+			if(r.type == msgpack::type::BOOLEAN && r.via.boolean == true) {
+				// cached
+				if(!e->cached_val) { throw msgpack::type_error(); }
+				ret.val       = (char*)e->cached_val->data();
+				ret.vallen    = e->cached_val->size();
+				clocktime     = e->cached_val->clocktime();
+			} else {
+				msgtype::DBValue st = r.as<msgtype::DBValue>();
+				ret.val       = (char*)st.data();
+				ret.vallen    = st.size();
+				clocktime     = st.clocktime();
+				net->mod_cache.update(key, st);
+			}
+			ret.clocktime = clocktime.get();
+
+			if(lease_msec > 0) {
+				net->mod_cache.lease(key, clocktime,
+						e->sent_msec + lease_msec, e->sequence);
+			}
+		}
 		try { (*callback)(user, ret, z); } catch (...) { }
-		TLOGPACK("eg",3,
-				"key",msgtype::raw_ref(key.data(),key.size()),
-				"err",err.via.u64);
-		LOG_ERROR("Get error: ", err);
+
+	} else if(!retry_get(retry, key, err, z)) {
+		reply_get_error(key, err, callback, user, z);
 	}
 }
 GATEWAY_CATCH(ResGet, gate::res_get)
@@ -464,6 +1279,13 @@ try {
 			ret.clocktime = res.as<ClockTime>().get();
 		}
 		//net->mod_cache.update(key, val);  // FIXME raw_data() is invalid
+		if(share->cfg_cache_lease_msec() > 0) {
+			// don't serve the old value under the lease
+			net->mod_cache.invalidate(key);
+		}
+		if(ret.cas_success) {
+			close_get_flights(key);
+		}
 		try { (*callback)(user, ret, z); } catch (...) { }
 
 	} else if( retry->retry_incr(share->cfg_set_retry_num()) ) {
@@ -497,6 +1319,145 @@ try {
 GATEWAY_CATCH(ResSet, gate::res_set)
 
 
+RPC_REPLY_IMPL(mod_store_t, Modify, from, res, err, z,
+		rpc::retry<server::mod_store_t::Modify>* retry,
+		gate::callback_set callback, void* user)
+try {
+	msgtype::DBKey key(retry->param().dbkey);
+	uint32_t headlen = retry->param().headlen;
+	LOG_TRACE("ResModify ",err);
+
+	if(!res.is_nil()) {
+		gate::res_set ret;
+		ret.error     = 0;
+		dbkey_remove_prefix(&ret, key);
+		ret.hash      = key.hash();
+		ret.val       = NULL;
+		ret.vallen    = 0;
+		ret.clocktime = 0;
+		if(res.type == msgpack::type::BOOLEAN) {
+			// not found: false, not a number: true
+			if(res.via.boolean) { ret.error = 2; }
+			ret.cas_success = false;
+		} else {
+			msgtype::DBValue st = res.as<msgtype::DBValue>();
+			if(st.size() < headlen) {
+				throw msgpack::type_error();
+			}
+			ret.val       = st.data() + headlen;
+			ret.vallen    = st.size() - headlen;
+			ret.clocktime = st.clocktime().get();
+			ret.cas_success = true;
+			if(share->cfg_cache_lease_msec() > 0) {
+				net->mod_cache.invalidate(key);
+			}
+			close_get_flights(key);
+		}
+		try { (*callback)(user, ret, z); } catch (...) { }
+
+	} else if( err.is_nil() &&
+			retry->retry_incr(share->cfg_set_retry_num()) ) {
+		// the server replies null only if the modification conflicted
+		// and is not stored. on the other errors it may be stored
+		// already and must not be sent again.
+		share->incr_error_renew_count();
+		SHARED_ZONE(life, z);
+		retry_after<resource::HS_WRITE>(1*framework::DO_AFTER_BY_SECONDS,
+				retry, life, key.hash());
+		LOG_WARN("Modify error: ",err,", retry ",retry->num_retried());
+
+	} else {
+		if(!err.is_nil() && (
+				err.via.u64 == (uint64_t)rpc::protocol::TRANSPORT_LOST_ERROR ||
+				err.via.u64 == (uint64_t)rpc::protocol::SERVER_ERROR)) {
+			net->mod_network.renew_hash_space();   // FIXME
+		}
+		gate::res_set ret;
+		ret.error     = 1;  // ERROR
+		dbkey_remove_prefix(&ret, key);
+		ret.hash      = key.hash();
+		ret.val       = NULL;
+		ret.vallen    = 0;
+		ret.clocktime = 0;
+		ret.cas_success = false;
+		try { (*callback)(user, ret, z); } catch (...) { }
+		LOG_ERROR("Modify error: ",err);
+	}
+}
+GATEWAY_CATCH(ResModify, gate::res_set)
+
+
+RPC_REPLY_IMPL(mod_store_t, SetMulti, from, res, err, z,
+		rpc::retry<server::mod_store_t::SetMulti>* retry,
+		set_multi_entry* entries)
+{
+	const std::vector<msgtype::DBKey>& keys(retry->param().dbkeys);
+	const std::vector<msgtype::DBValue>& vals(retry->param().dbvals);
+	const size_t num = keys.size();
+	LOG_TRACE("ResSetMulti ",err);
+
+	SHARED_ZONE(life, z);
+
+	bool batch_failed = !err.is_nil() ||
+		res.type != msgpack::type::ARRAY || res.via.array.size != num;
+	if(batch_failed) {
+		share->incr_error_renew_count();
+		LOG_DEBUG("SetMulti error: ",err,", fallback to Set");
+	}
+
+	bool renew_required = false;
+
+	for(size_t i=0; i < num; ++i) {
+		const msgtype::DBKey& key(keys[i]);
+		const msgtype::DBValue& val(vals[i]);
+		gate::callback_set callback = entries[i].callback;
+		void* user = entries[i].user;
+
+		try {
+			if(batch_failed ||
+					res.via.array.ptr[i].type != msgpack::type::POSITIVE_INTEGER) {
+				// per-key retry
+				if(!batch_failed &&
+						res.via.array.ptr[i].type == msgpack::type::BOOLEAN) {
+					renew_required = true;
+				}
+				set_single(server::OP_SET, key, val, callback, user, life);
+				continue;
+			}
+
+			// each callback holds the response zone
+			auto_zone kz(new msgpack::zone());
+			kz->allocate<shared_zone>(life);
+
+			gate::res_set ret;
+			ret.error     = 0;
+			dbkey_remove_prefix(&ret, key);
+			ret.hash      = key.hash();
+			ret.val       = val.data();
+			ret.vallen    = val.size();
+			ret.cas_success = true;
+			ret.clocktime = res.via.array.ptr[i].as<ClockTime>().get();
+			if(share->cfg_cache_lease_msec() > 0) {
+				net->mod_cache.invalidate(key);
+			}
+			close_get_flights(key);
+			try { (*callback)(user, ret, kz); } catch (...) { }
+
+		} catch (std::exception& e) {
+			LOG_WARN("ResSetMulti FAILED: ",e.what());
+			submit_set_error(callback, user, life);
+		} catch (...) {
+			LOG_WARN("ResSetMulti FAILED: unknown error");
+			submit_set_error(callback, user, life);
+		}
+	}
+
+	if(renew_required) {
+		share->incr_error_renew_count();
+	}
+}
+
+
 RPC_REPLY_IMPL(mod_store_t, Delete, from, res, err, z,
 		rpc::retry<server::mod_store_t::Delete>* retry,
 		gate::callback_delete callback, void* user)
@@ -511,6 +1472,10 @@ try {
 		dbkey_remove_prefix(&ret, key);
 		ret.hash      = key.hash();
 		ret.deleted   = st;
+		if(share->cfg_cache_lease_msec() > 0) {
+			net->mod_cache.invalidate(key);
+		}
+		close_get_flights(key);
 		try { (*callback)(user, ret, z); } catch (...) { }
 
 	} else if( retry->retry_incr(share->cfg_delete_retry_num()) ) {
@@ -20,6 +20,9 @@
 
 #include "gate/interface.h"
 #include "server/mod_store.h"
+#include <map>
+#include <vector>
+#include <string>
 
 namespace kumo {
 namespace gateway {
@@ -33,24 +36,152 @@ public:
 public:
 	void Get(gate::req_get& req);
 
+	// starts the thread which sends hedged gets when they are due.
+	// the thread sleeps while no get is waiting to be hedged.
+	void start_hedge();
+
+	void GetMulti(gate::req_get_multi& req);
+
 	void Set(gate::req_set& req);
 
+	void SetMulti(gate::req_set_multi& req);
+
 	void Delete(gate::req_delete& req);
 
+private:
+	bool get_cached(const msgtype::DBKey& key,
+			gate::callback_get callback, void* user,
+			shared_zone& life);
+
+	void get_single(const msgtype::DBKey& key,
+			gate::callback_get callback, void* user,
+			shared_zone& life, bool primary_failed = false);
+
+	struct get_lease_entry {
+		msgtype::DBValue* cached_val;  // NULL if not cached
+		uint64_t sequence;   // mod_cache_t::lease_sequence
+		uint64_t sent_msec;  // lease starts before the request is sent
+	};
+
+	void get_lease(const msgtype::DBKey& key,
+			gate::callback_get callback, void* user,
+			shared_zone& life, msgtype::DBValue* cached_val);
+
+	// concurrent gets of the same key share one request
+	struct get_flight;
+	bool join_get_flight(const msgtype::DBKey& key,
+			gate::callback_get* callback, void** user,
+			shared_zone& life);
+	void complete_get_flight(get_flight* f, gate::res_get& res, auto_zone z);
+	static void get_flight_callback(void* user, gate::res_get& res, auto_zone z);
+
+	// called when a write of the key succeeded; later gets don't join
+	// the flights sent before the write
+	void close_get_flights(const msgtype::DBKey& key);
+
+	typedef std::multimap<uint64_t, get_flight*> get_flight_map_t;
+	struct get_flight_stripe {
+		mp::pthread_mutex mutex;
+		get_flight_map_t map;
+	};
+	static const size_t GET_FLIGHT_STRIPES = 16;
+	get_flight_stripe m_get_flights[GET_FLIGHT_STRIPES];
+
+	// a get sent to the replica selected by resource::read_server_for.
+	// it may be hedged: sent to another replica again if it's slow.
+	struct read_state {
+		read_state();
+		volatile int done;
+		volatile int outstanding;
+		volatile int hedged;
+		struct attempt {
+			void* session;
+			address addr;
+			uint64_t sent_usec;
+		};
+		attempt attempts[2];
+	};
+	void send_read(read_state* rs, uint64_t hash,
+			rpc::retry<server::mod_store_t::Get>* retry, shared_zone& life);
+	// latency of a successful reply or an error of the server
+	void record_read(read_state* rs, basic_shared_session& from, bool failed);
+
+	struct hedge_entry {
+		read_state* rs;
+		uint64_t hash;
+		rpc::retry<server::mod_store_t::Get>* retry;
+		shared_zone life;
+	};
+	mp::pthread_mutex m_hedge_mutex;
+	mp::pthread_cond m_hedge_cond;  // signaled when the earliest entry changes
+	typedef std::multimap<uint64_t, hedge_entry> hedge_queue_t;
+	hedge_queue_t m_hedge_queue;
+
+	class hedge_thread;
+	friend class hedge_thread;
+	hedge_thread* m_hedge_thread;
+	bool m_hedge_end;
+
+	void run_hedge();
+	void step_hedge();  // sends hedged gets which are due
+
+	struct get_multi_entry {
+		gate::callback_get callback;
+		void* user;
+	};
+
+	// servers older than GetMulti reply PROTOCOL_ERROR; keys are sent to
+	// the server by Get for GET_MULTI_RETRY_SEC, so that servers can be
+	// upgraded one by one.
+	static const time_t GET_MULTI_RETRY_SEC = 60;
+	// session => time to try again
+	typedef std::map<void*, time_t> get_multi_unsupported_t;
+	mp::pthread_mutex m_get_multi_unsupported_mutex;
+	get_multi_unsupported_t m_get_multi_unsupported;
+	bool get_multi_supported(void* session);
+
+	void set_single(server::set_op_t op,
+			const msgtype::DBKey& key, const msgtype::DBValue& val,
+			gate::callback_set callback, void* user,
+			shared_zone& life);
+
+	struct set_multi_entry {
+		gate::callback_set callback;
+		void* user;
+	};
+
 private:
 	RPC_REPLY_DECL(Get, from, res, err, z,
 			rpc::retry<server::mod_store_t::Get>* retry,
-			gate::callback_get callback, void* user);
+			gate::callback_get callback, void* user,
+			read_state* rs);
 
 	RPC_REPLY_DECL(GetIfModified, from, res, err, z,
 			rpc::retry<server::mod_store_t::GetIfModified>* retry,
 			gate::callback_get callback, void* user,
 			msgtype::DBValue* cached_val);
 
+	RPC_REPLY_DECL(GetLease, from, res, err, z,
+			rpc::retry<server::mod_store_t::GetLease>* retry,
+			gate::callback_get callback, void* user,
+			get_lease_entry* e);
+
+	RPC_REPLY_DECL(GetMulti, from, res, err, z,
+			rpc::retry<server::mod_store_t::GetMulti>* retry,
+			get_multi_entry* entries);
+
 	RPC_REPLY_DECL(Set, from, res, err, z,
 			rpc::retry<server::mod_store_t::Set>* retry,
 			gate::callback_set callback, void* user);
 
+	RPC_REPLY_DECL(Modify, from, res, err, z,
+			rpc::retry<server::mod_store_t::Modify>* retry,
+			gate::callback_set callback, void* user);
+
+	RPC_REPLY_DECL(SetMulti, from, res, err, z,
+			rpc::retry<server::mod_store_t::SetMulti>* retry,
+			set_multi_entry* entries);
+
 	RPC_REPLY_DECL(Delete, from, res, err, z,
 			rpc::retry<server::mod_store_t::Delete>* retry,
 			gate::callback_delete callback, void* user);
@@ -21,8 +21,13 @@
 #include "log/mlogger.h"
 #include "config.h"
 
+// default number of replicas except the primary.
+// the number is recorded in the hash space; see HashSpace::replicas().
 #define NUM_REPLICATION 2
 
+// upper limit of NUM_REPLICATION which is set at runtime
+#define MAX_REPLICATION 4
+
 #ifndef MANAGER_DEFAULT_PORT
 #define MANAGER_DEFAULT_PORT  19700
 #endif
@@ -25,44 +25,166 @@ namespace kumo {
 static const size_t HASHSPACE_VIRTUAL_NODE_NUMBER = 128;
 
 
-HashSpace::HashSpace(ClockTime clocktime) :
+HashSpace::HashSpace(ClockTime clocktime, hash_function func, size_t replicas) :
+	m_search_first(0),
+	m_function(func),
+	m_num_replicas(replicas),
 	m_timestamp(clocktime) {}
 
 HashSpace::~HashSpace() {}
 
 
-/*
-class HashFunction {
-public:
-	HashFunction() { SHA1_Init(&m_ctx); }
-	uint64_t operator() (const char* data, unsigned long datalen)
-	{
-		SHA1_Update(&m_ctx, data, datalen);
-		SHA1_Final(m_buf, &m_ctx);
-		return *(uint64_t*)m_buf;  // FIXME endian
+static inline uint64_t xxh_read64(const unsigned char* p)
+{
+	return  (uint64_t)p[0]        | ((uint64_t)p[1] <<  8) |
+		   ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		   ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		   ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t xxh_read32(const unsigned char* p)
+{
+	return  (uint32_t)p[0]        | ((uint32_t)p[1] <<  8) |
+		   ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc  = xxh_rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// xxHash64 with seed 0
+static uint64_t xxh64(const char* data, unsigned long len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* const end = p + len;
+	uint64_t h;
+
+	if(len >= 32) {
+		const unsigned char* const limit = end - 32;
+		uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = XXH_PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - XXH_PRIME64_1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));    p += 8;
+			v2 = xxh_round(v2, xxh_read64(p));    p += 8;
+			v3 = xxh_round(v3, xxh_read64(p));    p += 8;
+			v4 = xxh_round(v4, xxh_read64(p));    p += 8;
+		} while(p <= limit);
+
+		h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) +
+			xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+		h = xxh_merge_round(h, v1);
+		h = xxh_merge_round(h, v2);
+		h = xxh_merge_round(h, v3);
+		h = xxh_merge_round(h, v4);
+	} else {
+		h = XXH_PRIME64_5;
+	}
+
+	h += (uint64_t)len;
+
+	while(p + 8 <= end) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h  = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if(p + 4 <= end) {
+		h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+		h  = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
 	}
-private:
-	SHA_CTX m_ctx;
-	unsigned char m_buf[SHA_DIGEST_LENGTH];
-};
-static HashFunction HashFunction_;
-*/
+	while(p < end) {
+		h ^= (uint64_t)(*p) * XXH_PRIME64_5;
+		h  = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+		++p;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
 
-uint64_t HashSpace::hash(const char* data, unsigned long len)
+uint64_t HashSpace::hash(const char* data, unsigned long len, hash_function func)
 {
-	// FIXME thread-safety with thread local storage
-	//return HashFunction_(data, len);
+	if(func == HASH_XXH64) {
+		return xxh64(data, len);
+	}
 	unsigned char buf[SHA_DIGEST_LENGTH];
 	SHA1((unsigned const char*)data, len, buf);
 	return *(uint64_t*)buf;  // FIXME endian?
 }
 
+const char* HashSpace::function_name(hash_function func)
+{
+	switch(func) {
+	case HASH_SHA1:
+		return "sha1";
+	case HASH_XXH64:
+		return "xxh64";
+	default:
+		return "unknown";
+	}
+}
+
+bool HashSpace::parse_function(const std::string& name, hash_function* result)
+{
+	if(name == "sha1") {
+		*result = HASH_SHA1;
+		return true;
+	} else if(name == "xxh64") {
+		*result = HASH_XXH64;
+		return true;
+	}
+	return false;
+}
+
+void HashSpace::set_function(hash_function func)
+{
+	if(m_function != func) {
+		m_function = func;
+		rehash();
+	}
+}
+
+void HashSpace::set_replicas(size_t replicas)
+{
+	if(m_num_replicas != replicas) {
+		m_num_replicas = replicas;
+		build_index();
+	}
+}
+
 void HashSpace::add_server(ClockTime clocktime, const address& addr)
 {
 	m_timestamp = clocktime;
 	m_nodes.push_back( node(addr,true) );
 	add_virtual_nodes(m_nodes.back());
 	std::stable_sort(m_hashspace.begin(), m_hashspace.end());
+	build_index();
 }
 
 bool HashSpace::remove_server(ClockTime clocktime, const address& addr)
@@ -126,11 +248,11 @@ bool HashSpace::remove_fault_servers(ClockTime clocktime)
 
 void HashSpace::add_virtual_nodes(const node& n)
 {
-	uint64_t x = HashSpace::hash(n.addr().dump(), n.addr().dump_size());
+	uint64_t x = HashSpace::hash(n.addr().dump(), n.addr().dump_size(), m_function);
 	m_hashspace.push_back( virtual_node(x, n) );
 	for(size_t i=1; i < HASHSPACE_VIRTUAL_NODE_NUMBER; ++i) {
 		// FIXME use another hash function?
-		x = HashSpace::hash((const char*)&x, sizeof(uint64_t));
+		x = HashSpace::hash((const char*)&x, sizeof(uint64_t), m_function);
 		m_hashspace.push_back( virtual_node(x, n) );
 	}
 }
@@ -148,6 +270,68 @@ void HashSpace::rehash()
 			x != x_end; ++x) {
 		LOG_TRACE("virtual node dump: ",std::hex,std::setw(16),std::setfill('0'),x->hash(),std::dec,":",x->real());
 	}
+
+	build_index();
+}
+
+static size_t build_eytzinger(const std::vector<uint64_t>& sorted,
+		std::vector<uint64_t>& search, std::vector<uint32_t>& pos,
+		size_t i, size_t k)
+{
+	if(k < search.size()) {
+		i = build_eytzinger(sorted, search, pos, i, 2*k);
+		search[k] = sorted[i];
+		pos[k] = i;
+		++i;
+		i = build_eytzinger(sorted, search, pos, i, 2*k+1);
+	}
+	return i;
+}
+
+void HashSpace::build_index()
+{
+	size_t n = m_hashspace.size();
+
+	std::vector<uint64_t> sorted;
+	sorted.reserve(n);
+	for(hashspace_t::const_iterator x(m_hashspace.begin()), x_end(m_hashspace.end());
+			x != x_end; ++x) {
+		sorted.push_back(x->hash());
+	}
+
+	std::vector<uint32_t> pos(n+1);
+	m_search.assign(n+1, 0);
+	build_eytzinger(sorted, m_search, pos, 0, 1);
+
+	m_replicas.assign((n+1)*m_num_replicas, 0);
+	m_replicas_num.assign(n+1, 0);
+	m_search_first = 0;
+
+	for(size_t k=1; k <= n; ++k) {
+		size_t origin = pos[k];
+		if(origin == 0) {
+			m_search_first = k;
+		}
+
+		// same order as walking the ring from the virtual node
+		uint32_t* r = &m_replicas[k*m_num_replicas];
+		size_t num = 0;
+		for(size_t i=0; i < n && num < m_num_replicas; ++i) {
+			size_t x = (origin + i) % n;
+			const node& real = m_hashspace[x].real();
+			bool dup = false;
+			for(size_t j=0; j < num; ++j) {
+				if(m_hashspace[r[j]].real() == real) {
+					dup = true;
+					break;
+				}
+			}
+			if(!dup) {
+				r[num++] = x;
+			}
+		}
+		m_replicas_num[k] = num;
+	}
 }
 
 
@@ -20,7 +20,9 @@
 
 #include "rpc/address.h"
 #include "logic/clock.h"
+#include "logic/global.h"
 #include <vector>
+#include <string>
 #include <algorithm>
 #include <ostream>
 
@@ -34,7 +36,16 @@ class HashSpace {
 public:
 	class Seed;
 
-	HashSpace(ClockTime clocktime = ClockTime(0,0));
+	// recorded in the Seed. HASH_SHA1 keeps compatibility with
+	// clusters created by older releases.
+	enum hash_function {
+		HASH_SHA1  = 0,
+		HASH_XXH64 = 1,
+	};
+
+	HashSpace(ClockTime clocktime = ClockTime(0,0),
+			hash_function func = HASH_SHA1,
+			size_t replicas = NUM_REPLICATION+1);
 	HashSpace(const Seed& seed);
 	~HashSpace();
 
@@ -79,6 +90,17 @@ private:
 	typedef std::vector<node> nodes_t;
 	nodes_t m_nodes;
 
+	// search index built by build_index().
+	// m_search is the hashes of virtual nodes in eytzinger layout (1-origin)
+	// and m_replicas has m_num_replicas distinct nodes for each of them.
+	std::vector<uint64_t> m_search;
+	std::vector<uint32_t> m_replicas;
+	std::vector<uint8_t> m_replicas_num;
+	size_t m_search_first;
+
+	hash_function m_function;
+	size_t m_num_replicas;
+
 	ClockTime m_timestamp;
 
 public:
@@ -86,9 +108,18 @@ public:
 
 	iterator find(uint64_t h) const;
 
+	static const size_t MAX_REPLICAS = MAX_REPLICATION+1;
+
+	// distinct nodes assigned to the hash. the first one is the primary.
+	// returns number of the nodes, which is replicas() at most.
+	size_t find_replicas(uint64_t h, const node* result[MAX_REPLICAS]) const;
+
 	size_t active_node_count() const;
 	void get_active_nodes(std::vector<address>& result) const;
 
+	// assignment of hashes doesn't change in (b[i-1], b[i]]
+	void get_boundaries(std::vector<uint64_t>& result) const;
+
 public:
 	void add_server(ClockTime clocktime, const address& addr);
 	bool remove_server(ClockTime clocktime, const address& addr);
@@ -101,9 +132,30 @@ public:
 	ClockTime clocktime() const
 		{ return m_timestamp; }
 
-	// compare nodes (clocktime is ignored)
+	hash_function function() const
+		{ return m_function; }
+
+	// rebuilds virtual nodes if the function is changed
+	void set_function(hash_function func);
+
+	// replication factor; number of nodes a hash is assigned to
+	size_t replicas() const
+		{ return m_num_replicas; }
+
+	// 1 <= replicas <= MAX_REPLICAS
+	void set_replicas(size_t replicas);
+
+	static bool is_valid_replicas(size_t replicas)
+		{ return 1 <= replicas && replicas <= MAX_REPLICAS; }
+
+	// compare nodes, hash function and replication factor
+	// (clocktime is ignored)
 	bool operator== (const HashSpace& other) const
-		{ return m_nodes == other.m_nodes; }
+	{
+		return m_function == other.m_function &&
+			m_num_replicas == other.m_num_replicas &&
+			m_nodes == other.m_nodes;
+	}
 
 	void nodes_diff(const HashSpace& other, std::vector<address>& result) const;
 
@@ -114,14 +166,20 @@ public:
 private:
 	void add_virtual_nodes(const node& n);
 	void rehash();
+	void build_index();
 
 public:
-	static uint64_t hash(const char* data, unsigned long len);
+	static uint64_t hash(const char* data, unsigned long len,
+			hash_function func = HASH_SHA1);
+
+	static const char* function_name(hash_function func);
+	static bool parse_function(const std::string& name, hash_function* result);
 
 public:
 	friend class Seed;
 
-	// compare nodes (clocktime is ignored)
+	// compare nodes, hash function and replication factor
+	// (clocktime is ignored)
 	bool operator== (const Seed& other) const;
 };
 
@@ -210,26 +268,90 @@ inline msgpack::packer<Stream>& operator<< (msgpack::packer<Stream>& o, const Ha
 }
 
 
-class HashSpace::Seed : public msgpack::define<
-		msgpack::type::tuple<nodes_t, ClockTime> > {
+// serialized as [nodes, clocktime] if the hash function is HASH_SHA1
+// and the replication factor is the default so that nodes of older
+// releases can read it, otherwise [nodes, clocktime, function] or
+// [nodes, clocktime, function, replicas].
+class HashSpace::Seed {
 public:
-	Seed() { }
-	Seed(HashSpace& hs) :
-		define_type(msgpack_type( hs.m_nodes, hs.m_timestamp )) {}
-	const nodes_t& nodes()     const { return get<0>(); }
-	ClockTime      clocktime() const { return get<1>(); }
-	bool           empty()     const;
+	Seed() : m_function(HASH_SHA1), m_replicas(NUM_REPLICATION+1) { }
+	Seed(const HashSpace& hs) :
+		m_nodes(hs.m_nodes), m_clocktime(hs.m_timestamp),
+		m_function(hs.m_function), m_replicas(hs.m_num_replicas) { }
+	const nodes_t& nodes()       const { return m_nodes; }
+	ClockTime      clocktime()   const { return m_clocktime; }
+	hash_function  function()    const { return m_function; }
+	size_t         replicas()    const { return m_replicas; }
+	bool           empty()       const;
+
+	template <typename Packer>
+	void msgpack_pack(Packer& pk) const
+	{
+		if(m_replicas != NUM_REPLICATION+1) {
+			pk.pack_array(4);
+		} else if(m_function != HASH_SHA1) {
+			pk.pack_array(3);
+		} else {
+			pk.pack_array(2);
+		}
+		pk.pack(m_nodes);
+		pk.pack(m_clocktime);
+		if(m_function != HASH_SHA1 || m_replicas != NUM_REPLICATION+1) {
+			pk.pack((uint8_t)m_function);
+		}
+		if(m_replicas != NUM_REPLICATION+1) {
+			pk.pack((uint8_t)m_replicas);
+		}
+	}
+
+	void msgpack_unpack(msgpack::object o)
+	{
+		using namespace msgpack;
+		if(o.type != type::ARRAY || o.via.array.size < 2) {
+			throw type_error();
+		}
+		o.via.array.ptr[0].convert(&m_nodes);
+		o.via.array.ptr[1].convert(&m_clocktime);
+		m_function = HASH_SHA1;
+		if(o.via.array.size >= 3) {
+			uint8_t func;
+			o.via.array.ptr[2].convert(&func);
+			if(func != HASH_SHA1 && func != HASH_XXH64) {
+				throw type_error();
+			}
+			m_function = (hash_function)func;
+		}
+		m_replicas = NUM_REPLICATION+1;
+		if(o.via.array.size >= 4) {
+			uint8_t replicas;
+			o.via.array.ptr[3].convert(&replicas);
+			if(!HashSpace::is_valid_replicas(replicas)) {
+				throw type_error();
+			}
+			m_replicas = replicas;
+		}
+	}
+
+private:
+	nodes_t m_nodes;
+	ClockTime m_clocktime;
+	hash_function m_function;
+	size_t m_replicas;
 };
 
 inline HashSpace::HashSpace(const Seed& seed) :
-	m_nodes(seed.nodes()), m_timestamp(seed.clocktime())
+	m_nodes(seed.nodes()), m_search_first(0),
+	m_function(seed.function()), m_num_replicas(seed.replicas()),
+	m_timestamp(seed.clocktime())
 {
 	rehash();
 }
 
 inline bool HashSpace::operator== (const Seed& other) const
 {
-	return m_nodes == other.nodes();
+	return m_function == other.function() &&
+		m_num_replicas == other.replicas() &&
+		m_nodes == other.nodes();
 }
 
 
@@ -245,6 +367,31 @@ inline HashSpace::iterator HashSpace::find(uint64_t h) const
 	}
 }
 
+inline size_t HashSpace::find_replicas(uint64_t h, const node* result[MAX_REPLICAS]) const
+{
+	size_t n = m_replicas_num.size();
+	if(n <= 1) {
+		return 0;
+	}
+
+	// lower_bound on the eytzinger layout
+	size_t k = 1;
+	while(k < n) {
+		k = 2*k + (m_search[k] < h);
+	}
+	k >>= __builtin_ffsl(~(long)k);
+	if(k == 0) {
+		k = m_search_first;
+	}
+
+	const uint32_t* r = &m_replicas[k*m_num_replicas];
+	size_t num = m_replicas_num[k];
+	for(size_t i=0; i < num; ++i) {
+		result[i] = &m_hashspace[r[i]].real();
+	}
+	return num;
+}
+
 inline bool HashSpace::empty() const
 {
 	for(nodes_t::const_iterator it(m_nodes.begin()), it_end(m_nodes.end());
@@ -256,7 +403,7 @@ inline bool HashSpace::empty() const
 
 inline bool HashSpace::Seed::empty() const
 {
-	for(nodes_t::const_iterator it(get<0>().begin()), it_end(get<0>().end());
+	for(nodes_t::const_iterator it(m_nodes.begin()), it_end(m_nodes.end());
 			it != it_end; ++it) {
 		if(it->is_active()) { return false; }
 	}
@@ -281,6 +428,14 @@ inline void HashSpace::get_active_nodes(std::vector<address>& result) const
 	}
 }
 
+inline void HashSpace::get_boundaries(std::vector<uint64_t>& result) const
+{
+	for(hashspace_t::const_iterator it(m_hashspace.begin()), it_end(m_hashspace.end());
+			it != it_end; ++it) {
+		result.push_back(it->hash());
+	}
+}
+
 inline void HashSpace::nodes_diff(const HashSpace& other, std::vector<address>& result) const
 {
 	for(nodes_t::const_iterator it(m_nodes.begin()), it_end(m_nodes.end());
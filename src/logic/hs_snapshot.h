@@ -0,0 +1,76 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef LOGIC_HS_SNAPSHOT_H__
+#define LOGIC_HS_SNAPSHOT_H__
+
+#include "logic/hash.h"
+#include <mp/pthread.h>
+#include <mp/memory.h>
+
+namespace kumo {
+
+
+// HashSpace published as immutable reference-counted snapshots.
+//
+// Readers take a reference to the current snapshot; the lock is held
+// only while the reference count is incremented. Writers serialize on
+// mutex() and publish a new snapshot; the replaced snapshot is freed
+// when the last reader releases its reference.
+class hs_snapshot {
+public:
+	typedef mp::shared_ptr<const HashSpace> ref;
+
+	hs_snapshot() :
+		m_current(new HashSpace()) { }
+
+	explicit hs_snapshot(const HashSpace& hs) :
+		m_current(new HashSpace(hs)) { }
+
+	ref get() const
+	{
+		mp::pthread_scoped_lock reflk(m_ref_mutex);
+		return m_current;
+	}
+
+	mp::pthread_mutex& mutex() { return m_mutex; }
+
+	// mutex() must be locked
+	void publish(const HashSpace& hs, const mp::pthread_scoped_lock& hslk)
+	{
+		ref next(new HashSpace(hs));
+		{
+			mp::pthread_scoped_lock reflk(m_ref_mutex);
+			m_current.swap(next);
+		}
+		// the replaced snapshot is released here, out of m_ref_mutex
+	}
+
+private:
+	ref m_current;
+	mutable mp::pthread_mutex m_ref_mutex;
+
+	mp::pthread_mutex m_mutex;
+
+private:
+	hs_snapshot(const hs_snapshot&);
+};
+
+
+}  // namespace kumo
+
+#endif /* logic/hs_snapshot.h */
@@ -85,6 +85,9 @@ private:
 	HashSpace m_rhs;
 	HashSpace m_whs;
 
+	const HashSpace::hash_function m_cfg_hash_function;
+	const size_t m_cfg_replicas;
+
 	// connected but not joined servers
 	mp::pthread_mutex m_new_servers_mutex;
 	new_servers_t m_new_servers;
@@ -107,6 +110,9 @@ public:
 	RESOURCE_ACCESSOR(bool, cfg_auto_replace);
 	RESOURCE_CONST_ACCESSOR(short, cfg_replace_delay_seconds);
 
+	RESOURCE_CONST_ACCESSOR(HashSpace::hash_function, cfg_hash_function);
+	RESOURCE_CONST_ACCESSOR(size_t, cfg_replicas);
+
 private:
 	resource();
 	resource(const resource&);
@@ -48,6 +48,10 @@ void framework::run(const Config& cfg)
 
 template <typename Config>
 resource::resource(const Config& cfg) :
+	m_rhs(ClockTime(0,0), cfg.hash_function, cfg.replicas),
+	m_whs(ClockTime(0,0), cfg.hash_function, cfg.replicas),
+	m_cfg_hash_function(cfg.hash_function),
+	m_cfg_replicas(cfg.replicas),
 	m_partner(cfg.partner),
 	m_cfg_auto_replace(cfg.auto_replace),
 	m_cfg_replace_delay_seconds(cfg.replace_delay_seconds)
@@ -26,6 +26,11 @@ struct arg_t : cluster_args {
 
 	bool auto_replace;
 
+	std::string hash_function_name;
+	HashSpace::hash_function hash_function;  // convert
+
+	unsigned short replicas;
+
 	bool partner_set;
 	struct sockaddr_in partner_in;
 	rpc::address partner;  // convert
@@ -34,10 +39,17 @@ struct arg_t : cluster_args {
 	{
 		cluster_args::convert();
 		partner = rpc::address(partner_in);
+		if(!HashSpace::parse_function(hash_function_name, &hash_function)) {
+			throw std::runtime_error("unknown hash function: "+hash_function_name);
+		}
+		if(!HashSpace::is_valid_replicas(replicas)) {
+			throw std::runtime_error("invalid replication factor");
+		}
 	}
 
 	arg_t(int argc, char** argv) :
-		replace_delay_seconds(4)
+		replace_delay_seconds(4),
+		replicas(NUM_REPLICATION+1)
 	{
 		using namespace kazuhiki;
 		set_basic_args();
@@ -49,6 +61,10 @@ struct arg_t : cluster_args {
 				type::boolean(&auto_replace));
 		on("-Rs", "--replace-delay",
 				type::numeric(&replace_delay_seconds, replace_delay_seconds));
+		on("-hf", "--hash-function",
+				type::string(&hash_function_name, "sha1"));
+		on("-rf", "--replication-factor",
+				type::numeric(&replicas, replicas));
 		parse(argc, argv);
 	}
 
@@ -65,6 +81,10 @@ struct arg_t : cluster_args {
 			"--auto-replace   enable auto replacing\n"
 		"  -Rs <number="<<replace_delay_seconds  <<">            "
 			"--replace-delay  delay time of auto replacing in sec.\n"
+		"  -hf <sha1|xxh64=sha1>     "
+			"--hash-function  hash function of new hash spaces\n"
+		"  -rf <number="<<replicas<<">            "
+			"--replication-factor  number of replicas of new hash spaces\n"
 		;
 		cluster_args::show_usage();
 	}
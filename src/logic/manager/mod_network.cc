@@ -175,6 +175,17 @@ RPC_IMPL(mod_network_t, HashSpaceSync, req, z, response)
 
 	if(!req.param().wseed.empty() && (share->whs().empty() ||
 			share->whs().clocktime() <= ClockTime(req.param().wseed.clocktime()))) {
+		if(req.param().wseed.function() != share->cfg_hash_function()) {
+			LOG_WARN("partner uses hash function ",
+					HashSpace::function_name(req.param().wseed.function()),
+					" instead of ",
+					HashSpace::function_name(share->cfg_hash_function()));
+		}
+		if(req.param().wseed.replicas() != share->cfg_replicas()) {
+			LOG_WARN("partner uses replication factor ",
+					req.param().wseed.replicas(),
+					" instead of ",share->cfg_replicas());
+		}
 		share->whs() = HashSpace(req.param().wseed);
 		ret = true;
 	}
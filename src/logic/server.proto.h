@@ -18,9 +18,16 @@
 #include "server/proto.h"
 #include "logic/msgtype.h"
 #include "logic/cluster_logic.h"
+#include "server/lease_table.h"
+#include "server/hint_log.h"
+#include "server/digest_table.h"
+#include "server/change_log.h"
 #include <msgpack.hpp>
 #include <string>
+#include <vector>
+#include <map>
 #include <stdint.h>
+#include <time.h>
 
 namespace kumo {
 namespace server {
@@ -30,6 +37,7 @@ namespace server {
 @message mod_network_t::HashSpaceSync       =   2
 @message mod_replace_t::ReplaceCopyStart    =   8
 @message mod_replace_t::ReplaceDeleteStart  =   9
+@message mod_replace_t::ReplaceDigest       =  10
 @message mod_replace_stream_t::ReplaceOffer =  16
 @message mod_store_t::ReplicateSet          =  32
 @message mod_store_t::ReplicateDelete       =  33
@@ -37,6 +45,11 @@ namespace server {
 @message mod_store_t::Set                   =  35
 @message mod_store_t::Delete                =  36
 @message mod_store_t::GetIfModified         =  37
+@message mod_store_t::GetMulti              =  38
+@message mod_store_t::GetLease              =  39
+@message mod_store_t::SetMulti              =  40
+@message mod_store_t::Modify                =  41
+@message mod_store_t::ReplicateBatch        =  42
 @message mod_control_t::CreateBackup        =  96
 @message mod_control_t::GetStatus           =  97
 @message mod_control_t::SetConfig           =  98
@@ -75,6 +88,9 @@ static const set_op_t OP_SET_ASYNC = 0x01;
 static const set_op_t OP_CAS       = 0x02;
 static const set_op_t OP_APPEND    = 0x04;
 static const set_op_t OP_PREPEND   = 0x08;
+static const set_op_t OP_INCR      = 0x10;
+static const set_op_t OP_DECR      = 0x20;
+static const set_op_t OP_ADD       = 0x40;  // stored if the key is not found
 
 struct store_flags;
 typedef msgtype::flags<store_flags, 0>    store_flags_none;
@@ -108,18 +124,75 @@ struct replicate_flags : msgtype::flags_base {
 		// not found: nil
 	};
 
+	message GetLease {
+		msgtype::DBKey dbkey;
+		ClockTime if_time;
+		uint32_t lease_msec;
+		// success:      [value:DBValue, lease_msec]
+		// not-modified: [true, lease_msec]
+		// not found:    nil
+		// lease_msec is 0 if the lease is not granted.
+		// the lease is revoked by gateway::mod_network_t::CacheInvalidate
+	};
+
+	message GetMulti {
+		std::vector<msgtype::DBKey> dbkeys;
+		// success: array of results in the same order as dbkeys
+		//   found:        value:DBValue
+		//   not found:    nil
+		//   not assigned: false  // retry it on another node
+	};
+
 	message Set {
 		set_op_t operation;
 		msgtype::DBKey dbkey;
 		msgtype::DBValue dbval;
+		uint8_t write_quorum = 0;
+		// write_quorum: number of copies stored before replying
+		//               including the coordinator (0: server's default)
 		// success: clocktime:ClockTime
 		// failed:  nil
 		// cas is tried and failed: false
+		// add is tried and the key is found: false
+	};
+
+	message SetMulti {
+		std::vector<msgtype::DBKey> dbkeys;
+		std::vector<msgtype::DBValue> dbvals;
+		uint8_t write_quorum = 0;
+		// same as Set with OP_SET for each pair of dbkeys and dbvals.
+		// write_quorum: same as Set; applied to each entry
+		// success: array of results in the same order as dbkeys
+		//   stored:       clocktime:ClockTime
+		//   failed:       nil
+		//   not assigned: false  // retry it on another node
+	};
+
+	message Modify {
+		set_op_t operation;
+		msgtype::DBKey dbkey;
+		msgtype::DBValue dbval;
+		uint32_t headlen;
+		uint64_t amount;
+		uint8_t write_quorum = 0;
+		// dbval is [head][operand]. head (headlen bytes; expiration
+		// time and flags of memcached gates) of the stored data is kept.
+		// OP_APPEND, OP_PREPEND: operand is added to the stored data.
+		// OP_INCR, OP_DECR: the stored decimal number is increased or
+		//   decreased by amount. dbval is stored if the key is not found
+		//   and operand (initial number) is not empty.
+		// write_quorum: same as Set
+		// success:    value:DBValue  // stored value
+		// not found:  false
+		// not number: true
+		// failed:     nil
 	};
 
 	message Delete {
 		store_flags flags;
 		msgtype::DBKey dbkey;
+		uint8_t write_quorum = 0;
+		// write_quorum: same as Set
 		// success: true
 		// not foud: false
 		// failed: nil
@@ -143,23 +216,228 @@ struct replicate_flags : msgtype::flags_base {
 		// ignored: false
 	};
 
+	message ReplicateBatch {
+		Clock adjust_clock;
+		std::vector<ReplicateSet> sets;
+		std::vector<ReplicateDelete> deletes;
+		// ReplicateSet and ReplicateDelete to the same node
+		// success: array of results; sets first, then deletes
+		//   same as ReplicateSet or ReplicateDelete
+		//   not assigned:  nil
+		//   storage error: rpc::protocol::SERVER_ERROR
+	};
+
+public:
+	mod_store_t();
+	~mod_store_t();
+
+	// called periodically by the timer thread
+	void sweep_expired();
+	void purge_garbage();
+	void replay_hints();
+
+	// starts the thread which flushes batched replication.
+	// the thread sleeps while no replication is queued.
+	void start_replicate_batch();
+
+	void init_hints(const std::string& path);
+
 private:
-	static void check_replicator_assign(HashSpace& hs, uint64_t h);
-	static void check_coordinator_assign(HashSpace& hs, uint64_t h);
+	static bool test_replicator_assign(const HashSpace& hs, uint64_t h);
+	static void check_replicator_assign(const HashSpace& hs, uint64_t h);
+	static void check_coordinator_assign(const HashSpace& hs, uint64_t h);
 
 	static void calc_replicators(uint64_t h,
 			shared_node* rrepto, unsigned int* rrep_num,
 			shared_node* wrepto, unsigned int* wrep_num);
 
+	// Set, SetMulti, Modify and Delete reply when W copies are stored;
+	// remaining replications continue after the reply.
+	struct write_quorum {
+		volatile unsigned int acks;    // replies the result when it becomes 0
+		volatile unsigned int spares;  // failures tolerated before replying nil
+		// returns true if the caller should reply the result
+		bool ack();
+		// returns true if the caller should reply nil
+		bool fail();
+	};
+	static write_quorum* new_write_quorum(shared_zone& life,
+			uint8_t requested, unsigned int replicas);
+
 	RPC_REPLY_DECL(ReplicateSet, from, res, err, z,
 			rpc::retry<ReplicateSet>* retry,
-			volatile unsigned int* copy_required,
+			write_quorum* quorum,
 			rpc::weak_responder response, ClockTime clocktime);
 
 	RPC_REPLY_DECL(ReplicateDelete, from, res, err, z,
 			rpc::retry<ReplicateDelete>* retry,
-			volatile unsigned int* copy_required,
+			write_quorum* quorum,
 			rpc::weak_responder response, bool deleted);
+
+	// SetMulti replies when the write quorum of all entries is satisfied
+	struct set_multi_state {
+		set_multi_state(rpc::weak_responder r) : response(r) { }
+		volatile unsigned int remain;
+		uint8_t write_quorum;
+		size_t num;
+		msgpack::object* results;
+		rpc::weak_responder response;
+	};
+	void set_multi_entry(const msgtype::DBKey& key, msgtype::DBValue val,
+			set_multi_state* st, size_t index, shared_zone& life);
+	static void finish_set_multi(set_multi_state* st, shared_zone& life);
+
+	RPC_REPLY_DECL(ReplicateModify, from, res, err, z,
+			rpc::retry<ReplicateSet>* retry,
+			write_quorum* quorum,
+			rpc::weak_responder response, msgtype::raw_ref* stored);
+
+	RPC_REPLY_DECL(ReplicateSetMulti, from, res, err, z,
+			rpc::retry<ReplicateSet>* retry,
+			write_quorum* quorum,
+			set_multi_state* st, size_t index);
+
+	// error reply of ReplicateSet, ReplicateModify and ReplicateSetMulti.
+	// the replication is retried, or handed off and logged if it failed.
+	enum replicate_error_t {
+		REPLICATE_RETRIED,
+		REPLICATE_FAILED,
+		REPLICATE_IGNORED,  // rhs replication; treated as succeeded
+	};
+	replicate_error_t replicate_set_error(basic_shared_session& from,
+			rpc::msgobj err, auto_zone& z, rpc::retry<ReplicateSet>* retry);
+
+public:
+	// notifies gateways which hold a lease on the updated key.
+	// mod_replace_stream_t calls it for the records it stores.
+	void revoke_leases(const msgtype::DBKey& key);
+
+private:
+	RPC_REPLY_DECL(CacheInvalidate, from, res, err, z);
+
+	enum get_result_t { GET_FOUND, GET_NOT_MODIFIED, GET_NOT_FOUND };
+	static get_result_t get_if_modified(const msgtype::DBKey& key,
+			ClockTime if_time, msgtype::raw_ref* result, msgpack::zone* z);
+
+	lease_table m_leases;
+
+private:
+	// replications which failed are handed off to the hint log
+	// instead of being retried, and replayed when the node comes back.
+	bool hand_off(basic_shared_session& from, const ReplicateSet& param);
+	bool hand_off(basic_shared_session& from, const ReplicateDelete& param);
+	bool hand_off_enabled() const { return m_hints.is_open(); }
+
+	// types: hint_log::SET or DELETE of each hint in the batch
+	RPC_REPLY_DECL(ReplayHints, from, res, err, z,
+			address to, size_t num, const uint8_t* types,
+			ReplicateBatch* param);
+
+	static const size_t HINT_REPLAY_MAX = 256;
+	void replay_hint_batch(const hint_log::batch& b);
+
+	// hints to nodes which don't support ReplicateBatch are sent one by
+	// one; the batch is finished when all of them are replied.
+	struct hint_replay {
+		hint_replay(const address& t, size_t n) :
+			to(t), num(n), remain(n), lost(false) { }
+		mp::pthread_mutex mutex;
+		address to;
+		size_t num;
+		size_t remain;
+		bool lost;  // the node is still down
+		std::vector<size_t> failed;
+	};
+
+	void replay_hints_one_by_one(const address& to, size_t num,
+			const uint8_t* types, ReplicateBatch* param, shared_zone& life);
+	RPC_REPLY_DECL(ReplayHint, from, res, err, z,
+			hint_replay* r, size_t index);
+	void finish_replay_hint(hint_replay* r, size_t index, rpc::msgobj err);
+
+	hint_log m_hints;
+
+private:
+	// received ReplicateSet requests are queued and applied in batches
+	// by Storage::updatev if the storage supports batched updates
+	struct replicate_set_entry {
+		replicate_set_entry(msgtype::DBKey k, msgtype::DBValue v,
+				rpc::weak_responder r, msgpack::zone* z) :
+			key(k), val(v), response(r), life(z) { }
+		msgtype::DBKey key;
+		msgtype::DBValue val;
+		rpc::weak_responder response;
+		msgpack::zone* life;  // life of this entry
+	};
+	typedef std::vector<replicate_set_entry*> replicate_set_queue_t;
+
+	void flush_replicate_set();
+	void apply_replicate_set(replicate_set_entry** entries, uint16_t num);
+
+	mp::pthread_mutex m_replicate_set_mutex;
+	replicate_set_queue_t m_replicate_set_queue;
+
+private:
+	// ReplicateSet and ReplicateDelete to the same node are queued and
+	// sent in one ReplicateBatch when the queue becomes full or by the
+	// flush thread. replies are passed to the callback of each entry,
+	// which retries it with ReplicateSet or ReplicateDelete.
+	// servers older than ReplicateBatch reply PROTOCOL_ERROR; entries are
+	// sent again one by one and the node is replicated without batching
+	// for REPLICATE_BATCH_RETRY_SEC, so that servers can be upgraded one
+	// by one.
+	void replicate(rpc::retry<ReplicateSet>* retry,
+			shared_node& node, shared_zone& life);
+	void replicate(rpc::retry<ReplicateDelete>* retry,
+			shared_node& node, shared_zone& life);
+
+	struct replicate_pending {
+		replicate_pending(const rpc::callback_t& c, shared_zone& l) :
+			callback(c), life(l) { }
+		rpc::callback_t callback;
+		shared_zone life;
+	};
+
+	struct replicate_batch {
+		shared_zone life;  // holds this batch until it's sent
+		shared_node node;
+		ReplicateBatch param;
+		std::vector<replicate_pending> set_pending;
+		std::vector<replicate_pending> delete_pending;
+		size_t size;
+	};
+	typedef std::map<address, replicate_batch*> replicate_batch_map_t;
+
+	replicate_batch* replicate_batch_for(shared_node& node, REQUIRE_RBLK);
+	replicate_batch* replicate_batch_add(replicate_batch* b, size_t size, REQUIRE_RBLK);
+	void send_replicate_batch(replicate_batch* b);
+
+	RPC_REPLY_DECL(ReplicateBatch, from, res, err, z,
+			replicate_batch* b);
+
+	// flushed without waiting for the timer if it's larger
+	static const size_t REPLICATE_BATCH_SIZE_MAX = 512*1024;
+
+	mp::pthread_mutex m_replicate_batch_mutex;
+	replicate_batch_map_t m_replicate_batches;
+
+	// nodes which don't support ReplicateBatch: address => time to try again
+	static const time_t REPLICATE_BATCH_RETRY_SEC = 60;
+	typedef std::map<address, time_t> replicate_batch_unsupported_t;
+	replicate_batch_unsupported_t m_replicate_batch_unsupported;
+	bool replicate_batch_supported(const address& addr, REQUIRE_RBLK);
+	void replicate_one_by_one(replicate_batch* b);
+
+	mp::pthread_cond m_replicate_batch_cond;  // signaled when a batch is queued
+	struct timespec m_replicate_batch_due;    // flush time of the queued batches
+
+	class replicate_batch_thread;
+	friend class replicate_batch_thread;
+	replicate_batch_thread* m_replicate_batch_thread;
+	bool m_replicate_batch_end;
+
+	void run_replicate_batch();
+	void flush_replicate_batch();
 @end
 
 
@@ -178,10 +456,28 @@ private:
 		// accepted: true
 	};
 
+	message ReplaceDigest +cluster {
+		ClockTime hs_clocktime;
+		std::vector<uint64_t> ranges;   // begin and end of each range
+		std::vector<uint64_t> digests;  // digest of each range
+		// success: begin and end of the ranges which differ
+		// hash space is not same or scanned recently: nil
+	};
+
 public:
 	mod_replace_t();
 	~mod_replace_t();
 
+	// called periodically by the timer thread
+	void anti_entropy();
+
+	// updates are kept in the change log after this call
+	void init_change_log(size_t limit);
+	change_log& changes() { return m_changes; }
+
+	// fault servers in the hash space are marked as down
+	void mark_fault_servers(const HashSpace::Seed& seed);
+
 private:
 	static bool test_replicator_assign(const HashSpace& hs, uint64_t h, const address& target);
 
@@ -193,13 +489,55 @@ private:
 	void replace_copy(const address& manager_addr, HashSpace& hs, shared_zone life);
 	void full_replace_copy(const address& manager_addr, HashSpace& hs, shared_zone life);
 
+	// servers which come back from fault are sent the updates after
+	// they went down instead of all records of the hash ranges.
+	// catchup_nodes is set to the servers which caught up.
+	void catch_up(const HashSpace& srchs, const HashSpace& dsths,
+			const addrvec_t& fault_nodes, addrvec_t* catchup_nodes,
+			ClockTime replace_time);
+
+	change_log m_changes;
+
+	static const size_t CATCHUP_READ_MAX = 256;
+
 	void finish_replace_copy(ClockTime clocktime, REQUIRE_STLK);
 	RPC_REPLY_DECL(ReplaceCopyEnd, from, res, err, z);
 
+	unsigned int replace_parts() const;
+
 	void replace_delete(shared_node& manager, HashSpace& hs, shared_zone life);
 	struct for_each_replace_delete;
 	RPC_REPLY_DECL(ReplaceDeleteEnd, from, res, err, z);
 
+private:
+	// Anti-entropy: the first owner of each range sends digests of the
+	// range to the other owners. Both of them offer the records in the
+	// parts of the range whose digests differ to each other.
+	bool is_anti_entropy_ready(ClockTime hs_clocktime) const;
+	void start_anti_entropy();
+	void compare_digests(address from, ReplaceDigest& param,
+			rpc::weak_responder response, shared_zone life);
+	RPC_REPLY_DECL(ReplaceDigest, from, res, err, z,
+			address peer, ClockTime hs_clocktime);
+
+	typedef std::vector<digest_table::range_t> digest_ranges_t;
+	struct for_each_repair;
+	void repair_ranges(const address& peer, const digest_ranges_t& ranges,
+			ClockTime hs_clocktime);
+	void finish_repair_ranges(address peer, digest_ranges_t& ranges,
+			ClockTime hs_clocktime);
+	void anti_entropy_done();
+
+	digest_table m_digests;
+	volatile int m_anti_entropy_pending;
+
+	// number of parts of a range compared at once
+	static const unsigned int ANTI_ENTROPY_PARTS = 16;
+
+	// timeout of ReplaceDigest; the peer may scan its database
+	// to compute the digests
+	static const unsigned short ANTI_ENTROPY_TIMEOUT_STEPS = 160;
+
 private:
 	class replace_state {
 	public:
@@ -308,7 +646,13 @@ public:
 
 	void send_offer(offer_storage& offer, ClockTime replace_time);
 
+	// send_offer() and wait until the offer is sent, because
+	// an offer sent by send_offer() replaces the previous one.
+	void send_offer_sync(offer_storage& offer, ClockTime replace_time);
+
 private:
+	mp::pthread_mutex m_send_offer_mutex;
+
 	mp::pthread_mutex m_accum_set_mutex;
 	accum_set_t m_accum_set;
 
@@ -344,6 +688,7 @@ enum status_type {
 	STAT_RHS			= 9,
 	STAT_WHS			= 10,
 	STAT_REPLACE		= 11,
+	STAT_GARBAGE_DROPPED	= 12,
 };
 
 enum config_type {
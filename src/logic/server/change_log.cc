@@ -0,0 +1,194 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/change_log.h"
+#include "storage/storage.h"
+
+namespace kumo {
+namespace server {
+
+
+change_log::change_log() :
+	m_limit(0), m_entry_limit(0), m_down_unknown(false) { }
+
+change_log::~change_log() { }
+
+void change_log::init(size_t limit, ClockTime now)
+{
+	for(size_t i=0; i < SHARDS; ++i) {
+		mp::pthread_scoped_lock lk(m_shards[i].mutex);
+		m_shards[i].horizon = now;
+	}
+	m_limit = (limit + SHARDS - 1) / SHARDS;
+	m_entry_limit = m_limit / 16;
+}
+
+void change_log::hook(void* self,
+		const char* raw_key, size_t raw_keylen,
+		const char* raw_val, size_t raw_vallen)
+{
+	static_cast<change_log*>(self)->add(
+			raw_key, raw_keylen, raw_val, raw_vallen);
+}
+
+void change_log::add(const char* raw_key, size_t raw_keylen,
+		const char* raw_val, size_t raw_vallen)
+{
+	if(m_limit == 0 || raw_vallen < Storage::VALUE_CLOCKTIME_SIZE) {
+		return;
+	}
+
+	shard& sh(m_shards[Storage::hash_of(raw_key) % SHARDS]);
+	ClockTime clocktime = Storage::clocktime_of(raw_val);
+
+	if(raw_keylen + raw_vallen + sizeof(entry) > m_entry_limit) {
+		// not copied; catch-up after it copies all records
+		mp::pthread_scoped_lock lk(sh.mutex);
+		if(sh.horizon < clocktime) {
+			sh.horizon = clocktime;
+		}
+		return;
+	}
+
+	// copy outside of the lock
+	entry e;
+	e.clocktime = clocktime;
+	e.raw_key.assign(raw_key, raw_keylen);
+	e.raw_val.assign(raw_val, raw_vallen);
+	size_t size = entry_size(e);
+
+	mp::pthread_scoped_lock lk(sh.mutex);
+
+	sh.entries.push_back(entry());
+	sh.entries.back().clocktime = e.clocktime;
+	sh.entries.back().raw_key.swap(e.raw_key);
+	sh.entries.back().raw_val.swap(e.raw_val);
+	sh.size += size;
+
+	while(sh.size > m_limit && !sh.entries.empty()) {
+		const entry& front(sh.entries.front());
+		if(sh.horizon < front.clocktime) {
+			sh.horizon = front.clocktime;
+		}
+		sh.size -= entry_size(front);
+		sh.entries.pop_front();
+		++sh.first_seq;
+	}
+}
+
+bool change_log::covers(ClockTime since) const
+{
+	if(m_limit == 0) {
+		return false;
+	}
+	for(size_t i=0; i < SHARDS; ++i) {
+		mp::pthread_scoped_lock lk(m_shards[i].mutex);
+		if(!(m_shards[i].horizon < since)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool change_log::read(ClockTime since, position* pos, size_t max,
+		std::vector<entry>* result)
+{
+	for(; pos->shard < SHARDS; ++pos->shard, pos->seq = 0) {
+		shard& sh(m_shards[pos->shard]);
+		mp::pthread_scoped_lock lk(sh.mutex);
+
+		if(pos->seq < sh.first_seq) {
+			// evicted updates are older than since
+			if(!(sh.horizon < since)) {
+				return false;
+			}
+			pos->seq = sh.first_seq;
+		}
+
+		const uint64_t end = sh.first_seq + sh.entries.size();
+		for(; pos->seq < end && result->size() < max; ++pos->seq) {
+			const entry& e(sh.entries[pos->seq - sh.first_seq]);
+			if(e.clocktime >= since) {
+				result->push_back(e);
+			}
+		}
+
+		if(result->size() >= max) {
+			return true;
+		}
+	}
+
+	return true;
+}
+
+void change_log::mark_down(const rpc::address& addr, ClockTime since)
+{
+	mp::pthread_scoped_lock lk(m_down_mutex);
+	if(m_limit == 0) {
+		return;
+	}
+	down_map_t::iterator it(m_down.find(addr));
+	if(it == m_down.end()) {
+		m_down.insert(std::make_pair(addr, since));
+	} else if(since < it->second) {
+		it->second = since;
+	}
+}
+
+void change_log::mark_down_unknown(ClockTime since)
+{
+	mp::pthread_scoped_lock lk(m_down_mutex);
+	if(m_limit == 0) {
+		return;
+	}
+	if(!m_down_unknown || since < m_down_unknown_since) {
+		m_down_unknown_since = since;
+	}
+	m_down_unknown = true;
+}
+
+ClockTime change_log::take_down_unknown(ClockTime since)
+{
+	mp::pthread_scoped_lock lk(m_down_mutex);
+	if(m_down_unknown && m_down_unknown_since < since) {
+		since = m_down_unknown_since;
+	}
+	m_down_unknown = false;
+	return since;
+}
+
+bool change_log::down_since(const rpc::address& addr, ClockTime* result) const
+{
+	mp::pthread_scoped_lock lk(m_down_mutex);
+	down_map_t::const_iterator it(m_down.find(addr));
+	if(it == m_down.end()) {
+		return false;
+	}
+	*result = it->second;
+	return true;
+}
+
+void change_log::clear_down(const rpc::address& addr)
+{
+	mp::pthread_scoped_lock lk(m_down_mutex);
+	m_down.erase(addr);
+}
+
+
+}  // namespace server
+}  // namespace kumo
+
@@ -0,0 +1,132 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef SERVER_CHANGE_LOG_H__
+#define SERVER_CHANGE_LOG_H__
+
+#include "logic/clock.h"
+#include "rpc/address.h"
+#include <mp/pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+namespace kumo {
+namespace server {
+
+
+// Recent updates of the storage kept in memory.
+// A server which comes back from fault is sent the updates after it
+// went down instead of all records of its hash ranges, if the log
+// still has all of them.
+// The log is sharded by the hash of the key so that writes to different
+// keys don't contend; updates of the same key are kept in order.
+class change_log {
+public:
+	change_log();
+	~change_log();
+
+public:
+	// limit: bytes of keys and values kept in the log. 0: disabled
+	// updates before now are not in the log.
+	void init(size_t limit, ClockTime now);
+	bool is_enabled() const { return m_limit > 0; }
+
+	void add(const char* raw_key, size_t raw_keylen,
+			const char* raw_val, size_t raw_vallen);
+
+	// for Storage::set_change_hook
+	static void hook(void* self,
+			const char* raw_key, size_t raw_keylen,
+			const char* raw_val, size_t raw_vallen);
+
+	struct entry {
+		ClockTime clocktime;
+		std::string raw_key;
+		std::string raw_val;  // clocktime only if removed
+	};
+
+	// true if no update whose clocktime is since or later is evicted
+	bool covers(ClockTime since) const;
+
+	struct position {
+		position() : shard(0), seq(0) { }
+		size_t shard;
+		uint64_t seq;
+	};
+
+	// copies up to max updates whose clocktime is since or later
+	// from the position *pos (default: head) and advances *pos.
+	// result is empty at the end of the log.
+	// returns false if some of them are evicted.
+	bool read(ClockTime since, position* pos, size_t max,
+			std::vector<entry>* result);
+
+	// replication to the server failed or it is marked as fault.
+	// keeps the oldest clocktime.
+	void mark_down(const rpc::address& addr, ClockTime since);
+
+	// replication failed but the server is not known (the session is
+	// lost). applied to the servers marked as fault next time.
+	void mark_down_unknown(ClockTime since);
+
+	// returns the older one of since and the unknown mark, and
+	// forgets the unknown mark
+	ClockTime take_down_unknown(ClockTime since);
+
+	// returns false if the server is not marked
+	bool down_since(const rpc::address& addr, ClockTime* result) const;
+
+	void clear_down(const rpc::address& addr);
+
+private:
+	static size_t entry_size(const entry& e)
+		{ return e.raw_key.size() + e.raw_val.size() + sizeof(entry); }
+
+	static const size_t SHARDS = 16;
+
+	struct shard {
+		shard() : first_seq(0), size(0) { }
+		mutable mp::pthread_mutex mutex;
+		std::deque<entry> entries;
+		uint64_t first_seq;  // seq of entries.front()
+		size_t size;
+		// the newest clocktime of the evicted updates
+		ClockTime horizon;
+	};
+	shard m_shards[SHARDS];
+
+	size_t m_limit;        // per shard
+	size_t m_entry_limit;  // larger updates are not kept but evicted
+
+	mutable mp::pthread_mutex m_down_mutex;
+	typedef std::map<rpc::address, ClockTime> down_map_t;
+	down_map_t m_down;
+	bool m_down_unknown;
+	ClockTime m_down_unknown_since;
+
+private:
+	change_log(const change_log&);
+};
+
+
+}  // namespace server
+}  // namespace kumo
+
+#endif /* server/change_log.h */
+
@@ -0,0 +1,209 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/digest_table.h"
+#include <algorithm>
+#include <time.h>
+
+namespace kumo {
+namespace server {
+
+
+digest_table::digest_table() :
+	m_next_scan(0), m_scanning(false) { }
+
+digest_table::~digest_table() { }
+
+
+uint64_t digest_table::record_digest(uint64_t hash, ClockTime clocktime)
+{
+	// splitmix64 finalizer
+	uint64_t x = hash ^ (clocktime.get() * 0x9e3779b97f4a7c15ULL);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t digest_table::removed_digest(uint64_t hash, ClockTime clocktime)
+{
+	return record_digest(~hash, clocktime);
+}
+
+ClockTime digest_table::removed_since(ClockTime now, uint32_t garbage_min_time)
+{
+	// rounded up; records removed after it are younger than garbage_min_time
+	uint32_t step = garbage_min_time / 2;
+	if(step == 0) { step = 1; }
+	uint32_t sec = (uint32_t)(now.get() >> 32) - garbage_min_time;
+	sec = (sec / step + 1) * step;
+	return ClockTime(0, sec);
+}
+
+uint64_t digest_table::now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void digest_table::split(uint64_t begin, uint64_t end, unsigned int n,
+		std::vector<range_t>* result)
+{
+	const uint64_t step = (end - begin) / n + 1;
+	for(uint64_t b = begin; ; b += step) {
+		if(end - b < step) {
+			result->push_back(range_t(b, end));
+			break;
+		}
+		result->push_back(range_t(b, b + step - 1));
+	}
+}
+
+
+struct digest_table::scan_ranges {
+	scan_ranges(const std::vector<range_t>& r, std::vector<uint64_t>& d,
+			ClockTime since) :
+		ranges(r), digests(d), removed_since(since) { }
+
+	struct begin_less {
+		bool operator() (uint64_t h, const range_t& r) const
+			{ return h < r.first; }
+	};
+
+	void operator() (Storage::iterator& kv)
+	{
+		uint64_t h = Storage::hash_of(kv.key());
+
+		std::vector<range_t>::const_iterator it =
+			std::upper_bound(ranges.begin(), ranges.end(), h, begin_less());
+		if(it == ranges.begin()) { return; }
+		--it;
+		if(h > it->second) { return; }
+
+		ClockTime ct = Storage::clocktime_of(kv.val());
+		if(!Storage::is_removed(kv.val(), kv.vallen())) {
+			digests[it - ranges.begin()] += record_digest(h, ct);
+		} else if(ct >= removed_since) {
+			digests[it - ranges.begin()] += removed_digest(h, ct);
+		}
+	}
+
+private:
+	const std::vector<range_t>& ranges;
+	std::vector<uint64_t>& digests;
+	ClockTime removed_since;
+};
+
+bool digest_table::get(Storage& db, ClockTime hs_clocktime, ClockTime now,
+		const std::vector<range_t>& ranges,
+		std::vector<uint64_t>* result)
+{
+	result->resize(ranges.size());
+
+	ClockTime since = removed_since(now, db.garbage_min_time());
+
+	std::vector<size_t> stale;
+	std::vector<range_t> stale_ranges;
+	std::vector<uint64_t> stale_counts;
+
+	{
+		mp::pthread_scoped_lock lk(m_mutex);
+
+		if(m_hs_clocktime != hs_clocktime) {
+			m_map.clear();
+			m_hs_clocktime = hs_clocktime;
+		}
+
+		for(size_t i=0; i < ranges.size(); ++i) {
+			// taken before the scan; records updated during the scan
+			// make the digest stale
+			uint64_t count = db.change_count(ranges[i].first, ranges[i].second);
+			map_t::const_iterator it(m_map.find(ranges[i]));
+			if(it != m_map.end() && it->second.change_count == count &&
+					it->second.removed_since == since) {
+				(*result)[i] = it->second.digest;
+			} else {
+				stale.push_back(i);
+				stale_ranges.push_back(ranges[i]);
+				stale_counts.push_back(count);
+			}
+		}
+
+		if(stale.empty()) {
+			return true;
+		}
+
+		// without range support, the whole database is scanned
+		if(m_scanning || now_usec() < m_next_scan) {
+			return false;
+		}
+		m_scanning = true;
+	}
+
+	std::vector<uint64_t> digests(stale.size(), 0);
+	scan_ranges f(stale_ranges, digests, since);
+
+	uint64_t start = now_usec();
+	try {
+		if(db.is_range_supported()) {
+			for(std::vector<range_t>::const_iterator it(stale_ranges.begin()),
+					it_end(stale_ranges.end()); it != it_end; ++it) {
+				db.for_each_range_with_removed(f, it->first, it->second, now);
+			}
+		} else {
+			db.for_each_with_removed(f, now);
+		}
+	} catch (...) {
+		mp::pthread_scoped_lock lk(m_mutex);
+		m_scanning = false;
+		throw;
+	}
+	uint64_t end = now_usec();
+
+	mp::pthread_scoped_lock lk(m_mutex);
+	m_scanning = false;
+	m_next_scan = end + (end - start) *
+		(100 - SCAN_DUTY_PERCENT) / SCAN_DUTY_PERCENT;
+
+	bool cache = (m_hs_clocktime == hs_clocktime);
+
+	for(size_t i=0; i < stale.size(); ++i) {
+		(*result)[stale[i]] = digests[i];
+		if(cache) {
+			entry& e(m_map[stale_ranges[i]]);
+			e.change_count = stale_counts[i];
+			e.removed_since = since;
+			e.digest = digests[i];
+		}
+	}
+
+	return true;
+}
+
+void digest_table::invalidate(const std::vector<range_t>& ranges)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	for(std::vector<range_t>::const_iterator it(ranges.begin()),
+			it_end(ranges.end()); it != it_end; ++it) {
+		m_map.erase(*it);
+	}
+}
+
+
+}  // namespace server
+}  // namespace kumo
+
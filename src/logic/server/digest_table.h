@@ -0,0 +1,101 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef SERVER_DIGEST_TABLE_H__
+#define SERVER_DIGEST_TABLE_H__
+
+#include "storage/storage.h"
+#include <mp/pthread.h>
+#include <map>
+#include <vector>
+#include <utility>
+
+namespace kumo {
+namespace server {
+
+
+// Digests of the records in hash ranges.
+// The digest of a range is the sum of record_digest() of the live
+// records in it and removed_digest() of the records removed recently;
+// replicas which have the same records have the same digest.
+// Digests are cached and computed again only if
+// Storage::change_count() of the range is changed.
+//
+// Removed records are counted if they are removed after removed_since(),
+// which is at most Storage::garbage_min_time() ago; they are not purged
+// on any replica yet. removed_since() is rounded so that replicas count
+// the same removed records.
+class digest_table {
+public:
+	digest_table();
+	~digest_table();
+
+public:
+	typedef std::pair<uint64_t, uint64_t> range_t;  // [first, second]
+
+	// ranges must be sorted and must not overlap.
+	// cached digests are forgotten if hs_clocktime is changed.
+	// now is passed to Storage::for_each.
+	// returns false if the database needs to be scanned but the
+	// last scan was too recent; scans take at most SCAN_DUTY_PERCENT
+	// of the time.
+	bool get(Storage& db, ClockTime hs_clocktime, ClockTime now,
+			const std::vector<range_t>& ranges,
+			std::vector<uint64_t>* result);
+
+	// digests of the ranges are computed again next time
+	void invalidate(const std::vector<range_t>& ranges);
+
+	static uint64_t record_digest(uint64_t hash, ClockTime clocktime);
+	static uint64_t removed_digest(uint64_t hash, ClockTime clocktime);
+
+	static ClockTime removed_since(ClockTime now, uint32_t garbage_min_time);
+
+	static const unsigned int SCAN_DUTY_PERCENT = 10;
+
+	// splits [begin, end] into at most n ranges
+	static void split(uint64_t begin, uint64_t end, unsigned int n,
+			std::vector<range_t>* result);
+
+private:
+	struct entry {
+		uint64_t change_count;
+		ClockTime removed_since;
+		uint64_t digest;
+	};
+	typedef std::map<range_t, entry> map_t;
+
+	struct scan_ranges;
+
+	mp::pthread_mutex m_mutex;
+	map_t m_map;
+	ClockTime m_hs_clocktime;
+
+	static uint64_t now_usec();
+	uint64_t m_next_scan;  // now_usec()
+	bool m_scanning;
+
+private:
+	digest_table(const digest_table&);
+};
+
+
+}  // namespace server
+}  // namespace kumo
+
+#endif /* server/digest_table.h */
+
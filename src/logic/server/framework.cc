@@ -34,8 +34,10 @@ try {
 	RPC_DISPATCH(mod_network, HashSpaceSync);
 	RPC_DISPATCH(mod_store,   ReplicateSet);
 	RPC_DISPATCH(mod_store,   ReplicateDelete);
+	RPC_DISPATCH(mod_store,   ReplicateBatch);
 	RPC_DISPATCH(mod_replace, ReplaceCopyStart);
 	RPC_DISPATCH(mod_replace, ReplaceDeleteStart);
+	RPC_DISPATCH(mod_replace, ReplaceDigest);
 	RPC_DISPATCH(mod_replace_stream, ReplaceOffer);
 	RPC_DISPATCH(mod_control, CreateBackup);
 	default:
@@ -53,6 +55,10 @@ try {
 	RPC_DISPATCH(mod_store,   Set);
 	RPC_DISPATCH(mod_store,   Delete);
 	RPC_DISPATCH(mod_store,   GetIfModified);
+	RPC_DISPATCH(mod_store,   GetMulti);
+	RPC_DISPATCH(mod_store,   GetLease);
+	RPC_DISPATCH(mod_store,   SetMulti);
+	RPC_DISPATCH(mod_store,   Modify);
 	RPC_DISPATCH(mod_control, GetStatus);
 	RPC_DISPATCH(mod_control, SetConfig);
 	default:
@@ -20,6 +20,7 @@
 
 #include "logic/cluster_logic.h"
 #include "logic/clock_logic.h"
+#include "logic/hs_snapshot.h"
 #include "server/mod_control.h"
 #include "server/mod_network.h"
 #include "server/mod_replace.h"
@@ -28,26 +29,12 @@
 
 #define EACH_ASSIGN(HS, HASH, REAL, CODE) \
 { \
-	HashSpace::iterator _it_(HS.find(HASH)); \
-	HashSpace::iterator _origin_(_it_); \
+	const HashSpace::node* _reps_[HashSpace::MAX_REPLICAS]; \
+	size_t _reps_num_ = HS.find_replicas(HASH, _reps_); \
 	HashSpace::node REAL; \
-	REAL = *_it_; \
-	CODE; \
-	++_it_; \
-	for(; _it_ != _origin_; ++_it_) { \
-		if(*_it_ == *_origin_) { continue; } \
-		HashSpace::node _rep1_ = *_it_; \
-		REAL = _rep1_; \
+	for(size_t _i_=0; _i_ < _reps_num_; ++_i_) { \
+		REAL = *_reps_[_i_]; \
 		CODE; \
-		++_it_; \
-		for(; _it_ != _origin_; ++_it_) { \
-			if(*_it_ == *_origin_ || *_it_ == _rep1_) { continue; } \
-			HashSpace::node _rep2_ = *_it_; \
-			REAL = _rep2_; \
-			CODE; \
-			break; \
-		} \
-		break; \
 	} \
 }
 
@@ -114,11 +101,8 @@ public:
 	resource(const Config& cfg);
 
 private:
-	mp::pthread_rwlock m_rhs_mutex;
-	HashSpace m_rhs;
-
-	mp::pthread_rwlock m_whs_mutex;
-	HashSpace m_whs;
+	hs_snapshot m_rhs;
+	hs_snapshot m_whs;
 
 	Storage& m_db;
 
@@ -131,7 +115,16 @@ private:
 
 	const unsigned short m_cfg_replicate_set_retry_num;
 	const unsigned short m_cfg_replicate_delete_retry_num;
+	const unsigned short m_cfg_write_quorum;
+	const size_t m_cfg_hint_limit;
+	const time_t m_cfg_hint_max_backoff_sec;
 	const unsigned short m_cfg_replace_set_limit_mem;
+	const unsigned short m_cfg_replace_threads;
+	const unsigned long m_cfg_replicate_batch_interval_usec;
+	const size_t m_cfg_replicate_batch_limit;
+	const size_t m_cfg_expire_sweep_limit;
+	const uint32_t m_cfg_lease_max_time_msec;
+	const size_t m_cfg_lease_limit;
 
 	const time_t m_stat_start_time;  // FIXME m_start_time -> m_stat_start_time
 	volatile uint64_t m_stat_num_get;
@@ -139,10 +132,14 @@ private:
 	volatile uint64_t m_stat_num_delete;
 
 public:
-	RESOURCE_ACCESSOR(mp::pthread_rwlock, rhs_mutex);
-	RESOURCE_ACCESSOR(mp::pthread_rwlock, whs_mutex);
-	RESOURCE_ACCESSOR(HashSpace, rhs);
-	RESOURCE_ACCESSOR(HashSpace, whs);
+	// current snapshots. the snapshot is kept while the reference is held;
+	// hold it once to see a consistent hash space.
+	hs_snapshot::ref rhs() const { return m_rhs.get(); }
+	hs_snapshot::ref whs() const { return m_whs.get(); }
+
+	// lock mutex() and publish() to update
+	hs_snapshot& rhs_snapshot() { return m_rhs; }
+	hs_snapshot& whs_snapshot() { return m_whs; }
 
 	RESOURCE_ACCESSOR(Storage, db);
 
@@ -153,7 +150,16 @@ public:
 	RESOURCE_CONST_ACCESSOR(std::string, cfg_db_backup_basename);
 	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_replicate_set_retry_num);
 	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_replicate_delete_retry_num);
+	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_write_quorum);
+	RESOURCE_CONST_ACCESSOR(size_t, cfg_hint_limit);
+	RESOURCE_CONST_ACCESSOR(time_t, cfg_hint_max_backoff_sec);
 	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_replace_set_limit_mem);
+	RESOURCE_CONST_ACCESSOR(unsigned short, cfg_replace_threads);
+	RESOURCE_CONST_ACCESSOR(unsigned long, cfg_replicate_batch_interval_usec);
+	RESOURCE_CONST_ACCESSOR(size_t, cfg_replicate_batch_limit);
+	RESOURCE_CONST_ACCESSOR(size_t, cfg_expire_sweep_limit);
+	RESOURCE_CONST_ACCESSOR(uint32_t, cfg_lease_max_time_msec);
+	RESOURCE_CONST_ACCESSOR(size_t, cfg_lease_limit);
 
 	RESOURCE_CONST_ACCESSOR(time_t, stat_start_time);
 
@@ -0,0 +1,393 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/hint_log.h"
+#include "logic/global.h"
+#include <stdexcept>
+#include <algorithm>
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+namespace kumo {
+namespace server {
+
+
+// The hint file is a sequence of records:
+//
+// +-------+--------+------+---------+------+-----------+--------+-----+-----+
+// | crc32 | reclen | type | addrlen | addr | clocktime | keylen | key | val |
+// +-------+--------+------+---------+------+-----------+--------+-----+-----+
+//   uint32  uint32   uint8  uint8            uint64      uint32   (big endian)
+//
+// reclen is the size of the record. crc32 covers the rest of the record.
+// DONE record removes the first <clocktime> hints to addr.
+static const uint8_t HINT_DONE = 0xff;
+static const size_t HINT_HEADER_SIZE = 4+4+1+1;
+static const size_t HINT_MAX_RECORD = 64*1024*1024;
+
+static inline void hint_store32(char* p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static inline uint32_t hint_load32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static inline void hint_store64(char* p, uint64_t v)
+{
+	hint_store32(p,   (uint32_t)(v >> 32));
+	hint_store32(p+4, (uint32_t)v);
+}
+
+static inline uint64_t hint_load64(const char* p)
+{
+	return ((uint64_t)hint_load32(p) << 32) | hint_load32(p+4);
+}
+
+static bool hint_write_all(int fd, const char* buf, size_t size)
+{
+	size_t done = 0;
+	while(done < size) {
+		ssize_t wl = ::write(fd, buf+done, size-done);
+		if(wl < 0) {
+			if(errno == EINTR) { continue; }
+			return false;
+		}
+		done += wl;
+	}
+	return true;
+}
+
+static inline uint64_t hint_reclen(const rpc::address& to, const hint_log::hint& h)
+{
+	return HINT_HEADER_SIZE + to.dump_size() + 8 + 4 + h.key.size() + h.val.size();
+}
+
+
+hint_log::hint_log() :
+	m_size(0), m_fd(-1), m_file_size(0), m_live_size(0) { }
+
+hint_log::~hint_log()
+{
+	if(m_fd >= 0) {
+		::close(m_fd);
+	}
+}
+
+void hint_log::open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDWR|O_CREAT, 0644);
+	if(fd < 0) {
+		throw std::runtime_error(std::string("can't open hint file: ") + strerror(errno));
+	}
+
+	mp::pthread_scoped_lock lk(m_mutex);
+	try {
+		load(fd);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+
+	m_path = path;
+	rewrite();
+
+	LOG_INFO("hint file ",path,": ",m_size," hints");
+}
+
+void hint_log::load(int fd)
+{
+	struct stat st;
+	if(::fstat(fd, &st) < 0) {
+		throw std::runtime_error(std::string("can't stat hint file: ") + strerror(errno));
+	}
+
+	std::vector<char> buf(st.st_size);
+	size_t len = 0;
+	while(len < buf.size()) {
+		ssize_t rl = ::read(fd, &buf[len], buf.size() - len);
+		if(rl < 0) {
+			if(errno == EINTR) { continue; }
+			throw std::runtime_error(std::string("can't read hint file: ") + strerror(errno));
+		} else if(rl == 0) {
+			break;
+		}
+		len += rl;
+	}
+
+	size_t off = 0;
+	while(off + HINT_HEADER_SIZE <= len) {
+		const char* p = &buf[off];
+		uint32_t reclen = hint_load32(p+4);
+		if(reclen < HINT_HEADER_SIZE || off + reclen > len) {
+			break;
+		}
+		if(crc32(0, (const Bytef*)p+4, reclen-4) != hint_load32(p)) {
+			break;
+		}
+
+		uint8_t type = p[8];
+		uint8_t addrlen = p[9];
+		if(reclen < HINT_HEADER_SIZE + addrlen + 8 + 4) {
+			break;
+		}
+		const char* q = p + HINT_HEADER_SIZE;
+		rpc::address to(q, addrlen);  q += addrlen;
+		uint64_t clocktime = hint_load64(q);  q += 8;
+		uint32_t keylen = hint_load32(q);  q += 4;
+		if(q + keylen > p + reclen) {
+			break;
+		}
+
+		peer& pr(m_peers[to]);
+		if(type == HINT_DONE) {
+			for(uint64_t i=0; i < clocktime && !pr.hints.empty(); ++i) {
+				pr.hints.pop_front();
+				--m_size;
+			}
+		} else {
+			hint h;
+			h.type = type;
+			h.clocktime = clocktime;
+			h.key.assign(q, keylen);
+			h.val.assign(q + keylen, p + reclen);
+			pr.hints.push_back(h);
+			++m_size;
+		}
+
+		off += reclen;
+	}
+
+	if(off != len) {
+		LOG_WARN("hint file is broken at ",off,"; following hints are ignored");
+	}
+
+	for(peers_t::iterator it(m_peers.begin()); it != m_peers.end(); ) {
+		if(it->second.hints.empty()) {
+			m_peers.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+void hint_log::write_record(int fd, const rpc::address& to, const hint& h)
+{
+	uint64_t reclen = hint_reclen(to, h);
+	if(reclen > HINT_MAX_RECORD) {
+		throw std::runtime_error("too large hint");
+	}
+
+	std::vector<char> buf(reclen);
+	char* p = &buf[0];
+	hint_store32(p+4, reclen);
+	p[8] = h.type;
+	p[9] = to.dump_size();
+
+	char* q = p + HINT_HEADER_SIZE;
+	memcpy(q, to.dump(), to.dump_size());  q += to.dump_size();
+	hint_store64(q, h.clocktime);  q += 8;
+	hint_store32(q, h.key.size());  q += 4;
+	memcpy(q, h.key.data(), h.key.size());  q += h.key.size();
+	memcpy(q, h.val.data(), h.val.size());
+
+	hint_store32(p, crc32(0, (const Bytef*)p+4, reclen-4));
+
+	if(!hint_write_all(fd, p, reclen)) {
+		throw std::runtime_error(std::string("can't write hint file: ") + strerror(errno));
+	}
+	m_file_size += reclen;
+}
+
+// writes live hints to a new file and replaces the file with it
+void hint_log::rewrite()
+{
+	std::string tmp = m_path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+	if(fd < 0) {
+		throw std::runtime_error(std::string("can't create hint file: ") + strerror(errno));
+	}
+
+	m_file_size = 0;
+	m_live_size = 0;
+	try {
+		for(peers_t::iterator it(m_peers.begin()),
+				it_end(m_peers.end()); it != it_end; ++it) {
+			std::deque<hint>& hints(it->second.hints);
+			for(std::deque<hint>::iterator h(hints.begin()),
+					h_end(hints.end()); h != h_end; ++h) {
+				write_record(fd, it->first, *h);
+			}
+		}
+		if(::fsync(fd) < 0 || ::rename(tmp.c_str(), m_path.c_str()) < 0) {
+			throw std::runtime_error(std::string("can't replace hint file: ") + strerror(errno));
+		}
+	} catch (...) {
+		::close(fd);
+		::unlink(tmp.c_str());
+		throw;
+	}
+	m_live_size = m_file_size;
+
+	if(m_fd >= 0) {
+		::close(m_fd);
+	}
+	m_fd = fd;
+}
+
+bool hint_log::add(const rpc::address& to, const hint& h, size_t limit)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	if(m_fd < 0 || m_size >= limit) {
+		return false;
+	}
+
+	try {
+		write_record(m_fd, to, h);
+	} catch (std::exception& e) {
+		LOG_ERROR("failed to store hint: ",e.what());
+		return false;
+	}
+
+	m_peers[to].hints.push_back(h);
+	++m_size;
+	m_live_size += hint_reclen(to, h);
+	return true;
+}
+
+void hint_log::take(time_t now, size_t max, std::vector<batch>* result)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	for(peers_t::iterator it(m_peers.begin()),
+			it_end(m_peers.end()); it != it_end; ++it) {
+		peer& pr(it->second);
+		if(pr.hints.empty() || pr.sending || pr.next_try > now) {
+			continue;
+		}
+		pr.sending = true;
+
+		result->push_back(batch());
+		batch& b(result->back());
+		b.to = it->first;
+		size_t n = std::min(max, pr.hints.size());
+		b.hints.assign(pr.hints.begin(), pr.hints.begin() + n);
+	}
+}
+
+void hint_log::done(const rpc::address& to, size_t num)
+{
+	finish(to, num, std::vector<size_t>(), 0, 0);
+}
+
+void hint_log::retry(const rpc::address& to, size_t num,
+		const std::vector<size_t>& failed, time_t now, time_t max_backoff)
+{
+	finish(to, num, failed, now, max_backoff);
+}
+
+void hint_log::finish(const rpc::address& to, size_t num,
+		const std::vector<size_t>& failed, time_t now, time_t max_backoff)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	peers_t::iterator it(m_peers.find(to));
+	if(it == m_peers.end()) {
+		return;
+	}
+	peer& pr(it->second);
+	pr.sending = false;
+	if(failed.empty()) {
+		pr.backoff = 0;
+		pr.next_try = 0;
+	} else {
+		pr.backoff = (pr.backoff == 0) ? 1 : std::min(pr.backoff * 2, max_backoff);
+		pr.next_try = now + pr.backoff;
+	}
+
+	// failed hints are moved to the end so that the order of
+	// the hints is same as the file after the DONE record
+	std::vector<hint> kept;
+	std::vector<size_t>::const_iterator f(failed.begin());
+	for(size_t i=0; i < num && !pr.hints.empty(); ++i) {
+		if(f != failed.end() && *f == i) {
+			kept.push_back(pr.hints.front());
+			++f;
+		}
+		m_live_size -= hint_reclen(to, pr.hints.front());
+		pr.hints.pop_front();
+		--m_size;
+	}
+	for(std::vector<hint>::iterator k(kept.begin()),
+			k_end(kept.end()); k != k_end; ++k) {
+		pr.hints.push_back(*k);
+		++m_size;
+		m_live_size += hint_reclen(to, *k);
+	}
+	if(pr.hints.empty()) {
+		m_peers.erase(it);
+	}
+
+	try {
+		if(m_size == 0 || (m_file_size > REWRITE_SIZE &&
+					m_file_size > m_live_size * LIVE_RATIO)) {
+			rewrite();
+		} else {
+			for(std::vector<hint>::iterator k(kept.begin()),
+					k_end(kept.end()); k != k_end; ++k) {
+				write_record(m_fd, to, *k);
+			}
+			hint d;
+			d.type = HINT_DONE;
+			d.clocktime = num;
+			write_record(m_fd, to, d);
+		}
+	} catch (std::exception& e) {
+		// FIXME delivered hints are sent again after restart
+		LOG_ERROR("failed to update hint file: ",e.what());
+	}
+}
+
+void hint_log::failed(const rpc::address& to, time_t now, time_t max_backoff)
+{
+	mp::pthread_scoped_lock lk(m_mutex);
+	peers_t::iterator it(m_peers.find(to));
+	if(it == m_peers.end()) {
+		return;
+	}
+	peer& pr(it->second);
+	pr.sending = false;
+	pr.backoff = (pr.backoff == 0) ? 1 : std::min(pr.backoff * 2, max_backoff);
+	pr.next_try = now + pr.backoff;
+}
+
+
+}  // namespace server
+}  // namespace kumo
+
@@ -0,0 +1,122 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef SERVER_HINT_LOG_H__
+#define SERVER_HINT_LOG_H__
+
+#include "rpc/address.h"
+#include <mp/pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <time.h>
+
+namespace kumo {
+namespace server {
+
+
+// Replications which failed are kept as hints until the node comes back.
+// Hints are appended to a file so that they survive restarts;
+// the file is truncated when all hints are delivered.
+class hint_log {
+public:
+	hint_log();
+	~hint_log();
+
+public:
+	// loads hints left in the file and appends new hints to it
+	void open(const std::string& path);
+	bool is_open() const { return m_fd >= 0; }
+
+	static const uint8_t SET    = 0;
+	static const uint8_t DELETE = 1;
+
+	struct hint {
+		uint8_t type;
+		uint64_t clocktime;  // delete clocktime
+		std::string key;
+		std::string val;
+	};
+
+	// returns false if limit hints are already stored
+	bool add(const rpc::address& to, const hint& h, size_t limit);
+
+	struct batch {
+		rpc::address to;
+		std::vector<hint> hints;
+	};
+
+	// copies up to max hints for each node whose backoff is expired.
+	// hints are kept until done() or failed() is called.
+	void take(time_t now, size_t max, std::vector<batch>* result);
+
+	// the first num hints are delivered
+	void done(const rpc::address& to, size_t num);
+
+	// the first num hints are sent but the node failed to store the
+	// hints at the indexes in failed (ascending). they are appended
+	// again and retried after backoff.
+	void retry(const rpc::address& to, size_t num,
+			const std::vector<size_t>& failed, time_t now, time_t max_backoff);
+
+	// the node is still down; retry after backoff
+	void failed(const rpc::address& to, time_t now, time_t max_backoff);
+
+	size_t size() const { return m_size; }
+
+private:
+	struct peer {
+		peer() : next_try(0), backoff(0), sending(false) { }
+		std::deque<hint> hints;
+		time_t next_try;
+		time_t backoff;
+		bool sending;
+	};
+	typedef std::map<rpc::address, peer> peers_t;
+
+	void finish(const rpc::address& to, size_t num,
+			const std::vector<size_t>& failed, time_t now, time_t max_backoff);
+
+	void load(int fd);
+	void write_record(int fd, const rpc::address& to, const hint& h);
+	void rewrite();
+
+	mp::pthread_mutex m_mutex;
+	peers_t m_peers;
+	size_t m_size;
+
+	std::string m_path;
+	int m_fd;
+	uint64_t m_file_size;
+	uint64_t m_live_size;
+
+	// hint file is rewritten if it is larger than this and
+	// LIVE_RATIO times of live hints
+	static const uint64_t REWRITE_SIZE = 64*1024*1024;
+	static const uint64_t LIVE_RATIO = 4;
+
+private:
+	hint_log(const hint_log&);
+};
+
+
+}  // namespace server
+}  // namespace kumo
+
+#endif /* server/hint_log.h */
+
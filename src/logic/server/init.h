@@ -37,11 +37,38 @@ framework::framework(const Config& cfg) :
 template <typename Config>
 void framework::run(const Config& cfg)
 {
+	if(cfg.change_log_size_kb > 0) {
+		mod_replace.init_change_log(cfg.change_log_size_kb*1024);
+	}
 	init_wavy(cfg.rthreads, cfg.wthreads);  // wavy_server
 	listen_cluster(cfg.cluster_lsock);  // cluster_logic
 	start_timeout_step(cfg.clock_interval_usec);  // rpc_server
 	start_keepalive(cfg.keepalive_interval_usec);  // rpc_server
 	mod_replace_stream.init_stream(cfg.stream_lsock);
+	{
+		struct timespec ts = {1, 0};
+		wavy::timer(&ts, mp::bind(&mod_store_t::purge_garbage, &mod_store));
+	}
+	if(cfg.expire_sweep_interval_usec > 0 && !share->db().is_sweep_supported()) {
+		LOG_WARN("storage doesn't support sweeping expired keys");
+	} else if(cfg.expire_sweep_interval_usec > 0) {
+		struct timespec ts = {
+			cfg.expire_sweep_interval_usec / 1000000,
+			cfg.expire_sweep_interval_usec % 1000000 * 1000};
+		wavy::timer(&ts, mp::bind(&mod_store_t::sweep_expired, &mod_store));
+	}
+	if(!cfg.hint_file.empty()) {
+		mod_store.init_hints(cfg.hint_file);
+		struct timespec ts = {1, 0};
+		wavy::timer(&ts, mp::bind(&mod_store_t::replay_hints, &mod_store));
+	}
+	if(cfg.anti_entropy_interval_sec > 0) {
+		struct timespec ts = {cfg.anti_entropy_interval_sec, 0};
+		wavy::timer(&ts, mp::bind(&mod_replace_t::anti_entropy, &mod_replace));
+	}
+	if(cfg.replicate_batch_interval_usec > 0) {
+		mod_store.start_replicate_batch();
+	}
 	LOG_INFO("start server ",addr());
 	TLOGPACK("SS",2,
 			"addr", cfg.cluster_addr,
@@ -63,7 +90,16 @@ resource::resource(const Config& cfg) :
 	m_cfg_db_backup_basename(cfg.db_backup_basename),
 	m_cfg_replicate_set_retry_num(cfg.replicate_set_retry_num),
 	m_cfg_replicate_delete_retry_num(cfg.replicate_delete_retry_num),
+	m_cfg_write_quorum(cfg.write_quorum),
+	m_cfg_hint_limit(cfg.hint_limit),
+	m_cfg_hint_max_backoff_sec(cfg.hint_max_backoff_sec),
 	m_cfg_replace_set_limit_mem(cfg.replace_set_limit_mem),
+	m_cfg_replace_threads(cfg.replace_threads),
+	m_cfg_replicate_batch_interval_usec(cfg.replicate_batch_interval_usec),
+	m_cfg_replicate_batch_limit(cfg.replicate_batch_limit),
+	m_cfg_expire_sweep_limit(cfg.expire_sweep_limit),
+	m_cfg_lease_max_time_msec(cfg.lease_max_time_msec),
+	m_cfg_lease_limit(cfg.lease_limit),
 
 	m_stat_start_time(time(NULL)),
 	m_stat_num_get(0),
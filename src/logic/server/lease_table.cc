@@ -0,0 +1,120 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "server/lease_table.h"
+#include "rpc/rpc.h"
+#include <time.h>
+
+namespace kumo {
+namespace server {
+
+
+lease_table::lease_table() : m_size(0) { }
+
+lease_table::~lease_table() { }
+
+uint64_t lease_table::now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool lease_table::grant(uint64_t hash, const rpc::basic_shared_session& s,
+		uint32_t msec, size_t limit)
+{
+	uint64_t expire = now_msec() + msec;
+	stripe& st(stripe_for(hash));
+	mp::pthread_scoped_lock lk(st.mutex);
+
+	std::pair<map_t::iterator, map_t::iterator> range(st.map.equal_range(hash));
+	for(map_t::iterator it(range.first); it != range.second; ++it) {
+		if(it->second.id == s.get()) {
+			// renew
+			it->second.session = s;
+			it->second.expire = expire;
+			return true;
+		}
+	}
+
+	if(m_size >= limit) {
+		return false;
+	}
+
+	holder h;
+	h.id = s.get();
+	h.session = s;
+	h.expire = expire;
+	st.map.insert(range.second, map_t::value_type(hash, h));
+	__sync_add_and_fetch(&m_size, 1);
+	return true;
+}
+
+void lease_table::revoke(uint64_t hash, std::vector<rpc::basic_shared_session>* result)
+{
+	uint64_t now = now_msec();
+	stripe& st(stripe_for(hash));
+	mp::pthread_scoped_lock lk(st.mutex);
+
+	std::pair<map_t::iterator, map_t::iterator> range(st.map.equal_range(hash));
+	size_t n = 0;
+	for(map_t::iterator it(range.first); it != range.second; ++it, ++n) {
+		if(it->second.expire < now) { continue; }
+		rpc::basic_shared_session s(it->second.session.lock());
+		if(s && !s->is_lost()) {
+			result->push_back(s);
+		}
+	}
+
+	if(n > 0) {
+		st.map.erase(range.first, range.second);
+		__sync_sub_and_fetch(&m_size, n);
+	}
+}
+
+size_t lease_table::purge_expired()
+{
+	uint64_t now = now_msec();
+	size_t total = 0;
+
+	for(size_t i=0; i < STRIPES; ++i) {
+		stripe& st(m_stripes[i]);
+		mp::pthread_scoped_lock lk(st.mutex);
+
+		size_t n = 0;
+		for(map_t::iterator it(st.map.begin()); it != st.map.end(); ) {
+			if(it->second.expire < now) {
+				st.map.erase(it++);
+				++n;
+			} else {
+				++it;
+			}
+		}
+
+		if(n > 0) {
+			__sync_sub_and_fetch(&m_size, n);
+			total += n;
+		}
+	}
+
+	return total;
+}
+
+
+}  // namespace server
+}  // namespace kumo
+
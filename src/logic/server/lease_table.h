@@ -0,0 +1,84 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef SERVER_LEASE_TABLE_H__
+#define SERVER_LEASE_TABLE_H__
+
+#include "rpc/types.h"
+#include <mp/pthread.h>
+#include <map>
+#include <vector>
+
+namespace kumo {
+namespace server {
+
+
+// Gateways which hold a lease on a key serve it from their local cache
+// until the lease expires or it is revoked by an update of the key.
+class lease_table {
+public:
+	lease_table();
+	~lease_table();
+
+public:
+	// returns false if limit leases are already granted
+	bool grant(uint64_t hash, const rpc::basic_shared_session& s,
+			uint32_t msec, size_t limit);
+
+	// removes leases on the hash and returns living holders
+	void revoke(uint64_t hash, std::vector<rpc::basic_shared_session>* result);
+
+	size_t purge_expired();
+
+	bool empty() const { return m_size == 0; }
+	size_t size() const { return m_size; }
+
+	static uint64_t now_msec();
+
+	static const size_t STRIPES = 64;
+
+private:
+	struct holder {
+		void* id;
+		rpc::basic_weak_session session;
+		uint64_t expire;
+	};
+	typedef std::multimap<uint64_t, holder> map_t;
+
+	struct stripe {
+		mp::pthread_mutex mutex;
+		map_t map;
+	};
+
+	stripe& stripe_for(uint64_t hash)
+	{
+		return m_stripes[hash % STRIPES];
+	}
+
+	stripe m_stripes[STRIPES];
+	volatile size_t m_size;
+
+private:
+	lease_table(const lease_table&);
+};
+
+
+}  // namespace server
+}  // namespace kumo
+
+#endif /* server/lease_table.h */
+
@@ -43,11 +43,30 @@ struct arg_t : cluster_args {
 	unsigned short replicate_set_retry_num;
 	unsigned short replicate_delete_retry_num;
 	unsigned short replace_set_limit_mem;
+	unsigned short replace_threads;
+	unsigned int anti_entropy_interval_sec;
+	size_t change_log_size_kb;
+
+	unsigned short write_quorum;
+
+	std::string hint_file;
+	size_t hint_limit;
+	unsigned int hint_max_backoff_sec;
+
+	unsigned long replicate_batch_interval_usec;
+	size_t replicate_batch_limit;
 
 	unsigned int garbage_min_time_sec;
 	unsigned int garbage_max_time_sec;
 	size_t garbage_mem_limit_kb;
 
+	unsigned int expire_sweep_interval_sec;
+	unsigned long expire_sweep_interval_usec;  // convert
+	size_t expire_sweep_limit;
+
+	uint32_t lease_max_time_msec;
+	size_t lease_limit;
+
 	virtual void convert()
 	{
 		cluster_args::convert();
@@ -66,9 +85,23 @@ struct arg_t : cluster_args {
 
 		db_backup_basename = dbpath + "-";
 
+		if(replace_threads == 0) {
+			replace_threads = 1;
+		}
+
+		if(write_quorum > MAX_REPLICATION+1) {
+			throw std::runtime_error("-wQ is larger than the maximum replication factor");
+		}
+
+		if(replicate_batch_limit == 0) {
+			replicate_batch_limit = 1;
+		}
+
 		if(garbage_min_time_sec > garbage_max_time_sec) {
 			garbage_min_time_sec = garbage_max_time_sec;
 		}
+
+		expire_sweep_interval_usec = expire_sweep_interval_sec * 1000 * 1000;
 	}
 
 	arg_t(int argc, char** argv) :
@@ -76,9 +109,21 @@ struct arg_t : cluster_args {
 		replicate_set_retry_num(20),
 		replicate_delete_retry_num(20),
 		replace_set_limit_mem(0),
+		replace_threads(4),
+		anti_entropy_interval_sec(0),
+		change_log_size_kb(0),
+		write_quorum(0),
+		hint_limit(1000*1000),
+		hint_max_backoff_sec(60),
+		replicate_batch_interval_usec(200),
+		replicate_batch_limit(64),
 		garbage_min_time_sec(60),
 		garbage_max_time_sec(60*60),
-		garbage_mem_limit_kb(2*1024)
+		garbage_mem_limit_kb(2*1024),
+		expire_sweep_interval_sec(1),
+		expire_sweep_limit(1000),
+		lease_max_time_msec(10*1000),
+		lease_limit(1000*1000)
 	{
 		clock_interval = 8.0;
 
@@ -100,14 +145,40 @@ struct arg_t : cluster_args {
 				type::numeric(&replicate_set_retry_num, replicate_set_retry_num));
 		on("-D", "--replicate-delete-retry",
 				type::numeric(&replicate_delete_retry_num, replicate_delete_retry_num));
+		on("-wQ", "--write-quorum",
+				type::numeric(&write_quorum, write_quorum));
+		on("-hF", "--hint-file",
+				type::string(&hint_file, ""));
+		on("-hN", "--hint-limit",
+				type::numeric(&hint_limit, hint_limit));
+		on("-hX", "--hint-max-backoff",
+				type::numeric(&hint_max_backoff_sec, hint_max_backoff_sec));
 		on("-M", "--replace-memory-limit",
 				type::numeric(&replace_set_limit_mem, replace_set_limit_mem));
+		on("-TP", "--replace-threads",
+				type::numeric(&replace_threads, replace_threads));
+		on("-aI", "--anti-entropy-interval",
+				type::numeric(&anti_entropy_interval_sec, anti_entropy_interval_sec));
+		on("-cS", "--change-log-size",
+				type::numeric(&change_log_size_kb, change_log_size_kb));
+		on("-bI", "--replicate-batch-interval",
+				type::numeric(&replicate_batch_interval_usec, replicate_batch_interval_usec));
+		on("-bN", "--replicate-batch-limit",
+				type::numeric(&replicate_batch_limit, replicate_batch_limit));
 		on("-gN", "--garbage-min-time",
 				type::numeric(&garbage_min_time_sec, garbage_min_time_sec));
 		on("-gX", "--garbage-max-time",
 				type::numeric(&garbage_max_time_sec, garbage_max_time_sec));
 		on("-gS", "--garbage-mem-limit",
 				type::numeric(&garbage_mem_limit_kb, garbage_mem_limit_kb));
+		on("-eI", "--expire-sweep-interval",
+				type::numeric(&expire_sweep_interval_sec, expire_sweep_interval_sec));
+		on("-eN", "--expire-sweep-limit",
+				type::numeric(&expire_sweep_limit, expire_sweep_limit));
+		on("-lT", "--lease-max-time",
+				type::numeric(&lease_max_time_msec, lease_max_time_msec));
+		on("-lN", "--lease-limit",
+				type::numeric(&lease_limit, lease_limit));
 		parse(argc, argv);
 	}
 
@@ -136,14 +207,40 @@ struct arg_t : cluster_args {
 			"--replicate-set-retry    replicate set retry limit\n"
 		"  -D  <number="<<replicate_delete_retry_num<<">        "
 			"--replicate-delete-retry replicate delete retry limit\n"
+		"  -wQ <number="<<write_quorum<<">         "
+			"--write-quorum           number of copies stored before response on set and delete (0: all)\n"
+		"  -hF <path>                "
+			"--hint-file              path to hint file; hand off failed replication instead of retrying it\n"
+		"  -hN <number="<<hint_limit<<">   "
+			"--hint-limit             maximum number of hints\n"
+		"  -hX <seconds="<<hint_max_backoff_sec<<">       "
+			"--hint-max-backoff       maximum interval to replay hints to a down server\n"
 		"  -M  <number="<<replace_set_limit_mem<<">        "
 			"--replace-memory-limit   Memory map limit size\n"
+		"  -TP <number="<<replace_threads<<">         "
+			"--replace-threads        number of threads to scan database for replacing\n"
+		"  -aI <seconds="<<anti_entropy_interval_sec<<">        "
+			"--anti-entropy-interval  interval to compare digests with replicas and repair differences (0: disabled)\n"
+		"  -cS <kilobytes="<<change_log_size_kb<<">      "
+			"--change-log-size        size of recent updates kept to catch up recovered servers (0: disabled)\n"
+		"  -bI <usec="<<replicate_batch_interval_usec<<">         "
+			"--replicate-batch-interval  maximum time to wait for batching replication (0: disabled)\n"
+		"  -bN <number="<<replicate_batch_limit<<">        "
+			"--replicate-batch-limit     maximum number of entries in one batched replication\n"
 		"  -gN <seconds="<<garbage_min_time_sec<<">       "
 			"--garbage-min-time       minimum time to maintenance deleted key\n"
 		"  -gX <seconds="<<garbage_max_time_sec<<">     "
 			"--garbage-max-time       maximum time to maintenance deleted key\n"
 		"  -gS <kilobytes="<<garbage_mem_limit_kb<<">   "
 			"--garbage-mem-limit      maximum memory usage to memory deleted key\n"
+		"  -eI <seconds="<<expire_sweep_interval_sec<<">        "
+			"--expire-sweep-interval  interval to sweep expired keys (0: disabled)\n"
+		"  -eN <number="<<expire_sweep_limit<<">      "
+			"--expire-sweep-limit     maximum number of keys to scan in one sweep\n"
+		"  -lT <msec="<<lease_max_time_msec<<">     "
+			"--lease-max-time         maximum time of cache leases granted to gateways (0: disabled)\n"
+		"  -lN <number="<<lease_limit<<">   "
+			"--lease-limit            maximum number of cache leases\n"
 		;
 		cluster_args::show_usage();
 	}
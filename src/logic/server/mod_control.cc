@@ -106,22 +106,14 @@ RPC_IMPL(mod_control_t, GetStatus, req, z, response)
 
 	case STAT_RHS:
 		{
-			HashSpace::Seed sd;
-			{
-				pthread_scoped_rdlock rhlk(share->rhs_mutex());
-				sd = share->rhs();
-			}
+			HashSpace::Seed sd(*share->rhs());
 			response.result(sd);
 		}
 		break;
 
 	case STAT_WHS:
 		{
-			HashSpace::Seed sd;
-			{
-				pthread_scoped_rdlock whlk(share->whs_mutex());
-				sd = share->whs();
-			}
+			HashSpace::Seed sd(*share->whs());
 			response.result(sd);
 		}
 		break;
@@ -131,14 +123,14 @@ RPC_IMPL(mod_control_t, GetStatus, req, z, response)
 			bool active;
 			bool hssame;
 			{
-				pthread_scoped_rdlock rhlk(share->rhs_mutex());
-				pthread_scoped_rdlock whlk(share->whs_mutex());
-				if(share->rhs() == share->whs()) {
+				hs_snapshot::ref rhs(share->rhs());
+				hs_snapshot::ref whs(share->whs());
+				if(*rhs == *whs) {
 					hssame = true;
 				} else {
 					hssame = false;
 				}
-				if(share->whs().server_is_active(net->addr())) {
+				if(whs->server_is_active(net->addr())) {
 					active = true;
 				} else {
 					active = false;
@@ -158,6 +150,10 @@ RPC_IMPL(mod_control_t, GetStatus, req, z, response)
 		}
 		break;
 
+	case STAT_GARBAGE_DROPPED:
+		response.result( share->db().garbage_dropped() );
+		break;
+
 	default:
 		response.result(msgpack::type::nil());
 		break;
@@ -67,12 +67,13 @@ RPC_IMPL(mod_network_t, HashSpaceSync, req, z, response)
 
 	bool ret = false;
 
-	pthread_scoped_wrlock whlk(share->whs_mutex());
+	pthread_scoped_lock whlk(share->whs_snapshot().mutex());
 //	typedef std::vector<HashSpace::node> nodes_t;
 
-	if(share->whs().clocktime() <= req.param().wseed.clocktime() &&
+	if(share->whs()->clocktime() <= req.param().wseed.clocktime() &&
 			!req.param().wseed.empty()) {
-		share->whs() = HashSpace(req.param().wseed);
+		share->whs_snapshot().publish(HashSpace(req.param().wseed), whlk);
+		net->mod_replace.mark_fault_servers(req.param().wseed);
 		ret = true;
 	}
 //	if(share->whs().clocktime() <= req.param().wseed.clocktime() &&
@@ -88,11 +89,11 @@ RPC_IMPL(mod_network_t, HashSpaceSync, req, z, response)
 //		}
 //	}
 
-	pthread_scoped_wrlock rhlk(share->rhs_mutex());
+	pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
 
-	if(share->rhs().clocktime() <= req.param().rseed.clocktime() &&
+	if(share->rhs()->clocktime() <= req.param().rseed.clocktime() &&
 			!req.param().rseed.empty()) {
-		share->rhs() = HashSpace(req.param().rseed);
+		share->rhs_snapshot().publish(HashSpace(req.param().rseed), rhlk);
 		ret = true;
 	}
 //	if(share->rhs().clocktime() <= req.param().rseed.clocktime() &&
@@ -184,11 +185,12 @@ RPC_REPLY_IMPL(mod_network_t, WHashSpaceRequest, from, res, err, z)
 		LOG_DEBUG("renew hash space");
 		HashSpace::Seed hsseed(res.convert());
 
-		pthread_scoped_wrlock whlk(share->whs_mutex());
-		if(share->whs().empty() || share->whs().clocktime() < ClockTime(hsseed.clocktime())) {
+		pthread_scoped_lock whlk(share->whs_snapshot().mutex());
+		if(share->whs()->empty() || share->whs()->clocktime() < ClockTime(hsseed.clocktime())) {
 		//   ^                ^
-			share->whs() = HashSpace(hsseed);
+			share->whs_snapshot().publish(HashSpace(hsseed), whlk);
 			//^
+			net->mod_replace.mark_fault_servers(hsseed);
 		}
 	}
 }
@@ -213,10 +215,10 @@ RPC_REPLY_IMPL(mod_network_t, RHashSpaceRequest, from, res, err, z)
 		LOG_DEBUG("renew hash space");
 		HashSpace::Seed hsseed(res.convert());
 
-		pthread_scoped_wrlock rhlk(share->rhs_mutex());
-		if(share->rhs().empty() || share->rhs().clocktime() < ClockTime(hsseed.clocktime())) {
+		pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
+		if(share->rhs()->empty() || share->rhs()->clocktime() < ClockTime(hsseed.clocktime())) {
 		//   ^                ^
-			share->rhs() = HashSpace(hsseed);
+			share->rhs_snapshot().publish(HashSpace(hsseed), rhlk);
 			//^
 		}
 	}
@@ -24,11 +24,41 @@ namespace server {
 
 
 mod_replace_t::mod_replace_t() :
-	m_copying(false), m_deleting(false) { }
+	m_copying(false), m_deleting(false),
+	m_anti_entropy_pending(0) { }
 
 mod_replace_t::~mod_replace_t() { }
 
 
+void mod_replace_t::init_change_log(size_t limit)
+{
+	m_changes.init(limit, net->clocktime_now());
+	share->db().set_change_hook(&change_log::hook, &m_changes);
+}
+
+void mod_replace_t::mark_fault_servers(const HashSpace::Seed& seed)
+{
+	if(!m_changes.is_enabled()) {
+		return;
+	}
+	// failed replications to the server are marked by hand_off()
+	// with their clocktime; the oldest one is kept. updates after the
+	// server is marked as fault are not replicated to it.
+	ClockTime since(seed.clocktime());
+	bool taken = false;
+	for(std::vector<HashSpace::node>::const_iterator it(seed.nodes().begin()),
+			it_end(seed.nodes().end()); it != it_end; ++it) {
+		if(!it->is_active()) {
+			if(!taken) {
+				since = m_changes.take_down_unknown(since);
+				taken = true;
+			}
+			m_changes.mark_down(it->addr(), since);
+		}
+	}
+}
+
+
 bool mod_replace_t::test_replicator_assign(const HashSpace& hs, uint64_t h, const address& target)
 {
 	EACH_ASSIGN(hs, h, r,
@@ -39,6 +69,86 @@ bool mod_replace_t::test_replicator_assign(const HashSpace& hs, uint64_t h, cons
 }
 
 
+unsigned int mod_replace_t::replace_parts() const
+{
+	if(!share->db().is_parallel_supported() &&
+			!share->db().is_range_supported()) {
+		return 1;
+	}
+	return share->cfg_replace_threads();
+}
+
+static void send_offers(
+		std::vector<mod_replace_stream_t::offer_storage*>& offers,
+		ClockTime replace_time)
+{
+	// the last offer is sent asynchronously
+	for(size_t i=0; i+1 < offers.size(); ++i) {
+		net->mod_replace_stream.send_offer_sync(*offers[i], replace_time);
+	}
+	net->mod_replace_stream.send_offer(*offers.back(), replace_time);
+}
+
+
+typedef Storage::hash_ranges_t hash_ranges_t;
+
+static void add_hash_range(hash_ranges_t* ranges, uint64_t begin, uint64_t end)
+{
+	if(!ranges->empty() && ranges->back().second + 1 == begin) {
+		ranges->back().second = end;
+	} else {
+		ranges->push_back(std::make_pair(begin, end));
+	}
+}
+
+// collect hash ranges [first, second] where f.is_target() is true.
+// assignment of hashes doesn't change between the boundaries of
+// virtual nodes, so it's enough to test one hash for each of them.
+template <typename F>
+static void collect_hash_ranges(const HashSpace& srchs, const HashSpace& dsths,
+		F& f, hash_ranges_t* ranges)
+{
+	std::vector<uint64_t> b;
+	srchs.get_boundaries(b);
+	dsths.get_boundaries(b);
+	std::sort(b.begin(), b.end());
+	b.erase(std::unique(b.begin(), b.end()), b.end());
+
+	if(b.empty()) {
+		return;
+	}
+
+	// (b.back(), max] and [0, b.front()] belong to b.front()
+	bool wrap = f.is_target(b.front());
+	if(wrap) {
+		add_hash_range(ranges, 0, b.front());
+	}
+
+	for(size_t i=1; i < b.size(); ++i) {
+		if(f.is_target(b[i])) {
+			add_hash_range(ranges, b[i-1] + 1, b[i]);
+		}
+	}
+
+	if(wrap && b.back() != ~(uint64_t)0) {
+		add_hash_range(ranges, b.back() + 1, ~(uint64_t)0);
+	}
+}
+
+// the ranges are scanned by parts[0] ... parts[nparts-1] in parallel.
+template <typename F>
+static void for_each_hash_ranges(const HashSpace& srchs, const HashSpace& dsths,
+		F** parts, unsigned int nparts, ClockTime clocktime)
+{
+	hash_ranges_t ranges;
+	collect_hash_ranges(srchs, dsths, *parts[0], &ranges);
+
+	LOG_INFO("scan ",ranges.size()," hash ranges");
+
+	share->db().for_each_ranges_parallel(parts, nparts, ranges, clocktime);
+}
+
+
 mod_replace_t::replace_state::replace_state() :
 	m_push_waiting(0),
 	m_clocktime(0) {}
@@ -143,25 +253,38 @@ struct mod_replace_t::for_each_replace_copy {
 			const address& addr,
 			const HashSpace& src, const HashSpace& dst,
 			mod_replace_stream_t::offer_storage** offer_storage,
-			const addrvec_t& faults, const ClockTime rtime) :
+			const addrvec_t& faults, const addrvec_t& catchup,
+			const ClockTime rtime) :
 		self(addr),
 		srchs(src), dsths(dst),
 		offer(offer_storage), fault_nodes(faults),
+		catchup_nodes(catchup),
 		replace_time(rtime)
 	{
-		Sa.reserve(NUM_REPLICATION+1);
-		Da.reserve(NUM_REPLICATION+1);
-		current_owners.reserve(NUM_REPLICATION+1);
-		newbies.reserve(NUM_REPLICATION+1);
+		Sa.reserve(dst.replicas());
+		Sf.reserve(dst.replicas());
+		Da.reserve(dst.replicas());
+		current_owners.reserve(dst.replicas());
+		newbies.reserve(dst.replicas());
+		catchups.reserve(dst.replicas());
 	}
 
 	inline void operator() (Storage::iterator& kv);
 
+	// true if records of the hash should be copied by this node
+	inline bool is_target(uint64_t h);
+
+	// catch-up nodes which should be sent updates of the hash;
+	// set by is_target()
+	const addrvec_t& catchup_targets() const { return catchups; }
+
 private:
 	addrvec_t Sa;
+	addrvec_t Sf;
 	addrvec_t Da;
 	addrvec_t current_owners;
 	addrvec_t newbies;
+	addrvec_t catchups;
 
 	const address& self;
 
@@ -170,6 +293,7 @@ private:
 
 	mod_replace_stream_t::offer_storage** offer;
 	const addrvec_t& fault_nodes;
+	const addrvec_t& catchup_nodes;
 	const ClockTime replace_time;
 
 private:
@@ -190,13 +314,13 @@ void mod_replace_t::replace_copy(const address& manager_addr, HashSpace& hs, sha
 
 	LOG_INFO("start replace copy for time(",replace_time.get(),")");
 
-	pthread_scoped_wrlock whlk(share->whs_mutex());
-	pthread_scoped_wrlock rhlk(share->rhs_mutex());
+	pthread_scoped_lock whlk(share->whs_snapshot().mutex());
+	pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
 
-	HashSpace srchs(share->rhs());
+	HashSpace srchs(*share->rhs());
 	rhlk.unlock();
 
-	share->whs() = hs;
+	share->whs_snapshot().publish(hs, whlk);
 	whlk.unlock();
 
 	HashSpace& dsths(hs);
@@ -241,15 +365,48 @@ void mod_replace_t::replace_copy(const address& manager_addr, HashSpace& hs, sha
 	}
 
 	{
-		mod_replace_stream_t::offer_storage* offer = new mod_replace_stream_t::offer_storage(
-				share->cfg_offer_tmpdir(), replace_time);
+		// servers which come back from fault catch up from the change log
+		addrvec_t catchup_nodes;
+		if(m_changes.is_enabled()) {
+			catch_up(srchs, dsths, fault_nodes, &catchup_nodes, replace_time);
+		}
 
-		share->db().for_each(
-				for_each_replace_copy(net->addr(), srchs, dsths, &offer, fault_nodes, replace_time),
-				net->clocktime_now());
+		unsigned int nparts = replace_parts();
+		std::vector<mod_replace_stream_t::offer_storage*> offers(nparts);
+		std::vector<for_each_replace_copy*> parts(nparts);
 
-		net->mod_replace_stream.send_offer(*offer, replace_time);
-		delete offer;
+		for(unsigned int i=0; i < nparts; ++i) {
+			offers[i] = new mod_replace_stream_t::offer_storage(
+					share->cfg_offer_tmpdir(), replace_time);
+			parts[i] = new for_each_replace_copy(
+					net->addr(), srchs, dsths, &offers[i],
+					fault_nodes, catchup_nodes, replace_time);
+		}
+
+		if(share->db().is_range_supported()) {
+			// scan only the ranges which are moved
+			for_each_hash_ranges(srchs, dsths, &parts[0], nparts,
+					net->clocktime_now());
+		} else {
+			share->db().for_each_parallel(&parts[0], nparts,
+					net->clocktime_now());
+		}
+
+		send_offers(offers, replace_time);
+
+		for(unsigned int i=0; i < nparts; ++i) {
+			delete parts[i];
+			delete offers[i];
+		}
+
+		// the servers are copied or caught up
+		addrvec_t dst_nodes;
+		dsths.get_active_nodes(dst_nodes);
+		for(addrvec_iterator it(dst_nodes.begin()); it != dst_nodes.end(); ++it) {
+			if(!srchs.server_is_active(*it)) {
+				m_changes.clear_down(*it);
+			}
+		}
 	}
 
 skip_replace:
@@ -257,23 +414,15 @@ skip_replace:
 	replace_offer_pop(replace_time, stlk);  // replace_copy
 }
 
-void mod_replace_t::for_each_replace_copy::operator() (Storage::iterator& kv)
+bool mod_replace_t::for_each_replace_copy::is_target(uint64_t h)
 {
-	const char* raw_key = kv.key();
-	size_t raw_keylen = kv.keylen();
-	const char* raw_val = kv.val();
-	size_t raw_vallen = kv.vallen();
-	unsigned long size_total = 0;
-
-	// Note: it is done in storage wrapper.
-	//if(raw_vallen < Storage::VALUE_META_SIZE) { return; }
-	//if(raw_keylen < Storage::KEY_META_SIZE) { return; }
-
-	uint64_t h = Storage::hash_of(kv.key());
+	catchups.clear();
 
 	Sa.clear();
+	Sf.clear();
 	EACH_ASSIGN(srchs, h, r, {
-		if(r.is_active()) Sa.push_back(r.addr()); });
+		if(r.is_active()) Sa.push_back(r.addr());
+		else Sf.push_back(r.addr()); });
 
 	Da.clear();
 	EACH_ASSIGN(dsths, h, r, {
@@ -287,18 +436,41 @@ void mod_replace_t::for_each_replace_copy::operator() (Storage::iterator& kv)
 	}
 
 	// FIXME 再配置中にServerがダウンしたときコピーが正常に行われないかもしれない？
-	if(current_owners.empty() || current_owners.front() != self) { return; }
+	if(current_owners.empty() || current_owners.front() != self) { return false; }
 	//if(std::find(current_owners.begin(), current_owners.end(), self)
-	//		== current_owners.end()) { return; }
+	//		== current_owners.end()) { return false; }
 
 	newbies.clear();
 	for(addrvec_iterator it(Da.begin()); it != Da.end(); ++it) {
 		if(std::find(Sa.begin(), Sa.end(), *it) == Sa.end()) {
-			newbies.push_back(*it);
+			// a catch-up node has records of the hash only if
+			// the hash was assigned to it before it went down
+			if(std::find(Sf.begin(), Sf.end(), *it) != Sf.end() &&
+					std::binary_search(catchup_nodes.begin(), catchup_nodes.end(), *it)) {
+				catchups.push_back(*it);
+			} else {
+				newbies.push_back(*it);
+			}
 		}
 	}
 
-	if(newbies.empty()) { return; }
+	return !newbies.empty();
+}
+
+void mod_replace_t::for_each_replace_copy::operator() (Storage::iterator& kv)
+{
+	const char* raw_key = kv.key();
+	size_t raw_keylen = kv.keylen();
+	const char* raw_val = kv.val();
+	size_t raw_vallen = kv.vallen();
+	unsigned long size_total = 0;
+
+	// Note: it is done in storage wrapper.
+	//if(raw_vallen < Storage::VALUE_META_SIZE) { return; }
+	//if(raw_keylen < Storage::KEY_META_SIZE) { return; }
+
+	uint64_t h = Storage::hash_of(kv.key());
+	if(!is_target(h)) { return; }
 
 	for(addrvec_iterator it(newbies.begin()); it != newbies.end(); ++it) {
 		(*offer)->add(*it,
@@ -311,11 +483,7 @@ void mod_replace_t::for_each_replace_copy::operator() (Storage::iterator& kv)
 	if((unsigned long)share->cfg_replace_set_limit_mem() > 0) {
 		if(size_total >= (unsigned long)share->cfg_replace_set_limit_mem()*1024*1024) {
 			LOG_INFO("send replace offer by limit for time(",replace_time.get(),")");
-			net->mod_replace_stream.send_offer(*(*offer), replace_time);
-
-			while(net->mod_replace_stream.accum_set_size()) {
-				sleep(1);
-			}
+			net->mod_replace_stream.send_offer_sync(*(*offer), replace_time);
 
 			delete (*offer);
 			(*offer) = new mod_replace_stream_t::offer_storage(share->cfg_offer_tmpdir(), replace_time);
@@ -324,6 +492,100 @@ void mod_replace_t::for_each_replace_copy::operator() (Storage::iterator& kv)
 }
 
 
+void mod_replace_t::catch_up(const HashSpace& srchs, const HashSpace& dsths,
+		const addrvec_t& fault_nodes, addrvec_t* catchup_nodes,
+		ClockTime replace_time)
+{
+	addrvec_t candidates;
+	{
+		addrvec_t dst_nodes;
+		dsths.get_active_nodes(dst_nodes);
+		for(addrvec_iterator it(dst_nodes.begin()); it != dst_nodes.end(); ++it) {
+			ClockTime since;
+			if(srchs.server_is_fault(*it) &&
+					m_changes.down_since(*it, &since) &&
+					m_changes.covers(since)) {
+				candidates.push_back(*it);
+			}
+		}
+	}
+
+	if(candidates.empty()) {
+		return;
+	}
+
+	mod_replace_stream_t::offer_storage* offer =
+		new mod_replace_stream_t::offer_storage(
+				share->cfg_offer_tmpdir(), replace_time);
+
+	try {
+		std::vector<change_log::entry> entries;
+		for(addrvec_iterator it(candidates.begin()); it != candidates.end(); ++it) {
+			const address& node(*it);
+
+			ClockTime since;
+			if(!m_changes.down_since(node, &since)) { continue; }
+
+			addrvec_t only(1, node);
+			for_each_replace_copy f(net->addr(), srchs, dsths,
+					&offer, fault_nodes, only, replace_time);
+
+			bool covered = true;
+			size_t num = 0;
+			change_log::position pos;
+			while(true) {
+				entries.clear();
+				if(!m_changes.read(since, &pos, CATCHUP_READ_MAX, &entries)) {
+					covered = false;
+					break;
+				}
+				if(entries.empty()) {
+					break;
+				}
+
+				for(std::vector<change_log::entry>::const_iterator e(entries.begin()),
+						e_end(entries.end()); e != e_end; ++e) {
+					f.is_target(Storage::hash_of(e->raw_key.data()));
+					if(f.catchup_targets().empty()) { continue; }
+
+					offer->add(node,
+							e->raw_key.data(), e->raw_key.size(),
+							e->raw_val.data(), e->raw_val.size());
+					++num;
+
+					if((unsigned long)share->cfg_replace_set_limit_mem() > 0 &&
+							offer->stream_size(node) >=
+							(unsigned long)share->cfg_replace_set_limit_mem()*1024*1024) {
+						LOG_INFO("send catch-up offer by limit for time(",replace_time.get(),")");
+						net->mod_replace_stream.send_offer_sync(*offer, replace_time);
+
+						delete offer;
+						offer = new mod_replace_stream_t::offer_storage(share->cfg_offer_tmpdir(), replace_time);
+					}
+				}
+			}
+
+			if(covered) {
+				LOG_INFO("catch up ",node," with ",num," updates since time(",since.get(),")");
+				catchup_nodes->push_back(node);
+			} else {
+				LOG_WARN("change log lost updates to ",node,"; copy all records");
+			}
+		}
+
+		net->mod_replace_stream.send_offer_sync(*offer, replace_time);
+
+	} catch (...) {
+		delete offer;
+		catchup_nodes->clear();
+		throw;
+	}
+	delete offer;
+
+	std::sort(catchup_nodes->begin(), catchup_nodes->end());
+}
+
+
 struct mod_replace_t::for_each_full_replace_copy {
 	for_each_full_replace_copy(
 			const address& addr, const HashSpace& hs,
@@ -366,15 +628,26 @@ void mod_replace_t::full_replace_copy(const address& manager_addr, HashSpace& hs
 	LOG_INFO("start full replace copy for time(",replace_time.get(),")");
 
 	{
-		mod_replace_stream_t::offer_storage* offer = new mod_replace_stream_t::offer_storage(
-				share->cfg_offer_tmpdir(), replace_time);
-	
-		share->db().for_each(
-				for_each_full_replace_copy(net->addr(), hs, &offer, replace_time),
+		unsigned int nparts = replace_parts();
+		std::vector<mod_replace_stream_t::offer_storage*> offers(nparts);
+		std::vector<for_each_full_replace_copy*> parts(nparts);
+
+		for(unsigned int i=0; i < nparts; ++i) {
+			offers[i] = new mod_replace_stream_t::offer_storage(
+					share->cfg_offer_tmpdir(), replace_time);
+			parts[i] = new for_each_full_replace_copy(
+					net->addr(), hs, &offers[i], replace_time);
+		}
+
+		share->db().for_each_parallel(&parts[0], nparts,
 				net->clocktime_now());
-	
-		net->mod_replace_stream.send_offer(*offer, replace_time);
-		delete offer;
+
+		send_offers(offers, replace_time);
+
+		for(unsigned int i=0; i < nparts; ++i) {
+			delete parts[i];
+			delete offers[i];
+		}
 	}
 
 	pthread_scoped_lock stlk(m_state_mutex);
@@ -410,11 +683,7 @@ void mod_replace_t::for_each_full_replace_copy::operator() (Storage::iterator& k
 	if((unsigned long)share->cfg_replace_set_limit_mem() > 0) {
 		if(size_total >= (unsigned long)share->cfg_replace_set_limit_mem()*1024*1024) {
 			LOG_INFO("send replace offer by limit for time(",replace_time.get(),")");
-			net->mod_replace_stream.send_offer(*(*offer), replace_time);
-
-			while(net->mod_replace_stream.accum_set_size()) {
-				sleep(1);
-			}
+			net->mod_replace_stream.send_offer_sync(*(*offer), replace_time);
 
 			delete (*offer);
 			(*offer) = new mod_replace_stream_t::offer_storage(share->cfg_offer_tmpdir(), replace_time);
@@ -456,6 +725,12 @@ struct mod_replace_t::for_each_replace_delete {
 
 	inline void operator() (Storage::iterator& kv);
 
+	// true if records of the hash should be deleted by this node
+	inline bool is_target(uint64_t h)
+	{
+		return !mod_replace_t::test_replicator_assign(m_hs, h, self);
+	}
+
 private:
 	const address& self;
 	const HashSpace& m_hs;
@@ -468,23 +743,38 @@ void mod_replace_t::replace_delete(shared_node& manager, HashSpace& hs, shared_z
 {
 	scoped_set_true set_deleting(&m_deleting);
 
-	pthread_scoped_rdlock whlk(share->whs_mutex());
-	ClockTime replace_time = share->whs().clocktime();
+	pthread_scoped_lock whlk(share->whs_snapshot().mutex());
+	ClockTime replace_time = share->whs()->clocktime();
 
 	{
-		pthread_scoped_wrlock rhlk(share->rhs_mutex());
-		share->rhs() = share->whs();
+		pthread_scoped_lock rhlk(share->rhs_snapshot().mutex());
+		share->rhs_snapshot().publish(*share->whs(), rhlk);
 	}
 
 	LOG_INFO("start replace delete for time(",replace_time.get(),")");
 
-	if(!share->whs().empty()) {
-		HashSpace dsths(share->whs());
+	if(!share->whs()->empty()) {
+		HashSpace dsths(*share->whs());
 		whlk.unlock();
 
-		share->db().for_each(
-				for_each_replace_delete(dsths, net->addr()),
-				net->clocktime_now() );
+		unsigned int nparts = replace_parts();
+		std::vector<for_each_replace_delete*> parts(nparts);
+		for(unsigned int i=0; i < nparts; ++i) {
+			parts[i] = new for_each_replace_delete(dsths, net->addr());
+		}
+
+		if(share->db().is_range_supported()) {
+			// scan only the ranges which are not assigned
+			for_each_hash_ranges(dsths, dsths, &parts[0], nparts,
+					net->clocktime_now());
+		} else {
+			share->db().for_each_parallel(&parts[0], nparts,
+					net->clocktime_now() );
+		}
+
+		for(unsigned int i=0; i < nparts; ++i) {
+			delete parts[i];
+		}
 
 	} else {
 		whlk.unlock();
@@ -510,7 +800,7 @@ void mod_replace_t::for_each_replace_delete::operator() (Storage::iterator& kv)
 	//	kv.del();
 	//}
 	uint64_t h = Storage::hash_of(kv.key());
-	if(!mod_replace_t::test_replicator_assign(m_hs, h, self)) {
+	if(is_target(h)) {
 		LOG_TRACE("replace delete key: ",kv.key());
 		kv.del();
 	}
@@ -525,6 +815,408 @@ RPC_REPLY_IMPL(mod_replace_t, ReplaceDeleteEnd, from, res, err, z)
 }
 
 
+// collect the ranges of virtual nodes whose first active owner is self
+// for each of the other active owners. each range is split into parts.
+static void collect_replica_ranges(const HashSpace& hs, const address& self,
+		unsigned int parts, std::map<address, hash_ranges_t>* peers)
+{
+	std::vector<uint64_t> b;
+	hs.get_boundaries(b);
+	std::sort(b.begin(), b.end());
+	b.erase(std::unique(b.begin(), b.end()), b.end());
+
+	if(b.empty()) {
+		return;
+	}
+
+	std::vector<address> owners;
+	owners.reserve(hs.replicas());
+
+	// (b.back(), max] and [0, b.front()] belong to b.front()
+	for(size_t i=0; i <= b.size(); ++i) {
+		uint64_t begin, end, h;
+		if(i < b.size()) {
+			begin = (i == 0) ? 0 : b[i-1] + 1;
+			end = b[i];
+			h = b[i];
+		} else if(b.back() != ~(uint64_t)0) {
+			begin = b.back() + 1;
+			end = ~(uint64_t)0;
+			h = b.front();
+		} else {
+			break;
+		}
+
+		owners.clear();
+		EACH_ASSIGN(hs, h, r, {
+			if(r.is_active()) owners.push_back(r.addr()); });
+
+		if(owners.empty() || owners.front() != self) { continue; }
+
+		for(std::vector<address>::iterator it(owners.begin()+1);
+				it != owners.end(); ++it) {
+			digest_table::split(begin, end, parts, &(*peers)[*it]);
+		}
+	}
+}
+
+static inline bool hash_ranges_include(const hash_ranges_t& ranges, uint64_t h)
+{
+	hash_ranges_t::const_iterator it = std::upper_bound(
+			ranges.begin(), ranges.end(),
+			std::make_pair(h, ~(uint64_t)0));
+	if(it == ranges.begin()) { return false; }
+	--it;
+	return h <= it->second;
+}
+
+
+bool mod_replace_t::is_anti_entropy_ready(ClockTime hs_clocktime) const
+{
+	if(m_copying || m_deleting) { return false; }
+	hs_snapshot::ref rhs(share->rhs());
+	hs_snapshot::ref whs(share->whs());
+	// not replacing
+	return !rhs->empty() && rhs->clocktime() == hs_clocktime &&
+		whs->clocktime() == hs_clocktime;
+}
+
+void mod_replace_t::anti_entropy()
+{
+	if(m_copying || m_deleting) { return; }
+
+	// the previous round is not finished
+	if(!__sync_bool_compare_and_swap(&m_anti_entropy_pending, 0, 1)) {
+		return;
+	}
+
+	try {
+		wavy::submit(&mod_replace_t::start_anti_entropy, this);
+	} catch (std::exception& e) {
+		LOG_ERROR("anti-entropy failed: ",e.what());
+		anti_entropy_done();
+	} catch (...) {
+		LOG_ERROR("anti-entropy failed: unknown error");
+		anti_entropy_done();
+	}
+}
+
+void mod_replace_t::anti_entropy_done()
+{
+	__sync_sub_and_fetch(&m_anti_entropy_pending, 1);
+}
+
+void mod_replace_t::start_anti_entropy()
+try {
+	HashSpace hs(*share->rhs());
+	if(!is_anti_entropy_ready(hs.clocktime())) {
+		anti_entropy_done();
+		return;
+	}
+
+	std::map<address, hash_ranges_t> peers;
+	collect_replica_ranges(hs, net->addr(), ANTI_ENTROPY_PARTS, &peers);
+
+	// ranges of the peers are same or don't overlap; digests of
+	// all ranges are computed at once
+	hash_ranges_t all;
+	for(std::map<address, hash_ranges_t>::iterator it(peers.begin()),
+			it_end(peers.end()); it != it_end; ++it) {
+		all.insert(all.end(), it->second.begin(), it->second.end());
+	}
+	std::sort(all.begin(), all.end());
+	all.erase(std::unique(all.begin(), all.end()), all.end());
+
+	std::vector<uint64_t> all_digests;
+	if(!m_digests.get(share->db(), hs.clocktime(), net->clocktime_now(),
+				all, &all_digests)) {
+		LOG_DEBUG("anti-entropy: scanned recently; skip");
+		anti_entropy_done();
+		return;
+	}
+
+	for(std::map<address, hash_ranges_t>::iterator it(peers.begin()),
+			it_end(peers.end()); it != it_end; ++it) {
+		const hash_ranges_t& ranges(it->second);
+
+		std::vector<uint64_t> digests;
+		digests.reserve(ranges.size());
+		for(hash_ranges_t::const_iterator r(ranges.begin()),
+				r_end(ranges.end()); r != r_end; ++r) {
+			digests.push_back(all_digests[
+					std::lower_bound(all.begin(), all.end(), *r) - all.begin()]);
+		}
+
+		std::vector<uint64_t> bounds;
+		bounds.reserve(ranges.size()*2);
+		for(hash_ranges_t::const_iterator r(ranges.begin()),
+				r_end(ranges.end()); r != r_end; ++r) {
+			bounds.push_back(r->first);
+			bounds.push_back(r->second);
+		}
+
+		LOG_DEBUG("send ",ranges.size()," digests to ",it->first);
+
+		shared_zone nullz;
+		ReplaceDigest param(hs.clocktime(), bounds, digests);
+
+		// released by the response; this round holds one until the end.
+		// the response may be received before call() returns.
+		__sync_add_and_fetch(&m_anti_entropy_pending, 1);
+
+		try {
+			using namespace mp::placeholders;
+			net->get_node(it->first)->call(param, nullz,
+					BIND_RESPONSE(mod_replace_t, ReplaceDigest, it->first,
+						hs.clocktime()),
+					ANTI_ENTROPY_TIMEOUT_STEPS);
+		} catch (...) {
+			anti_entropy_done();
+			throw;
+		}
+	}
+
+	anti_entropy_done();
+
+} catch (std::exception& e) {
+	LOG_ERROR("anti-entropy failed: ",e.what());
+	anti_entropy_done();
+} catch (...) {
+	LOG_ERROR("anti-entropy failed: unknown error");
+	anti_entropy_done();
+}
+
+RPC_REPLY_IMPL(mod_replace_t, ReplaceDigest, from, res, err, z,
+		address peer, ClockTime hs_clocktime)
+{
+	if(!err.is_nil()) {
+		LOG_WARN("ReplaceDigest to ",peer," failed: ",err);
+		anti_entropy_done();
+		return;
+	}
+
+	if(res.is_nil()) {
+		LOG_DEBUG("hash space of ",peer," is not same or it scanned recently; skip anti-entropy");
+		anti_entropy_done();
+		return;
+	}
+
+	try {
+		std::vector<uint64_t> bounds(res.as<std::vector<uint64_t> >());
+
+		hash_ranges_t diff;
+		for(size_t i=0; i+1 < bounds.size(); i += 2) {
+			diff.push_back(std::make_pair(bounds[i], bounds[i+1]));
+		}
+
+		if(diff.empty()) {
+			anti_entropy_done();
+			return;
+		}
+
+		// digests will be computed again after repairing
+		m_digests.invalidate(diff);
+
+		wavy::submit(&mod_replace_t::finish_repair_ranges, this,
+				peer, diff, hs_clocktime);
+
+	} catch (std::exception& e) {
+		LOG_ERROR("anti-entropy with ",peer," failed: ",e.what());
+		anti_entropy_done();
+	} catch (...) {
+		LOG_ERROR("anti-entropy with ",peer," failed: unknown error");
+		anti_entropy_done();
+	}
+}
+
+void mod_replace_t::finish_repair_ranges(address peer, digest_ranges_t& ranges,
+		ClockTime hs_clocktime)
+{
+	try {
+		repair_ranges(peer, ranges, hs_clocktime);
+	} catch (std::exception& e) {
+		LOG_ERROR("anti-entropy with ",peer," failed: ",e.what());
+	} catch (...) {
+		LOG_ERROR("anti-entropy with ",peer," failed: unknown error");
+	}
+	anti_entropy_done();
+}
+
+
+RPC_IMPL(mod_replace_t, ReplaceDigest, req, z, response)
+{
+	shared_zone life(z.release());
+
+	wavy::submit(&mod_replace_t::compare_digests, this,
+			req.node()->addr(), req.param(), response, life);
+}
+
+void mod_replace_t::compare_digests(address from, ReplaceDigest& param,
+		rpc::weak_responder response, shared_zone life)
+try {
+	if(!is_anti_entropy_ready(param.hs_clocktime)) {
+		response.null();
+		return;
+	}
+
+	const std::vector<uint64_t>& bounds(param.ranges);
+	const std::vector<uint64_t>& peer_digests(param.digests);
+
+	if(bounds.size() != peer_digests.size()*2) {
+		response.error((uint8_t)rpc::protocol::SERVER_ERROR);
+		return;
+	}
+
+	hash_ranges_t ranges;
+	ranges.reserve(peer_digests.size());
+	for(size_t i=0; i < peer_digests.size(); ++i) {
+		uint64_t begin = bounds[i*2];
+		uint64_t end   = bounds[i*2+1];
+		// digest_table requires sorted ranges
+		if(begin > end || (!ranges.empty() && begin <= ranges.back().second)) {
+			response.error((uint8_t)rpc::protocol::SERVER_ERROR);
+			return;
+		}
+		ranges.push_back(std::make_pair(begin, end));
+	}
+
+	std::vector<uint64_t> digests;
+	if(!m_digests.get(share->db(), param.hs_clocktime, net->clocktime_now(),
+				ranges, &digests)) {
+		// scanned recently; skip this round like a hash space mismatch
+		LOG_DEBUG("anti-entropy with ",from,": scanned recently; skip");
+		response.null();
+		return;
+	}
+
+	hash_ranges_t diff;
+	std::vector<uint64_t> result;
+	for(size_t i=0; i < ranges.size(); ++i) {
+		if(digests[i] != peer_digests[i]) {
+			diff.push_back(ranges[i]);
+			result.push_back(ranges[i].first);
+			result.push_back(ranges[i].second);
+		}
+	}
+
+	LOG_INFO("anti-entropy with ",from,": ",
+			diff.size()," of ",ranges.size()," ranges differ");
+
+	m_digests.invalidate(diff);
+	response.result(result);
+
+	if(!diff.empty()) {
+		repair_ranges(from, diff, param.hs_clocktime);
+	}
+
+} catch (std::exception& e) {
+	LOG_ERROR("anti-entropy with ",from," failed: ",e.what());
+} catch (...) {
+	LOG_ERROR("anti-entropy with ",from," failed: unknown error");
+}
+
+
+struct mod_replace_t::for_each_repair {
+	for_each_repair(const address& addr, const hash_ranges_t& r,
+			mod_replace_stream_t::offer_storage** offer_storage,
+			const ClockTime rtime, const ClockTime hstime, bool* abort) :
+		peer(addr), ranges(r),
+		offer(offer_storage),
+		replace_time(rtime), hs_clocktime(hstime),
+		aborted(abort) { }
+
+	inline void operator() (Storage::iterator& kv);
+
+private:
+	const address& peer;
+	const hash_ranges_t& ranges;
+
+	mod_replace_stream_t::offer_storage** offer;
+	const ClockTime replace_time;
+	const ClockTime hs_clocktime;
+	bool* aborted;
+
+private:
+	for_each_repair();
+};
+
+// offers records in the ranges to the peer.
+// the peer stores them if they are newer than its records.
+// aborted if replacing starts or the hash space is changed, so that
+// the offers don't conflict with the offers of replace_copy.
+void mod_replace_t::repair_ranges(const address& peer, const digest_ranges_t& ranges,
+		ClockTime hs_clocktime)
+{
+	ClockTime replace_time = net->clocktime_now();
+
+	LOG_INFO("anti-entropy: repair ",ranges.size()," ranges with ",peer);
+
+	mod_replace_stream_t::offer_storage* offer =
+		new mod_replace_stream_t::offer_storage(
+				share->cfg_offer_tmpdir(), replace_time);
+
+	bool aborted = false;
+	try {
+		for_each_repair f(peer, ranges, &offer, replace_time,
+				hs_clocktime, &aborted);
+
+		// removed records are offered, too; the peer removes the
+		// record if it missed the remove
+		if(share->db().is_range_supported()) {
+			for(hash_ranges_t::const_iterator it(ranges.begin()),
+					it_end(ranges.end()); it != it_end && !aborted; ++it) {
+				share->db().for_each_range_with_removed(f, it->first, it->second,
+						net->clocktime_now());
+			}
+		} else {
+			share->db().for_each_with_removed(f, net->clocktime_now());
+		}
+
+		if(aborted || !is_anti_entropy_ready(hs_clocktime)) {
+			LOG_INFO("anti-entropy: replacing started; abort repair with ",peer);
+		} else {
+			net->mod_replace_stream.send_offer_sync(*offer, replace_time);
+		}
+
+	} catch (...) {
+		delete offer;
+		throw;
+	}
+	delete offer;
+}
+
+void mod_replace_t::for_each_repair::operator() (Storage::iterator& kv)
+{
+	if(*aborted) { return; }
+	if(net->mod_replace.is_copying() || net->mod_replace.is_deleting()) {
+		*aborted = true;
+		return;
+	}
+
+	uint64_t h = Storage::hash_of(kv.key());
+	if(!hash_ranges_include(ranges, h)) { return; }
+
+	(*offer)->add(peer,
+			kv.key(), kv.keylen(),
+			kv.val(), kv.vallen());
+
+	if((unsigned long)share->cfg_replace_set_limit_mem() > 0) {
+		if((*offer)->stream_size(peer) >=
+				(unsigned long)share->cfg_replace_set_limit_mem()*1024*1024) {
+			if(!net->mod_replace.is_anti_entropy_ready(hs_clocktime)) {
+				*aborted = true;
+				return;
+			}
+			LOG_INFO("send repair offer by limit to ",peer);
+			net->mod_replace_stream.send_offer_sync(*(*offer), replace_time);
+
+			delete (*offer);
+			(*offer) = new mod_replace_stream_t::offer_storage(share->cfg_offer_tmpdir(), replace_time);
+		}
+	}
+}
+
+
 }  // namespace server
 }  // namespace kumo
 
@@ -145,6 +145,17 @@ void mod_replace_stream_t::send_offer(mod_replace_stream_t::offer_storage& offer
 	}
 }
 
+void mod_replace_stream_t::send_offer_sync(mod_replace_stream_t::offer_storage& offer, ClockTime replace_time)
+{
+	pthread_scoped_lock sdlk(m_send_offer_mutex);
+
+	send_offer(offer, replace_time);
+
+	while(accum_set_size()) {
+		sleep(1);
+	}
+}
+
 
 RPC_REPLY_IMPL(mod_replace_stream_t, ReplaceOffer, from, res, err, z,
 		address addr, uint32_t counter)
@@ -493,37 +504,79 @@ class mod_replace_stream_t::stream_handler : public zconnection<stream_handler>
 public:
 	stream_handler(int fd) :
 		zconnection<stream_handler>(fd),
-		m_items(0), m_major_counter(0), m_minor_counter(0) { }
+		m_items(0), m_major_counter(0), m_minor_counter(0)
+	{
+		// push_back never throws
+		m_batch_keys.reserve(Storage::UPDATEV_MAX);
+		m_batch_keylens.reserve(Storage::UPDATEV_MAX);
+		m_batch_vals.reserve(Storage::UPDATEV_MAX);
+		m_batch_vallens.reserve(Storage::UPDATEV_MAX);
+		m_batch_zones.reserve(Storage::UPDATEV_MAX);
+	}
 
-	~stream_handler() { }
+	~stream_handler()
+	{
+		try {
+			submit_flush();
+		} catch (...) { }
+		clear_batch();
+	}
 
 	void submit_message(rpc::msgobj msg, rpc::auto_zone& z);
+	void submit_flush();
+
+private:
+	void clear_batch();
 
 private:
 	uint64_t m_items;
 	uint64_t m_major_counter;
 	volatile uint64_t m_minor_counter;
+
+	std::vector<const char*> m_batch_keys;
+	std::vector<size_t> m_batch_keylens;
+	std::vector<const char*> m_batch_vals;
+	std::vector<size_t> m_batch_vallens;
+	std::vector<msgpack::zone*> m_batch_zones;
 };
 
 void mod_replace_stream_t::stream_handler::submit_message(rpc::msgobj msg, rpc::auto_zone& z)
 {
 	if(msg.is_nil()) {
+		submit_flush();
+
 		msgpack::sbuffer tmpbuf(32);
 		msgpack::packer<msgpack::sbuffer>(tmpbuf).pack_nil();
 		wavy::write(fd(), tmpbuf.data(), tmpbuf.size());
 		return;
 	}
 
-	msgpack::type::tuple<msgtype::DBKey, msgtype::DBValue> kv(msg);
+	msgpack::type::tuple<msgtype::DBKey, msgpack::type::raw_ref> kv(msg);
 	msgtype::DBKey key = kv.get<0>();
-	msgtype::DBValue val = kv.get<1>();
+	msgpack::type::raw_ref val = kv.get<1>();
 
-	// FIXME updatev
-	share->db().update(
-			key.raw_data(), key.raw_size(),
-			val.raw_data(), val.raw_size());
+	if(val.size < Storage::VALUE_META_SIZE) {
+		// removed record sent by catch-up
+		if(val.size != Storage::VALUE_CLOCKTIME_SIZE) {
+			throw msgpack::type_error();
+		}
+		submit_flush();  // keep the order of the updates
+		if(share->db().remove(key.raw_data(), key.raw_size(),
+					Storage::clocktime_of(val.ptr))) {
+			net->mod_store.revoke_leases(key);
+		}
 
-	// update() returns false means that key is overwritten while replicating.
+	} else {
+		m_batch_keys.push_back(key.raw_data());
+		m_batch_keylens.push_back(key.raw_size());
+		m_batch_vals.push_back(val.ptr);
+		m_batch_vallens.push_back(val.size);
+		m_batch_zones.push_back(z.release());
+
+		if(m_batch_keys.size() >= Storage::UPDATEV_MAX) {
+			submit_flush();
+		}
+	}
 
 	if((++m_major_counter) % 100 == 0) {
 		m_minor_counter += 1;
@@ -536,6 +589,48 @@ void mod_replace_stream_t::stream_handler::submit_message(rpc::msgobj msg, rpc::
 	}
 }
 
+void mod_replace_stream_t::stream_handler::submit_flush()
+{
+	if(m_batch_keys.empty()) {
+		return;
+	}
+
+	bool updated[Storage::UPDATEV_MAX];
+
+	try {
+		share->db().updatev(
+				&m_batch_keys[0], &m_batch_keylens[0],
+				&m_batch_vals[0], &m_batch_vallens[0],
+				m_batch_keys.size(), updated);
+	} catch (...) {
+		clear_batch();
+		throw;
+	}
+
+	// updated[i] == false means that the key is overwritten while replicating.
+	for(size_t i=0; i < m_batch_keys.size(); ++i) {
+		if(updated[i]) {
+			net->mod_store.revoke_leases(
+					msgtype::DBKey(m_batch_keys[i], m_batch_keylens[i]));
+		}
+	}
+
+	clear_batch();
+}
+
+void mod_replace_stream_t::stream_handler::clear_batch()
+{
+	for(std::vector<msgpack::zone*>::iterator it(m_batch_zones.begin()),
+			it_end(m_batch_zones.end()); it != it_end; ++it) {
+		delete *it;
+	}
+	m_batch_keys.clear();
+	m_batch_keylens.clear();
+	m_batch_vals.clear();
+	m_batch_vallens.clear();
+	m_batch_zones.clear();
+}
+
 
 }  // namespace server
 }  // namespace kumo
@@ -17,6 +17,11 @@
 //
 #include "server/framework.h"
 #include "server/mod_control.h"
+#include "gateway/mod_network.h"
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <time.h>
 
 #define EACH_ASSIGNED_ACTIVE_NODE_EXCLUDE_ONE(EXCLUDE, HS, HASH, NODE, CODE) \
 	EACH_ASSIGN(HS, HASH, _real_, \
@@ -45,19 +50,103 @@ namespace kumo {
 namespace server {
 
 
-void mod_store_t::check_replicator_assign(HashSpace& hs, uint64_t h)
+class mod_store_t::replicate_batch_thread : public mp::pthread_thread {
+public:
+	replicate_batch_thread(mod_store_t* store) :
+		mp::pthread_thread(this), m_store(store) { }
+
+	void operator() ()
+	{
+		m_store->run_replicate_batch();
+	}
+
+private:
+	mod_store_t* m_store;
+	replicate_batch_thread();
+	replicate_batch_thread(const replicate_batch_thread&);
+};
+
+mod_store_t::mod_store_t() :
+	m_replicate_batch_thread(NULL),
+	m_replicate_batch_end(false) { }
+
+mod_store_t::~mod_store_t()
 {
-	if(hs.empty()) {
-		throw std::runtime_error("server not ready");
+	if(m_replicate_batch_thread) {
+		{
+			pthread_scoped_lock rblk(m_replicate_batch_mutex);
+			m_replicate_batch_end = true;
+			m_replicate_batch_cond.signal();
+		}
+		m_replicate_batch_thread->join();
+		delete m_replicate_batch_thread;
+	}
+	for(replicate_set_queue_t::iterator it(m_replicate_set_queue.begin()),
+			it_end(m_replicate_set_queue.end()); it != it_end; ++it) {
+		delete (*it)->life;
+	}
+	for(replicate_batch_map_t::iterator it(m_replicate_batches.begin()),
+			it_end(m_replicate_batches.end()); it != it_end; ++it) {
+		shared_zone life;
+		life.swap(it->second->life);
+	}
+}
+
+
+void mod_store_t::sweep_expired()
+try {
+	if(!share->db().is_sweep_supported()) {
+		return;
 	}
+	size_t n = share->db().sweep_expired(share->cfg_expire_sweep_limit());
+	if(n > 0) {
+		LOG_DEBUG("swept ",n," expired keys");
+	}
+} catch (std::exception& e) {
+	LOG_WARN("sweep expired keys failed: ",e.what());
+} catch (...) {
+	LOG_WARN("sweep expired keys failed: unknown error");
+}
+
+void mod_store_t::purge_garbage()
+try {
+	size_t n = share->db().purge_garbage(net->clocktime_now());
+	if(n > 0) {
+		LOG_DEBUG("purged ",n," deleted keys");
+	}
+	if(!m_leases.empty()) {
+		n = m_leases.purge_expired();
+		if(n > 0) {
+			LOG_TRACE("purged ",n," expired leases");
+		}
+	}
+} catch (std::exception& e) {
+	LOG_WARN("purge deleted keys failed: ",e.what());
+} catch (...) {
+	LOG_WARN("purge deleted keys failed: unknown error");
+}
+
+
+bool mod_store_t::test_replicator_assign(const HashSpace& hs, uint64_t h)
+{
 	EACH_ASSIGN(hs, h, r,
 			if(r.is_active()) {  // don't write to fault node
-				if(r.addr() == net->addr()) return;
+				if(r.addr() == net->addr()) return true;
 			})
-	throw std::runtime_error("obsolete hash space");
+	return false;
+}
+
+void mod_store_t::check_replicator_assign(const HashSpace& hs, uint64_t h)
+{
+	if(hs.empty()) {
+		throw std::runtime_error("server not ready");
+	}
+	if(!test_replicator_assign(hs, h)) {
+		throw std::runtime_error("obsolete hash space");
+	}
 }
 
-void mod_store_t::check_coordinator_assign(HashSpace& hs, uint64_t h)
+void mod_store_t::check_coordinator_assign(const HashSpace& hs, uint64_t h)
 {
 	if(hs.empty()) {
 		throw std::runtime_error("server not ready");
@@ -78,36 +167,36 @@ void mod_store_t::calc_replicators(uint64_t h,
 	unsigned int rrep = 0;
 	unsigned int wrep = 0;
 
-	pthread_scoped_rdlock whlk(share->whs_mutex());
-	check_coordinator_assign(share->whs(), h);
+	hs_snapshot::ref whs_ref(share->whs());
+	hs_snapshot::ref rhs_ref(share->rhs());
+	const HashSpace& whs(*whs_ref);
+	const HashSpace& rhs(*rhs_ref);
+	check_coordinator_assign(whs, h);
 
-	if(share->whs().clocktime() == share->rhs().clocktime()) {
+	if(whs.clocktime() == rhs.clocktime()) {
 		EACH_ASSIGNED_ACTIVE_NODE_EXCLUDE_ONE(net->addr(),
-				share->whs(), h, n, {
+				whs, h, n, {
 					wrepto[wrep++] = n;
 				})
 
 	} else {
-		pthread_scoped_rdlock rhlk(share->rhs_mutex());
-		if(share->rhs().empty()) {  // FIXME more elegant way
+		if(rhs.empty()) {  // FIXME more elegant way
 			throw std::runtime_error("server not ready");
 		}
 
-		address wrep_addrs[NUM_REPLICATION+1];
+		address wrep_addrs[MAX_REPLICATION+1];
 
 		EACH_ASSIGNED_ACTIVE_NODE_EXCLUDE_ONE(net->addr(),
-				share->whs(), h, n, {
+				whs, h, n, {
 					wrepto[wrep] = n;
 					wrep_addrs[wrep] = n->addr();
 					++wrep;
 				})
 
-		whlk.unlock();
-
 		wrep_addrs[wrep] = net->addr();  // exclude self
 
 		EACH_ASSIGNED_ACTIVE_NODE_EXCLUDE_N(wrep_addrs, wrep+1,
-				share->rhs(), h, n, {
+				rhs, h, n, {
 					rrepto[rrep++] = n;
 				})
 	}
@@ -116,6 +205,53 @@ void mod_store_t::calc_replicators(uint64_t h,
 	*wrep_num = wrep;
 }
 
+mod_store_t::write_quorum* mod_store_t::new_write_quorum(shared_zone& life,
+		uint8_t requested, unsigned int replicas)
+{
+	unsigned int w = requested;
+	if(w == 0) {
+		w = share->cfg_write_quorum();
+	}
+
+	write_quorum* q = (write_quorum*)life->malloc(sizeof(write_quorum));
+	if(w == 0 || w > replicas) {
+		q->acks = replicas;
+	} else {
+		q->acks = w - 1;  // the coordinator stores the first copy
+	}
+	q->spares = replicas - q->acks;
+	return q;
+}
+
+bool mod_store_t::write_quorum::ack()
+{
+	while(true) {
+		unsigned int n = acks;
+		if(n == 0) {
+			return false;  // already replied
+		}
+		if(__sync_bool_compare_and_swap(&acks, n, n-1)) {
+			return n == 1;
+		}
+	}
+}
+
+bool mod_store_t::write_quorum::fail()
+{
+	while(true) {
+		unsigned int n = spares;
+		if(n == 0) {
+			break;
+		}
+		if(__sync_bool_compare_and_swap(&spares, n, n-1)) {
+			return false;  // other replicas can still satisfy the quorum
+		}
+	}
+	// the first failure which breaks the quorum replies nil
+	// unless the result is already replied.
+	return __sync_fetch_and_and(&acks, 0) != 0;
+}
+
 
 RPC_IMPL(mod_store_t, Get, req, z, response)
 {
@@ -124,10 +260,7 @@ RPC_IMPL(mod_store_t, Get, req, z, response)
 			/*std::string(key.data(),key.size()),*/"' with hash ",
 			key.hash());
 
-	{
-		pthread_scoped_rdlock rhlk(share->rhs_mutex());
-		check_replicator_assign(share->rhs(), key.hash());
-	}
+	check_replicator_assign(*share->rhs(), key.hash());
 
 	uint32_t raw_vallen;
 	const char* raw_val = share->db().get(
@@ -155,44 +288,215 @@ RPC_IMPL(mod_store_t, GetIfModified, req, z, response)
 			/*std::string(key.data(),key.size()),*/"' with hash ",
 			key.hash());
 
-	{
-		pthread_scoped_rdlock rhlk(share->rhs_mutex());
-		check_replicator_assign(share->rhs(), key.hash());
-	}
+	check_replicator_assign(*share->rhs(), key.hash());
 
-	if(share->db().cache_is_valid(
-				key.raw_data(), key.raw_size(),
-				req.param().if_time)) {
+	msgtype::raw_ref val;
+	switch(get_if_modified(key, req.param().if_time, &val, z.get())) {
+	case GET_NOT_MODIFIED:
 		response.result(true);
 		return;
+
+	case GET_FOUND:
+		response.result(val, z);
+		break;
+
+	case GET_NOT_FOUND:
+		response.null();
+		break;
+	}
+
+	++share->stat_num_get();
+}
+
+
+RPC_IMPL(mod_store_t, GetLease, req, z, response)
+{
+	msgtype::DBKey key(req.param().dbkey);
+	LOG_DEBUG("GetLease '",
+			/*std::string(key.data(),key.size()),*/"' with hash ",
+			key.hash());
+
+	check_replicator_assign(*share->rhs(), key.hash());
+
+	// grant the lease before reading the value so that
+	// updates after the read are always notified
+	uint32_t lease_msec = std::min(req.param().lease_msec,
+			share->cfg_lease_max_time_msec());
+	if(lease_msec > 0 && !m_leases.grant(key.hash(), req.session(),
+				lease_msec, share->cfg_lease_limit())) {
+		lease_msec = 0;
+	}
+
+	msgtype::raw_ref val;
+	switch(get_if_modified(key, req.param().if_time, &val, z.get())) {
+	case GET_NOT_MODIFIED:
+		{
+			msgpack::type::tuple<bool, uint32_t> res(true, lease_msec);
+			response.result(res);
+		}
+		return;
+
+	case GET_FOUND:
+		{
+			msgpack::type::tuple<msgtype::raw_ref, uint32_t> res(val, lease_msec);
+			response.result(res, z);
+		}
+		break;
+
+	case GET_NOT_FOUND:
+		response.null();
+		break;
+	}
+
+	++share->stat_num_get();
+}
+
+mod_store_t::get_result_t mod_store_t::get_if_modified(const msgtype::DBKey& key,
+		ClockTime if_time, msgtype::raw_ref* result, msgpack::zone* z)
+{
+	if(share->db().cache_is_valid(
+				key.raw_data(), key.raw_size(), if_time)) {
+		return GET_NOT_MODIFIED;
 	}
 
 	uint32_t raw_vallen;
 	const char* raw_val = share->db().get(
 			key.raw_data(), key.raw_size(),
-			&raw_vallen, z.get());
-
-	if(raw_val) {
-		LOG_DEBUG("key found");
-		msgtype::raw_ref res(raw_val, raw_vallen);
-		response.result(res, z);
+			&raw_vallen, z);
 
-	} else {
+	if(!raw_val) {
 		LOG_DEBUG("key not found");
-		response.null();
+		return GET_NOT_FOUND;
 	}
 
-	++share->stat_num_get();
+	LOG_DEBUG("key found");
+	*result = msgtype::raw_ref(raw_val, raw_vallen);
+	return GET_FOUND;
+}
+
+
+// the holders are notified without waiting for the replies; a holder
+// which misses the notification serves the old value until its lease
+// expires. see kumo-gateway -lL
+void mod_store_t::revoke_leases(const msgtype::DBKey& key)
+try {
+	if(m_leases.empty()) { return; }
+
+	std::vector<rpc::basic_shared_session> holders;
+	m_leases.revoke(key.hash(), &holders);
+	if(holders.empty()) { return; }
+
+	shared_zone life(new msgpack::zone());
+	char* raw_key = (char*)life->malloc(key.raw_size());
+	memcpy(raw_key, key.raw_data(), key.raw_size());
+
+	gateway::mod_network_t::CacheInvalidate param(
+			msgtype::DBKey(raw_key, key.raw_size()));
+
+	rpc::callback_t callback( BIND_RESPONSE(mod_store_t, CacheInvalidate) );
+	for(std::vector<rpc::basic_shared_session>::iterator it(holders.begin()),
+			it_end(holders.end()); it != it_end; ++it) {
+		(*it)->call(param, life, callback, 10);
+	}
+} catch (std::exception& e) {
+	LOG_WARN("CacheInvalidate failed: ",e.what());
+} catch (...) {
+	LOG_WARN("CacheInvalidate failed: unknown error");
+}
+
+RPC_REPLY_IMPL(mod_store_t, CacheInvalidate, from, res, err, z)
+{
+	// the gateway drops its leases when the session is lost
+}
+
+
+RPC_IMPL(mod_store_t, GetMulti, req, z, response)
+{
+	const std::vector<msgtype::DBKey>& keys(req.param().dbkeys);
+	const size_t num = keys.size();
+	LOG_DEBUG("GetMulti ",num," keys");
+
+	msgpack::object* results = (msgpack::object*)z->malloc(
+			sizeof(msgpack::object)*(num ? num : 1));
+
+	{
+		hs_snapshot::ref rhs_ref(share->rhs());
+		const HashSpace& rhs(*rhs_ref);
+		if(rhs.empty()) {
+			throw std::runtime_error("server not ready");
+		}
+		for(size_t i=0; i < num; ++i) {
+			if(test_replicator_assign(rhs, keys[i].hash())) {
+				results[i].type = msgpack::type::NIL;
+			} else {
+				// the gateway retries this key on another node
+				results[i].type = msgpack::type::BOOLEAN;
+				results[i].via.boolean = false;
+			}
+		}
+	}
+
+	for(size_t i=0; i < num; ++i) {
+		if(results[i].type != msgpack::type::NIL) { continue; }
+
+		uint32_t raw_vallen;
+		const char* raw_val = share->db().get(
+				keys[i].raw_data(), keys[i].raw_size(),
+				&raw_vallen, z.get());
+
+		if(raw_val) {
+			results[i].type = msgpack::type::RAW;
+			results[i].via.raw.ptr  = raw_val;
+			results[i].via.raw.size = raw_vallen;
+		}
+	}
+
+	msgpack::object res;
+	res.type = msgpack::type::ARRAY;
+	res.via.array.size = num;
+	res.via.array.ptr  = results;
+	response.result(res, z);
+
+	share->stat_num_get() += num;
 }
 
 
+namespace {
+// stores the value of Set with OP_ADD if the key is not found
+struct add_proc {
+	add_proc(const msgtype::DBValue& val) :
+		m_val(val), found(false) { }
+
+	const char* operator() (const char* raw_oldval, uint32_t raw_oldvallen,
+			uint32_t* result_raw_vallen)
+	{
+		// removed and expired records are not found
+		if(raw_oldval) {
+			found = true;
+			return NULL;
+		}
+		found = false;
+		*result_raw_vallen = m_val.raw_size();
+		return m_val.raw_data();
+	}
+
+private:
+	const msgtype::DBValue& m_val;
+
+public:
+	bool found;
+};
+
+static const unsigned int MODIFY_RETRY_MAX = 16;
+}  // noname namespace
+
 RPC_IMPL(mod_store_t, Set, req, z, response)
 {
 	set_op_t op = req.param().operation;
 	switch(op) {
-	case OP_SET: case OP_SET_ASYNC: case OP_CAS:
-	//case OP_APPEND: case OP_PREPEND:  // FIXME
+	case OP_SET: case OP_SET_ASYNC: case OP_CAS: case OP_ADD:
 		break;
+	// OP_APPEND, OP_PREPEND: see Modify
 	default:
 		throw msgpack::type_error();
 	}
@@ -208,8 +512,8 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 
 	unsigned int rrep_num;
 	unsigned int wrep_num;
-	shared_node rrepto[NUM_REPLICATION];
-	shared_node wrepto[NUM_REPLICATION];
+	shared_node rrepto[MAX_REPLICATION];
+	shared_node wrepto[MAX_REPLICATION];
 	calc_replicators(key.hash(), rrepto, &rrep_num, wrepto, &wrep_num);
 
 	ClockTime ct(net->clock_incr_clocktime());
@@ -232,24 +536,40 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 				response.result(false);
 				return;
 			}
+			revoke_leases(key);
 		} break;
 
-	case OP_PREPEND:
-		// FIXME
-		break;
-
-	case OP_APPEND:
-		// FIXME
-		break;
+	case OP_ADD: {
+			// retried only if the key is updated by other request
+			add_proc proc(val);
+			for(unsigned int i=0; ; ++i) {
+				if(share->db().modify(key.raw_data(), key.raw_size(),
+							proc, life.get())) {
+					break;
+				}
+				if(i >= MODIFY_RETRY_MAX) {
+					LOG_WARN("Set with add conflicted ",i," times");
+					response.null();
+					return;
+				}
+				ct = ClockTime(net->clock_incr_clocktime());
+				val.raw_set_clocktime(ct);
+			}
+			if(proc.found) {
+				response.result(false);
+				return;
+			}
+			revoke_leases(key);
+		} break;
 
 	default:
 		throw std::logic_error("unknown operation");
 	}
 
-	volatile unsigned int* pcr =
-		(volatile unsigned int*)life->malloc(sizeof(volatile unsigned int));
-	if(op == OP_SET_ASYNC) { *pcr = 0; }
-	else { *pcr = wrep_num + rrep_num; }
+	write_quorum* quorum = new_write_quorum(life,
+			(op == OP_SET_ASYNC ? 1 : req.param().write_quorum),
+			wrep_num + rrep_num);
+	bool reply_now = (quorum->acks == 0);
 
 	if(rrep_num != 0) {
 		// rhs Replication
@@ -262,11 +582,11 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 					);
 		rretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateSet,
 				rretry,
-				pcr,
+				quorum,
 				response, ct) );
 
 		for(unsigned int i=0; i < rrep_num; ++i) {
-			rretry->call(rrepto[i], life, 10);
+			replicate(rretry, rrepto[i], life);
 		}
 	}
 	
@@ -281,11 +601,11 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 
 		wretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateSet,
 				wretry,
-				pcr,
+				quorum,
 				response, ct) );
 
 		for(unsigned int i=0; i < wrep_num; ++i) {
-			wretry->call(wrepto[i], life, 10);
+			replicate(wretry, wrepto[i], life);
 		}
 	}
 
@@ -295,11 +615,11 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 			share->db().set(
 					key.raw_data(), key.raw_size(),
 					val.raw_data(), val.raw_size());
+			revoke_leases(key);
 		} break;
 
 	case OP_CAS:
-	case OP_PREPEND:
-	case OP_APPEND:
+	case OP_ADD:
 		break;
 
 	default:
@@ -307,7 +627,7 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 	}
 
 	LOG_DEBUG("set copy required: ", wrep_num+rrep_num);
-	if((wrep_num == 0 && rrep_num == 0) || op == OP_SET_ASYNC) {
+	if(reply_now) {
 		response.result(ct);
 	}
 
@@ -315,143 +635,522 @@ RPC_IMPL(mod_store_t, Set, req, z, response)
 }
 
 
-RPC_IMPL(mod_store_t, Delete, req, z, response)
+RPC_IMPL(mod_store_t, SetMulti, req, z, response)
 {
-	msgtype::DBKey key(req.param().dbkey);
-	bool is_async = req.param().flags.is_async();
-	LOG_DEBUG("Delete '",
-			std::string(key.data(),key.size()),"' with hash",
-			key.hash());
+	const std::vector<msgtype::DBKey>& keys(req.param().dbkeys);
+	const std::vector<msgtype::DBValue>& vals(req.param().dbvals);
+	const size_t num = keys.size();
+	if(vals.size() != num) {
+		throw msgpack::type_error();
+	}
+	LOG_DEBUG("SetMulti ",num," keys");
 
-	unsigned int rrep_num;
-	unsigned int wrep_num;
-	shared_node rrepto[NUM_REPLICATION];
-	shared_node wrepto[NUM_REPLICATION];
-	calc_replicators(key.hash(), rrepto, &rrep_num, wrepto, &wrep_num);
+	SHARED_ZONE(life, z);
 
-	ClockTime ct(net->clock_incr_clocktime());
+	set_multi_state* st = life->allocate<set_multi_state>(response);
+	st->results = (msgpack::object*)life->malloc(
+			sizeof(msgpack::object)*(num ? num : 1));
+	st->write_quorum = req.param().write_quorum;
+	st->num = num;
+	st->remain = num + 1;  // +1: released after all entries are sent
 
-	bool deleted = share->db().remove(key.raw_data(), key.raw_size(), ct);
-	if(!deleted) {
-		if(rrep_num != 0) {
-			//response.result(false);
-			// the key is not stored
-			//return true;
-			wrep_num = 0;
-		} else {
-			response.result(false);
-			// the key is not stored
-			return;
-		}
+	for(size_t i=0; i < num; ++i) {
+		set_multi_entry(keys[i], vals[i], st, i, life);
 	}
 
-	LOG_DEBUG("delete copy required: ", wrep_num+rrep_num);
-	if((wrep_num == 0 && rrep_num == 0) || is_async) {
-		response.result(true);
+	finish_set_multi(st, life);
+
+	share->stat_num_set() += num;
+}
+
+void mod_store_t::set_multi_entry(const msgtype::DBKey& key, msgtype::DBValue val,
+		set_multi_state* st, size_t index, shared_zone& life)
+{
+	unsigned int rrep_num;
+	unsigned int wrep_num;
+	shared_node rrepto[MAX_REPLICATION];
+	shared_node wrepto[MAX_REPLICATION];
+	try {
+		calc_replicators(key.hash(), rrepto, &rrep_num, wrepto, &wrep_num);
+	} catch (std::exception& e) {
+		// the gateway retries this key on another node
+		LOG_DEBUG("SetMulti: ",e.what());
+		st->results[index].type = msgpack::type::BOOLEAN;
+		st->results[index].via.boolean = false;
+		finish_set_multi(st, life);
+		return;
 	}
 
-	SHARED_ZONE(life, z);
+	ClockTime ct(net->clock_incr_clocktime());
+	val.raw_set_clocktime(ct);
 
-	volatile unsigned int* pcr =
-		(volatile unsigned int*)life->malloc(sizeof(volatile unsigned int));
-	if(is_async) { *pcr = 0; }
-	else { *pcr = wrep_num + rrep_num; }
+	// replaced by nil if the replication failed
+	st->results[index].type = msgpack::type::POSITIVE_INTEGER;
+	st->results[index].via.u64 = ct.get();
+
+	write_quorum* quorum = new_write_quorum(life,
+			st->write_quorum, wrep_num + rrep_num);
+	bool finish_now = (quorum->acks == 0);
 
 	if(rrep_num != 0) {
 		// rhs Replication
-		rpc::retry<ReplicateDelete>* rretry =
-			life->allocate< rpc::retry<ReplicateDelete> >(
-					ReplicateDelete(
-						ct.clock(),
-						replicate_flags_by_rhs(),  // flag = by rhs
-						ct,
-						msgtype::DBKey(key.raw_data(), key.raw_size()))
+		rpc::retry<ReplicateSet>* rretry =
+			life->allocate< rpc::retry<ReplicateSet> >(
+					ReplicateSet(
+						ct.clock(), replicate_flags_by_rhs(),  // flags = by rhs
+						msgtype::DBKey(key.raw_data(), key.raw_size()),
+						msgtype::DBValue(val.raw_data(), val.raw_size()))
 					);
-		rretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateDelete,
-					rretry,
-					pcr,
-					response, deleted) );
+		rretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateSetMulti,
+				rretry,
+				quorum,
+				st, index) );
 
 		for(unsigned int i=0; i < rrep_num; ++i) {
-			rretry->call(rrepto[i], life, 10);
+			replicate(rretry, rrepto[i], life);
 		}
 	}
 
 	{	// whs Replication
-		rpc::retry<ReplicateDelete>* wretry =
-			life->allocate< rpc::retry<ReplicateDelete> >(
-					ReplicateDelete(
-						ct.clock(),
-						replicate_flags_none(),  // flag = none
-						ct,
-						msgtype::DBKey(key.raw_data(), key.raw_size()))
+		rpc::retry<ReplicateSet>* wretry =
+			life->allocate< rpc::retry<ReplicateSet> >(
+					ReplicateSet(
+						ct.clock(), replicate_flags_none(),  // flags = none
+						msgtype::DBKey(key.raw_data(), key.raw_size()),
+						msgtype::DBValue(val.raw_data(), val.raw_size()))
 					);
-		wretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateDelete,
+		wretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateSetMulti,
 				wretry,
-				pcr,
-				response, deleted) );
+				quorum,
+				st, index) );
 
 		for(unsigned int i=0; i < wrep_num; ++i) {
-			wretry->call(wrepto[i], life, 10);
+			replicate(wretry, wrepto[i], life);
 		}
 	}
 
-	++share->stat_num_delete();
+	share->db().set(
+			key.raw_data(), key.raw_size(),
+			val.raw_data(), val.raw_size());
+	revoke_leases(key);
+
+	LOG_DEBUG("set multi copy required: ", wrep_num+rrep_num);
+	if(finish_now) {
+		finish_set_multi(st, life);
+	}
+}
+
+void mod_store_t::finish_set_multi(set_multi_state* st, shared_zone& life)
+{
+	if(__sync_sub_and_fetch(&st->remain, 1) != 0) {
+		return;
+	}
+
+	msgpack::object res;
+	res.type = msgpack::type::ARRAY;
+	res.via.array.size = st->num;
+	res.via.array.ptr  = st->results;
+	st->response.result(res, life);
 }
 
 
+namespace {
+// builds new value of Modify in the storage
+struct modify_proc {
+	enum result_t {
+		MODIFIED,
+		NOT_FOUND,
+		NOT_NUMBER
+	};
 
-RPC_REPLY_IMPL(mod_store_t, ReplicateSet, from, res, err, z,
-		rpc::retry<ReplicateSet>* retry,
-		volatile unsigned int* copy_required,
-		rpc::weak_responder response, ClockTime clocktime)
-{
-	LOG_DEBUG("ResReplicateSet ",res,",",err," remain:",*copy_required);
-	// retry if failed
-	if(!err.is_nil()) {
-		if(SESSION_IS_ACTIVE(from)) {
-			// FIXME delayed retry?
-			if(retry->retry_incr(share->cfg_replicate_set_retry_num())) {
-				SHARED_ZONE(life, z);
-				retry->call(from, life);
-				LOG_WARN("ReplicateSet error: ",err,", retry ",retry->num_retried());
-				return;
+	modify_proc(set_op_t op, const msgtype::DBValue& val,
+			uint32_t headlen, uint64_t amount, msgpack::zone* z) :
+		m_op(op), m_val(val), m_headlen(headlen), m_amount(amount), m_z(z),
+		result(NOT_FOUND), raw_val(NULL), raw_vallen(0) { }
+
+	const char* operator() (const char* raw_oldval, uint32_t raw_oldvallen,
+			uint32_t* result_raw_vallen)
+	{
+		const char* head;
+		const char* data;
+		size_t datalen;
+		uint16_t meta;
+		const char* operand = m_val.data() + m_headlen;
+		size_t operandlen = m_val.size() - m_headlen;
+
+		if(raw_oldval) {
+			head    = raw_oldval + Storage::VALUE_META_SIZE;
+			datalen = raw_oldvallen - Storage::VALUE_META_SIZE;
+			meta    = Storage::meta_of(raw_oldval);
+			if(datalen < m_headlen) {
+				result = NOT_NUMBER;
+				return NULL;
 			}
+			data     = head + m_headlen;
+			datalen -= m_headlen;
+
+		} else if((m_op == OP_INCR || m_op == OP_DECR) && operandlen > 0) {
+			// initial number
+			head       = m_val.data();
+			data       = operand;
+			datalen    = operandlen;
+			meta       = m_val.meta();
+			operand    = NULL;
+			operandlen = 0;
+
+		} else {
+			result = NOT_FOUND;
+			return NULL;
 		}
-		if(!retry->param().flags.is_rhs()) {  // FIXME ?
-			response.null();
-			TLOGPACK("ers",4,
-					"key",msgtype::raw_ref(
-						retry->param().dbkey.data(),
-						retry->param().dbkey.size()),
-					"val",msgtype::raw_ref(
-						retry->param().dbval.data(),
-						retry->param().dbval.size()),
-					"hash",retry->param().dbkey.hash(),
-					"cktm",retry->param().dbval.clocktime(),
-					"to",(from ?
-						mp::static_pointer_cast<rpc::node>(from)->addr():
-						rpc::address()));
-			LOG_ERROR("ReplicateSet failed: ",err);
-			return;
+
+		char numbuf[24];
+		const char* parts[2] = {data, operand};
+		size_t lens[2] = {datalen, operandlen};
+
+		switch(m_op) {
+		case OP_APPEND:
+			break;
+
+		case OP_PREPEND:
+			std::swap(parts[0], parts[1]);
+			std::swap(lens[0], lens[1]);
+			break;
+
+		case OP_INCR:
+		case OP_DECR:
+			if(operand) {
+				uint64_t num;
+				if(!parse_number(data, datalen, &num)) {
+					result = NOT_NUMBER;
+					return NULL;
+				}
+				if(m_op == OP_INCR) {
+					num += m_amount;  // wrap around
+				} else {
+					num = (num < m_amount) ? 0 : num - m_amount;
+				}
+				lens[0] = snprintf(numbuf, sizeof(numbuf), "%llu",
+						(unsigned long long)num);
+				parts[0] = numbuf;
+			}
+			lens[1] = 0;
+			break;
+
+		default:
+			throw std::logic_error("unknown operation");
+		}
+
+		raw_vallen = Storage::VALUE_META_SIZE + m_headlen + lens[0] + lens[1];
+		char* p = (char*)m_z->malloc(raw_vallen);
+		Storage::clocktime_to(clocktime, p);
+		Storage::meta_to(meta, p);
+		char* w = p + Storage::VALUE_META_SIZE;
+		memcpy(w, head, m_headlen);     w += m_headlen;
+		memcpy(w, parts[0], lens[0]);   w += lens[0];
+		memcpy(w, parts[1], lens[1]);
+
+		result = MODIFIED;
+		raw_val = p;
+		*result_raw_vallen = raw_vallen;
+		return raw_val;
+	}
+
+	static bool parse_number(const char* p, size_t len, uint64_t* num)
+	{
+		if(len == 0 || len > 20) { return false; }
+		uint64_t n = 0;
+		for(size_t i=0; i < len; ++i) {
+			if(p[i] < '0' || '9' < p[i]) { return false; }
+			uint64_t x = n * 10 + (p[i] - '0');
+			if(x / 10 != n) { return false; }  // overflow
+			n = x;
+		}
+		*num = n;
+		return true;
+	}
+
+private:
+	set_op_t m_op;
+	const msgtype::DBValue& m_val;
+	uint32_t m_headlen;
+	uint64_t m_amount;
+	msgpack::zone* m_z;
+
+public:
+	ClockTime clocktime;
+	result_t result;
+	const char* raw_val;
+	uint32_t raw_vallen;
+};
+}  // noname namespace
+
+RPC_IMPL(mod_store_t, Modify, req, z, response)
+{
+	set_op_t op = req.param().operation;
+	switch(op) {
+	case OP_APPEND: case OP_PREPEND: case OP_INCR: case OP_DECR:
+		break;
+	default:
+		throw msgpack::type_error();
+	}
+
+	msgtype::DBKey key(req.param().dbkey);
+	msgtype::DBValue val(req.param().dbval);
+	uint32_t headlen = req.param().headlen;
+	if(headlen > val.size()) {
+		throw msgpack::type_error();
+	}
+
+	LOG_DEBUG("Modify with hash ",key.hash(),", op ",op);
+
+	unsigned int rrep_num;
+	unsigned int wrep_num;
+	shared_node rrepto[MAX_REPLICATION];
+	shared_node wrepto[MAX_REPLICATION];
+	calc_replicators(key.hash(), rrepto, &rrep_num, wrepto, &wrep_num);
+
+	SHARED_ZONE(life, z);
+
+	// read-modify-write in this node; retried only if the key is
+	// updated by other request between read and write.
+	modify_proc proc(op, val, headlen, req.param().amount, life.get());
+	for(unsigned int i=0; ; ++i) {
+		proc.clocktime = net->clock_incr_clocktime();
+		if(share->db().modify(key.raw_data(), key.raw_size(),
+					proc, life.get())) {
+			break;
+		}
+		if(i >= MODIFY_RETRY_MAX) {
+			LOG_WARN("Modify conflicted ",i," times");
+			response.null();
+			return;
+		}
+	}
+
+	switch(proc.result) {
+	case modify_proc::MODIFIED:
+		break;
+	case modify_proc::NOT_FOUND:
+		response.result(false);
+		return;
+	case modify_proc::NOT_NUMBER:
+		response.result(true);
+		return;
+	}
+
+	revoke_leases(key);
+
+	ClockTime ct(proc.clocktime);
+	msgtype::raw_ref* stored = life->allocate<msgtype::raw_ref>(
+			proc.raw_val, proc.raw_vallen);
+
+	write_quorum* quorum = new_write_quorum(life,
+			req.param().write_quorum, wrep_num + rrep_num);
+	bool reply_now = (quorum->acks == 0);
+
+	if(rrep_num != 0) {
+		// rhs Replication
+		rpc::retry<ReplicateSet>* rretry =
+			life->allocate< rpc::retry<ReplicateSet> >(
+					ReplicateSet(
+						ct.clock(), replicate_flags_by_rhs(),  // flags = by rhs
+						msgtype::DBKey(key.raw_data(), key.raw_size()),
+						msgtype::DBValue(proc.raw_val, proc.raw_vallen))
+					);
+		rretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateModify,
+				rretry,
+				quorum,
+				response, stored) );
+
+		for(unsigned int i=0; i < rrep_num; ++i) {
+			replicate(rretry, rrepto[i], life);
+		}
+	}
+
+	{	// whs Replication
+		rpc::retry<ReplicateSet>* wretry =
+			life->allocate< rpc::retry<ReplicateSet> >(
+					ReplicateSet(
+						ct.clock(), replicate_flags_none(),  // flags = none
+						msgtype::DBKey(key.raw_data(), key.raw_size()),
+						msgtype::DBValue(proc.raw_val, proc.raw_vallen))
+					);
+		wretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateModify,
+				wretry,
+				quorum,
+				response, stored) );
+
+		for(unsigned int i=0; i < wrep_num; ++i) {
+			replicate(wretry, wrepto[i], life);
+		}
+	}
+
+	LOG_DEBUG("modify copy required: ", wrep_num+rrep_num);
+	if(reply_now) {
+		response.result(*stored, life);
+	}
+
+	++share->stat_num_set();
+}
+
+
+RPC_IMPL(mod_store_t, Delete, req, z, response)
+{
+	msgtype::DBKey key(req.param().dbkey);
+	bool is_async = req.param().flags.is_async();
+	LOG_DEBUG("Delete '",
+			std::string(key.data(),key.size()),"' with hash",
+			key.hash());
+
+	unsigned int rrep_num;
+	unsigned int wrep_num;
+	shared_node rrepto[MAX_REPLICATION];
+	shared_node wrepto[MAX_REPLICATION];
+	calc_replicators(key.hash(), rrepto, &rrep_num, wrepto, &wrep_num);
+
+	ClockTime ct(net->clock_incr_clocktime());
+
+	bool deleted = share->db().remove(key.raw_data(), key.raw_size(), ct);
+	if(deleted) {
+		revoke_leases(key);
+	} else {
+		if(rrep_num != 0) {
+			//response.result(false);
+			// the key is not stored
+			//return true;
+			wrep_num = 0;
+		} else {
+			response.result(false);
+			// the key is not stored
+			return;
+		}
+	}
+
+	SHARED_ZONE(life, z);
+
+	write_quorum* quorum = new_write_quorum(life,
+			(is_async ? 1 : req.param().write_quorum),
+			wrep_num + rrep_num);
+
+	LOG_DEBUG("delete copy required: ", wrep_num+rrep_num);
+	if(quorum->acks == 0) {
+		response.result(true);
+	}
+
+	if(rrep_num != 0) {
+		// rhs Replication
+		rpc::retry<ReplicateDelete>* rretry =
+			life->allocate< rpc::retry<ReplicateDelete> >(
+					ReplicateDelete(
+						ct.clock(),
+						replicate_flags_by_rhs(),  // flag = by rhs
+						ct,
+						msgtype::DBKey(key.raw_data(), key.raw_size()))
+					);
+		rretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateDelete,
+					rretry,
+					quorum,
+					response, deleted) );
+
+		for(unsigned int i=0; i < rrep_num; ++i) {
+			replicate(rretry, rrepto[i], life);
+		}
+	}
+
+	{	// whs Replication
+		rpc::retry<ReplicateDelete>* wretry =
+			life->allocate< rpc::retry<ReplicateDelete> >(
+					ReplicateDelete(
+						ct.clock(),
+						replicate_flags_none(),  // flag = none
+						ct,
+						msgtype::DBKey(key.raw_data(), key.raw_size()))
+					);
+		wretry->set_callback( BIND_RESPONSE(mod_store_t, ReplicateDelete,
+				wretry,
+				quorum,
+				response, deleted) );
+
+		for(unsigned int i=0; i < wrep_num; ++i) {
+			replicate(wretry, wrepto[i], life);
+		}
+	}
+
+	++share->stat_num_delete();
+}
+
+
+
+mod_store_t::replicate_error_t mod_store_t::replicate_set_error(
+		basic_shared_session& from, rpc::msgobj err, auto_zone& z,
+		rpc::retry<ReplicateSet>* retry)
+{
+	if(SESSION_IS_ACTIVE(from) && !hand_off_enabled()) {
+		// FIXME delayed retry?
+		if(retry->retry_incr(share->cfg_replicate_set_retry_num())) {
+			SHARED_ZONE(life, z);
+			retry->call(from, life);
+			LOG_WARN("ReplicateSet error: ",err,", retry ",retry->num_retried());
+			return REPLICATE_RETRIED;
+		}
+	}
+
+	if(retry->param().flags.is_rhs()) {  // FIXME ?
+		return REPLICATE_IGNORED;
+	}
+
+	hand_off(from, retry->param());
+	TLOGPACK("ers",4,
+			"key",msgtype::raw_ref(
+				retry->param().dbkey.data(),
+				retry->param().dbkey.size()),
+			"val",msgtype::raw_ref(
+				retry->param().dbval.data(),
+				retry->param().dbval.size()),
+			"hash",retry->param().dbkey.hash(),
+			"cktm",retry->param().dbval.clocktime(),
+			"to",(from ?
+				mp::static_pointer_cast<rpc::node>(from)->addr():
+				rpc::address()));
+	LOG_ERROR("ReplicateSet failed: ",err);
+	return REPLICATE_FAILED;
+}
+
+RPC_REPLY_IMPL(mod_store_t, ReplicateSet, from, res, err, z,
+		rpc::retry<ReplicateSet>* retry,
+		write_quorum* quorum,
+		rpc::weak_responder response, ClockTime clocktime)
+{
+	LOG_DEBUG("ResReplicateSet ",res,",",err," remain:",quorum->acks);
+	if(!err.is_nil()) {
+		switch(replicate_set_error(from, err, z, retry)) {
+		case REPLICATE_RETRIED:
+			return;
+		case REPLICATE_FAILED:
+			if(quorum->fail()) {
+				response.null();
+			}
+			return;
+		case REPLICATE_IGNORED:
+			break;
 		}
 	}
 
 	LOG_DEBUG("ReplicateSet succeeded");
 
-	if(__sync_sub_and_fetch(copy_required, 1) == 0) {
+	if(quorum->ack()) {
 		response.result(clocktime);
 	}
 }
 
 RPC_REPLY_IMPL(mod_store_t, ReplicateDelete, from, res, err, z,
 		rpc::retry<ReplicateDelete>* retry,
-		volatile unsigned int* copy_required,
+		write_quorum* quorum,
 		rpc::weak_responder response, bool deleted)
 {
 	// retry if failed
 	if(!err.is_nil()) {
-		if(SESSION_IS_ACTIVE(from)) {
+		if(SESSION_IS_ACTIVE(from) && !hand_off_enabled()) {
 			// FIXME delayed retry?
 			if(retry->retry_incr(share->cfg_replicate_delete_retry_num())) {
 				SHARED_ZONE(life, z);
@@ -461,7 +1160,10 @@ RPC_REPLY_IMPL(mod_store_t, ReplicateDelete, from, res, err, z,
 			}
 		}
 		if(!retry->param().flags.is_rhs()) {  // FIXME ?
-			response.null();
+			hand_off(from, retry->param());
+			if(quorum->fail()) {
+				response.null();
+			}
 			TLOGPACK("erd",4,
 					"key",msgtype::raw_ref(
 						retry->param().dbkey.data(),
@@ -477,7 +1179,7 @@ RPC_REPLY_IMPL(mod_store_t, ReplicateDelete, from, res, err, z,
 
 	LOG_DEBUG("ReplicateDelete succeeded");
 
-	if(__sync_sub_and_fetch(copy_required, 1) == 0) {
+	if(quorum->ack()) {
 		if(!deleted && retry->param().flags.is_rhs() &&
 				res.type == msgtype::BOOLEAN && res.via.boolean == true) {
 			deleted = true;
@@ -487,6 +1189,589 @@ RPC_REPLY_IMPL(mod_store_t, ReplicateDelete, from, res, err, z,
 }
 
 
+RPC_REPLY_IMPL(mod_store_t, ReplicateModify, from, res, err, z,
+		rpc::retry<ReplicateSet>* retry,
+		write_quorum* quorum,
+		rpc::weak_responder response, msgtype::raw_ref* stored)
+{
+	LOG_DEBUG("ResReplicateModify ",res,",",err," remain:",quorum->acks);
+	if(!err.is_nil()) {
+		switch(replicate_set_error(from, err, z, retry)) {
+		case REPLICATE_RETRIED:
+			return;
+		case REPLICATE_FAILED:
+			// the modification is already stored in this node and the
+			// replica is recovered by hand off; replying null would make
+			// the gateway apply it again.
+			if(quorum->fail()) {
+				SHARED_ZONE(life, z);
+				response.result(*stored, life);
+			}
+			return;
+		case REPLICATE_IGNORED:
+			break;
+		}
+	}
+
+	if(quorum->ack()) {
+		SHARED_ZONE(life, z);
+		response.result(*stored, life);
+	}
+}
+
+
+RPC_REPLY_IMPL(mod_store_t, ReplicateSetMulti, from, res, err, z,
+		rpc::retry<ReplicateSet>* retry,
+		write_quorum* quorum,
+		set_multi_state* st, size_t index)
+{
+	LOG_DEBUG("ResReplicateSetMulti ",res,",",err," remain:",quorum->acks);
+	if(!err.is_nil()) {
+		switch(replicate_set_error(from, err, z, retry)) {
+		case REPLICATE_RETRIED:
+			return;
+		case REPLICATE_FAILED:
+			if(quorum->fail()) {
+				SHARED_ZONE(life, z);
+				st->results[index].type = msgpack::type::NIL;
+				finish_set_multi(st, life);
+			}
+			return;
+		case REPLICATE_IGNORED:
+			break;
+		}
+	}
+
+	if(quorum->ack()) {
+		SHARED_ZONE(life, z);
+		finish_set_multi(st, life);
+	}
+}
+
+
+void mod_store_t::replicate(rpc::retry<ReplicateSet>* retry,
+		shared_node& node, shared_zone& life)
+{
+	if(share->cfg_replicate_batch_interval_usec() == 0) {
+		retry->call(node, life, 10);
+		return;
+	}
+
+	replicate_batch* full;
+	{
+		pthread_scoped_lock rblk(m_replicate_batch_mutex);
+		if(!replicate_batch_supported(node->addr(), rblk)) {
+			rblk.unlock();
+			retry->call(node, life, 10);
+			return;
+		}
+		replicate_batch* b = replicate_batch_for(node, rblk);
+		b->param.sets.push_back(retry->param());
+		b->set_pending.push_back(replicate_pending(retry->callback(), life));
+		full = replicate_batch_add(b,
+				retry->param().dbkey.raw_size() +
+				retry->param().dbval.raw_size(), rblk);
+	}
+
+	if(full) {
+		send_replicate_batch(full);
+	}
+}
+
+void mod_store_t::replicate(rpc::retry<ReplicateDelete>* retry,
+		shared_node& node, shared_zone& life)
+{
+	if(share->cfg_replicate_batch_interval_usec() == 0) {
+		retry->call(node, life, 10);
+		return;
+	}
+
+	replicate_batch* full;
+	{
+		pthread_scoped_lock rblk(m_replicate_batch_mutex);
+		if(!replicate_batch_supported(node->addr(), rblk)) {
+			rblk.unlock();
+			retry->call(node, life, 10);
+			return;
+		}
+		replicate_batch* b = replicate_batch_for(node, rblk);
+		b->param.deletes.push_back(retry->param());
+		b->delete_pending.push_back(replicate_pending(retry->callback(), life));
+		full = replicate_batch_add(b,
+				retry->param().dbkey.raw_size(), rblk);
+	}
+
+	if(full) {
+		send_replicate_batch(full);
+	}
+}
+
+mod_store_t::replicate_batch* mod_store_t::replicate_batch_for(
+		shared_node& node, REQUIRE_RBLK)
+{
+	replicate_batch_map_t::iterator it(m_replicate_batches.find(node->addr()));
+	if(it != m_replicate_batches.end()) {
+		return it->second;
+	}
+
+	// the batch is allocated in its own life, which is
+	// released when the reply of the batch is received
+	shared_zone life(new msgpack::zone());
+	replicate_batch* b = life->allocate<replicate_batch>();
+	b->life = life;
+	b->node = node;
+	b->size = 0;
+
+	if(m_replicate_batches.empty()) {
+		// wakes up the flush thread
+		unsigned long usec = share->cfg_replicate_batch_interval_usec();
+		clock_gettime(CLOCK_REALTIME, &m_replicate_batch_due);
+		unsigned long nsec = m_replicate_batch_due.tv_nsec + usec % 1000000 * 1000;
+		m_replicate_batch_due.tv_sec += usec / 1000000 + nsec / 1000000000;
+		m_replicate_batch_due.tv_nsec = nsec % 1000000000;
+		m_replicate_batch_cond.signal();
+	}
+
+	m_replicate_batches.insert(std::make_pair(node->addr(), b));
+	return b;
+}
+
+bool mod_store_t::replicate_batch_supported(const address& addr, REQUIRE_RBLK)
+{
+	replicate_batch_unsupported_t::iterator it(
+			m_replicate_batch_unsupported.find(addr));
+	if(it == m_replicate_batch_unsupported.end()) {
+		return true;
+	}
+	if(time(NULL) < it->second) {
+		return false;
+	}
+	// the node may be upgraded
+	m_replicate_batch_unsupported.erase(it);
+	return true;
+}
+
+// returns the batch if it should be sent now
+mod_store_t::replicate_batch* mod_store_t::replicate_batch_add(
+		replicate_batch* b, size_t size, REQUIRE_RBLK)
+{
+	b->size += size;
+	if(b->set_pending.size() + b->delete_pending.size() <
+				share->cfg_replicate_batch_limit() &&
+			b->size < REPLICATE_BATCH_SIZE_MAX) {
+		return NULL;
+	}
+	m_replicate_batches.erase(b->node->addr());
+	return b;
+}
+
+void mod_store_t::send_replicate_batch(replicate_batch* b)
+{
+	shared_zone life;
+	life.swap(b->life);
+
+	LOG_TRACE("ReplicateBatch ",b->param.sets.size()," sets, ",
+			b->param.deletes.size()," deletes to ",b->node->addr());
+
+	b->param.adjust_clock = net->clock_incr();
+
+	b->node->call(b->param, life,
+			BIND_RESPONSE(mod_store_t, ReplicateBatch, b), 10);
+}
+
+void mod_store_t::start_replicate_batch()
+{
+	std::auto_ptr<replicate_batch_thread> th(new replicate_batch_thread(this));
+	th->run();
+	m_replicate_batch_thread = th.release();
+}
+
+void mod_store_t::run_replicate_batch()
+{
+	pthread_scoped_lock rblk(m_replicate_batch_mutex);
+	while(!m_replicate_batch_end) {
+		if(m_replicate_batches.empty()) {
+			m_replicate_batch_cond.wait(m_replicate_batch_mutex);
+			continue;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(now.tv_sec < m_replicate_batch_due.tv_sec ||
+				(now.tv_sec == m_replicate_batch_due.tv_sec &&
+				 now.tv_nsec < m_replicate_batch_due.tv_nsec)) {
+			m_replicate_batch_cond.timedwait(m_replicate_batch_mutex,
+					&m_replicate_batch_due);
+			continue;
+		}
+
+		rblk.unlock();
+		flush_replicate_batch();
+		rblk.relock(m_replicate_batch_mutex);
+	}
+}
+
+void mod_store_t::flush_replicate_batch()
+try {
+	replicate_batch_map_t batches;
+	{
+		pthread_scoped_lock rblk(m_replicate_batch_mutex);
+		if(m_replicate_batches.empty()) {
+			return;
+		}
+		batches.swap(m_replicate_batches);
+	}
+
+	for(replicate_batch_map_t::iterator it(batches.begin()),
+			it_end(batches.end()); it != it_end; ++it) {
+		send_replicate_batch(it->second);
+	}
+} catch (std::exception& e) {
+	LOG_WARN("flush replicate batch failed: ",e.what());
+} catch (...) {
+	LOG_WARN("flush replicate batch failed: unknown error");
+}
+
+RPC_REPLY_IMPL(mod_store_t, ReplicateBatch, from, res, err, z,
+		replicate_batch* b)
+{
+	LOG_DEBUG("ResReplicateBatch ",err);
+	SHARED_ZONE(life, z);
+
+	if(err.type == msgpack::type::POSITIVE_INTEGER &&
+			err.via.u64 == (uint64_t)rpc::protocol::PROTOCOL_ERROR) {
+		// unknown method; the node is older than ReplicateBatch
+		LOG_WARN("ReplicateBatch is not supported by ",b->node->addr(),
+				"; replicate without batching");
+		{
+			pthread_scoped_lock rblk(m_replicate_batch_mutex);
+			m_replicate_batch_unsupported[b->node->addr()] =
+				time(NULL) + REPLICATE_BATCH_RETRY_SEC;
+		}
+		replicate_one_by_one(b);
+		return;
+	}
+
+	const size_t nsets = b->set_pending.size();
+	const size_t num = nsets + b->delete_pending.size();
+
+	msgpack::object nil;
+	nil.type = msgpack::type::NIL;
+
+	msgpack::object failed;
+	failed.type = msgpack::type::POSITIVE_INTEGER;
+	failed.via.u64 = rpc::protocol::SERVER_ERROR;
+
+	const msgpack::object* results = NULL;
+	if(err.is_nil()) {
+		if(res.type == msgpack::type::ARRAY && res.via.array.size == num) {
+			results = res.via.array.ptr;
+		} else {
+			LOG_WARN("ReplicateBatch: invalid response");
+			err = failed;
+		}
+	}
+
+	// same as the replies of ReplicateSet or ReplicateDelete
+	for(size_t i=0; i < num; ++i) {
+		replicate_pending& p(i < nsets ?
+				b->set_pending[i] : b->delete_pending[i - nsets]);
+
+		msgpack::object eres = nil;
+		msgpack::object eerr = err;
+		if(results) {
+			if(results[i].type == msgpack::type::NIL) {
+				eerr = failed;
+			} else if(results[i].type == msgpack::type::POSITIVE_INTEGER) {
+				eerr = results[i];  // storage error
+			} else {
+				eres = results[i];
+			}
+		}
+
+		auto_zone ez(new msgpack::zone());
+		ez->allocate<shared_zone>(life);
+		ez->allocate<shared_zone>(p.life);
+		try {
+			p.callback(from, eres, eerr, ez);
+		} catch (...) { }
+	}
+}
+
+void mod_store_t::replicate_one_by_one(replicate_batch* b)
+{
+	// the entries are held by the life of each entry
+	for(size_t i=0; i < b->set_pending.size(); ++i) {
+		replicate_pending& p(b->set_pending[i]);
+		try {
+			b->node->call(b->param.sets[i], p.life, p.callback, 10);
+		} catch (...) { }
+	}
+	for(size_t i=0; i < b->delete_pending.size(); ++i) {
+		replicate_pending& p(b->delete_pending[i]);
+		try {
+			b->node->call(b->param.deletes[i], p.life, p.callback, 10);
+		} catch (...) { }
+	}
+}
+
+
+void mod_store_t::init_hints(const std::string& path)
+{
+	m_hints.open(path);
+}
+
+bool mod_store_t::hand_off(basic_shared_session& from, const ReplicateSet& param)
+{
+	if(from) {
+		// the server catches up from the update when it comes back
+		net->mod_replace.changes().mark_down(
+				mp::static_pointer_cast<rpc::node>(from)->addr(),
+				param.dbval.clocktime());
+	} else {
+		net->mod_replace.changes().mark_down_unknown(param.dbval.clocktime());
+	}
+	if(!hand_off_enabled() || !from) {
+		return false;
+	}
+	hint_log::hint h;
+	h.type = hint_log::SET;
+	h.clocktime = 0;
+	h.key.assign(param.dbkey.raw_data(), param.dbkey.raw_size());
+	h.val.assign(param.dbval.raw_data(), param.dbval.raw_size());
+	const address& to(mp::static_pointer_cast<rpc::node>(from)->addr());
+	if(!m_hints.add(to, h, share->cfg_hint_limit())) {
+		LOG_WARN("hint log is full; ReplicateSet to ",to," is dropped");
+		return false;
+	}
+	LOG_DEBUG("ReplicateSet to ",to," is handed off");
+	return true;
+}
+
+bool mod_store_t::hand_off(basic_shared_session& from, const ReplicateDelete& param)
+{
+	if(from) {
+		// the server catches up from the update when it comes back
+		net->mod_replace.changes().mark_down(
+				mp::static_pointer_cast<rpc::node>(from)->addr(),
+				param.delete_clocktime);
+	} else {
+		net->mod_replace.changes().mark_down_unknown(param.delete_clocktime);
+	}
+	if(!hand_off_enabled() || !from) {
+		return false;
+	}
+	hint_log::hint h;
+	h.type = hint_log::DELETE;
+	h.clocktime = param.delete_clocktime.get();
+	h.key.assign(param.dbkey.raw_data(), param.dbkey.raw_size());
+	const address& to(mp::static_pointer_cast<rpc::node>(from)->addr());
+	if(!m_hints.add(to, h, share->cfg_hint_limit())) {
+		LOG_WARN("hint log is full; ReplicateDelete to ",to," is dropped");
+		return false;
+	}
+	LOG_DEBUG("ReplicateDelete to ",to," is handed off");
+	return true;
+}
+
+void mod_store_t::replay_hints()
+try {
+	if(m_hints.size() == 0) {
+		return;
+	}
+
+	std::vector<hint_log::batch> batches;
+	m_hints.take(time(NULL), HINT_REPLAY_MAX, &batches);
+
+	for(std::vector<hint_log::batch>::iterator b(batches.begin()),
+			b_end(batches.end()); b != b_end; ++b) {
+		try {
+			replay_hint_batch(*b);
+		} catch (std::exception& e) {
+			LOG_WARN("replay hints to ",b->to," failed: ",e.what());
+			m_hints.failed(b->to, time(NULL), share->cfg_hint_max_backoff_sec());
+		} catch (...) {
+			LOG_WARN("replay hints to ",b->to," failed: unknown error");
+			m_hints.failed(b->to, time(NULL), share->cfg_hint_max_backoff_sec());
+		}
+	}
+
+} catch (std::exception& e) {
+	LOG_WARN("replay hints failed: ",e.what());
+} catch (...) {
+	LOG_WARN("replay hints failed: unknown error");
+}
+
+void mod_store_t::replay_hint_batch(const hint_log::batch& b)
+{
+	shared_zone life(new msgpack::zone());
+	ReplicateBatch& param(*life->allocate<ReplicateBatch>());
+	param.adjust_clock = net->clock_incr();
+
+	const size_t num = b.hints.size();
+	uint8_t* types = (uint8_t*)life->malloc(num ? num : 1);
+
+	for(size_t i=0; i < num; ++i) {
+		const hint_log::hint& h(b.hints[i]);
+		char* key = (char*)life->malloc(h.key.size());
+		memcpy(key, h.key.data(), h.key.size());
+		types[i] = h.type;
+
+		if(h.type == hint_log::SET) {
+			char* val = (char*)life->malloc(h.val.size());
+			memcpy(val, h.val.data(), h.val.size());
+			param.sets.push_back(ReplicateSet(
+					param.adjust_clock, replicate_flags_none(),
+					msgtype::DBKey(key, h.key.size()),
+					msgtype::DBValue(val, h.val.size())));
+		} else {
+			param.deletes.push_back(ReplicateDelete(
+					param.adjust_clock, replicate_flags_none(),
+					ClockTime(h.clocktime),
+					msgtype::DBKey(key, h.key.size())));
+		}
+	}
+
+	bool batch;
+	{
+		pthread_scoped_lock rblk(m_replicate_batch_mutex);
+		batch = replicate_batch_supported(b.to, rblk);
+	}
+
+	LOG_INFO("replay ",num," hints to ",b.to);
+	if(!batch) {
+		replay_hints_one_by_one(b.to, num, types, &param, life);
+		return;
+	}
+	net->get_node(b.to)->call(param, life,
+			BIND_RESPONSE(mod_store_t, ReplayHints, b.to, num, types, &param), 10);
+}
+
+RPC_REPLY_IMPL(mod_store_t, ReplayHints, from, res, err, z,
+		address to, size_t num, const uint8_t* types,
+		ReplicateBatch* param)
+{
+	LOG_DEBUG("ResReplayHints ",to," ",err);
+	if(err.type == msgpack::type::POSITIVE_INTEGER &&
+			err.via.u64 == (uint64_t)rpc::protocol::PROTOCOL_ERROR) {
+		// unknown method; the node is older than ReplicateBatch
+		LOG_WARN("ReplicateBatch is not supported by ",to,
+				"; replay hints without batching");
+		{
+			pthread_scoped_lock rblk(m_replicate_batch_mutex);
+			m_replicate_batch_unsupported[to] =
+				time(NULL) + REPLICATE_BATCH_RETRY_SEC;
+		}
+		SHARED_ZONE(life, z);
+		replay_hints_one_by_one(to, num, types, param, life);
+		return;
+	}
+
+	if(!err.is_nil() || res.type != msgpack::type::ARRAY ||
+			res.via.array.size != num) {
+		m_hints.failed(to, time(NULL), share->cfg_hint_max_backoff_sec());
+		LOG_WARN("replay hints to ",to," failed: ",err);
+		return;
+	}
+
+	// results are sets first, then deletes
+	size_t nsets = 0;
+	for(size_t i=0; i < num; ++i) {
+		if(types[i] == hint_log::SET) {
+			++nsets;
+		}
+	}
+
+	// hints which are not assigned to the node any more are
+	// replied as nil; replacing copies them to the right node.
+	// hints which the node failed to store are kept.
+	std::vector<size_t> failed;
+	for(size_t i=0, si=0, di=nsets; i < num; ++i) {
+		const msgpack::object& r(res.via.array.ptr[
+				types[i] == hint_log::SET ? si++ : di++]);
+		if(r.type == msgpack::type::POSITIVE_INTEGER) {
+			failed.push_back(i);
+		}
+	}
+
+	if(failed.empty()) {
+		m_hints.done(to, num);
+	} else {
+		LOG_WARN("replay hints to ",to,": ",failed.size()," of ",num," hints failed");
+		m_hints.retry(to, num, failed,
+				time(NULL), share->cfg_hint_max_backoff_sec());
+	}
+}
+
+void mod_store_t::replay_hints_one_by_one(const address& to, size_t num,
+		const uint8_t* types, ReplicateBatch* param, shared_zone& life)
+{
+	// r and the hints are held by the life until the last reply
+	hint_replay* r = life->allocate<hint_replay>(to, num);
+	shared_node node(net->get_node(to));
+
+	for(size_t i=0, si=0, di=0; i < num; ++i) {
+		try {
+			if(types[i] == hint_log::SET) {
+				node->call(param->sets[si++], life,
+						BIND_RESPONSE(mod_store_t, ReplayHint, r, i), 10);
+			} else {
+				node->call(param->deletes[di++], life,
+						BIND_RESPONSE(mod_store_t, ReplayHint, r, i), 10);
+			}
+		} catch (...) {
+			// the reply never comes
+			msgpack::object lost;
+			lost.type = msgpack::type::POSITIVE_INTEGER;
+			lost.via.u64 = rpc::protocol::TRANSPORT_LOST_ERROR;
+			finish_replay_hint(r, i, lost);
+		}
+	}
+}
+
+RPC_REPLY_IMPL(mod_store_t, ReplayHint, from, res, err, z,
+		hint_replay* r, size_t index)
+{
+	LOG_DEBUG("ResReplayHint ",r->to," ",err);
+	finish_replay_hint(r, index, err);
+}
+
+void mod_store_t::finish_replay_hint(hint_replay* r, size_t index, rpc::msgobj err)
+{
+	{
+		pthread_scoped_lock lk(r->mutex);
+		if(!err.is_nil()) {
+			if(err.type == msgpack::type::POSITIVE_INTEGER &&
+					err.via.u64 == (uint64_t)rpc::protocol::SERVER_ERROR) {
+				// storage error, or the hint is not assigned to the node
+				// any more; ReplicateSet and ReplicateDelete can't tell
+				// them apart, so it's kept and retried.
+				r->failed.push_back(index);
+			} else {
+				r->lost = true;
+			}
+		}
+		if(--r->remain > 0) {
+			return;
+		}
+	}
+
+	// same as the reply of ReplayHints
+	if(r->lost) {
+		m_hints.failed(r->to, time(NULL), share->cfg_hint_max_backoff_sec());
+		LOG_WARN("replay hints to ",r->to," failed");
+	} else if(r->failed.empty()) {
+		m_hints.done(r->to, r->num);
+	} else {
+		// replies come in any order
+		std::sort(r->failed.begin(), r->failed.end());
+		LOG_WARN("replay hints to ",r->to,": ",r->failed.size()," of ",r->num," hints failed");
+		m_hints.retry(r->to, r->num, r->failed,
+				time(NULL), share->cfg_hint_max_backoff_sec());
+	}
+}
+
+
 RPC_IMPL(mod_store_t, ReplicateSet, req, z, response)
 {
 	msgtype::DBKey key = req.param().dbkey;
@@ -494,20 +1779,93 @@ RPC_IMPL(mod_store_t, ReplicateSet, req, z, response)
 	LOG_TRACE("ReplicateSet");
 
 	if(req.param().flags.is_rhs()) {
-		pthread_scoped_rdlock rhlk(share->rhs_mutex());
-		check_replicator_assign(share->rhs(), key.hash());
+		check_replicator_assign(*share->rhs(), key.hash());
 	} else {
-		pthread_scoped_rdlock whlk(share->whs_mutex());
-		check_replicator_assign(share->whs(), key.hash());
+		check_replicator_assign(*share->whs(), key.hash());
 	}
 
 	net->clock_update(req.param().adjust_clock);
 
-	bool updated = share->db().update(
-			key.raw_data(), key.raw_size(),
-			val.raw_data(), val.raw_size());
+	replicate_set_entry* e = z->allocate<replicate_set_entry>(
+			key, val, response, z.get());
+
+	if(!share->db().is_batch_supported()) {
+		// the storage applies a batch key by key;
+		// batching only serializes the worker threads.
+		z.release();
+		apply_replicate_set(&e, 1);
+		return;
+	}
+
+	{
+		pthread_scoped_lock lk(m_replicate_set_mutex);
+		m_replicate_set_queue.push_back(e);
+		z.release();
+	}
 
-	response.result(updated);
+	flush_replicate_set();
+}
+
+// Group commit: the thread takes all queued entries, including entries
+// queued by other threads, and applies them. threads apply their batches
+// in parallel; if another thread took the entry already, nothing is done.
+void mod_store_t::flush_replicate_set()
+{
+	replicate_set_queue_t batch;
+	{
+		pthread_scoped_lock lk(m_replicate_set_mutex);
+		if(m_replicate_set_queue.empty()) {
+			return;
+		}
+		batch.swap(m_replicate_set_queue);
+	}
+
+	for(size_t i=0; i < batch.size(); i += Storage::UPDATEV_MAX) {
+		uint16_t num = std::min(batch.size() - i, (size_t)Storage::UPDATEV_MAX);
+		apply_replicate_set(&batch[i], num);
+	}
+}
+
+void mod_store_t::apply_replicate_set(replicate_set_entry** entries, uint16_t num)
+{
+	const char* keys[Storage::UPDATEV_MAX];
+	size_t keylens[Storage::UPDATEV_MAX];
+	const char* vals[Storage::UPDATEV_MAX];
+	size_t vallens[Storage::UPDATEV_MAX];
+	bool updated[Storage::UPDATEV_MAX];
+
+	for(uint16_t i=0; i < num; ++i) {
+		keys[i]    = entries[i]->key.raw_data();
+		keylens[i] = entries[i]->key.raw_size();
+		vals[i]    = entries[i]->val.raw_data();
+		vallens[i] = entries[i]->val.raw_size();
+	}
+
+	bool failed = false;
+	try {
+		share->db().updatev(keys, keylens, vals, vallens, num, updated);
+	} catch (std::exception& e) {
+		LOG_WARN("ReplicateSet failed: ",e.what());
+		failed = true;
+	} catch (...) {
+		LOG_WARN("ReplicateSet failed: unknown error");
+		failed = true;
+	}
+
+	for(uint16_t i=0; i < num; ++i) {
+		if(failed || updated[i]) {
+			// some entries may be stored before the failure
+			revoke_leases(entries[i]->key);
+		}
+		try {
+			if(failed) {
+				entries[i]->response.error((uint8_t)rpc::protocol::SERVER_ERROR);
+			} else {
+				entries[i]->response.result(updated[i]);
+			}
+		} catch (...) { }
+		delete entries[i]->life;
+	}
 }
 
 
@@ -517,22 +1875,139 @@ RPC_IMPL(mod_store_t, ReplicateDelete, req, z, response)
 	LOG_TRACE("ReplicateDelete");
 
 	if(req.param().flags.is_rhs()) {
-		pthread_scoped_rdlock rhlk(share->rhs_mutex());
-		check_replicator_assign(share->rhs(), key.hash());
+		check_replicator_assign(*share->rhs(), key.hash());
 	} else {
-		pthread_scoped_rdlock whlk(share->whs_mutex());
-		check_replicator_assign(share->whs(), key.hash());
+		check_replicator_assign(*share->whs(), key.hash());
 	}
 
 	net->clock_update(req.param().adjust_clock);
 
 	bool deleted = share->db().remove(key.raw_data(), key.raw_size(),
 			req.param().delete_clocktime);
+	if(deleted) {
+		revoke_leases(key);
+	}
 
 	response.result(deleted);
 }
 
 
+// distinguished from nil (not assigned) so that the sender retries it
+static inline void set_replicate_batch_error(msgpack::object& r)
+{
+	r.type = msgpack::type::POSITIVE_INTEGER;
+	r.via.u64 = rpc::protocol::SERVER_ERROR;
+}
+
+RPC_IMPL(mod_store_t, ReplicateBatch, req, z, response)
+{
+	const std::vector<ReplicateSet>& sets(req.param().sets);
+	const std::vector<ReplicateDelete>& deletes(req.param().deletes);
+	const size_t nsets = sets.size();
+	const size_t num = nsets + deletes.size();
+	LOG_TRACE("ReplicateBatch ",nsets," sets, ",deletes.size()," deletes");
+
+	net->clock_update(req.param().adjust_clock);
+
+	msgpack::object* results = (msgpack::object*)z->malloc(
+			sizeof(msgpack::object)*(num ? num : 1));
+
+	std::vector<size_t> targets;
+	targets.reserve(nsets);
+	{
+		hs_snapshot::ref rhs(share->rhs());
+		hs_snapshot::ref whs(share->whs());
+		for(size_t i=0; i < nsets; ++i) {
+			const HashSpace& hs(sets[i].flags.is_rhs() ? *rhs : *whs);
+			results[i].type = msgpack::type::NIL;
+			if(!hs.empty() && test_replicator_assign(hs, sets[i].dbkey.hash())) {
+				targets.push_back(i);
+			}
+		}
+	}
+
+	// same as ReplicateSet; applied by Storage::updatev
+	const char* keys[Storage::UPDATEV_MAX];
+	size_t keylens[Storage::UPDATEV_MAX];
+	const char* vals[Storage::UPDATEV_MAX];
+	size_t vallens[Storage::UPDATEV_MAX];
+	bool updated[Storage::UPDATEV_MAX];
+
+	for(size_t off=0; off < targets.size(); off += Storage::UPDATEV_MAX) {
+		uint16_t n = std::min(targets.size() - off, (size_t)Storage::UPDATEV_MAX);
+		for(uint16_t i=0; i < n; ++i) {
+			const ReplicateSet& e(sets[targets[off+i]]);
+			keys[i]    = e.dbkey.raw_data();
+			keylens[i] = e.dbkey.raw_size();
+			vals[i]    = e.dbval.raw_data();
+			vallens[i] = e.dbval.raw_size();
+		}
+
+		try {
+			share->db().updatev(keys, keylens, vals, vallens, n, updated);
+		} catch (std::exception& e) {
+			LOG_WARN("ReplicateBatch failed: ",e.what());
+			for(uint16_t i=0; i < n; ++i) {
+				revoke_leases(sets[targets[off+i]].dbkey);
+				set_replicate_batch_error(results[targets[off+i]]);
+			}
+			continue;
+		} catch (...) {
+			LOG_WARN("ReplicateBatch failed: unknown error");
+			for(uint16_t i=0; i < n; ++i) {
+				revoke_leases(sets[targets[off+i]].dbkey);
+				set_replicate_batch_error(results[targets[off+i]]);
+			}
+			continue;
+		}
+
+		for(uint16_t i=0; i < n; ++i) {
+			size_t index = targets[off+i];
+			if(updated[i]) {
+				revoke_leases(sets[index].dbkey);
+			}
+			results[index].type = msgpack::type::BOOLEAN;
+			results[index].via.boolean = updated[i];
+		}
+	}
+
+	// same as ReplicateDelete
+	for(size_t i=0; i < deletes.size(); ++i) {
+		const ReplicateDelete& e(deletes[i]);
+		msgpack::object& r(results[nsets + i]);
+		r.type = msgpack::type::NIL;
+
+		hs_snapshot::ref hs(e.flags.is_rhs() ? share->rhs() : share->whs());
+		if(hs->empty() || !test_replicator_assign(*hs, e.dbkey.hash())) {
+			continue;
+		}
+
+		try {
+			bool deleted = share->db().remove(
+					e.dbkey.raw_data(), e.dbkey.raw_size(),
+					e.delete_clocktime);
+			if(deleted) {
+				revoke_leases(e.dbkey);
+			}
+			r.type = msgpack::type::BOOLEAN;
+			r.via.boolean = deleted;
+		} catch (std::exception& ex) {
+			LOG_WARN("ReplicateBatch failed: ",ex.what());
+			set_replicate_batch_error(r);
+		} catch (...) {
+			LOG_WARN("ReplicateBatch failed: unknown error");
+			set_replicate_batch_error(r);
+		}
+	}
+
+	msgpack::object res;
+	res.type = msgpack::type::ARRAY;
+	res.via.array.size = num;
+	res.via.array.ptr  = results;
+	response.result(res, z);
+}
+
+
 
 }  // namespace server
 }  // namespace kumo
@@ -42,6 +42,7 @@ public:
 
 	void read_event();
 	//void submit_message(rpc::msgobj msg, rpc::auto_zone& z);
+	//void submit_flush();  // called after submitting all messages in the buffer
 
 private:
 	msgpack::unpacker m_pac;
@@ -121,6 +122,7 @@ try {
 		m_pac.reset();
 		static_cast<IMPL*>(this)->submit_message(msg, z);
 	}
+	static_cast<IMPL*>(this)->submit_flush();
 
 } catch(msgpack::type_error& e) {
 	LOG_ERROR("rpc packet: type error");
@@ -72,7 +72,8 @@ namespace {
 }  // noname namespace
 
 
-void wavy_server::init_wavy(unsigned short rthreads, unsigned short wthreads)
+void wavy_server::init_wavy(unsigned short rthreads, unsigned short wthreads,
+		bool sharded, bool catch_signals)
 {
 	// ignore SIGPIPE
 	if( signal(SIGPIPE, SIG_IGN) == SIG_ERR ) {
@@ -80,18 +81,24 @@ void wavy_server::init_wavy(unsigned short rthreads, unsigned short wthreads)
 		throw mp::system_error(errno, "signal");
 	}
 
-	// initialize signal handler before starting threads
-	sigset_t ss;
-	sigemptyset(&ss);
-	sigaddset(&ss, SIGHUP);
-	sigaddset(&ss, SIGINT);
-	sigaddset(&ss, SIGTERM);
-
-	s_pth.reset( new mp::pthread_signal(ss,
-				get_signal_handler(),
-				reinterpret_cast<void*>(this)) );
+	if(catch_signals) {
+		// initialize signal handler before starting threads
+		sigset_t ss;
+		sigemptyset(&ss);
+		sigaddset(&ss, SIGHUP);
+		sigaddset(&ss, SIGINT);
+		sigaddset(&ss, SIGTERM);
+
+		s_pth.reset( new mp::pthread_signal(ss,
+					get_signal_handler(),
+					reinterpret_cast<void*>(this)) );
+	}
 
-	wavy::add_core_thread(rthreads);
+	if(sharded) {
+		wavy::add_core_shard(rthreads);
+	} else {
+		wavy::add_core_thread(rthreads);
+	}
 	wavy::add_output_thread(wthreads);
 }
 
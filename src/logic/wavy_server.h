@@ -40,7 +40,11 @@ public:
 
 protected:
 	// call this function before starting any threads
-	void init_wavy(unsigned short rthreads, unsigned short wthreads);
+	// if sharded is true, each of rthreads owns its own event loop.
+	// if catch_signals is false, SIGINT, SIGTERM and SIGHUP are left
+	// to the host process (embedded in libkumoclient).
+	void init_wavy(unsigned short rthreads, unsigned short wthreads,
+			bool sharded = false, bool catch_signals = true);
 
 	virtual void end_preprocess() { }
 
@@ -43,6 +43,11 @@ public:
 
 	void add_thread(size_t num);
 
+	// switches to sharded mode: each thread owns an edge and a task queue,
+	// file descriptors are pinned to a shard and idle shards steal tasks.
+	// call this before adding any handlers.
+	void add_shard(size_t num);
+
 	void end();
 	bool is_end() const;
 
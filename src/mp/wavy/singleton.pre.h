@@ -36,6 +36,7 @@ struct singleton {
 	static void initialize(size_t core_thread, size_t output_thread);
 
 	static void add_core_thread(size_t num);
+	static void add_core_shard(size_t num);
 	static void add_output_thread(size_t num);
 
 	static void join();
@@ -108,6 +109,10 @@ template <typename Instance>
 void singleton<Instance>::add_core_thread(size_t num)
 	{ s_core->add_thread(num); }
 
+template <typename Instance>
+void singleton<Instance>::add_core_shard(size_t num)
+	{ s_core->add_shard(num); }
+
 template <typename Instance>
 void singleton<Instance>::add_output_thread(size_t num)
 	{ s_output->add_thread(num); }
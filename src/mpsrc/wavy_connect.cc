@@ -137,7 +137,8 @@ void core::connect(int socket_family, int socket_type, int protocol,
 	impl::connect_thread t(this,
 			socket_family, socket_type, protocol,
 			addr, addrlen, timeout_msec, callback);
-	submit(t);
+	task_t task(t);
+	m_impl->submit_blocking(task);
 }
 
 
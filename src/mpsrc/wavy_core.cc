@@ -27,17 +27,89 @@
 #define MP_WAVY_TASK_QUEUE_LIMIT 16
 #endif
 
+#ifndef MP_WAVY_SHARD_TASK_BATCH
+#define MP_WAVY_SHARD_TASK_BATCH 16
+#endif
+
+#ifndef MP_WAVY_SHARD_BLOCKING_THREADS
+#define MP_WAVY_SHARD_BLOCKING_THREADS 2
+#endif
+
 namespace mp {
 namespace wavy {
 
 
+class core::impl::shard : public pthread_thread {
+public:
+	shard(impl* parent, size_t id);
+	~shard();
+
+public:
+	void watch(int fd);
+
+	// returns true if tasks are piling up on the busy shard
+	bool push(task_t& f);
+	bool steal(task_t* result);
+
+	void wakeup();
+	bool is_sleeping() const { return m_sleeping; }
+
+	size_t id() const { return m_id; }
+	impl* parent() const { return m_parent; }
+
+	// shard which runs on this thread
+	static __thread shard* s_current;
+
+public:
+	void operator() ();
+
+private:
+	bool pop(task_t* result);
+	void read_event(int fd);
+
+private:
+	impl* m_parent;
+	const size_t m_id;
+
+	edge::backlog m_backlog;
+	edge m_edge;
+
+	int m_wakeup[2];
+
+	pthread_mutex m_mutex;
+	task_queue_t m_task_queue;
+	volatile bool m_sleeping;
+
+private:
+	shard();
+	shard(const shard&);
+};
+
+class core::impl::blocking_thread : public pthread_thread {
+public:
+	blocking_thread(impl* parent) :
+		pthread_thread(this), m_parent(parent) { }
+
+	void operator() ()
+	{
+		m_parent->blocking_loop();
+	}
+
+private:
+	impl* m_parent;
+};
+
+__thread core::impl::shard* core::impl::shard::s_current = NULL;
+
+
 core::core() : m_impl(new impl()) { }
 
 core::impl::impl() :
 	m_off(0),
 	m_num(0),
 	m_pollable(true),
-	m_end_flag(false)
+	m_end_flag(false),
+	m_shard_rr(0)
 {
 	struct rlimit rbuf;
 	if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
@@ -72,6 +144,10 @@ void core::impl::end()
 		pthread_scoped_lock lk(m_mutex);
 		m_cond.broadcast();
 	}
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		(*it)->wakeup();
+	}
 }
 
 bool core::is_end() const { return m_impl->is_end(); }
@@ -114,8 +190,55 @@ void core::impl::add_thread(size_t num)
 }
 
 
+void core::add_shard(size_t num) { m_impl->add_shard(num); }
+void core::impl::add_shard(size_t num)
+{
+	size_t first = m_shards.size();
+	for(size_t i=0; i < num; ++i) {
+		shard* s = new shard(this, m_shards.size());
+		m_workers.push_back(s);
+		m_shards.push_back(s);
+	}
+	if(first == 0 && num > 0) {
+		add_blocking_thread(MP_WAVY_SHARD_BLOCKING_THREADS);
+	}
+	for(size_t i=first; i < m_shards.size(); ++i) {
+		m_shards[i]->run();
+	}
+}
+
+void core::impl::add_blocking_thread(size_t num)
+{
+	if(m_shards.empty()) {
+		add_thread(num);
+		return;
+	}
+	for(size_t i=0; i < num; ++i) {
+		m_workers.push_back(NULL);
+		try {
+			m_workers.back() = new blocking_thread(this);
+		} catch (...) {
+			m_workers.pop_back();
+			throw;
+		}
+		m_workers.back()->run();
+	}
+}
+
+
 void core::impl::submit_impl(task_t& f)
 {
+	if(!m_shards.empty()) {
+		// tasks submitted on a shard run on the shard
+		shard* s = shard::s_current;
+		if(!s || s->parent() != this) {
+			s = m_shards[__sync_fetch_and_add(&m_shard_rr, 1) % m_shards.size()];
+		}
+		if(s->push(f)) {
+			wakeup_idle(s);
+		}
+		return;
+	}
 	pthread_scoped_lock lk(m_mutex);
 	m_task_queue.push(f);
 	m_cond.signal();
@@ -123,6 +246,64 @@ void core::impl::submit_impl(task_t& f)
 void core::submit_impl(task_t f)
 	{ m_impl->submit_impl(f); }
 
+void core::impl::submit_blocking(task_t& f)
+{
+	if(m_shards.empty()) {
+		submit_impl(f);
+		return;
+	}
+	pthread_scoped_lock lk(m_mutex);
+	m_task_queue.push(f);
+	m_cond.signal();
+}
+
+void core::impl::blocking_loop()
+{
+	while(true) {
+		pthread_scoped_lock lk(m_mutex);
+		while(m_task_queue.empty()) {
+			if(m_end_flag) { return; }
+			m_cond.wait(m_mutex);
+		}
+		task_t ev = m_task_queue.front();
+		m_task_queue.pop();
+		lk.unlock();
+		try {
+			ev();
+		} catch (...) { }
+	}
+}
+
+core::impl::shard* core::impl::shard_for(int fd)
+{
+	return m_shards[fd % m_shards.size()];
+}
+
+bool core::impl::steal_for(shard* self, task_t* result)
+{
+	size_t num = m_shards.size();
+	for(size_t i=1; i < num; ++i) {
+		if(m_shards[(self->id() + i) % num]->steal(result)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void core::impl::wakeup_idle(shard* busy)
+{
+	// let an idle shard steal the task.
+	// is_sleeping() is read without the lock; it's only a hint.
+	size_t num = m_shards.size();
+	for(size_t i=1; i < num; ++i) {
+		shard* s = m_shards[(busy->id() + i) % num];
+		if(s->is_sleeping()) {
+			s->wakeup();
+			return;
+		}
+	}
+}
+
 
 void core::impl::add_impl(int fd, handler* newh)
 {
@@ -134,7 +315,12 @@ void core::impl::add_impl(int fd, handler* newh)
 	}
 	m_state[fd].reset(newh);
 	newh->m_shared_self = &m_state[fd];
-	m_edge.add_notify(fd, EVEDGE_READ);
+	if(m_shards.empty()) {
+		m_edge.add_notify(fd, EVEDGE_READ);
+	} else {
+		// pinned to the shard until it's removed
+		shard_for(fd)->watch(fd);
+	}
 }
 void core::add_impl(int fd, handler* newh)
 	{ m_impl->add_impl(fd, newh); }
@@ -207,6 +393,159 @@ void core::impl::operator() ()
 }
 
 
+core::impl::shard::shard(impl* parent, size_t id) :
+	pthread_thread(this),
+	m_parent(parent),
+	m_id(id),
+	m_sleeping(false)
+{
+	if(::pipe(m_wakeup) < 0) {
+		throw system_error(errno, "failed to create wakeup pipe");
+	}
+	try {
+		mp::set_nonblock(m_wakeup[0]);
+		mp::set_nonblock(m_wakeup[1]);
+		if(m_edge.add_notify(m_wakeup[0], EVEDGE_READ) < 0) {
+			throw system_error(errno, "failed to watch wakeup pipe");
+		}
+	} catch (...) {
+		::close(m_wakeup[0]);
+		::close(m_wakeup[1]);
+		throw;
+	}
+}
+
+core::impl::shard::~shard()
+{
+	::close(m_wakeup[0]);
+	::close(m_wakeup[1]);
+}
+
+void core::impl::shard::watch(int fd)
+{
+	m_edge.add_notify(fd, EVEDGE_READ);
+}
+
+void core::impl::shard::wakeup()
+{
+	char c = 0;
+	while(::write(m_wakeup[1], &c, 1) < 0 && errno == EINTR) { }
+}
+
+bool core::impl::shard::push(task_t& f)
+{
+	bool sleeping;
+	bool piling;
+	{
+		pthread_scoped_lock lk(m_mutex);
+		m_task_queue.push(f);
+		sleeping = m_sleeping;
+		m_sleeping = false;
+		piling = !sleeping && m_task_queue.size() > 1;
+	}
+	if(sleeping) {
+		wakeup();
+	}
+	return piling;
+}
+
+bool core::impl::shard::pop(task_t* result)
+{
+	pthread_scoped_lock lk(m_mutex);
+	if(m_task_queue.empty()) {
+		return false;
+	}
+	*result = m_task_queue.front();
+	m_task_queue.pop();
+	return true;
+}
+
+bool core::impl::shard::steal(task_t* result)
+{
+	if(!m_mutex.trylock()) {
+		return false;
+	}
+	bool ret = false;
+	if(!m_task_queue.empty()) {
+		*result = m_task_queue.front();
+		m_task_queue.pop();
+		ret = true;
+	}
+	m_mutex.unlock();
+	return ret;
+}
+
+void core::impl::shard::read_event(int fd)
+{
+	shared_handler& h = m_parent->m_state[fd];
+	try {
+		h->read_event();
+	} catch (...) {
+		m_edge.shot_remove(fd, EVEDGE_READ);
+		h->m_shared_self = NULL;
+		h.reset();
+		return;
+	}
+	m_edge.shot_reactivate(fd, EVEDGE_READ);
+}
+
+void core::impl::shard::operator() ()
+{
+	s_current = this;
+
+	while(!m_parent->is_end()) {
+		size_t ntasks = 0;
+		task_t ev;
+		while(ntasks < MP_WAVY_SHARD_TASK_BATCH && pop(&ev)) {
+			++ntasks;
+			try {
+				ev();
+			} catch (...) { }
+		}
+		if(ntasks == 0 && m_parent->steal_for(this, &ev)) {
+			++ntasks;
+			try {
+				ev();
+			} catch (...) { }
+		}
+
+		int timeout_msec = 0;
+		if(ntasks == 0) {
+			pthread_scoped_lock lk(m_mutex);
+			if(m_task_queue.empty()) {
+				m_sleeping = true;
+				timeout_msec = 1000;
+			}
+		}
+
+		int num = m_edge.wait(&m_backlog, timeout_msec);
+		if(timeout_msec != 0) {
+			pthread_scoped_lock lk(m_mutex);
+			m_sleeping = false;
+		}
+
+		if(num < 0) {
+			if(errno == EINTR || errno == EAGAIN) {
+				continue;
+			} else {
+				throw system_error(errno, "wavy core event failed");
+			}
+		}
+
+		for(int i=0; i < num; ++i) {
+			int fd = m_backlog[i];
+			if(fd == m_wakeup[0]) {
+				char buf[64];
+				while(::read(fd, buf, sizeof(buf)) > 0) { }
+				m_edge.shot_reactivate(fd, EVEDGE_READ);
+			} else {
+				read_event(fd);
+			}
+		}
+	}
+}
+
+
 }  // namespace wavy
 }  // namespace mp
 
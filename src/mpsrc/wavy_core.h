@@ -34,6 +34,7 @@ public:
 
 public:
 	void add_thread(size_t num);
+	void add_shard(size_t num);
 
 	void end();
 	bool is_end() const;
@@ -48,13 +49,27 @@ public:
 
 	class timer_thread;
 
+	class shard;
+	class blocking_thread;
+
 public:
 	inline void add_impl(int fd, handler* newh);
 	inline void submit_impl(task_t& f);
 
+	// tasks which may block for a long time.
+	// they don't run on shards in sharded mode.
+	void add_blocking_thread(size_t num);
+	void submit_blocking(task_t& f);
+
 public:
 	void operator() ();
 
+private:
+	void blocking_loop();
+	bool steal_for(shard* self, task_t* result);
+	void wakeup_idle(shard* busy);
+	shard* shard_for(int fd);
+
 private:
 	volatile size_t m_off;
 	volatile size_t m_num;
@@ -75,10 +90,18 @@ private:
 	typedef std::queue<task_t> task_queue_t;
 	task_queue_t m_task_queue;
 
+	// sharded mode: each shard owns an edge and a task queue
+	typedef std::vector<shard*> shards_t;
+	shards_t m_shards;
+	volatile size_t m_shard_rr;
+
 private:
 	typedef std::vector<pthread_thread*> workers_t;
 	workers_t m_workers;
 
+	friend class shard;
+	friend class blocking_thread;
+
 private:
 	impl(const impl&);
 };
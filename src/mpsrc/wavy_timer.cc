@@ -48,9 +48,10 @@ private:
 
 void core::timer(const timespec* interval, timer_callback_t callback)
 {
-	add_thread(1);
+	m_impl->add_blocking_thread(1);
 	impl::timer_thread t(this, interval, callback);
-	submit(t);
+	task_t task(t);
+	m_impl->submit_blocking(task);
 }
 
 
@@ -59,6 +59,11 @@ public:
 		return m_param;
 	}
 
+	const rpc::callback_t& callback() const
+	{
+		return m_callbck;
+	}
+
 private:
 	unsigned short m_limit;
 	Parameter m_param;
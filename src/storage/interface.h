@@ -70,11 +70,16 @@ typedef struct {
 			const char* val, uint32_t vallen,
 			kumo_storage_casproc proc, void* casdata);
 
-	// number of processed keys
+	// update() for each key. casdata[i] is passed to proc for keys[i].
+	// result[i] is set to true if keys[i] is updated.
+	// number of updated keys;  failed: < 0
+	// NULL is allowed; update() is called for each key.
 	int (*updatev)(void* data,
 			const char** keys, const size_t* keylens,
 			const char** vals, const size_t* vallens,
-			uint16_t num);
+			uint16_t num,
+			kumo_storage_casproc proc, void** casdata,
+			bool* result);
 
 	// number of stored keys
 	uint64_t (*rnum)(void* data);
@@ -110,6 +115,41 @@ typedef struct {
 	// deleted: true;  not-deleted: false
 	bool (*iterator_del_force)(void* iterator_data);
 
+	// incremental iteration. NULL is allowed (not supported).
+	// the cursor doesn't lock the database between steps.
+	// failed: NULL
+	void* (*cursor_new)(void* data);
+
+	void (*cursor_free)(void* cursor);
+
+	// call func for at most `limit' records from the cursor
+	// with same iterator_data as for_each, and advance the cursor.
+	// the cursor is rewound after reaching the end.
+	// it may return 0 without iterating if the database is busy.
+	// number of iterated records;  failed: < 0
+	int (*cursor_step)(void* cursor, size_t limit,
+			void* user,
+			int (*func)(void* user, void* iterator_data));
+
+	// for_each for the `part'th of `nparts' disjoint partitions.
+	// it is called from multiple threads at the same time, once for
+	// each part. calls of different scans are not interleaved.
+	// NULL is allowed (not supported).
+	// success >= 0;  failed < 0
+	int (*for_each_part)(void* data,
+			unsigned int part, unsigned int nparts,
+			void* user,
+			int (*func)(void* user, void* iterator_data));
+
+	// for_each for records whose key hash is in [begin, end].
+	// NULL is allowed (not supported). it should be implemented
+	// only if the records are ordered by the hash.
+	// success >= 0;  failed < 0
+	int (*for_each_range)(void* data,
+			uint64_t begin, uint64_t end,
+			void* user,
+			int (*func)(void* user, void* iterator_data));
+
 } kumo_storage_op;
 
 
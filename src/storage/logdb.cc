@@ -0,0 +1,1755 @@
+//
+// kumofs
+//
+// Copyright (C) 2009 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#include "storage/interface.h"  // FIXME
+#include <mp/pthread.h>
+#include <tr1/unordered_map>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+//
+// Native storage: in-memory index + segmented append-only log
+//
+// path is a directory which contains log segments named "%08x.log".
+// Each segment is a sequence of records:
+//
+// +-------+--------+--------+-----+-----+
+// | crc32 | keylen | vallen | key | val |
+// +-------+--------+--------+-----+-----+
+//   uint32  uint32   uint32   (big endian)
+//
+// crc32 covers keylen, vallen, key and val.
+// vallen == LOGDB_TOMBSTONE means the key is deleted.
+//
+// The index maps a key to the location of its latest record.
+// It is striped into many hash tables so that writers of different
+// keys don't contend on one lock. Appending to the log only holds
+// append_mutex while reserving the offset; pwrite runs without it.
+//
+// Segments whose live records become less than LOGDB_COMPACT_PERCENT
+// are compacted by a background thread after the log is rotated: live
+// records are copied to the tail segment, the tail is fsync'ed and the
+// old segment is removed.
+//
+// A record whose write was interrupted by a crash may be followed by
+// records which were written concurrently and acknowledged. Broken
+// records are skipped on open and only the broken tail is truncated.
+//
+// params: path#stripes=<num>#segsiz=<bytes>
+//
+
+#define BACKUP_TMP_SUFFIX ".tmp"
+
+#define LOGDB_SEGMENT_FORMAT "%s/%08x.log"
+#define LOGDB_SEGMENT_SCAN   "%8x.log"
+#define LOGDB_HEADER_SIZE 12
+#define LOGDB_TOMBSTONE   0xffffffff
+#define LOGDB_MAX_RECORD  0x7fffffff
+
+#define LOGDB_DEFAULT_STRIPES 256
+#define LOGDB_DEFAULT_SEGSIZ  (64*1024*1024)
+#define LOGDB_COMPACT_PERCENT 50
+#define LOGDB_SCAN_BUFFER_SIZE (1024*1024)
+
+
+struct logdb_segment {
+	logdb_segment(uint32_t pid, int pfd) :
+		id(pid), fd(pfd), size(0), live(0), pending(0) { }
+
+	uint32_t id;
+	int fd;
+
+	// end of the reserved area; guarded by append_mutex
+	uint64_t size;
+
+	// bytes of records referenced by the index
+	volatile uint64_t live;
+
+	// number of appended records which are not linked to the index yet
+	volatile uint32_t pending;
+
+private:
+	logdb_segment();
+	logdb_segment(const logdb_segment&);
+};
+
+struct logdb_location {
+	logdb_segment* seg;
+	uint64_t off;
+	uint32_t vallen;
+};
+
+typedef std::tr1::unordered_map<std::string, logdb_location> logdb_index;
+
+struct logdb_stripe {
+	mp::pthread_rwlock mutex;
+	logdb_index index;
+};
+
+typedef std::map<uint32_t, logdb_segment*> logdb_segments;
+
+struct logdb_compactor;
+
+// error message of the last failed operation of this thread
+static __thread const char* s_errmsg = "success";
+
+
+// positive number without trailing characters
+static bool parse_number(const char* val, uint64_t max, uint64_t* num)
+{
+	if(*val < '0' || '9' < *val) {  // rejects signs and spaces
+		return false;
+	}
+	char* end;
+	errno = 0;
+	unsigned long long n = ::strtoull(val, &end, 0);
+	if(errno != 0 || *end != '\0' || n == 0 || n > max) {
+		return false;
+	}
+	*num = n;
+	return true;
+}
+
+// returns NULL if the parameters are invalid
+static char* parse_param(char* str,
+		bool* stripes_set, uint32_t* stripes,
+		bool* segsiz_set, uint64_t* segsiz)
+{
+	char* key;
+	char* val;
+	while((key = ::strrchr(str, '#')) != NULL) {
+		*key++ = '\0';
+		if((val = strchr(key, '=')) == NULL) {
+			return NULL;
+		}
+		*val++ = '\0';
+
+		uint64_t num;
+		if(::strcmp(key, "stripes") == 0) {
+			if(!parse_number(val, 0xffffffff, &num)) {
+				return NULL;
+			}
+			*stripes_set = true;
+			*stripes = num;
+		} else if(::strcmp(key, "segsiz") == 0) {
+			if(!parse_number(val, ~(uint64_t)0, &num)) {
+				return NULL;
+			}
+			*segsiz_set = true;
+			*segsiz = num;
+		}
+	}
+	return str;
+}
+
+
+struct kumo_logdb {
+	kumo_logdb() :
+		stripes(NULL), nstripes(0),
+		segsiz(LOGDB_DEFAULT_SEGSIZ),
+		tail(NULL), rnum(0),
+		compactor(NULL),
+		compact_pending(false),
+		compact_stop(false) { }
+
+	~kumo_logdb()
+	{
+		close();
+	}
+
+	void close();
+
+	void close_segments()
+	{
+		for(logdb_segments::iterator it(segments.begin()),
+				it_end(segments.end()); it != it_end; ++it) {
+			::fsync(it->second->fd);
+			::close(it->second->fd);
+			delete it->second;
+		}
+		segments.clear();
+		tail = NULL;
+
+		delete[] stripes;
+		stripes = NULL;
+		nstripes = 0;
+
+		rnum = 0;
+	}
+
+	logdb_stripe* stripe_of(const char* key, uint32_t keylen)
+	{
+		// FNV-1a
+		uint32_t h = 2166136261U;
+		for(uint32_t i=0; i < keylen; ++i) {
+			h = (h ^ (unsigned char)key[i]) * 16777619U;
+		}
+		return &stripes[h & (nstripes-1)];
+	}
+
+	logdb_stripe* stripes;
+	uint32_t nstripes;
+
+	uint64_t segsiz;
+	std::string path;
+
+	mp::pthread_mutex append_mutex;
+	logdb_segment* tail;
+
+	mp::pthread_rwlock segments_mutex;
+	logdb_segments segments;
+
+	volatile uint64_t rnum;
+
+	// the compactor thread waits on compact_cond until a writer
+	// rotates the log and sets compact_pending.
+	// compact_stop is guarded by compact_mutex.
+	logdb_compactor* compactor;
+	mp::pthread_mutex compact_mutex;
+	mp::pthread_cond compact_cond;
+	volatile bool compact_pending;
+	bool compact_stop;
+
+private:
+	kumo_logdb(const kumo_logdb&);
+};
+
+
+static inline void logdb_store32(char* p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static inline uint32_t logdb_load32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static inline uint64_t logdb_reclen(size_t keylen, uint32_t vallen)
+{
+	return LOGDB_HEADER_SIZE + keylen +
+		(vallen == LOGDB_TOMBSTONE ? 0 : vallen);
+}
+
+static ssize_t logdb_pread_all(int fd, char* buf, size_t size, uint64_t off)
+{
+	size_t done = 0;
+	while(done < size) {
+		ssize_t rl = ::pread(fd, buf+done, size-done, off+done);
+		if(rl < 0) {
+			if(errno == EINTR) { continue; }
+			return -1;
+		} else if(rl == 0) {
+			break;
+		}
+		done += rl;
+	}
+	return done;
+}
+
+static bool logdb_pwrite_all(int fd, const char* buf, size_t size, uint64_t off)
+{
+	size_t done = 0;
+	while(done < size) {
+		ssize_t wl = ::pwrite(fd, buf+done, size-done, off+done);
+		if(wl < 0) {
+			if(errno == EINTR) { continue; }
+			return false;
+		}
+		done += wl;
+	}
+	return true;
+}
+
+// buf must have logdb_reclen(keylen, vallen) bytes
+static void logdb_fill_record(char* buf,
+		const char* key, uint32_t keylen,
+		const char* val, uint32_t vallen)
+{
+	logdb_store32(buf+4, keylen);
+	logdb_store32(buf+8, vallen);
+	memcpy(buf+LOGDB_HEADER_SIZE, key, keylen);
+	if(vallen != LOGDB_TOMBSTONE) {
+		memcpy(buf+LOGDB_HEADER_SIZE+keylen, val, vallen);
+	}
+
+	uint32_t crc = crc32(0, (const Bytef*)buf+4,
+			logdb_reclen(keylen, vallen)-4);
+	logdb_store32(buf, crc);
+}
+
+static char* logdb_build_record(
+		const char* key, uint32_t keylen,
+		const char* val, uint32_t vallen,
+		uint64_t* result_reclen)
+{
+	uint64_t reclen = logdb_reclen(keylen, vallen);
+	if(reclen > LOGDB_MAX_RECORD) {
+		return NULL;
+	}
+
+	char* buf = (char*)::malloc(reclen);
+	if(!buf) {
+		return NULL;
+	}
+
+	logdb_fill_record(buf, key, keylen, val, vallen);
+
+	*result_reclen = reclen;
+	return buf;
+}
+
+
+struct logdb_scanner {
+	logdb_scanner(int pfd) :
+		fd(pfd), buf(NULL), bufsz(0), base(0), len(0) { }
+
+	~logdb_scanner()
+	{
+		::free(buf);
+	}
+
+	// readable: pointer to [off, off+size);  EOF or error: NULL
+	const char* fetch(uint64_t off, size_t size)
+	{
+		if(off >= base && off + size <= base + len) {
+			return buf + (off - base);
+		}
+
+		size_t want = std::max(size, (size_t)LOGDB_SCAN_BUFFER_SIZE);
+		if(want > bufsz) {
+			char* tmp = (char*)::realloc(buf, want);
+			if(!tmp) {
+				return NULL;
+			}
+			buf = tmp;
+			bufsz = want;
+		}
+
+		ssize_t rl = logdb_pread_all(fd, buf, want, off);
+		if(rl < 0) {
+			len = 0;
+			return NULL;
+		}
+		base = off;
+		len = rl;
+
+		if(len < size) {
+			return NULL;
+		}
+		return buf;
+	}
+
+	// valid record: length of the record;  broken or EOF: 0
+	uint64_t read(uint64_t off,
+			const char** key, uint32_t* keylen,
+			const char** val, uint32_t* vallen)
+	{
+		const char* p = fetch(off, LOGDB_HEADER_SIZE);
+		if(!p) {
+			return 0;
+		}
+
+		uint32_t kl = logdb_load32(p+4);
+		uint32_t vl = logdb_load32(p+8);
+		uint64_t reclen = logdb_reclen(kl, vl);
+		if(reclen > LOGDB_MAX_RECORD) {
+			return 0;
+		}
+
+		p = fetch(off, reclen);
+		if(!p) {
+			return 0;
+		}
+
+		uint32_t crc = crc32(0, (const Bytef*)p+4, reclen-4);
+		if(crc != logdb_load32(p)) {
+			return 0;
+		}
+
+		*key = p + LOGDB_HEADER_SIZE;
+		*keylen = kl;
+		*val = p + LOGDB_HEADER_SIZE + kl;
+		*vallen = vl;
+		return reclen;
+	}
+
+	// offset of the next valid record after the broken record at off;
+	// not found: end
+	uint64_t skip(uint64_t off, uint64_t end)
+	{
+		const char* key;  uint32_t keylen;
+		const char* val;  uint32_t vallen;
+
+		// the header may be intact if only the body is broken
+		const char* p = fetch(off, LOGDB_HEADER_SIZE);
+		if(p) {
+			uint64_t next = off + logdb_reclen(logdb_load32(p+4), logdb_load32(p+8));
+			if(next < end && read(next, &key, &keylen, &val, &vallen) > 0) {
+				return next;
+			}
+		}
+
+		// search the next record
+		for(uint64_t next = off + 1; next + LOGDB_HEADER_SIZE <= end; ++next) {
+			p = fetch(next, LOGDB_HEADER_SIZE);
+			if(!p) {
+				break;
+			}
+			uint64_t reclen = logdb_reclen(logdb_load32(p+4), logdb_load32(p+8));
+			if(next + reclen > end) {
+				continue;
+			}
+			if(read(next, &key, &keylen, &val, &vallen) > 0) {
+				return next;
+			}
+		}
+		return end;
+	}
+
+	int fd;
+	char* buf;
+	size_t bufsz;
+	uint64_t base;
+	size_t len;
+
+private:
+	logdb_scanner();
+	logdb_scanner(const logdb_scanner&);
+};
+
+
+static std::string logdb_segment_path(const std::string& dir, uint32_t id)
+{
+	std::string fname(dir.size() + 16, '\0');
+	int len = ::snprintf(&fname[0], fname.size(), LOGDB_SEGMENT_FORMAT, dir.c_str(), id);
+	fname.resize(len);
+	return fname;
+}
+
+static logdb_segment* logdb_open_segment(kumo_logdb* ctx, uint32_t id, bool create)
+{
+	std::string fname(logdb_segment_path(ctx->path, id));
+
+	int fd = ::open(fname.c_str(), O_RDWR | (create ? O_CREAT|O_EXCL : 0), 0644);
+	if(fd < 0) {
+		s_errmsg = strerror(errno);
+		return NULL;
+	}
+
+	try {
+		logdb_segment* seg = new logdb_segment(id, fd);
+		{
+			mp::pthread_scoped_wrlock lk(ctx->segments_mutex);
+			ctx->segments[id] = seg;
+		}
+		return seg;
+
+	} catch (...) {
+		::close(fd);
+		s_errmsg = "out of memory";
+		return NULL;
+	}
+}
+
+static void logdb_remove_segment(kumo_logdb* ctx, logdb_segment* seg)
+{
+	{
+		mp::pthread_scoped_wrlock lk(ctx->segments_mutex);
+		ctx->segments.erase(seg->id);
+	}
+
+	::unlink(logdb_segment_path(ctx->path, seg->id).c_str());
+
+	::close(seg->fd);
+	delete seg;
+}
+
+
+// write nrecords records in buf at the tail.
+// caller must hold the write locks of the stripes of the records.
+// if succeeded, (*result_seg)->pending is incremented by nrecords;
+// release them with logdb_link() or logdb_unpend().
+static bool logdb_write(kumo_logdb* ctx,
+		const char* buf, uint64_t len, uint32_t nrecords,
+		logdb_segment** result_seg, uint64_t* result_off)
+{
+	logdb_segment* seg;
+	uint64_t off;
+	try {
+		mp::pthread_scoped_lock lk(ctx->append_mutex);
+
+		seg = ctx->tail;
+		if(seg->size > 0 && seg->size + len > ctx->segsiz) {
+			seg = logdb_open_segment(ctx, seg->id + 1, true);
+			if(!seg) {
+				return false;
+			}
+			ctx->tail = seg;
+			ctx->compact_pending = true;
+		}
+
+		off = seg->size;
+		seg->size += len;
+		__sync_add_and_fetch(&seg->pending, nrecords);
+
+	} catch (...) {
+		s_errmsg = "failed to lock";
+		return false;
+	}
+
+	if(!logdb_pwrite_all(seg->fd, buf, len, off)) {
+		s_errmsg = strerror(errno);
+		// the reserved area is left broken and skipped on next open.
+		__sync_sub_and_fetch(&seg->pending, nrecords);
+		return false;
+	}
+
+	*result_seg = seg;
+	*result_off = off;
+	return true;
+}
+
+// caller must hold the write lock of the stripe of the key.
+// if succeeded, result->seg->pending is incremented;
+// release it with logdb_link() or logdb_unpend().
+static bool logdb_append(kumo_logdb* ctx,
+		const char* key, uint32_t keylen,
+		const char* val, uint32_t vallen,
+		logdb_location* result)
+{
+	uint64_t reclen;
+	char* buf = logdb_build_record(key, keylen, val, vallen, &reclen);
+	if(!buf) {
+		s_errmsg = "out of memory";
+		return false;
+	}
+
+	bool ret = logdb_write(ctx, buf, reclen, 1, &result->seg, &result->off);
+	::free(buf);
+	if(!ret) {
+		return false;
+	}
+
+	result->vallen = vallen;
+	return true;
+}
+
+// the record at loc is referenced by the index
+static inline void logdb_link(const logdb_location& loc, size_t keylen)
+{
+	__sync_add_and_fetch(&loc.seg->live, logdb_reclen(keylen, loc.vallen));
+	__sync_sub_and_fetch(&loc.seg->pending, 1);
+}
+
+// the appended record at loc is not referenced by the index
+static inline void logdb_unpend(const logdb_location& loc)
+{
+	__sync_sub_and_fetch(&loc.seg->pending, 1);
+}
+
+// the record at loc is no longer referenced by the index
+static inline void logdb_unlink(const logdb_location& loc, size_t keylen)
+{
+	__sync_sub_and_fetch(&loc.seg->live, logdb_reclen(keylen, loc.vallen));
+}
+
+// caller must hold the lock of the stripe of the key
+static char* logdb_read_value(kumo_logdb* ctx,
+		const logdb_location& loc, size_t keylen)
+{
+	char* val = (char*)::malloc(loc.vallen > 0 ? loc.vallen : 1);
+	if(!val) {
+		s_errmsg = "out of memory";
+		return NULL;
+	}
+
+	ssize_t rl = logdb_pread_all(loc.seg->fd, val, loc.vallen,
+			loc.off + LOGDB_HEADER_SIZE + keylen);
+	if(rl != (ssize_t)loc.vallen) {
+		s_errmsg = (rl < 0) ? strerror(errno) : "unexpected end of log";
+		::free(val);
+		return NULL;
+	}
+
+	return val;
+}
+
+
+// replay a segment on open. broken records are skipped and
+// the broken tail of the segment is truncated.
+static bool logdb_replay_segment(kumo_logdb* ctx, logdb_segment* seg)
+{
+	struct stat st;
+	if(::fstat(seg->fd, &st) < 0) {
+		s_errmsg = strerror(errno);
+		return false;
+	}
+	const uint64_t fsize = st.st_size;
+
+	logdb_scanner sc(seg->fd);
+
+	uint64_t off = 0;
+	uint64_t end = 0;  // end of the last valid record
+	while(off < fsize) {
+		const char* key;  uint32_t keylen;
+		const char* val;  uint32_t vallen;
+		uint64_t reclen = sc.read(off, &key, &keylen, &val, &vallen);
+		if(reclen == 0) {
+			off = sc.skip(off, fsize);
+			continue;
+		}
+
+		logdb_stripe* st = ctx->stripe_of(key, keylen);
+		std::string k(key, keylen);
+
+		if(vallen == LOGDB_TOMBSTONE) {
+			logdb_index::iterator it = st->index.find(k);
+			if(it != st->index.end()) {
+				logdb_unlink(it->second, keylen);
+				st->index.erase(it);
+				--ctx->rnum;
+			}
+
+		} else {
+			logdb_location loc = { seg, off, vallen };
+			std::pair<logdb_index::iterator, bool> ins =
+				st->index.insert(logdb_index::value_type(k, loc));
+			if(ins.second) {
+				++ctx->rnum;
+			} else {
+				logdb_unlink(ins.first->second, keylen);
+				ins.first->second = loc;
+			}
+			seg->live += reclen;
+		}
+
+		off += reclen;
+		end = off;
+	}
+
+	if(fsize != end && ::ftruncate(seg->fd, end) < 0) {
+		s_errmsg = strerror(errno);
+		return false;
+	}
+
+	seg->size = end;
+	return true;
+}
+
+
+// copy live records in seg to the tail.
+static void logdb_compact_segment(kumo_logdb* ctx, logdb_segment* seg)
+{
+	logdb_scanner sc(seg->fd);
+
+	uint64_t off = 0;
+	while(off < seg->size) {
+		const char* key;  uint32_t keylen;
+		const char* val;  uint32_t vallen;
+		uint64_t reclen = sc.read(off, &key, &keylen, &val, &vallen);
+		if(reclen == 0) {
+			if(__sync_add_and_fetch(&seg->pending, 0) > 0) {
+				// a record may be still being written
+				return;
+			}
+			// broken by a failed write or a crash
+			off = sc.skip(off, seg->size);
+			continue;
+		}
+		uint64_t recoff = off;
+		off += reclen;
+
+		bool oldest;
+		{
+			mp::pthread_scoped_rdlock lk(ctx->segments_mutex);
+			oldest = ctx->segments.begin()->first == seg->id;
+		}
+
+		logdb_stripe* st = ctx->stripe_of(key, keylen);
+		mp::pthread_scoped_wrlock lk(st->mutex);
+
+		logdb_index::iterator it = st->index.find(std::string(key, keylen));
+
+		if(vallen == LOGDB_TOMBSTONE) {
+			// the tombstone is required only if older segments
+			// may have the deleted record
+			if(oldest || it != st->index.end()) {
+				continue;
+			}
+
+			logdb_location loc;
+			if(!logdb_append(ctx, key, keylen, NULL, LOGDB_TOMBSTONE, &loc)) {
+				return;
+			}
+			logdb_unpend(loc);
+
+		} else {
+			if(it == st->index.end() ||
+					it->second.seg != seg || it->second.off != recoff) {
+				continue;
+			}
+
+			logdb_location loc;
+			if(!logdb_append(ctx, key, keylen, val, vallen, &loc)) {
+				return;
+			}
+			logdb_unlink(it->second, keylen);
+			it->second = loc;
+			logdb_link(loc, keylen);
+		}
+	}
+}
+
+// fsync segments whose id is first or larger
+static bool logdb_sync_segments(kumo_logdb* ctx, uint32_t first)
+{
+	mp::pthread_scoped_rdlock lk(ctx->segments_mutex);
+	for(logdb_segments::iterator it(ctx->segments.lower_bound(first)),
+			it_end(ctx->segments.end()); it != it_end; ++it) {
+		if(::fsync(it->second->fd) < 0) {
+			s_errmsg = strerror(errno);
+			return false;
+		}
+	}
+	return true;
+}
+
+// called only by the compactor thread
+static void logdb_compact(kumo_logdb* ctx)
+{
+	try {
+		uint32_t tail_id;
+		{
+			mp::pthread_scoped_lock lk(ctx->append_mutex);
+			tail_id = ctx->tail->id;
+		}
+
+		std::vector<logdb_segment*> victims;
+		{
+			mp::pthread_scoped_rdlock lk(ctx->segments_mutex);
+			for(logdb_segments::iterator it(ctx->segments.begin()),
+					it_end(ctx->segments.end()); it != it_end; ++it) {
+				logdb_segment* seg = it->second;
+				if(seg->id >= tail_id) { break; }
+				if(seg->size == 0 ||
+						seg->live * 100 < seg->size * LOGDB_COMPACT_PERCENT) {
+					victims.push_back(seg);
+				}
+			}
+		}
+
+		std::vector<logdb_segment*> removes;
+		for(std::vector<logdb_segment*>::iterator it(victims.begin()),
+				it_end(victims.end()); it != it_end; ++it) {
+			logdb_segment* seg = *it;
+			logdb_compact_segment(ctx, seg);
+
+			// pending must be checked before live;
+			// no records are appended to non-tail segments.
+			if(__sync_add_and_fetch(&seg->pending, 0) == 0 &&
+					__sync_add_and_fetch(&seg->live, 0) == 0) {
+				removes.push_back(seg);
+			}
+		}
+
+		if(removes.empty()) {
+			return;
+		}
+
+		// the copied records must be on the disk before the old
+		// segments are removed
+		if(!logdb_sync_segments(ctx, tail_id)) {
+			return;
+		}
+
+		for(std::vector<logdb_segment*>::iterator it(removes.begin()),
+				it_end(removes.end()); it != it_end; ++it) {
+			logdb_remove_segment(ctx, *it);
+		}
+
+	} catch (...) { }
+}
+
+
+struct logdb_compactor : public mp::pthread_thread {
+	logdb_compactor(kumo_logdb* pctx) :
+		mp::pthread_thread(this), ctx(pctx) { }
+
+	void operator() ()
+	{
+		mp::pthread_scoped_lock lk(ctx->compact_mutex);
+		while(!ctx->compact_stop) {
+			if(!ctx->compact_pending) {
+				ctx->compact_cond.wait(ctx->compact_mutex);
+				continue;
+			}
+			ctx->compact_pending = false;
+
+			lk.unlock();
+			logdb_compact(ctx);
+			lk.relock(ctx->compact_mutex);
+		}
+	}
+
+	kumo_logdb* ctx;
+
+private:
+	logdb_compactor();
+	logdb_compactor(const logdb_compactor&);
+};
+
+// wake up the compactor thread if the log is rotated
+static inline void logdb_notify_compact(kumo_logdb* ctx)
+{
+	if(!ctx->compact_pending) {
+		return;
+	}
+	mp::pthread_scoped_lock lk(ctx->compact_mutex);
+	ctx->compact_cond.signal();
+}
+
+void kumo_logdb::close()
+{
+	if(compactor) {
+		{
+			mp::pthread_scoped_lock lk(compact_mutex);
+			compact_stop = true;
+			compact_cond.signal();
+		}
+		compactor->join();
+		delete compactor;
+		compactor = NULL;
+		compact_stop = false;
+	}
+	close_segments();
+}
+
+
+static void* kumo_logdb_create(void)
+try {
+	kumo_logdb* ctx = new kumo_logdb();
+	return reinterpret_cast<void*>(ctx);
+
+} catch (...) {
+	return NULL;
+}
+
+static void kumo_logdb_free(void* data)
+{
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+	delete ctx;
+}
+
+static bool kumo_logdb_open(void* data, const char* path)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	char* str = ::strdup(path);
+	if(!str) {
+		return false;
+	}
+
+	uint32_t stripes = LOGDB_DEFAULT_STRIPES;  bool stripes_set = false;
+	uint64_t segsiz  = LOGDB_DEFAULT_SEGSIZ;   bool segsiz_set = false;
+
+	path = parse_param(str,
+			&stripes_set, &stripes,
+			&segsiz_set, &segsiz);
+	if(!path || stripes == 0 || (stripes & (stripes-1)) != 0 || segsiz == 0) {
+		s_errmsg = "invalid parameter";
+		::free(str);
+		return false;
+	}
+
+	ctx->path = path;
+	::free(str);
+
+	ctx->segsiz = segsiz;
+	ctx->stripes = new logdb_stripe[stripes];
+	ctx->nstripes = stripes;
+
+	if(::mkdir(ctx->path.c_str(), 0755) < 0 && errno != EEXIST) {
+		s_errmsg = strerror(errno);
+		goto open_error;
+	}
+
+	{
+		std::vector<uint32_t> ids;
+
+		DIR* dir = ::opendir(ctx->path.c_str());
+		if(!dir) {
+			s_errmsg = strerror(errno);
+			goto open_error;
+		}
+		while(struct dirent* ent = ::readdir(dir)) {
+			unsigned int id;
+			char tail;
+			if(::sscanf(ent->d_name, LOGDB_SEGMENT_SCAN "%c", &id, &tail) == 1 &&
+					::strlen(ent->d_name) == 12) {
+				ids.push_back(id);
+			}
+		}
+		::closedir(dir);
+
+		std::sort(ids.begin(), ids.end());
+
+		for(std::vector<uint32_t>::iterator it(ids.begin()),
+				it_end(ids.end()); it != it_end; ++it) {
+			logdb_segment* seg = logdb_open_segment(ctx, *it, false);
+			if(!seg) {
+				goto open_error;
+			}
+			if(!logdb_replay_segment(ctx, seg)) {
+				goto open_error;
+			}
+			ctx->tail = seg;
+		}
+	}
+
+	if(!ctx->tail || ctx->tail->size >= ctx->segsiz) {
+		uint32_t id = ctx->tail ? ctx->tail->id + 1 : 1;
+		ctx->tail = logdb_open_segment(ctx, id, true);
+		if(!ctx->tail) {
+			goto open_error;
+		}
+	}
+
+	ctx->compact_pending = true;
+	ctx->compactor = new logdb_compactor(ctx);
+	try {
+		ctx->compactor->run();
+	} catch (...) {
+		delete ctx->compactor;
+		ctx->compactor = NULL;
+		s_errmsg = "failed to create thread";
+		goto open_error;
+	}
+	return true;
+
+open_error:
+	ctx->close();
+	return false;
+
+} catch (...) {
+	return false;
+}
+
+static void kumo_logdb_close(void* data)
+{
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+	ctx->close();
+}
+
+
+static const char* kumo_logdb_get(void* data,
+		const char* key, uint32_t keylen,
+		uint32_t* result_vallen,
+		msgpack_zone* zone)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	logdb_stripe* st = ctx->stripe_of(key, keylen);
+	mp::pthread_scoped_rdlock lk(st->mutex);
+
+	logdb_index::const_iterator it = st->index.find(std::string(key, keylen));
+	if(it == st->index.end()) {
+		return NULL;
+	}
+
+	char* val = logdb_read_value(ctx, it->second, keylen);
+	if(!val) {
+		return NULL;
+	}
+	*result_vallen = it->second.vallen;
+
+	if(!msgpack_zone_push_finalizer(zone, free, val)) {
+		free(val);
+		return NULL;
+	}
+
+	return val;
+
+} catch (...) {
+	return NULL;
+}
+
+static int32_t kumo_logdb_get_header(void* data,
+		const char* key, uint32_t keylen,
+		char* result_val, uint32_t vallen)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	logdb_stripe* st = ctx->stripe_of(key, keylen);
+	mp::pthread_scoped_rdlock lk(st->mutex);
+
+	logdb_index::const_iterator it = st->index.find(std::string(key, keylen));
+	if(it == st->index.end()) {
+		return -1;
+	}
+
+	const logdb_location& loc(it->second);
+	uint32_t len = std::min(vallen, loc.vallen);
+
+	ssize_t rl = logdb_pread_all(loc.seg->fd, result_val, len,
+			loc.off + LOGDB_HEADER_SIZE + keylen);
+	if(rl != (ssize_t)len) {
+		return -1;
+	}
+
+	return len;
+
+} catch (...) {
+	return -1;
+}
+
+static bool kumo_logdb_set(void* data,
+		const char* key, uint32_t keylen,
+		const char* val, uint32_t vallen)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	{
+		logdb_stripe* st = ctx->stripe_of(key, keylen);
+		mp::pthread_scoped_wrlock lk(st->mutex);
+
+		logdb_location loc;
+		if(!logdb_append(ctx, key, keylen, val, vallen, &loc)) {
+			return false;
+		}
+
+		std::pair<logdb_index::iterator, bool> ins =
+			st->index.insert(logdb_index::value_type(std::string(key, keylen), loc));
+		if(ins.second) {
+			__sync_add_and_fetch(&ctx->rnum, 1);
+		} else {
+			logdb_unlink(ins.first->second, keylen);
+			ins.first->second = loc;
+		}
+		logdb_link(loc, keylen);
+	}
+
+	logdb_notify_compact(ctx);
+
+	return true;
+
+} catch (...) {
+	return false;
+}
+
+
+static bool logdb_del_impl(kumo_logdb* ctx,
+		const char* key, uint32_t keylen,
+		kumo_storage_casproc proc, void* casdata)
+{
+	{
+		logdb_stripe* st = ctx->stripe_of(key, keylen);
+		mp::pthread_scoped_wrlock lk(st->mutex);
+
+		logdb_index::iterator it = st->index.find(std::string(key, keylen));
+		if(it == st->index.end()) {
+			return false;
+		}
+
+		if(proc) {
+			char* oldval = logdb_read_value(ctx, it->second, keylen);
+			if(!oldval) {
+				return false;
+			}
+			bool ok = proc(casdata, oldval, it->second.vallen);
+			::free(oldval);
+			if(!ok) {
+				return false;
+			}
+		}
+
+		logdb_location loc;
+		if(!logdb_append(ctx, key, keylen, NULL, LOGDB_TOMBSTONE, &loc)) {
+			return false;
+		}
+		logdb_unpend(loc);
+
+		logdb_unlink(it->second, keylen);
+		st->index.erase(it);
+		__sync_sub_and_fetch(&ctx->rnum, 1);
+	}
+
+	logdb_notify_compact(ctx);
+
+	return true;
+}
+
+static bool kumo_logdb_del(void* data,
+		const char* key, uint32_t keylen,
+		kumo_storage_casproc proc, void* casdata)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+	return logdb_del_impl(ctx, key, keylen, proc, casdata);
+
+} catch (...) {
+	return false;
+}
+
+static bool kumo_logdb_update(void* data,
+			const char* key, uint32_t keylen,
+			const char* val, uint32_t vallen,
+			kumo_storage_casproc proc, void* casdata)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	{
+		logdb_stripe* st = ctx->stripe_of(key, keylen);
+		mp::pthread_scoped_wrlock lk(st->mutex);
+
+		std::string k(key, keylen);
+		logdb_index::iterator it = st->index.find(k);
+
+		if(it != st->index.end()) {
+			char* oldval = logdb_read_value(ctx, it->second, keylen);
+			if(!oldval) {
+				return false;
+			}
+			bool ok = proc(casdata, oldval, it->second.vallen);
+			::free(oldval);
+			if(!ok) {
+				return false;
+			}
+		}
+
+		logdb_location loc;
+		if(!logdb_append(ctx, key, keylen, val, vallen, &loc)) {
+			return false;
+		}
+
+		if(it != st->index.end()) {
+			logdb_unlink(it->second, keylen);
+			it->second = loc;
+		} else {
+			st->index.insert(logdb_index::value_type(k, loc));
+			__sync_add_and_fetch(&ctx->rnum, 1);
+		}
+		logdb_link(loc, keylen);
+	}
+
+	logdb_notify_compact(ctx);
+
+	return true;
+
+} catch (...) {
+	return false;
+}
+
+
+namespace {
+struct logdb_scoped_stripes {
+	logdb_scoped_stripes(std::vector<logdb_stripe*>& stripes) :
+		m_stripes(stripes), m_locked(0)
+	{
+		// lock in address order to avoid deadlock
+		std::sort(m_stripes.begin(), m_stripes.end());
+		m_stripes.erase(std::unique(m_stripes.begin(), m_stripes.end()),
+				m_stripes.end());
+		for(; m_locked < m_stripes.size(); ++m_locked) {
+			m_stripes[m_locked]->mutex.wrlock();
+		}
+	}
+
+	~logdb_scoped_stripes()
+	{
+		for(size_t i=0; i < m_locked; ++i) {
+			m_stripes[i]->mutex.unlock();
+		}
+	}
+
+private:
+	std::vector<logdb_stripe*>& m_stripes;
+	size_t m_locked;
+	logdb_scoped_stripes();
+	logdb_scoped_stripes(const logdb_scoped_stripes&);
+};
+}  // noname namespace
+
+// all stripes of the keys are locked at once and the accepted records
+// are written with one pwrite. nothing is written if it fails.
+static int logdb_updatev_impl(kumo_logdb* ctx,
+		const char** keys, const size_t* keylens,
+		const char** vals, const size_t* vallens,
+		uint16_t num,
+		kumo_storage_casproc proc, void** casdata,
+		bool* result)
+{
+	std::vector<logdb_stripe*> sts(num);
+	for(uint16_t i=0; i < num; ++i) {
+		sts[i] = ctx->stripe_of(keys[i], keylens[i]);
+	}
+
+	int n = 0;
+	{
+		std::vector<logdb_stripe*> locks(sts);
+		logdb_scoped_stripes lk(locks);
+
+		// key -> last accepted entry in this batch
+		typedef std::tr1::unordered_map<std::string, uint16_t> batch_t;
+		batch_t batch;
+
+		for(uint16_t i=0; i < num; ++i) {
+			result[i] = false;
+			std::string k(keys[i], keylens[i]);
+
+			batch_t::iterator b = batch.find(k);
+			if(b != batch.end()) {
+				// compare with the earlier entry of this batch
+				uint16_t j = b->second;
+				if(proc(casdata[i], vals[j], vallens[j])) {
+					result[i] = true;
+					b->second = i;
+				}
+				continue;
+			}
+
+			logdb_index::const_iterator it = sts[i]->index.find(k);
+			if(it != sts[i]->index.end()) {
+				char* oldval = logdb_read_value(ctx, it->second, keylens[i]);
+				if(!oldval) {
+					continue;
+				}
+				bool ok = proc(casdata[i], oldval, it->second.vallen);
+				::free(oldval);
+				if(!ok) {
+					continue;
+				}
+			}
+
+			result[i] = true;
+			batch.insert(batch_t::value_type(k, i));
+		}
+
+		if(batch.empty()) {
+			return 0;
+		}
+
+		// only the last accepted entry of each key is written
+		uint64_t len = 0;
+		for(batch_t::const_iterator b(batch.begin()),
+				b_end(batch.end()); b != b_end; ++b) {
+			uint16_t i = b->second;
+			uint64_t reclen = logdb_reclen(keylens[i], vallens[i]);
+			if(reclen > LOGDB_MAX_RECORD) {
+				s_errmsg = "too large record";
+				return -1;
+			}
+			len += reclen;
+		}
+
+		char* buf = (char*)::malloc(len);
+		if(!buf) {
+			s_errmsg = "out of memory";
+			return -1;
+		}
+
+		std::vector<uint64_t> offs;
+		offs.reserve(batch.size());
+		uint64_t off = 0;
+		for(batch_t::const_iterator b(batch.begin()),
+				b_end(batch.end()); b != b_end; ++b) {
+			uint16_t i = b->second;
+			logdb_fill_record(buf+off, keys[i], keylens[i], vals[i], vallens[i]);
+			offs.push_back(off);
+			off += logdb_reclen(keylens[i], vallens[i]);
+		}
+
+		logdb_segment* seg;
+		uint64_t base;
+		bool ret = logdb_write(ctx, buf, len, batch.size(), &seg, &base);
+		::free(buf);
+		if(!ret) {
+			return -1;
+		}
+
+		std::vector<uint64_t>::const_iterator o(offs.begin());
+		for(batch_t::const_iterator b(batch.begin()),
+				b_end(batch.end()); b != b_end; ++b, ++o) {
+			uint16_t i = b->second;
+			logdb_location loc = { seg, base + *o, (uint32_t)vallens[i] };
+
+			std::pair<logdb_index::iterator, bool> ins =
+				sts[i]->index.insert(logdb_index::value_type(b->first, loc));
+			if(ins.second) {
+				__sync_add_and_fetch(&ctx->rnum, 1);
+			} else {
+				logdb_unlink(ins.first->second, keylens[i]);
+				ins.first->second = loc;
+			}
+			logdb_link(loc, keylens[i]);
+		}
+
+		for(uint16_t i=0; i < num; ++i) {
+			if(result[i]) { ++n; }
+		}
+	}
+
+	logdb_notify_compact(ctx);
+
+	return n;
+}
+
+static int kumo_logdb_updatev(void* data,
+		const char** keys, const size_t* keylens,
+		const char** vals, const size_t* vallens,
+		uint16_t num,
+		kumo_storage_casproc proc, void** casdata,
+		bool* result)
+{
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	int n;
+	try {
+		n = logdb_updatev_impl(ctx, keys, keylens, vals, vallens,
+				num, proc, casdata, result);
+	} catch (...) {
+		s_errmsg = "out of memory";
+		n = -1;
+	}
+
+	if(n < 0) {
+		// result[] is set before the records are written
+		for(uint16_t i=0; i < num; ++i) {
+			result[i] = false;
+		}
+	}
+	return n;
+}
+
+
+static uint64_t kumo_logdb_rnum(void* data)
+{
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+	return ctx->rnum;
+}
+
+
+static bool logdb_write_snapshot(kumo_logdb* ctx, int fd)
+{
+	uint64_t off = 0;
+
+	for(uint32_t i=0; i < ctx->nstripes; ++i) {
+		logdb_stripe* st = &ctx->stripes[i];
+		mp::pthread_scoped_rdlock lk(st->mutex);
+
+		for(logdb_index::const_iterator it(st->index.begin()),
+				it_end(st->index.end()); it != it_end; ++it) {
+			const std::string& k(it->first);
+
+			char* val = logdb_read_value(ctx, it->second, k.size());
+			if(!val) {
+				return false;
+			}
+
+			uint64_t reclen;
+			char* buf = logdb_build_record(k.data(), k.size(),
+					val, it->second.vallen, &reclen);
+			::free(val);
+			if(!buf) {
+				s_errmsg = "out of memory";
+				return false;
+			}
+
+			bool ok = logdb_pwrite_all(fd, buf, reclen, off);
+			::free(buf);
+			if(!ok) {
+				s_errmsg = strerror(errno);
+				return false;
+			}
+			off += reclen;
+		}
+	}
+
+	return true;
+}
+
+// the backup is a directory which contains one segment
+static void logdb_remove_backup(const std::string& path)
+{
+	::unlink(logdb_segment_path(path, 1).c_str());
+	::rmdir(path.c_str());
+}
+
+static bool logdb_backup_to(kumo_logdb* ctx, const std::string& tmppath)
+{
+	int fd = ::open(logdb_segment_path(tmppath, 1).c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd < 0) {
+		s_errmsg = strerror(errno);
+		return false;
+	}
+
+	if(!logdb_write_snapshot(ctx, fd)) {
+		::close(fd);
+		return false;
+	}
+
+	if(::fsync(fd) < 0) {
+		s_errmsg = strerror(errno);
+		::close(fd);
+		return false;
+	}
+	::close(fd);
+
+	return true;
+}
+
+static bool kumo_logdb_backup(void* data, const char* dstpath)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	std::string tmppath(dstpath);
+	tmppath += BACKUP_TMP_SUFFIX;
+
+	// left by a failed backup
+	logdb_remove_backup(tmppath);
+
+	if(::mkdir(tmppath.c_str(), 0755) < 0) {
+		s_errmsg = strerror(errno);
+		return false;
+	}
+
+	try {
+		if(!logdb_backup_to(ctx, tmppath)) {
+			logdb_remove_backup(tmppath);
+			return false;
+		}
+	} catch (...) {
+		logdb_remove_backup(tmppath);
+		return false;
+	}
+
+	if(::rename(tmppath.c_str(), dstpath) < 0) {
+		s_errmsg = strerror(errno);
+		logdb_remove_backup(tmppath);
+		return false;
+	}
+
+	return true;
+
+} catch (...) {
+	return false;
+}
+
+static const char* kumo_logdb_error(void* data)
+{
+	return s_errmsg;
+}
+
+
+struct kumo_logdb_iterator {
+	kumo_logdb_iterator(kumo_logdb* pctx) :
+		key(NULL), keylen(0),
+		val(NULL), vallen(0),
+		ctx(pctx) { }
+
+	~kumo_logdb_iterator()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		::free(key);  key = NULL;
+		::free(val);  val = NULL;
+	}
+
+	char* key;
+	size_t keylen;
+	char* val;
+	size_t vallen;
+	kumo_logdb* ctx;
+
+private:
+	kumo_logdb_iterator();
+	kumo_logdb_iterator(const kumo_logdb_iterator&);
+};
+
+// func is called without any locks so that it can modify the storage.
+// number of iterated records;  failed: < 0
+static int logdb_for_each_stripe(kumo_logdb* ctx, logdb_stripe* st,
+		void* user, int (*func)(void* user, void* iterator_data))
+{
+	kumo_logdb_iterator it(ctx);
+	std::vector<std::string> keys;
+
+	{
+		mp::pthread_scoped_rdlock lk(st->mutex);
+		keys.reserve(st->index.size());
+		for(logdb_index::const_iterator kt(st->index.begin()),
+				kt_end(st->index.end()); kt != kt_end; ++kt) {
+			keys.push_back(kt->first);
+		}
+	}
+
+	int n = 0;
+	for(std::vector<std::string>::const_iterator kt(keys.begin()),
+			kt_end(keys.end()); kt != kt_end; ++kt) {
+		{
+			mp::pthread_scoped_rdlock lk(st->mutex);
+
+			logdb_index::const_iterator f = st->index.find(*kt);
+			if(f == st->index.end()) {
+				continue;  // deleted
+			}
+
+			it.val = logdb_read_value(ctx, f->second, kt->size());
+			if(!it.val) {
+				return -1;
+			}
+			it.vallen = f->second.vallen;
+		}
+
+		it.key = (char*)::malloc(kt->size() > 0 ? kt->size() : 1);
+		if(!it.key) {
+			it.reset();
+			return -1;
+		}
+		memcpy(it.key, kt->data(), kt->size());
+		it.keylen = kt->size();
+
+		int ret = (*func)(user, (void*)&it);
+		it.reset();
+		if(ret < 0) {
+			return ret;
+		}
+		++n;
+	}
+
+	return n;
+}
+
+static int kumo_logdb_for_each(void* data,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	for(uint32_t i=0; i < ctx->nstripes; ++i) {
+		int ret = logdb_for_each_stripe(ctx, &ctx->stripes[i], user, func);
+		if(ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+
+} catch (...) {
+	return -1;
+}
+
+static const char* kumo_logdb_iterator_key(void* iterator_data)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return it->key;
+}
+
+static const char* kumo_logdb_iterator_val(void* iterator_data)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return it->val;
+}
+
+static size_t kumo_logdb_iterator_keylen(void* iterator_data)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return it->keylen;
+}
+
+static size_t kumo_logdb_iterator_vallen(void* iterator_data)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return it->vallen;
+}
+
+
+static const char* kumo_logdb_iterator_release_key(void* iterator_data, msgpack_zone* zone)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+
+	if(!msgpack_zone_push_finalizer(zone, free, it->key)) {
+		return NULL;
+	}
+
+	const char* tmp = it->key;
+	it->key = NULL;
+	return tmp;
+}
+
+static const char* kumo_logdb_iterator_release_val(void* iterator_data, msgpack_zone* zone)
+{
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+
+	if(!msgpack_zone_push_finalizer(zone, free, it->val)) {
+		return NULL;
+	}
+
+	const char* tmp = it->val;
+	it->val = NULL;
+	return tmp;
+}
+
+static bool kumo_logdb_iterator_del(void* iterator_data,
+		kumo_storage_casproc proc, void* casdata)
+try {
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return logdb_del_impl(it->ctx, it->key, it->keylen, proc, casdata);
+
+} catch (...) {
+	return false;
+}
+
+static bool kumo_logdb_iterator_del_force(void* iterator_data)
+try {
+	kumo_logdb_iterator* it = reinterpret_cast<kumo_logdb_iterator*>(iterator_data);
+	return logdb_del_impl(it->ctx, it->key, it->keylen, NULL, NULL);
+
+} catch (...) {
+	return false;
+}
+
+
+// A cursor steps stripe by stripe; `limit' is rounded up to a stripe.
+struct kumo_logdb_cursor {
+	kumo_logdb_cursor(kumo_logdb* pctx) :
+		ctx(pctx), stripe(0) { }
+
+	kumo_logdb* ctx;
+	uint32_t stripe;
+
+private:
+	kumo_logdb_cursor();
+	kumo_logdb_cursor(const kumo_logdb_cursor&);
+};
+
+static void* kumo_logdb_cursor_new(void* data)
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+	return reinterpret_cast<void*>(new kumo_logdb_cursor(ctx));
+
+} catch (...) {
+	return NULL;
+}
+
+static void kumo_logdb_cursor_free(void* cursor)
+{
+	kumo_logdb_cursor* cur = reinterpret_cast<kumo_logdb_cursor*>(cursor);
+	delete cur;
+}
+
+static int kumo_logdb_cursor_step(void* cursor, size_t limit,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_logdb_cursor* cur = reinterpret_cast<kumo_logdb_cursor*>(cursor);
+	kumo_logdb* ctx = cur->ctx;
+
+	int n = 0;
+	while((size_t)n < limit) {
+		if(cur->stripe >= ctx->nstripes) {
+			// rewind
+			cur->stripe = 0;
+			break;
+		}
+
+		int ret = logdb_for_each_stripe(ctx, &ctx->stripes[cur->stripe], user, func);
+		if(ret < 0) {
+			return ret;
+		}
+		n += ret;
+		++cur->stripe;
+	}
+
+	return n;
+
+} catch (...) {
+	return -1;
+}
+
+// partitions are sets of stripes
+static int kumo_logdb_for_each_part(void* data,
+		unsigned int part, unsigned int nparts,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_logdb* ctx = reinterpret_cast<kumo_logdb*>(data);
+
+	for(uint32_t i=part; i < ctx->nstripes; i += nparts) {
+		int ret = logdb_for_each_stripe(ctx, &ctx->stripes[i], user, func);
+		if(ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+
+} catch (...) {
+	return -1;
+}
+
+
+static kumo_storage_op kumo_logdb_op =
+{
+	kumo_logdb_create,
+	kumo_logdb_free,
+	kumo_logdb_open,
+	kumo_logdb_close,
+	kumo_logdb_get,
+	kumo_logdb_get_header,
+	kumo_logdb_set,
+	kumo_logdb_del,
+	kumo_logdb_update,
+	kumo_logdb_updatev,
+	kumo_logdb_rnum,
+	kumo_logdb_backup,
+	kumo_logdb_error,
+	kumo_logdb_for_each,
+	kumo_logdb_iterator_key,
+	kumo_logdb_iterator_val,
+	kumo_logdb_iterator_keylen,
+	kumo_logdb_iterator_vallen,
+	kumo_logdb_iterator_release_key,
+	kumo_logdb_iterator_release_val,
+	kumo_logdb_iterator_del,
+	kumo_logdb_iterator_del_force,
+	kumo_logdb_cursor_new,
+	kumo_logdb_cursor_free,
+	kumo_logdb_cursor_step,
+	kumo_logdb_for_each_part,
+	NULL,  // logdb is not ordered
+};
+
+kumo_storage_op kumo_storage_init(void)
+{
+	return kumo_logdb_op;
+}
+
@@ -17,6 +17,8 @@
 //
 #include "storage/storage.h"
 #include "log/mlogger.h"
+#include <vector>
+#include <memory>
 
 namespace kumo {
 
@@ -27,8 +29,13 @@ Storage::Storage(const char* path,
 		size_t garbage_mem_limit) :
 	m_garbage_min_time(garbage_min_time),
 	m_garbage_max_time(garbage_max_time),
-	m_garbage_mem_limit(garbage_mem_limit)
+	m_garbage_mem_limit(garbage_mem_limit / GARBAGE_SHARDS),
+	m_sweep_cursor(NULL),
+	m_change_hook(NULL),
+	m_change_hook_user(NULL)
 {
+	memset((void*)m_change, 0, sizeof(m_change));
+
 	m_op = kumo_storage_init();
 
 	m_data = m_op.create();
@@ -45,6 +52,9 @@ Storage::Storage(const char* path,
 
 Storage::~Storage()
 {
+	if(m_sweep_cursor) {
+		m_op.cursor_free(m_sweep_cursor);
+	}
 	m_op.close(m_data);
 	m_op.free(m_data);
 }
@@ -59,6 +69,7 @@ void Storage::set(
 			raw_val, raw_vallen)) {
 		throw storage_error("set failed");
 	}
+	changed(raw_key, raw_keylen, raw_val, raw_vallen);
 }
 
 
@@ -100,11 +111,63 @@ bool Storage::update(
 {
 	ClockTime update_clocktime = clocktime_of(raw_val);
 
-	return m_op.update(m_data,
+	bool updated = m_op.update(m_data,
 			raw_key, raw_keylen,
 			raw_val, raw_vallen,
 			&storage_updateproc,
 			reinterpret_cast<void*>(&update_clocktime));
+	if(updated) {
+		changed(raw_key, raw_keylen, raw_val, raw_vallen);
+	}
+	return updated;
+}
+
+
+size_t Storage::updatev(
+		const char** raw_keys, const size_t* raw_keylens,
+		const char** raw_vals, const size_t* raw_vallens,
+		uint16_t num, bool* updated)
+{
+	if(!m_op.updatev) {
+		size_t n = 0;
+		for(uint16_t i=0; i < num; ++i) {
+			updated[i] = update(
+					raw_keys[i], raw_keylens[i],
+					raw_vals[i], raw_vallens[i]);
+			if(updated[i]) { ++n; }
+		}
+		return n;
+	}
+
+	std::vector<ClockTime> update_clocktimes;
+	update_clocktimes.reserve(num);
+	std::vector<void*> casdata(num);
+	for(uint16_t i=0; i < num; ++i) {
+		update_clocktimes.push_back( clocktime_of(raw_vals[i]) );
+		casdata[i] = reinterpret_cast<void*>(&update_clocktimes[i]);
+		updated[i] = false;
+	}
+
+	int n = m_op.updatev(m_data,
+			raw_keys, raw_keylens,
+			raw_vals, raw_vallens,
+			num,
+			&storage_updateproc,
+			&casdata[0],
+			updated);
+
+	// some entries may be updated before the failure
+	for(uint16_t i=0; i < num; ++i) {
+		if(updated[i]) {
+			changed(raw_keys[i], raw_keylens[i], raw_vals[i], raw_vallens[i]);
+		}
+	}
+
+	if(n < 0) {
+		throw storage_error("updatev failed");
+	}
+
+	return n;
 }
 
 
@@ -129,11 +192,15 @@ bool Storage::cas(
 		const char* raw_val, uint32_t raw_vallen,
 		ClockTime compare)
 {
-	return m_op.update(m_data,
+	bool updated = m_op.update(m_data,
 			raw_key, raw_keylen,
 			raw_val, raw_vallen,
 			&storage_casproc,
 			static_cast<void*>(&compare));
+	if(updated) {
+		changed(raw_key, raw_keylen, raw_val, raw_vallen);
+	}
+	return updated;
 }
 
 
@@ -211,55 +278,143 @@ bool Storage::remove(
 	}
 
 	// push garbage
+	// aged garbage is deleted by purge_garbage()
 
-	mp::pthread_scoped_lock gclk;
+	scoped_clock_key clock_key(raw_key, raw_keylen, update_clocktime);
 
-	{
-		scoped_clock_key clock_key(raw_key, raw_keylen, update_clocktime);
+	garbage_shard& gs = m_garbage[hash_of(raw_key) % GARBAGE_SHARDS];
+	mp::pthread_scoped_lock gslk(gs.mutex);
 
-		gclk.relock(m_garbage_mutex);
+	gs.queue.push(clock_key.data(), clock_key.size(raw_keylen));
 
-		m_garbage.push(clock_key.data(), clock_key.size(raw_keylen));
+	// purge_garbage() seems to be stalled.
+	// forget old garbage; for_each() removes them later.
+	if(gs.queue.total_size() > m_garbage_mem_limit * 2) {
+		uint64_t n = 0;
+		do {
+			gs.queue.pop();
+			++n;
+		} while(gs.queue.total_size() > m_garbage_mem_limit * 2);
+		gs.dropped += n;
+
+		if(!gs.dropping) {
+			gs.dropping = true;
+			LOG_WARN("garbage queue is full; forgetting garbage records (",
+					gs.dropped," dropped in the shard)");
+		}
 	}
 
+	return true;
+}
+
+uint64_t Storage::garbage_dropped()
+{
+	uint64_t n = 0;
+	for(size_t i=0; i < GARBAGE_SHARDS; ++i) {
+		mp::pthread_scoped_lock gslk(m_garbage[i].mutex);
+		n += m_garbage[i].dropped;
+	}
+	return n;
+}
+
+size_t Storage::purge_garbage(ClockTime now)
+{
+	size_t n = 0;
+	for(size_t i=0; i < GARBAGE_SHARDS; ++i) {
+		n += purge_garbage_shard(m_garbage[i], now);
+	}
+	return n;
+}
+
+size_t Storage::purge_garbage_shard(garbage_shard& gs, ClockTime now)
+{
+	size_t n = 0;
+	buffer_queue batch;
+
 	while(true) {
-		size_t size;
-		const char* data = (const char*)m_garbage.front(&size);
-		if(!data) {
-			break;
+		bool more = false;
+
+		{
+			mp::pthread_scoped_lock gslk(gs.mutex);
+
+			if(gs.dropping && gs.queue.total_size() <= m_garbage_mem_limit) {
+				gs.dropping = false;
+			}
+
+			for(size_t i=0; i < GARBAGE_PURGE_BATCH; ++i) {
+				size_t size;
+				const char* data = (const char*)gs.queue.front(&size);
+				if(!data) {
+					break;
+				}
+
+				scoped_clock_key::wrap garbage_key(data, size);
+
+				if(gs.queue.total_size() > m_garbage_mem_limit) {
+					// over usage over, pop garbage
+					if(garbage_key.clocktime() <
+							now.before_sec(m_garbage_min_time)) {  // min check
+						batch.push(data, size);
+					}
+					gs.queue.pop();
+
+				} else if(garbage_key.clocktime() <
+						now.before_sec(m_garbage_max_time)) {  // max check
+					batch.push(data, size);
+					gs.queue.pop();
+
+				} else {
+					break;
+				}
+
+				if(i == GARBAGE_PURGE_BATCH-1) {
+					more = true;
+				}
+			}
+
+			// unlock gslk
 		}
 
-		scoped_clock_key::wrap garbage_key(data, size);
-
-		if(m_garbage.total_size() > m_garbage_mem_limit) {
-			// over usage over, pop garbage
-			if(garbage_key.clocktime() <
-					update_clocktime.before_sec(m_garbage_min_time)) {  // min check
-				ClockTime ct = garbage_key.clocktime();
-				m_op.del(m_data,
-						garbage_key.key(), garbage_key.keylen(),
-						&storage_updateproc_eq,
-						reinterpret_cast<void*>(&ct));
+		while(true) {
+			size_t size;
+			const char* data = (const char*)batch.front(&size);
+			if(!data) {
+				break;
 			}
-			m_garbage.pop();
 
-		} else if(garbage_key.clocktime() <
-				update_clocktime.before_sec(m_garbage_max_time)) {  // max check
+			scoped_clock_key::wrap garbage_key(data, size);
+
 			ClockTime ct = garbage_key.clocktime();
-			m_op.del(m_data,
+			if(m_op.del(m_data,
 					garbage_key.key(), garbage_key.keylen(),
 					&storage_updateproc_eq,
-					reinterpret_cast<void*>(&ct));
-			m_garbage.pop();
+					reinterpret_cast<void*>(&ct))) {
+				// digests of the hash range are changed
+				count_change(garbage_key.key());
+				++n;
+			}
+			batch.pop();
+		}
 
-		} else {
-			break;
+		if(!more) {
+			return n;
 		}
 	}
+}
 
-	return true;
 
-	// unlock gclk
+static bool storage_expireproc(void* casdata,
+		const char* oldval, size_t oldvallen)
+{
+	if(oldvallen < Storage::VALUE_CLOCKTIME_SIZE) {
+		return false;
+	}
+
+	// not updated since it's expired
+	ClockTime expired_clocktime =
+		ClockTime( *reinterpret_cast<uint64_t*>(casdata) );
+
+	return Storage::clocktime_of(oldval) == expired_clocktime;
 }
 
 
@@ -269,6 +424,8 @@ struct for_each_data {
 	void (*callback)(void* obj, Storage::iterator& it);
 	void* obj;
 	ClockTime clocktime_limit;
+	time_t now;
+	bool removed;  // removed records are passed to the callback
 };
 
 static int for_each_collect(void* user, void* iterator_data)
@@ -294,10 +451,25 @@ try {
 					data->op->iterator_del(iterator_data,
 						&storage_updateproc,
 						reinterpret_cast<void*>(&data->clocktime_limit));
+					return 0;
 				}
 			}
 
 		}
+		if(data->removed && vallen == Storage::VALUE_CLOCKTIME_SIZE) {
+			Storage::iterator it(data->op, iterator_data);
+			(*data->callback)(data->obj, it);
+		}
+		return 0;
+	}
+
+	if(Storage::is_expired(val, vallen, data->now)) {
+		if(data->clocktime_limit.get() != 0) {  // for kumomergedb
+			ClockTime ct = Storage::clocktime_of(val);
+			data->op->iterator_del(iterator_data,
+					&storage_expireproc,
+					reinterpret_cast<void*>(&ct));
+		}
 		return 0;
 	}
 
@@ -312,13 +484,15 @@ try {
 }  // noname namespace
 
 void Storage::for_each_impl(void* obj, void (*callback)(void* obj, iterator& it),
-		ClockTime clocktime)
+		ClockTime clocktime, bool removed)
 {
 	for_each_data data = {
 		&m_op,
 		callback,
 		obj,
 		clocktime.before_sec(m_garbage_max_time),
+		time(NULL),
+		removed,
 	};
 
 	int ret = m_op.for_each(m_data,
@@ -329,6 +503,275 @@ void Storage::for_each_impl(void* obj, void (*callback)(void* obj, iterator& it)
 	}
 }
 
+void Storage::for_each_range_impl(void* obj, void (*callback)(void* obj, iterator& it),
+		uint64_t begin, uint64_t end, ClockTime clocktime, bool removed)
+{
+	for_each_data data = {
+		&m_op,
+		callback,
+		obj,
+		clocktime.before_sec(m_garbage_max_time),
+		time(NULL),
+		removed,
+	};
+
+	int ret = m_op.for_each_range(m_data, begin, end,
+			reinterpret_cast<void*>(&data), for_each_collect);
+
+	if(ret < 0) {
+		throw storage_error("error while iterating database");
+	}
+}
+
+
+namespace {
+// tasks[0] runs on this thread.
+// tasks which failed to start a thread run on this thread, too.
+template <typename Task>
+static void run_parallel(std::vector<Task>& tasks)
+{
+	size_t n = tasks.size();
+	std::vector<mp::pthread_thread*> threads(n, NULL);
+	for(size_t i=1; i < n; ++i) {
+		try {
+			std::auto_ptr<mp::pthread_thread> th(
+					new mp::pthread_thread(&tasks[i]));
+			th->run();
+			threads[i] = th.release();
+		} catch (...) {
+			LOG_WARN("failed to start iteration thread");
+		}
+	}
+
+	for(size_t i=0; i < n; ++i) {
+		if(i == 0 || !threads[i]) {
+			tasks[i]();
+		}
+	}
+
+	for(size_t i=1; i < n; ++i) {
+		if(threads[i]) {
+			threads[i]->join();
+			delete threads[i];
+		}
+	}
+}
+
+struct for_each_part_task {
+	kumo_storage_op* op;
+	void* db;
+	unsigned int part;
+	unsigned int nparts;
+	for_each_data data;
+	int ret;
+
+	void operator() ()
+	{
+		ret = op->for_each_part(db, part, nparts,
+				reinterpret_cast<void*>(&data), for_each_collect);
+	}
+};
+}  // noname namespace
+
+void Storage::for_each_parallel_impl(void** objs, unsigned int nparts,
+		void (*callback)(void* obj, iterator& it),
+		ClockTime clocktime)
+{
+	if(nparts <= 1 || !is_parallel_supported()) {
+		for_each_impl(objs[0], callback, clocktime);
+		return;
+	}
+
+	// kumo_storage_op::for_each_part doesn't interleave scans
+	mp::pthread_scoped_lock palk(m_parallel_mutex);
+
+	std::vector<for_each_part_task> tasks(nparts);
+	for(unsigned int i=0; i < nparts; ++i) {
+		for_each_part_task& t = tasks[i];
+		t.op = &m_op;
+		t.db = m_data;
+		t.part = i;
+		t.nparts = nparts;
+		for_each_data data = {
+			&m_op,
+			callback,
+			objs[i],
+			clocktime.before_sec(m_garbage_max_time),
+			time(NULL),
+			false,
+		};
+		t.data = data;
+		t.ret = 0;
+	}
+
+	run_parallel(tasks);
+
+	for(unsigned int i=0; i < nparts; ++i) {
+		if(tasks[i].ret < 0) {
+			throw storage_error("error while iterating database");
+		}
+	}
+}
+
+
+namespace {
+struct for_each_ranges_task {
+	kumo_storage_op* op;
+	void* db;
+	const Storage::hash_ranges_t* pieces;
+	volatile size_t* next;
+	for_each_data data;
+	int ret;
+
+	void operator() ()
+	{
+		while(true) {
+			size_t i = __sync_fetch_and_add(next, 1);
+			if(i >= pieces->size()) {
+				break;
+			}
+			ret = op->for_each_range(db,
+					(*pieces)[i].first, (*pieces)[i].second,
+					reinterpret_cast<void*>(&data), for_each_collect);
+			if(ret < 0) {
+				break;
+			}
+		}
+	}
+};
+}  // noname namespace
+
+void Storage::for_each_ranges_parallel_impl(void** objs, unsigned int nparts,
+		void (*callback)(void* obj, iterator& it),
+		const hash_ranges_t& ranges, ClockTime clocktime)
+{
+	if(nparts < 1) {
+		nparts = 1;
+	}
+
+	// split the ranges so that a wide range doesn't run on one thread.
+	// the threads take the pieces in order.
+	const uint64_t step = ~(uint64_t)0 / (nparts * 4);
+	hash_ranges_t pieces;
+	for(hash_ranges_t::const_iterator it(ranges.begin()), it_end(ranges.end());
+			it != it_end; ++it) {
+		uint64_t begin = it->first;
+		while(it->second - begin > step) {
+			pieces.push_back(std::make_pair(begin, begin + step));
+			begin += step + 1;
+		}
+		pieces.push_back(std::make_pair(begin, it->second));
+	}
+
+	if(pieces.size() < nparts) {
+		nparts = pieces.size();
+	}
+	if(nparts == 0) {
+		return;
+	}
+
+	volatile size_t next = 0;
+	std::vector<for_each_ranges_task> tasks(nparts);
+	for(unsigned int i=0; i < nparts; ++i) {
+		for_each_ranges_task& t = tasks[i];
+		t.op = &m_op;
+		t.db = m_data;
+		t.pieces = &pieces;
+		t.next = &next;
+		for_each_data data = {
+			&m_op,
+			callback,
+			objs[i],
+			clocktime.before_sec(m_garbage_max_time),
+			time(NULL),
+			false,
+		};
+		t.data = data;
+		t.ret = 0;
+	}
+
+	run_parallel(tasks);
+
+	for(unsigned int i=0; i < nparts; ++i) {
+		if(tasks[i].ret < 0) {
+			throw storage_error("error while iterating database");
+		}
+	}
+}
+
+namespace {
+struct sweep_data {
+	kumo_storage_op* op;
+	time_t now;
+	size_t removed;
+};
+
+struct sweep_unlock {
+	sweep_unlock(mp::pthread_mutex& mutex) : m(mutex) { }
+	~sweep_unlock() { m.unlock(); }
+private:
+	mp::pthread_mutex& m;
+	sweep_unlock();
+	sweep_unlock(const sweep_unlock&);
+};
+
+static int sweep_collect(void* user, void* iterator_data)
+{
+	sweep_data* data = reinterpret_cast<sweep_data*>(user);
+
+	const char* val = data->op->iterator_val(iterator_data);
+	size_t vallen = data->op->iterator_vallen(iterator_data);
+
+	if(!Storage::is_expired(val, vallen, data->now)) {
+		return 0;
+	}
+
+	ClockTime ct = Storage::clocktime_of(val);
+	if(data->op->iterator_del(iterator_data,
+				&storage_expireproc,
+				reinterpret_cast<void*>(&ct))) {
+		++data->removed;
+	}
+
+	return 0;
+}
+}  // noname namespace
+
+size_t Storage::sweep_expired(size_t limit)
+{
+	if(!is_sweep_supported()) {
+		return 0;
+	}
+
+	// skip this tick if the previous sweep is still running
+	if(!m_sweep_mutex.trylock()) {
+		return 0;
+	}
+	sweep_unlock swunlk(m_sweep_mutex);
+
+	if(!m_sweep_cursor) {
+		m_sweep_cursor = m_op.cursor_new(m_data);
+		if(!m_sweep_cursor) {
+			throw storage_error("failed to create cursor");
+		}
+	}
+
+	sweep_data data = {
+		&m_op,
+		time(NULL),
+		0,
+	};
+
+	int ret = m_op.cursor_step(m_sweep_cursor, limit,
+			reinterpret_cast<void*>(&data), sweep_collect);
+
+	if(ret < 0) {
+		throw storage_error("error while sweeping database");
+	}
+
+	return data.removed;
+}
+
 
 uint64_t Storage::rnum()
 {
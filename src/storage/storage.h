@@ -25,6 +25,10 @@
 #include <stdint.h>
 #include <msgpack.hpp>
 #include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <utility>
 
 #ifdef __LITTLE_ENDIAN__
 #if defined(__bswap_64)
@@ -64,6 +68,15 @@ static inline uint64_t kumo_be64(uint64_t x) {
  *          meta
  *             data
  *
+ * value with expire time (meta & VALUE_META_EXPIRE):
+ * +--------+--+--------+--------------+
+ * |   64   |16|   32   |     ...      |
+ * +--------+--+--------+--------------+
+ * clocktime
+ *          meta
+ *             expire time (unix time; 0: never)
+ *                      data
+ *
  * value (garbage):
  * +--------+
  * |   64   |
@@ -102,6 +115,10 @@ public:
 	static const size_t KEY_META_SIZE = 8;
 	static const size_t VALUE_CLOCKTIME_SIZE = 8;
 	static const size_t VALUE_META_SIZE = VALUE_CLOCKTIME_SIZE + 2;
+	static const size_t VALUE_EXPIRE_SIZE = 4;
+
+	// meta flags
+	static const uint16_t VALUE_META_EXPIRE = 0x0001;
 
 
 	static ClockTime clocktime_of(const char* raw_val);
@@ -113,6 +130,10 @@ public:
 	static uint64_t hash_of(const char* raw_key);
 	static void hash_to(uint64_t hash, char* raw_key);
 
+	// 0: never expires
+	static uint32_t expire_of(const char* raw_val, size_t raw_vallen);
+	static bool is_expired(const char* raw_val, size_t raw_vallen, time_t now);
+
 public:
 	const char* get(
 			const char* raw_key, uint32_t raw_keylen,
@@ -139,14 +160,42 @@ public:
 			const char* raw_key, uint32_t raw_keylen,
 			ClockTime update_clocktime);
 
-	// FIXME
-	//bool append(
-	//		const char* raw_key, uint32_t raw_keylen,
-	//		const char* val, uint32_t vallen,
-	//		ClockTime ct, bool prepend = false);
+	// delete aged garbage records pushed by remove().
+	// garbage is moved out of the shards in batches and deleted
+	// without holding the shard locks.
+	// returns number of deleted records.
+	size_t purge_garbage(ClockTime now);
+
+	// number of garbage records forgotten because purge_garbage()
+	// couldn't keep up. they are deleted by for_each() later.
+	uint64_t garbage_dropped();
+
+	// read-modify-write.
+	// f(raw_oldval, raw_oldvallen, &raw_newvallen) is called with the
+	// current value (NULL if not found or expired) and returns the new
+	// value or NULL not to update it.
+	// the new value is stored with cas() on the clocktime of the current
+	// value; returns false if the record is updated concurrently or it
+	// has newer clocktime than the new value. retry with new clocktime.
+	template <typename F>
+	bool modify(
+			const char* raw_key, uint32_t raw_keylen,
+			F& f, msgpack::zone* z);
+
+	// update() for each entry. updated[i] is set to true if the entry
+	// i is updated. returns number of updated entries.
+	// throws storage_error if the storage fails; some entries may be
+	// updated before the failure.
+	size_t updatev(
+			const char** raw_keys, const size_t* raw_keylens,
+			const char** raw_vals, const size_t* raw_vallens,
+			uint16_t num, bool* updated);
+
+	static const uint16_t UPDATEV_MAX = 256;
 
-	// FIXME
-	//void updatev()
+	// true if the storage applies updatev() faster than update()
+	// for each entry
+	bool is_batch_supported() const;
 
 	uint64_t rnum();
 
@@ -157,6 +206,66 @@ public:
 	template <typename F>
 	void for_each(F f, ClockTime clocktime);
 
+	// for_each() on `nparts' partitions of the database in parallel.
+	// fs[i] is called for records in the partition i on its own thread.
+	// only fs[0] is called if the storage doesn't support partitioning.
+	template <typename F>
+	void for_each_parallel(F** fs, unsigned int nparts, ClockTime clocktime);
+
+	bool is_parallel_supported() const;
+
+	// for_each() for records whose hash is in [begin, end].
+	template <typename F>
+	void for_each_range(F f, uint64_t begin, uint64_t end, ClockTime clocktime);
+
+	bool is_range_supported() const;
+
+	// for_each() and for_each_range() which also call f for removed
+	// records which are not purged yet. the value of a removed record
+	// is its clocktime only; see is_removed().
+	template <typename F>
+	void for_each_with_removed(F f, ClockTime clocktime);
+
+	template <typename F>
+	void for_each_range_with_removed(F f, uint64_t begin, uint64_t end, ClockTime clocktime);
+
+	static bool is_removed(const char* raw_val, size_t raw_vallen);
+
+	// removed records are kept at least this time
+	uint32_t garbage_min_time() const { return m_garbage_min_time; }
+
+	typedef std::vector<std::pair<uint64_t, uint64_t> > hash_ranges_t;
+
+	// for_each_range() for each of `ranges' on `nparts' threads.
+	// the ranges are split and divided among fs[0] ... fs[nparts-1].
+	template <typename F>
+	void for_each_ranges_parallel(F** fs, unsigned int nparts,
+			const hash_ranges_t& ranges, ClockTime clocktime);
+
+	// remove expired records incrementally.
+	// scans at most `limit' records from the last position and
+	// restarts from the head after reaching the end.
+	// returns 0 if another sweep is running.
+	// returns number of removed records.
+	size_t sweep_expired(size_t limit);
+
+	bool is_sweep_supported() const;
+
+	// number of updates of the records whose hash is in [begin, end].
+	// updates are counted per CHANGE_SLOT_BITS bits of the hash, so
+	// updates of the neighbor records are also counted.
+	// the count is increased after the record is updated.
+	uint64_t change_count(uint64_t begin, uint64_t end) const;
+
+	// hook(user, raw_key, raw_keylen, raw_val, raw_vallen) is called
+	// after a record is updated. raw_val is clocktime only if the
+	// record is removed. must be set before the storage is used.
+	typedef void (*change_hook_t)(void* user,
+			const char* raw_key, size_t raw_keylen,
+			const char* raw_val, size_t raw_vallen);
+
+	void set_change_hook(change_hook_t hook, void* user);
+
 	struct iterator {
 	public:
 		iterator(kumo_storage_op* op, void* data);
@@ -180,19 +289,58 @@ private:
 	void* m_data;
 	kumo_storage_op m_op;
 
-	mp::pthread_mutex m_garbage_mutex;
-	buffer_queue m_garbage;
+	static const size_t GARBAGE_SHARDS = 16;
+	static const size_t GARBAGE_PURGE_BATCH = 256;
+
+	struct garbage_shard {
+		garbage_shard() : dropped(0), dropping(false) { }
+		mp::pthread_mutex mutex;
+		buffer_queue queue;
+		uint64_t dropped;  // forgotten by remove()
+		bool dropping;
+	};
+	garbage_shard m_garbage[GARBAGE_SHARDS];
 
 	uint32_t m_garbage_min_time;
 	uint32_t m_garbage_max_time;
-	size_t m_garbage_mem_limit;
+	size_t m_garbage_mem_limit;  // per shard
+
+	size_t purge_garbage_shard(garbage_shard& gs, ClockTime now);
+
+	mp::pthread_mutex m_parallel_mutex;
+
+	mp::pthread_mutex m_sweep_mutex;
+	void* m_sweep_cursor;
+
+	static const unsigned int CHANGE_SLOT_BITS = 12;
+	volatile uint32_t m_change[1 << CHANGE_SLOT_BITS];
+
+	change_hook_t m_change_hook;
+	void* m_change_hook_user;
+
+	// counted also when garbage is purged; the hook is not called
+	void count_change(const char* raw_key);
+
+	void changed(const char* raw_key, size_t raw_keylen,
+			const char* raw_val, size_t raw_vallen);
 
 private:
 	template <typename F>
 	static void for_each_callback(void* obj, iterator& it);
 
 	void for_each_impl(void* obj, void (*callback)(void* obj, iterator& it),
+			ClockTime clocktime, bool removed = false);
+
+	void for_each_parallel_impl(void** objs, unsigned int nparts,
+			void (*callback)(void* obj, iterator& it),
 			ClockTime clocktime);
+
+	void for_each_range_impl(void* obj, void (*callback)(void* obj, iterator& it),
+			uint64_t begin, uint64_t end, ClockTime clocktime, bool removed = false);
+
+	void for_each_ranges_parallel_impl(void** objs, unsigned int nparts,
+			void (*callback)(void* obj, iterator& it),
+			const hash_ranges_t& ranges, ClockTime clocktime);
 };
 
 
@@ -227,6 +375,24 @@ inline void Storage::hash_to(uint64_t hash, char* raw_key)
 }
 
 
+inline uint32_t Storage::expire_of(const char* raw_val, size_t raw_vallen)
+{
+	if(raw_vallen < VALUE_META_SIZE + VALUE_EXPIRE_SIZE ||
+			!(meta_of(raw_val) & VALUE_META_EXPIRE)) {
+		return 0;
+	}
+	uint32_t exptime;
+	memcpy(&exptime, raw_val+VALUE_META_SIZE, VALUE_EXPIRE_SIZE);
+	return ntohl(exptime);
+}
+
+inline bool Storage::is_expired(const char* raw_val, size_t raw_vallen, time_t now)
+{
+	uint32_t exptime = expire_of(raw_val, raw_vallen);
+	return exptime != 0 && exptime < now;
+}
+
+
 inline const char* Storage::get(
 		const char* raw_key, uint32_t raw_keylen,
 		uint32_t* result_raw_vallen, msgpack::zone* z)
@@ -238,6 +404,9 @@ inline const char* Storage::get(
 	if(raw_val && *result_raw_vallen < VALUE_META_SIZE) {
 		return NULL;
 	}
+	if(raw_val && is_expired(raw_val, *result_raw_vallen, time(NULL))) {
+		return NULL;
+	}
 	return raw_val;
 }
 
@@ -245,17 +414,99 @@ inline bool Storage::cache_is_valid(
 		const char* raw_key, uint32_t raw_keylen,
 		ClockTime cache_clocktime)
 {
-	char meta_buf[VALUE_CLOCKTIME_SIZE];
+	char meta_buf[VALUE_META_SIZE + VALUE_EXPIRE_SIZE];
+
+	int32_t len = m_op.get_header(m_data, raw_key, raw_keylen,
+				meta_buf, sizeof(meta_buf));
+	if(len < static_cast<int32_t>(VALUE_CLOCKTIME_SIZE)) {
+		return false;
+	}
 
-	if( m_op.get_header(m_data, raw_key, raw_keylen,
-				meta_buf, sizeof(meta_buf)) <
-			static_cast<int32_t>(sizeof(meta_buf)) ) {
+	if(is_expired(meta_buf, len, time(NULL))) {
 		return false;
 	}
 
 	return clocktime_of(meta_buf) <= cache_clocktime;
 }
 
+template <typename F>
+bool Storage::modify(
+		const char* raw_key, uint32_t raw_keylen,
+		F& f, msgpack::zone* z)
+{
+	uint32_t raw_oldvallen = 0;
+	const char* raw_oldval = m_op.get(m_data,
+			raw_key, raw_keylen,
+			&raw_oldvallen,
+			z);
+
+	// cas() on a record which doesn't exist stores the value.
+	// cas() with clocktime 0 fails if the record is stored concurrently.
+	bool exist = false;
+	ClockTime compare(0);
+	if(raw_oldval && raw_oldvallen >= VALUE_CLOCKTIME_SIZE) {
+		// includes deleted and expired records
+		exist = true;
+		compare = clocktime_of(raw_oldval);
+	}
+
+	if(raw_oldval && (raw_oldvallen < VALUE_META_SIZE ||
+				is_expired(raw_oldval, raw_oldvallen, time(NULL)))) {
+		raw_oldval = NULL;
+		raw_oldvallen = 0;
+	}
+
+	uint32_t raw_newvallen = 0;
+	const char* raw_newval = f(raw_oldval, raw_oldvallen, &raw_newvallen);
+	if(!raw_newval) {
+		return true;
+	}
+
+	if(exist && clocktime_of(raw_newval) <= compare) {
+		return false;
+	}
+
+	return cas(raw_key, raw_keylen,
+			raw_newval, raw_newvallen,
+			compare);
+}
+
+inline bool Storage::is_sweep_supported() const
+{
+	return m_op.cursor_new != NULL;
+}
+
+inline void Storage::count_change(const char* raw_key)
+{
+	__sync_add_and_fetch(&m_change[hash_of(raw_key) >> (64 - CHANGE_SLOT_BITS)], 1);
+}
+
+inline void Storage::changed(const char* raw_key, size_t raw_keylen,
+		const char* raw_val, size_t raw_vallen)
+{
+	count_change(raw_key);
+	if(m_change_hook) {
+		(*m_change_hook)(m_change_hook_user,
+				raw_key, raw_keylen, raw_val, raw_vallen);
+	}
+}
+
+inline void Storage::set_change_hook(change_hook_t hook, void* user)
+{
+	m_change_hook_user = user;
+	m_change_hook = hook;
+}
+
+inline uint64_t Storage::change_count(uint64_t begin, uint64_t end) const
+{
+	uint64_t n = 0;
+	for(uint64_t i = begin >> (64 - CHANGE_SLOT_BITS),
+			i_end = end >> (64 - CHANGE_SLOT_BITS); i <= i_end; ++i) {
+		n += m_change[i];
+	}
+	return n;
+}
+
 
 template <typename F>
 inline void Storage::for_each(F f, ClockTime clocktime)
@@ -266,6 +517,72 @@ inline void Storage::for_each(F f, ClockTime clocktime)
 			clocktime);
 }
 
+template <typename F>
+inline void Storage::for_each_parallel(F** fs, unsigned int nparts, ClockTime clocktime)
+{
+	for_each_parallel_impl(
+			reinterpret_cast<void**>(fs), nparts,
+			&Storage::for_each_callback<F>,
+			clocktime);
+}
+
+inline bool Storage::is_batch_supported() const
+{
+	return m_op.updatev != NULL;
+}
+
+inline bool Storage::is_parallel_supported() const
+{
+	return m_op.for_each_part != NULL;
+}
+
+template <typename F>
+inline void Storage::for_each_range(F f, uint64_t begin, uint64_t end, ClockTime clocktime)
+{
+	for_each_range_impl(
+			reinterpret_cast<void*>(&f),
+			&Storage::for_each_callback<F>,
+			begin, end, clocktime);
+}
+
+inline bool Storage::is_range_supported() const
+{
+	return m_op.for_each_range != NULL;
+}
+
+template <typename F>
+inline void Storage::for_each_with_removed(F f, ClockTime clocktime)
+{
+	for_each_impl(
+			reinterpret_cast<void*>(&f),
+			&Storage::for_each_callback<F>,
+			clocktime, true);
+}
+
+template <typename F>
+inline void Storage::for_each_range_with_removed(F f, uint64_t begin, uint64_t end, ClockTime clocktime)
+{
+	for_each_range_impl(
+			reinterpret_cast<void*>(&f),
+			&Storage::for_each_callback<F>,
+			begin, end, clocktime, true);
+}
+
+inline bool Storage::is_removed(const char* raw_val, size_t raw_vallen)
+{
+	return raw_vallen < VALUE_META_SIZE;
+}
+
+template <typename F>
+inline void Storage::for_each_ranges_parallel(F** fs, unsigned int nparts,
+		const hash_ranges_t& ranges, ClockTime clocktime)
+{
+	for_each_ranges_parallel_impl(
+			reinterpret_cast<void**>(fs), nparts,
+			&Storage::for_each_callback<F>,
+			ranges, clocktime);
+}
+
 template <typename F>
 void Storage::for_each_callback(void* obj, iterator& it)
 {
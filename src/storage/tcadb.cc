@@ -439,6 +439,11 @@ static kumo_storage_op kumo_tcadb_op =
 	kumo_tcadb_iterator_release_val,
 	kumo_tcadb_iterator_del,
 	kumo_tcadb_iterator_del_force,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 };
 
 kumo_storage_op kumo_storage_init(void)
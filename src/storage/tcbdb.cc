@@ -344,8 +344,8 @@ static const char* kumo_tcbdb_error(void* data)
 
 
 struct kumo_tcbdb_iterator {
-	kumo_tcbdb_iterator(BDBCUR* c) :
-		cur(c)
+	kumo_tcbdb_iterator(TCBDB* d, BDBCUR* c) :
+		db(d), cur(c), deleted(false)
 	{
 		key = tcxstrnew();
 		if(!key) {
@@ -396,19 +396,19 @@ struct kumo_tcbdb_iterator {
 		deleted = false;
 	}
 
-	bool del()
-	{
-		if(tcbdbcurout(cur)) {
-			// FIXME if the cursor is on last position?
-			deleted = true;
-			return true;
-		} else {
-			return false;
-		}
-	}
+	// delete the record and move the cursor to the next record.
+	// tcbdbcurout is not used because it shifts the other cursors on
+	// the same leaf, such as the cursors of neighboring partitions.
+	bool del();
+
+	// delete the record if proc accepts it. the record is compared and
+	// deleted in one tcbdbputproc so that a concurrent update is not
+	// deleted, then the cursor moves to the next record.
+	bool del_if(kumo_storage_casproc proc, void* casdata);
 
 	TCXSTR* key;
 	TCXSTR* val;
+	TCBDB* db;
 	BDBCUR* cur;
 	bool deleted;
 
@@ -428,7 +428,7 @@ try {
 		return 0;
 	}
 
-	kumo_tcbdb_iterator it(cur);
+	kumo_tcbdb_iterator it(ctx->db, cur);
 
 	while(true) {
 		it.fetch();
@@ -504,12 +504,56 @@ static const char* kumo_tcbdb_iterator_release_val(void* iterator_data, msgpack_
 	return tmp;
 }
 
+bool kumo_tcbdb_iterator::del_if(kumo_storage_casproc proc, void* casdata)
+{
+	int ksiz;
+	char* kbuf = (char*)tcbdbcurkey(cur, &ksiz);
+	if(!kbuf) {
+		return false;
+	}
+
+	kumo_tcbdb_del_ctx delctx = { false, proc, casdata };
+	bool ret = tcbdbputproc(db,
+			kbuf, ksiz,
+			NULL, 0,
+			kumo_tcbdb_del_proc,
+			&delctx);
+	if(!ret || !delctx.deleted) {
+		::free(kbuf);
+		return false;
+	}
+
+	// jump to the record next to the deleted key. if there are no more
+	// records, the cursor is invalidated and next() ends the iteration.
+	deleted = tcbdbcurjump(cur, kbuf, ksiz);
+	::free(kbuf);
+	return true;
+}
+
+bool kumo_tcbdb_iterator::del()
+{
+	int ksiz;
+	char* kbuf = (char*)tcbdbcurkey(cur, &ksiz);
+	if(!kbuf) {
+		return false;
+	}
+
+	if(!tcbdbout(db, kbuf, ksiz)) {
+		::free(kbuf);
+		return false;
+	}
+
+	// same as del_if
+	deleted = tcbdbcurjump(cur, kbuf, ksiz);
+	::free(kbuf);
+	return true;
+}
+
 static bool kumo_tcbdb_iterator_del(void* iterator_data,
 		kumo_storage_casproc proc, void* casdata)
 {
-	// FIXME not supported
-	//kumo_tcbdb_iterator* it = reinterpret_cast<kumo_tcbdb_iterator*>(iterator_data);
-	return false;
+	kumo_tcbdb_iterator* it = reinterpret_cast<kumo_tcbdb_iterator*>(iterator_data);
+	return it->del_if(proc, casdata);
 }
 
 static bool kumo_tcbdb_iterator_del_force(void* iterator_data)
@@ -519,6 +563,211 @@ static bool kumo_tcbdb_iterator_del_force(void* iterator_data)
 }
 
 
+// A cursor remembers the next key and jumps to it on each step
+// so that it's not affected by modifications between steps.
+struct kumo_tcbdb_cursor {
+	kumo_tcbdb_cursor(kumo_tcbdb* pctx) :
+		ctx(pctx), has_next(false)
+	{
+		next = tcxstrnew();
+		if(!next) {
+			throw std::bad_alloc();
+		}
+	}
+
+	~kumo_tcbdb_cursor()
+	{
+		tcxstrdel(next);
+	}
+
+	kumo_tcbdb* ctx;
+	TCXSTR* next;
+	bool has_next;
+
+private:
+	kumo_tcbdb_cursor();
+	kumo_tcbdb_cursor(const kumo_tcbdb_cursor&);
+};
+
+static void* kumo_tcbdb_cursor_new(void* data)
+try {
+	kumo_tcbdb* ctx = reinterpret_cast<kumo_tcbdb*>(data);
+	return reinterpret_cast<void*>(new kumo_tcbdb_cursor(ctx));
+
+} catch (...) {
+	return NULL;
+}
+
+static void kumo_tcbdb_cursor_free(void* cursor)
+{
+	kumo_tcbdb_cursor* cur = reinterpret_cast<kumo_tcbdb_cursor*>(cursor);
+	delete cur;
+}
+
+static int kumo_tcbdb_cursor_step(void* cursor, size_t limit,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_tcbdb_cursor* cur = reinterpret_cast<kumo_tcbdb_cursor*>(cursor);
+
+	BDBCUR* c = tcbdbcurnew(cur->ctx->db);
+	if(!c) {
+		return -1;
+	}
+
+	bool found;
+	if(cur->has_next) {
+		found = tcbdbcurjump(c, TCXSTRPTR(cur->next), TCXSTRSIZE(cur->next));
+	} else {
+		found = tcbdbcurfirst(c);
+	}
+	cur->has_next = false;
+
+	if(!found) {
+		tcbdbcurdel(c);
+		return 0;
+	}
+
+	kumo_tcbdb_iterator it(cur->ctx->db, c);
+
+	int n = 0;
+	while(true) {
+		if(!tcbdbcurrec(c, it.key, it.val)) {
+			// reached the end
+			return n;
+		}
+
+		if((size_t)n >= limit) {
+			tcxstrclear(cur->next);
+			tcxstrcat(cur->next, TCXSTRPTR(it.key), TCXSTRSIZE(it.key));
+			cur->has_next = true;
+			return n;
+		}
+
+		int ret = (*func)(user, (void*)&it);
+		if(ret < 0) {
+			return ret;
+		}
+		++n;
+
+		if(!it.deleted) {
+			if(!it.next()) {
+				return n;
+			}
+		}
+
+		it.reset();
+	}
+
+} catch (...) {
+	return -1;
+}
+
+
+// keys begin with 8 bytes big-endian hash. see storage.h
+static inline uint64_t kumo_tcbdb_hash_of(const char* key, size_t keylen)
+{
+	if(keylen < 8) {
+		return 0;
+	}
+	const unsigned char* p = (const unsigned char*)key;
+	uint64_t h = 0;
+	for(int i=0; i < 8; ++i) {
+		h = (h << 8) | p[i];
+	}
+	return h;
+}
+
+static inline void kumo_tcbdb_hash_to(uint64_t h, char* key)
+{
+	for(int i=7; i >= 0; --i) {
+		key[i] = (char)(h & 0xff);
+		h >>= 8;
+	}
+}
+
+// iterate records whose hash is in [begin, end].
+// keys shorter than 8 bytes belong to the range where they are found.
+static int kumo_tcbdb_for_each_range(kumo_tcbdb* ctx,
+		uint64_t begin, uint64_t end,
+		void* user, int (*func)(void* user, void* iterator_data))
+{
+	BDBCUR* cur = tcbdbcurnew(ctx->db);
+	if(!cur) {
+		return -1;
+	}
+
+	bool found;
+	if(begin == 0) {
+		found = tcbdbcurfirst(cur);
+	} else {
+		char start[8];
+		kumo_tcbdb_hash_to(begin, start);
+		found = tcbdbcurjump(cur, start, sizeof(start));
+	}
+
+	if(!found) {
+		tcbdbcurdel(cur);
+		return 0;
+	}
+
+	kumo_tcbdb_iterator it(ctx->db, cur);
+
+	while(true) {
+		if(!tcbdbcurrec(cur, it.key, it.val)) {
+			// reached the end
+			return 0;
+		}
+
+		if(TCXSTRSIZE(it.key) >= 8 &&
+				kumo_tcbdb_hash_of(TCXSTRPTR(it.key), TCXSTRSIZE(it.key)) > end) {
+			return 0;
+		}
+
+		int ret = (*func)(user, (void*)&it);
+		if(ret < 0) {
+			return ret;
+		}
+
+		if(!it.deleted) {
+			if(!it.next()) {
+				return 0;
+			}
+		}
+
+		it.reset();
+	}
+}
+
+// partitions are equally divided hash ranges.
+// records are deleted by key and the cursor jumps to the next key
+// (see kumo_tcbdb_iterator::del).
+static int kumo_tcbdb_for_each_part(void* data,
+		unsigned int part, unsigned int nparts,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_tcbdb* ctx = reinterpret_cast<kumo_tcbdb*>(data);
+
+	uint64_t width = ~(uint64_t)0 / nparts;
+	uint64_t begin = width * part;
+	uint64_t end = (part == nparts-1) ? ~(uint64_t)0 : begin + width - 1;
+
+	return kumo_tcbdb_for_each_range(ctx, begin, end, user, func);
+
+} catch (...) {
+	return -1;
+}
+
+static int kumo_tcbdb_for_each_range_op(void* data,
+		uint64_t begin, uint64_t end,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_tcbdb* ctx = reinterpret_cast<kumo_tcbdb*>(data);
+	return kumo_tcbdb_for_each_range(ctx, begin, end, user, func);
+
+} catch (...) {
+	return -1;
+}
+
 static kumo_storage_op kumo_tcbdb_op =
 {
 	kumo_tcbdb_create,
@@ -530,7 +779,8 @@ static kumo_storage_op kumo_tcbdb_op =
 	kumo_tcbdb_set,
 	kumo_tcbdb_del,
 	kumo_tcbdb_update,
-	NULL,
+	NULL,  // tcbdbtranbegin flushes the leaf cache and blocks all threads;
+	       // update() for each key is faster.
 	kumo_tcbdb_rnum,
 	kumo_tcbdb_backup,
 	kumo_tcbdb_error,
@@ -543,6 +793,11 @@ static kumo_storage_op kumo_tcbdb_op =
 	kumo_tcbdb_iterator_release_val,
 	kumo_tcbdb_iterator_del,
 	kumo_tcbdb_iterator_del_force,
+	kumo_tcbdb_cursor_new,
+	kumo_tcbdb_cursor_free,
+	kumo_tcbdb_cursor_step,
+	kumo_tcbdb_for_each_part,
+	kumo_tcbdb_for_each_range_op,
 };
 
 kumo_storage_op kumo_storage_init(void)
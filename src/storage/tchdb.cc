@@ -53,7 +53,12 @@ static char* parse_param(char* str,
 
 
 struct kumo_tchdb {
-	kumo_tchdb()
+	kumo_tchdb() :
+		iterator_owner(NULL),
+		part_nparts(0),
+		part_entered(0),
+		part_left(0),
+		part_end(false)
 	{
 		db = tchdbnew();
 		if(!db) {
@@ -73,6 +78,15 @@ struct kumo_tchdb {
 
 	TCHDB* db;
 	mp::pthread_mutex iterator_mutex;
+	void* iterator_owner;  // cursor which uses the iterator
+
+	// for_each_part shares the iterator among the partitions.
+	// a partitioned scan runs while part_nparts != 0.
+	mp::pthread_cond part_cond;
+	unsigned int part_nparts;
+	unsigned int part_entered;
+	unsigned int part_left;
+	bool part_end;
 
 private:
 	kumo_tchdb(const kumo_tchdb&);
@@ -380,9 +394,14 @@ try {
 	// only one thread can use iterator
 	mp::pthread_scoped_lock itlk(ctx->iterator_mutex);
 
+	while(ctx->part_nparts != 0) {
+		ctx->part_cond.wait(ctx->iterator_mutex);
+	}
+
 	if(!tchdbiterinit(ctx->db)) {
 		return -1;
 	}
+	ctx->iterator_owner = NULL;
 
 	kumo_tchdb_iterator it(ctx);
 
@@ -401,6 +420,86 @@ try {
 	return -1;
 }
 
+// TCHDB has only one iterator and records are not ordered by the hash.
+// The partitions share the iterator: each of them takes the next record
+// under the iterator mutex and calls func without holding it, so the
+// records are split among the partitions dynamically.
+// The scan starts when the first partition enters and ends when all
+// `nparts' partitions left. Storage doesn't interleave scans.
+static bool kumo_tchdb_part_next(kumo_tchdb* ctx, kumo_tchdb_iterator* it)
+{
+	mp::pthread_scoped_lock itlk(ctx->iterator_mutex);
+	if(ctx->part_end) {
+		return false;
+	}
+	if(!tchdbiternext3(ctx->db, it->key, it->val)) {
+		ctx->part_end = true;
+		return false;
+	}
+	return true;
+}
+
+static void kumo_tchdb_part_leave(kumo_tchdb* ctx)
+{
+	mp::pthread_scoped_lock itlk(ctx->iterator_mutex);
+	if(++ctx->part_left >= ctx->part_nparts) {
+		ctx->part_nparts = 0;
+		ctx->part_cond.broadcast();
+	}
+}
+
+static int kumo_tchdb_for_each_part(void* data,
+		unsigned int part, unsigned int nparts,
+		void* user, int (*func)(void* user, void* iterator_data))
+{
+	kumo_tchdb* ctx = reinterpret_cast<kumo_tchdb*>(data);
+	int ret = 0;
+
+	try {
+		mp::pthread_scoped_lock itlk(ctx->iterator_mutex);
+
+		// wait for the previous scan
+		while(ctx->part_nparts != 0 && ctx->part_entered >= ctx->part_nparts) {
+			ctx->part_cond.wait(ctx->iterator_mutex);
+		}
+
+		if(ctx->part_nparts == 0) {
+			ctx->part_nparts = nparts;
+			ctx->part_entered = 0;
+			ctx->part_left = 0;
+			ctx->part_end = false;
+			ctx->iterator_owner = NULL;
+			if(!tchdbiterinit(ctx->db)) {
+				ctx->part_end = true;
+				ret = -1;
+			}
+		}
+		++ctx->part_entered;
+
+	} catch (...) {
+		return -1;
+	}
+
+	try {
+		kumo_tchdb_iterator it(ctx);
+
+		while( ret >= 0 && kumo_tchdb_part_next(ctx, &it) ) {
+			ret = (*func)(user, (void*)&it);
+			if(ret < 0) {
+				break;
+			}
+
+			it.reset();
+		}
+
+	} catch (...) {
+		ret = -1;
+	}
+
+	kumo_tchdb_part_leave(ctx);
+	return ret < 0 ? ret : 0;
+}
+
 static const char* kumo_tchdb_iterator_key(void* iterator_data)
 {
 	kumo_tchdb_iterator* it = reinterpret_cast<kumo_tchdb_iterator*>(iterator_data);
@@ -474,6 +573,100 @@ static bool kumo_tchdb_iterator_del_force(void* iterator_data)
 }
 
 
+// The iterator of TCHDB is shared in the database object.
+// A cursor keeps its position in the iterator while no other
+// iteration runs; otherwise it restarts from the head.
+struct kumo_tchdb_cursor {
+	kumo_tchdb_cursor(kumo_tchdb* pctx) :
+		ctx(pctx) { }
+
+	kumo_tchdb* ctx;
+
+private:
+	kumo_tchdb_cursor();
+	kumo_tchdb_cursor(const kumo_tchdb_cursor&);
+};
+
+struct kumo_tchdb_unlock {
+	kumo_tchdb_unlock(mp::pthread_mutex& mutex) : m(mutex) { }
+	~kumo_tchdb_unlock() { m.unlock(); }
+private:
+	mp::pthread_mutex& m;
+	kumo_tchdb_unlock();
+	kumo_tchdb_unlock(const kumo_tchdb_unlock&);
+};
+
+static void* kumo_tchdb_cursor_new(void* data)
+try {
+	kumo_tchdb* ctx = reinterpret_cast<kumo_tchdb*>(data);
+	return reinterpret_cast<void*>(new kumo_tchdb_cursor(ctx));
+
+} catch (...) {
+	return NULL;
+}
+
+static void kumo_tchdb_cursor_free(void* cursor)
+{
+	kumo_tchdb_cursor* cur = reinterpret_cast<kumo_tchdb_cursor*>(cursor);
+	{
+		mp::pthread_scoped_lock itlk(cur->ctx->iterator_mutex);
+		if(cur->ctx->iterator_owner == cur) {
+			cur->ctx->iterator_owner = NULL;
+		}
+	}
+	delete cur;
+}
+
+static int kumo_tchdb_cursor_step(void* cursor, size_t limit,
+		void* user, int (*func)(void* user, void* iterator_data))
+try {
+	kumo_tchdb_cursor* cur = reinterpret_cast<kumo_tchdb_cursor*>(cursor);
+	kumo_tchdb* ctx = cur->ctx;
+
+	// only one thread can use iterator.
+	// don't wait for for_each; the cursor steps at the next time.
+	if(!ctx->iterator_mutex.trylock()) {
+		return 0;
+	}
+	kumo_tchdb_unlock itunlk(ctx->iterator_mutex);
+
+	if(ctx->part_nparts != 0) {
+		return 0;
+	}
+
+	if(ctx->iterator_owner != cur) {
+		if(!tchdbiterinit(ctx->db)) {
+			return -1;
+		}
+		ctx->iterator_owner = cur;
+	}
+
+	kumo_tchdb_iterator it(ctx);
+
+	int n = 0;
+	while((size_t)n < limit) {
+		if(!tchdbiternext3(ctx->db, it.key, it.val)) {
+			// rewind
+			ctx->iterator_owner = NULL;
+			break;
+		}
+
+		int ret = (*func)(user, (void*)&it);
+		if(ret < 0) {
+			return ret;
+		}
+		++n;
+
+		it.reset();
+	}
+
+	return n;
+
+} catch (...) {
+	return -1;
+}
+
+
 static kumo_storage_op kumo_tchdb_op =
 {
 	kumo_tchdb_create,
@@ -485,7 +678,8 @@ static kumo_storage_op kumo_tchdb_op =
 	kumo_tchdb_set,
 	kumo_tchdb_del,
 	kumo_tchdb_update,
-	NULL,
+	NULL,  // Tokyo Cabinet doesn't have a multi-put API;
+	       // tchdbtranbegin serializes all writers and writes WAL.
 	kumo_tchdb_rnum,
 	kumo_tchdb_backup,
 	kumo_tchdb_error,
@@ -498,6 +692,11 @@ static kumo_storage_op kumo_tchdb_op =
 	kumo_tchdb_iterator_release_val,
 	kumo_tchdb_iterator_del,
 	kumo_tchdb_iterator_del_force,
+	kumo_tchdb_cursor_new,
+	kumo_tchdb_cursor_free,
+	kumo_tchdb_cursor_step,
+	kumo_tchdb_for_each_part,
+	NULL,  // tchdb is not ordered
 };
 
 kumo_storage_op kumo_storage_init(void)
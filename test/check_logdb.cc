@@ -0,0 +1,466 @@
+//
+// check_logdb: recovery, compaction, updatev, parameters and backup of
+//              the logdb storage
+//
+// usage: ./check_logdb <tmpdir>
+//
+#include "storage/interface.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <string>
+#include <algorithm>
+
+static kumo_storage_op op;
+
+#define CHECK(cond) \
+	do { if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} } while(0)
+
+static void usage(void)
+{
+	printf("usage: ./check_logdb <tmpdir>\n");
+	exit(1);
+}
+
+static bool accept(void* casdata, const char* oldval, size_t oldvallen)
+{
+	return true;
+}
+
+static bool reject(void* casdata, const char* oldval, size_t oldvallen)
+{
+	return false;
+}
+
+// casdata is the new value; accepted if it is greater than the old value
+static bool newer(void* casdata, const char* oldval, size_t oldvallen)
+{
+	const char* val = reinterpret_cast<const char*>(casdata);
+	size_t vallen = strlen(val);
+	int cmp = memcmp(val, oldval, std::min(vallen, oldvallen));
+	return cmp > 0 || (cmp == 0 && vallen > oldvallen);
+}
+
+static std::string segment_path(const std::string& dir, uint32_t id)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "/%08x.log", id);
+	return dir + buf;
+}
+
+static int count_segments(const std::string& dir)
+{
+	int n = 0;
+	DIR* d = opendir(dir.c_str());
+	CHECK(d != NULL);
+	while(struct dirent* ent = readdir(d)) {
+		if(strlen(ent->d_name) == 12 && strcmp(ent->d_name+8, ".log") == 0) {
+			++n;
+		}
+	}
+	closedir(d);
+	return n;
+}
+
+static void reset_dir(const std::string& dir)
+{
+	std::string cmd = "rm -rf '" + dir + "'";
+	CHECK(system(cmd.c_str()) == 0);
+}
+
+// record format of logdb.cc
+static std::string build_record(const char* key, const char* val)
+{
+	uint32_t keylen = strlen(key);
+	uint32_t vallen = strlen(val);
+	std::string rec(12, '\0');
+	uint32_t kl = htonl(keylen);
+	uint32_t vl = htonl(vallen);
+	memcpy(&rec[4], &kl, 4);
+	memcpy(&rec[8], &vl, 4);
+	rec.append(key, keylen);
+	rec.append(val, vallen);
+	uint32_t crc = htonl(crc32(0, (const Bytef*)rec.data()+4, rec.size()-4));
+	memcpy(&rec[0], &crc, 4);
+	return rec;
+}
+
+static void append_file(const std::string& path, const std::string& data)
+{
+	int fd = open(path.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+	CHECK(fd >= 0);
+	CHECK(write(fd, data.data(), data.size()) == (ssize_t)data.size());
+	close(fd);
+}
+
+static off_t file_size(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	CHECK(fd >= 0);
+	off_t size = lseek(fd, 0, SEEK_END);
+	close(fd);
+	return size;
+}
+
+static void* open_db(const std::string& param)
+{
+	void* db = op.create();
+	CHECK(db != NULL);
+	if(!op.open(db, param.c_str())) {
+		fprintf(stderr, "open failed: %s\n", op.error(db));
+		exit(1);
+	}
+	return db;
+}
+
+static void close_db(void* db)
+{
+	op.close(db);
+	op.free(db);
+}
+
+static void set(void* db, const char* key, const char* val)
+{
+	CHECK(op.set(db, key, strlen(key), val, strlen(val)));
+}
+
+static bool has(void* db, const char* key, const char* val)
+{
+	char buf[256];
+	int32_t len = op.get_header(db, key, strlen(key), buf, sizeof(buf));
+	return len == (int32_t)strlen(val) && memcmp(buf, val, len) == 0;
+}
+
+static bool missing(void* db, const char* key)
+{
+	char buf[1];
+	return op.get_header(db, key, strlen(key), buf, sizeof(buf)) < 0;
+}
+
+
+// records after a broken record are recovered
+static void check_recover_broken(const std::string& dir)
+{
+	reset_dir(dir);
+
+	void* db = open_db(dir);
+	set(db, "k1", "v1");
+	set(db, "k2", "v2");
+	close_db(db);
+
+	std::string seg = segment_path(dir, 1);
+
+	// torn record: the header is intact but the body is not
+	std::string torn = build_record("k3", "v3-torn");
+	torn[torn.size()-1] ^= 0xff;
+	append_file(seg, torn);
+	append_file(seg, build_record("k4", "v4"));
+
+	// not written area followed by a record written concurrently
+	append_file(seg, std::string(40, '\0'));
+	append_file(seg, build_record("k5", "v5"));
+
+	// broken tail
+	std::string tail = build_record("k6", "v6");
+	tail.resize(tail.size() - 3);
+	append_file(seg, tail);
+	off_t valid_end = file_size(seg) - tail.size();
+
+	db = open_db(dir);
+	CHECK(op.rnum(db) == 4);
+	CHECK(has(db, "k1", "v1"));
+	CHECK(has(db, "k2", "v2"));
+	CHECK(missing(db, "k3"));
+	CHECK(has(db, "k4", "v4"));
+	CHECK(has(db, "k5", "v5"));
+	CHECK(missing(db, "k6"));
+	CHECK(file_size(seg) == valid_end);
+
+	// appended after the skipped records
+	set(db, "k7", "v7");
+	close_db(db);
+
+	db = open_db(dir);
+	CHECK(op.rnum(db) == 5);
+	CHECK(has(db, "k5", "v5"));
+	CHECK(has(db, "k7", "v7"));
+	close_db(db);
+}
+
+// deleted records stay deleted after reopen
+static void check_recover_delete(const std::string& dir)
+{
+	reset_dir(dir);
+
+	void* db = open_db(dir);
+	set(db, "k1", "v1");
+	set(db, "k2", "v2");
+	CHECK(op.del(db, "k1", 2, accept, NULL));
+	CHECK(!op.del(db, "k2", 2, reject, NULL));
+	close_db(db);
+
+	db = open_db(dir);
+	CHECK(op.rnum(db) == 1);
+	CHECK(missing(db, "k1"));
+	CHECK(has(db, "k2", "v2"));
+	close_db(db);
+}
+
+static bool wait_segments(const std::string& dir, int max)
+{
+	for(int i=0; i < 100; ++i) {
+		if(count_segments(dir) <= max) {
+			return true;
+		}
+		usleep(50*1000);
+	}
+	return false;
+}
+
+// old segments are compacted and removed
+static void check_compact(const std::string& dir)
+{
+	reset_dir(dir);
+	std::string param = dir + "#segsiz=4096#stripes=16";
+
+	void* db = open_db(param);
+
+	char key[32];
+	char val[64];
+	for(int i=0; i < 4000; ++i) {
+		snprintf(key, sizeof(key), "key%d", i % 50);
+		snprintf(val, sizeof(val), "val%d-xxxxxxxxxxxxxxxx", i);
+		set(db, key, val);
+		if(i % 11 == 0) {
+			CHECK(op.del(db, key, strlen(key), accept, NULL));
+		}
+	}
+
+	// 4000 records are written to more than 40 segments
+	CHECK(wait_segments(dir, 10));
+
+	int live = 0;
+	for(int i=3950; i < 4000; ++i) {
+		snprintf(key, sizeof(key), "key%d", i % 50);
+		snprintf(val, sizeof(val), "val%d-xxxxxxxxxxxxxxxx", i);
+		if(i % 11 == 0) {
+			CHECK(missing(db, key));
+		} else {
+			CHECK(has(db, key, val));
+			++live;
+		}
+	}
+	CHECK(op.rnum(db) == (uint64_t)live);
+	close_db(db);
+
+	db = open_db(param);
+	CHECK(op.rnum(db) == (uint64_t)live);
+	for(int i=3950; i < 4000; ++i) {
+		snprintf(key, sizeof(key), "key%d", i % 50);
+		snprintf(val, sizeof(val), "val%d-xxxxxxxxxxxxxxxx", i);
+		if(i % 11 == 0) {
+			CHECK(missing(db, key));
+		} else {
+			CHECK(has(db, key, val));
+		}
+	}
+	close_db(db);
+}
+
+// a segment which has a broken record is compacted
+static void check_compact_broken(const std::string& dir)
+{
+	reset_dir(dir);
+	std::string param = dir + "#segsiz=4096#stripes=16";
+
+	void* db = open_db(param);
+	set(db, "a", "1");
+	close_db(db);
+
+	std::string seg = segment_path(dir, 1);
+	std::string torn = build_record("b", std::string(200, 'y').c_str());
+	torn[torn.size()-1] ^= 0xff;
+	append_file(seg, torn);
+	append_file(seg, build_record("c", "3"));
+
+	db = open_db(param);
+	CHECK(has(db, "a", "1"));
+	CHECK(has(db, "c", "3"));
+
+	char key[32];
+	for(int i=0; i < 1000; ++i) {
+		snprintf(key, sizeof(key), "key%d", i % 20);
+		set(db, key, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+	}
+
+	// records in the first segment are copied
+	bool removed = false;
+	for(int i=0; i < 100 && !removed; ++i) {
+		removed = access(seg.c_str(), F_OK) != 0;
+		usleep(50*1000);
+	}
+	CHECK(removed);
+	CHECK(has(db, "a", "1"));
+	CHECK(has(db, "c", "3"));
+	close_db(db);
+
+	db = open_db(param);
+	CHECK(has(db, "a", "1"));
+	CHECK(has(db, "c", "3"));
+	close_db(db);
+}
+
+static int updatev(void* db, uint16_t num,
+		const char** keys, const char** vals, bool* result)
+{
+	size_t keylens[16];
+	size_t vallens[16];
+	void* casdata[16];
+	for(uint16_t i=0; i < num; ++i) {
+		keylens[i] = strlen(keys[i]);
+		vallens[i] = strlen(vals[i]);
+		casdata[i] = (void*)vals[i];
+	}
+	return op.updatev(db, keys, keylens, vals, vallens, num,
+			newer, casdata, result);
+}
+
+// result[i] is true only if keys[i] is stored
+static void check_updatev(const std::string& dir)
+{
+	reset_dir(dir);
+
+	void* db = open_db(dir);
+	set(db, "a", "v1");
+
+	{
+		const char* keys[] = {"a", "b"};
+		const char* vals[] = {"v2", "v1"};
+		bool result[2];
+		CHECK(updatev(db, 2, keys, vals, result) == 2);
+		CHECK(result[0] && result[1]);
+		CHECK(has(db, "a", "v2"));
+		CHECK(has(db, "b", "v1"));
+	}
+
+	{
+		// older than the stored value
+		const char* keys[] = {"a"};
+		const char* vals[] = {"v0"};
+		bool result[1] = {true};
+		CHECK(updatev(db, 1, keys, vals, result) == 0);
+		CHECK(!result[0]);
+		CHECK(has(db, "a", "v2"));
+	}
+
+	{
+		// compared with the earlier entry of the same key in the batch
+		const char* keys[] = {"c", "c", "c"};
+		const char* vals[] = {"v1", "v3", "v2"};
+		bool result[3];
+		CHECK(updatev(db, 3, keys, vals, result) == 2);
+		CHECK(result[0] && result[1] && !result[2]);
+		CHECK(has(db, "c", "v3"));
+	}
+
+	{
+		// nothing is stored if the batch fails
+		const char* keys[] = {"d", "e"};
+		const char* vals[] = {"v1", "v1"};
+		size_t keylens[] = {1, 1};
+		size_t vallens[] = {2, 0x80000000U};
+		void* casdata[] = {(void*)"v1", (void*)"v1"};
+		bool result[2];
+		CHECK(op.updatev(db, keys, keylens, vals, vallens, 2,
+					newer, casdata, result) < 0);
+		CHECK(!result[0] && !result[1]);
+		CHECK(missing(db, "d"));
+		CHECK(missing(db, "e"));
+	}
+
+	CHECK(op.rnum(db) == 3);
+	close_db(db);
+
+	db = open_db(dir);
+	CHECK(op.rnum(db) == 3);
+	CHECK(has(db, "a", "v2"));
+	CHECK(has(db, "b", "v1"));
+	CHECK(has(db, "c", "v3"));
+	close_db(db);
+}
+
+// invalid parameters are rejected
+static void check_param(const std::string& dir)
+{
+	reset_dir(dir);
+
+	const char* invalid[] = {
+		"#stripes=0", "#stripes=3", "#stripes=x", "#stripes=4x",
+		"#stripes=-4", "#stripes=", "#segsiz=0", "#segsiz=1k",
+	};
+	for(size_t i=0; i < sizeof(invalid)/sizeof(invalid[0]); ++i) {
+		void* db = op.create();
+		CHECK(db != NULL);
+		CHECK(!op.open(db, (dir + invalid[i]).c_str()));
+		op.free(db);
+	}
+
+	void* db = open_db(dir + "#stripes=4#segsiz=0x100000");
+	close_db(db);
+}
+
+// a backup succeeds after a failed backup left the temporary directory
+static void check_backup(const std::string& dir)
+{
+	reset_dir(dir);
+	std::string dst = dir + ".bak";
+	reset_dir(dst);
+	reset_dir(dst + ".tmp");
+
+	void* db = open_db(dir);
+	set(db, "a", "v1");
+
+	CHECK(mkdir((dst + ".tmp").c_str(), 0755) == 0);
+	append_file(segment_path(dst + ".tmp", 1), "stale");
+
+	CHECK(op.backup(db, dst.c_str()));
+	CHECK(access((dst + ".tmp").c_str(), F_OK) < 0);
+	close_db(db);
+
+	db = open_db(dst);
+	CHECK(has(db, "a", "v1"));
+	close_db(db);
+
+	reset_dir(dst);
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2) { usage(); }
+	std::string dir = std::string(argv[1]) + "/check_logdb";
+
+	op = kumo_storage_init();
+
+	check_recover_broken(dir);
+	check_recover_delete(dir);
+	check_compact(dir);
+	check_compact_broken(dir);
+	check_updatev(dir);
+	check_param(dir);
+	check_backup(dir);
+
+	reset_dir(dir);
+	printf("ok\n");
+	return 0;
+}
+